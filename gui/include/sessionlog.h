@@ -4,6 +4,7 @@
 #define CHIAKI_SESSIONLOG_H
 
 #include <chiaki/log.h>
+#include <chiaki/logasync.h>
 
 #include <QString>
 #include <QDir>
@@ -19,6 +20,8 @@ class SessionLog
 	private:
 		StreamSession *session;
 		ChiakiLog log;
+		ChiakiLogAsync log_async; // keeps file writes off the threads that log
+		bool log_async_enabled;
 		QFile *file;
 		QMutex file_mutex;
 
@@ -28,7 +31,7 @@ class SessionLog
 		SessionLog(StreamSession *session, uint32_t level_mask, const QString &filename);
 		~SessionLog();
 
-		ChiakiLog *GetChiakiLog()	{ return &log; }
+		ChiakiLog *GetChiakiLog()	{ return log_async_enabled ? chiaki_log_async_get_log(&log_async) : &log; }
 };
 
 QString GetLogBaseDir();
@@ -18,6 +18,9 @@ SessionLog::SessionLog(StreamSession *session, uint32_t level_mask, const QStrin
 	: session(session)
 {
 	chiaki_log_init(&log, level_mask, LogCb, this);
+	// e.g. CHIAKI_LOG_VERBOSE_SUBSYSTEMS=takion,video for verbose logging of only those
+	QByteArray verbose_subsystems = qgetenv("CHIAKI_LOG_VERBOSE_SUBSYSTEMS");
+	bool verbose_subsystems_valid = chiaki_log_set_subsystems_verbose(&log, verbose_subsystems.constData()) == CHIAKI_ERR_SUCCESS;
 
 	if(filename.isEmpty())
 	{
@@ -40,10 +43,18 @@ SessionLog::SessionLog(StreamSession *session, uint32_t level_mask, const QStrin
 	}
 
 	CHIAKI_LOGI(&log, "Chiaki Version " CHIAKI_VERSION);
+	if(!verbose_subsystems_valid)
+		CHIAKI_LOGW(&log, "Unknown subsystem in CHIAKI_LOG_VERBOSE_SUBSYSTEMS=%s", verbose_subsystems.constData());
+
+	log_async_enabled = chiaki_log_async_init(&log_async, CHIAKI_LOG_ASYNC_SIZE_DEFAULT, CHIAKI_LOG_WARNING | CHIAKI_LOG_ERROR, &log) == CHIAKI_ERR_SUCCESS;
+	if(!log_async_enabled)
+		CHIAKI_LOGW(&log, "Failed to start async logging, logging synchronously");
 }
 
 SessionLog::~SessionLog()
 {
+	if(log_async_enabled)
+		chiaki_log_async_fini(&log_async);
 	delete file;
 }
 
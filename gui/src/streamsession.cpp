@@ -139,11 +139,13 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 		ffmpeg_decoder = new ChiakiFfmpegDecoder;
 		ChiakiLogSniffer sniffer;
 		chiaki_log_sniffer_init(&sniffer, CHIAKI_LOG_ALL, GetChiakiLog());
+		ChiakiFfmpegDecoderProfileSettings decoder_profile;
+		chiaki_ffmpeg_decoder_profile_settings_init(&decoder_profile, CHIAKI_FFMPEG_DECODER_PROFILE_LATENCY);
 		err = chiaki_ffmpeg_decoder_init(ffmpeg_decoder,
 				chiaki_log_sniffer_get_log(&sniffer),
 				chiaki_target_is_ps5(connect_info.target) ? connect_info.video_profile.codec : CHIAKI_CODEC_H264,
 				connect_info.hw_decoder.isEmpty() ? NULL : connect_info.hw_decoder.toUtf8().constData(),
-				connect_info.hw_device_ctx, FfmpegFrameCb, this);
+				connect_info.hw_device_ctx, &decoder_profile, FfmpegFrameCb, this);
 		if(err != CHIAKI_ERR_SUCCESS) {
 			QString log = QString::fromUtf8(chiaki_log_sniffer_get_buffer(&sniffer));
 			chiaki_log_sniffer_fini(&sniffer);
@@ -193,6 +195,7 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	chiaki_connect_info.packet_loss_max = connect_info.packet_loss_max;
 	chiaki_connect_info.auto_regist = connect_info.auto_regist;
 	chiaki_connect_info.audio_video_disabled = connect_info.audio_video_disabled;
+	chiaki_connect_info.audio_async = true;
 
     // Configuração de Atalhos Touch
 	dpad_touch_shortcut1 = connect_info.dpad_touch_shortcut1;
@@ -291,9 +294,16 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 
 #if CHIAKI_LIB_ENABLE_PI_DECODER
 	if(pi_decoder) chiaki_session_set_video_sample_cb(&session, chiaki_pi_decoder_video_sample_cb, pi_decoder);
-	else chiaki_session_set_video_sample_cb(&session, chiaki_ffmpeg_decoder_video_sample_cb, ffmpeg_decoder);
+	else
+	{
+		chiaki_session_set_video_sample_cb(&session, chiaki_ffmpeg_decoder_video_sample_cb, ffmpeg_decoder);
+		chiaki_session_set_video_sample_alloc_cb(&session, chiaki_ffmpeg_decoder_video_sample_alloc_cb);
+		chiaki_session_set_video_sample_info_cb(&session, chiaki_ffmpeg_decoder_video_sample_info_cb);
+	}
 #else
     chiaki_session_set_video_sample_cb(&session, chiaki_ffmpeg_decoder_video_sample_cb, ffmpeg_decoder);
+    chiaki_session_set_video_sample_alloc_cb(&session, chiaki_ffmpeg_decoder_video_sample_alloc_cb);
+    chiaki_session_set_video_sample_info_cb(&session, chiaki_ffmpeg_decoder_video_sample_info_cb);
 #endif
 
 	chiaki_session_set_event_cb(&session, EventCb, this);
@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_AUDIOJITTERBUFFER_H
+#define CHIAKI_AUDIOJITTERBUFFER_H
+
+#include "common.h"
+#include "seqnum.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_AUDIO_JITTER_BUFFER_SIZE 64 // frames, must be a power of 2
+#define CHIAKI_AUDIO_FRAME_SIZE_MAX 0x100 // audio units have an 8 bit size
+#define CHIAKI_AUDIO_JITTER_BUFFER_DELAY_MIN_DEFAULT 2
+#define CHIAKI_AUDIO_JITTER_BUFFER_DELAY_MAX_DEFAULT 16
+
+typedef enum chiaki_audio_jitter_buffer_action_t
+{
+	CHIAKI_AUDIO_JITTER_BUFFER_WAIT, // still buffering, output nothing
+	CHIAKI_AUDIO_JITTER_BUFFER_DECODE, // decode the returned frame
+	CHIAKI_AUDIO_JITTER_BUFFER_DECODE_FEC, // the frame is lost, recover it from the fec data in the returned following one
+	CHIAKI_AUDIO_JITTER_BUFFER_CONCEAL // the frame is lost or has not arrived yet, conceal it
+} ChiakiAudioJitterBufferAction;
+
+typedef struct chiaki_audio_jitter_buffer_stats_t
+{
+	uint64_t decoded;
+	uint64_t fec_recovered; // lost frames decoded from the fec data of the following one
+	uint64_t concealed; // lost or missing frames that had to be concealed
+	uint64_t underruns; // playouts that found nothing buffered
+	uint64_t overruns; // frames dropped because the delay grew beyond the target or they were too far ahead
+	uint64_t late; // frames dropped because they arrived after their playout
+	uint64_t target_delay_frames;
+} ChiakiAudioJitterBufferStats;
+
+typedef struct chiaki_audio_jitter_buffer_slot_t
+{
+	bool filled;
+	ChiakiSeqNum16 frame_index;
+	size_t size;
+	uint8_t buf[CHIAKI_AUDIO_FRAME_SIZE_MAX];
+} ChiakiAudioJitterBufferSlot;
+
+/**
+ * Holds back audio frames for just long enough to absorb the jitter of their arrivals.
+ *
+ * Frames are put in as they arrive, in any order, and chiaki_audio_jitter_buffer_pull() is called once per frame
+ * duration to take the next one for playout. The target delay follows the smoothed jitter between min and max frames.
+ * If the buffer runs dry, the playout is stretched by concealed frames, if more than the target is buffered,
+ * the oldest frames are dropped.
+ */
+typedef struct chiaki_audio_jitter_buffer_t
+{
+	uint64_t frame_duration_us;
+	size_t delay_min;
+	size_t delay_max;
+
+	ChiakiAudioJitterBufferSlot slots[CHIAKI_AUDIO_JITTER_BUFFER_SIZE];
+	bool empty; // nothing has been put since the last reset
+	bool started; // play_index is being played out, otherwise still buffering
+	ChiakiSeqNum16 play_index; // next frame to pull
+	ChiakiSeqNum16 newest_index; // newest frame put so far
+	size_t underruns_consecutive;
+
+	uint64_t arrival_prev_us;
+	ChiakiSeqNum16 arrival_prev_index;
+	uint64_t jitter_us; // smoothed deviation of arrivals from the frame duration
+
+	ChiakiAudioJitterBufferStats stats;
+} ChiakiAudioJitterBuffer;
+
+/**
+ * @param delay_min minimum target delay in frames, 0 for CHIAKI_AUDIO_JITTER_BUFFER_DELAY_MIN_DEFAULT
+ * @param delay_max maximum target delay in frames, 0 for CHIAKI_AUDIO_JITTER_BUFFER_DELAY_MAX_DEFAULT,
+ * at most CHIAKI_AUDIO_JITTER_BUFFER_SIZE / 2
+ */
+CHIAKI_EXPORT void chiaki_audio_jitter_buffer_init(ChiakiAudioJitterBuffer *jitter_buffer, uint64_t frame_duration_us, size_t delay_min, size_t delay_max);
+
+/**
+ * Drop all frames and start buffering again, keeping the stats.
+ */
+CHIAKI_EXPORT void chiaki_audio_jitter_buffer_reset(ChiakiAudioJitterBuffer *jitter_buffer);
+
+/**
+ * @param arrival_us monotonic time the frame arrived
+ * @return whether the frame was taken, false if it was late or a duplicate
+ */
+CHIAKI_EXPORT bool chiaki_audio_jitter_buffer_put(ChiakiAudioJitterBuffer *jitter_buffer, ChiakiSeqNum16 frame_index,
+		const uint8_t *buf, size_t buf_size, uint64_t arrival_us);
+
+/**
+ * Take the next frame for playout, to be called once per frame duration.
+ *
+ * @param buf set to the frame to decode for CHIAKI_AUDIO_JITTER_BUFFER_DECODE and CHIAKI_AUDIO_JITTER_BUFFER_DECODE_FEC,
+ * valid until the next call
+ */
+CHIAKI_EXPORT ChiakiAudioJitterBufferAction chiaki_audio_jitter_buffer_pull(ChiakiAudioJitterBuffer *jitter_buffer, const uint8_t **buf, size_t *buf_size);
+
+CHIAKI_EXPORT size_t chiaki_audio_jitter_buffer_target_delay(ChiakiAudioJitterBuffer *jitter_buffer);
+
+static inline void chiaki_audio_jitter_buffer_get_stats(ChiakiAudioJitterBuffer *jitter_buffer, ChiakiAudioJitterBufferStats *stats)
+{
+	*stats = jitter_buffer->stats;
+	stats->target_delay_frames = chiaki_audio_jitter_buffer_target_delay(jitter_buffer);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_AUDIOJITTERBUFFER_H
@@ -9,6 +9,7 @@
 #include "takion.h"
 #include "thread.h"
 #include "packetstats.h"
+#include "audiojitterbuffer.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,6 +17,7 @@ extern "C" {
 
 typedef void (*ChiakiAudioSinkHeader)(ChiakiAudioHeader *header, void *user);
 typedef void (*ChiakiAudioSinkFrame)(uint8_t *buf, size_t buf_size, void *user);
+typedef void (*ChiakiAudioSinkConceal)(uint8_t *next_buf, size_t next_buf_size, void *user);
 
 /**
  * Sink that receives Audio encoded as Opus
@@ -25,8 +27,23 @@ typedef struct chiaki_audio_sink_t
 	void *user;
 	ChiakiAudioSinkHeader header_cb;
 	ChiakiAudioSinkFrame frame_cb;
+
+	/**
+	 * Optional, only called for audio if audio_async is set in the ChiakiConnectInfo, in place of a frame that was lost
+	 * or has not arrived in time. next_buf is the following frame if it is already there, which may carry the lost one
+	 * as fec data, otherwise NULL. It is passed to frame_cb afterwards as usual.
+	 */
+	ChiakiAudioSinkConceal conceal_cb;
 } ChiakiAudioSink;
 
+#define CHIAKI_AUDIO_RECEIVER_QUEUE_SIZE 256 // frames, must be a power of 2
+
+typedef struct chiaki_audio_receiver_stats_t
+{
+	uint64_t queue_overruns; // frames dropped because the audio thread fell behind
+	ChiakiAudioJitterBufferStats jitter_buffer;
+} ChiakiAudioReceiverStats;
+
 typedef struct chiaki_audio_receiver_t
 {
 	struct chiaki_session_t *session;
@@ -35,13 +52,40 @@ typedef struct chiaki_audio_receiver_t
 	ChiakiSeqNum16 frame_index_prev;
 	bool frame_index_startup; // whether frame_index_prev has definitely not wrapped yet
 	ChiakiPacketStats *packet_stats;
+
+	/*
+	 * With audio_async, the sinks are called from a separate audio thread. Frames are passed to it through
+	 * a lock-free single producer, single consumer queue and audio frames are played out through a jitter buffer.
+	 */
+	bool async;
+	struct chiaki_audio_receiver_entry_t *queue;
+	uint64_t queue_write; // only advanced by the thread calling chiaki_audio_receiver_av_packet()
+	uint64_t queue_read; // only advanced by the audio thread
+	uint64_t queue_overruns;
+	bool thread_waiting;
+	ChiakiThread thread;
+	ChiakiCond cond;
+	bool stop;
+	bool header_received; // only used by the audio thread
+	ChiakiAudioJitterBuffer jitter_buffer; // only used by the audio thread
+	ChiakiAudioJitterBufferStats jitter_buffer_stats; // copy for chiaki_audio_receiver_get_stats(), protected by mutex
 } ChiakiAudioReceiver;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_receiver_init(ChiakiAudioReceiver *audio_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats);
 CHIAKI_EXPORT void chiaki_audio_receiver_fini(ChiakiAudioReceiver *audio_receiver);
+
+/**
+ * With audio_async, this and chiaki_audio_receiver_av_packet() must always be called from the same thread.
+ */
 CHIAKI_EXPORT void chiaki_audio_receiver_stream_info(ChiakiAudioReceiver *audio_receiver, ChiakiAudioHeader *audio_header);
+
 CHIAKI_EXPORT void chiaki_audio_receiver_av_packet(ChiakiAudioReceiver *audio_receiver, ChiakiTakionAVPacket *packet);
 
+/**
+ * May be called from any thread. The jitter buffer stats are only updated with audio_async.
+ */
+CHIAKI_EXPORT void chiaki_audio_receiver_get_stats(ChiakiAudioReceiver *audio_receiver, ChiakiAudioReceiverStats *stats);
+
 static inline ChiakiAudioReceiver *chiaki_audio_receiver_new(struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
 {
 	ChiakiAudioReceiver *audio_receiver = CHIAKI_NEW(ChiakiAudioReceiver);
@@ -43,15 +43,46 @@ typedef enum chiaki_bitstream_slice_type_t
 	CHIAKI_BITSTREAM_SLICE_P,
 } ChiakiBitstreamSliceType;
 
+#define CHIAKI_BITSTREAM_REF_FLAGS_MAX 16
+
 typedef struct chiaki_bitstream_slice_t
 {
 	ChiakiBitstreamSliceType slice_type;
 	unsigned reference_frame;
+
+	// where the slice header was parsed from, so the reference frame can be rewritten in place
+	uint8_t *nal;
+	unsigned nal_size;
+	unsigned ref_flags_count;
+	uint32_t ref_flag_bits[CHIAKI_BITSTREAM_REF_FLAGS_MAX]; // of used_by_curr_pic_s0_flag[i] in nal, counting emulation prevention bytes
 } ChiakiBitstreamSlice;
 
 CHIAKI_EXPORT void chiaki_bitstream_init(ChiakiBitstream *bitstream, ChiakiLog *log, ChiakiCodec codec);
 CHIAKI_EXPORT bool chiaki_bitstream_header(ChiakiBitstream *bitstream, uint8_t *data, unsigned size);
+
+/**
+ * Parse the header of the slice in the first NAL unit of data, which starts with a start code.
+ * Only the slice header is read, never the rest of the frame.
+ */
 CHIAKI_EXPORT bool chiaki_bitstream_slice(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, ChiakiBitstreamSlice *slice);
+
+/**
+ * Like chiaki_bitstream_slice(), for a NAL unit whose location is already known, e.g. from the frame processor.
+ *
+ * @param nal the NAL unit header, right after the start code
+ * @param nal_size may be smaller than the NAL unit, as long as it covers the slice header
+ */
+CHIAKI_EXPORT bool chiaki_bitstream_slice_nal(ChiakiBitstream *bitstream, uint8_t *nal, unsigned nal_size, ChiakiBitstreamSlice *slice);
+
+/**
+ * Change the reference frame of a slice parsed before, directly in the buffer it was parsed from.
+ * Only supported for H.265 P slices.
+ */
+CHIAKI_EXPORT bool chiaki_bitstream_slice_rewrite_reference_frame(ChiakiBitstream *bitstream, ChiakiBitstreamSlice *slice, unsigned reference_frame);
+
+/**
+ * Parse the slice in data and rewrite its reference frame, see chiaki_bitstream_slice_rewrite_reference_frame().
+ */
 CHIAKI_EXPORT bool chiaki_bitstream_slice_set_reference_frame(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, unsigned reference_frame);
 
 #ifdef __cplusplus
@@ -6,6 +6,8 @@
 #include "takion.h"
 #include "thread.h"
 #include "packetstats.h"
+#include "eventloop.h"
+#include "congestioncontroller.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -17,17 +19,49 @@ typedef struct chiaki_congestion_control_t
 	ChiakiPacketStats *stats;
 	ChiakiThread thread;
 	ChiakiBoolPredCond stop_cond;
-	double packet_loss;
-	double packet_loss_max;
+	ChiakiEventLoop *event_loop; // if not NULL, timer is used instead of thread
+	ChiakiEventLoopSource timer;
+	double packet_loss; // measured in the last interval
+
+	ChiakiMutex controller_mutex; // protects controller, samples may be fed from other threads
+	ChiakiCongestionController controller; // zeroed unless started
+	bool units_wanted; // atomic, whether controller has a unit_cb, so unit samples can skip the mutex
 } ChiakiCongestionControl;
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats, double packet_loss_max);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_init(ChiakiCongestionControl *control);
+CHIAKI_EXPORT void chiaki_congestion_control_fini(ChiakiCongestionControl *control);
+
+/**
+ * @param controller decides what to report, ownership is transferred to control until chiaki_congestion_control_stop()
+ * @param event_loop if not NULL, send the congestion packets from a timer on this loop instead of an own thread
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats, ChiakiCongestionController *controller, ChiakiEventLoop *event_loop);
 
 /**
- * Stop control and join the thread
+ * Stop control, join the thread or remove the timer and fini the controller
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionControl *control);
 
+/**
+ * @return whether the controller consumes unit samples at all, so callers can skip building them
+ */
+CHIAKI_EXPORT bool chiaki_congestion_control_wants_units(ChiakiCongestionControl *control);
+
+/**
+ * Feed a received video unit to the controller. No-op unless control is started and the controller has a unit_cb.
+ */
+CHIAKI_EXPORT void chiaki_congestion_control_unit(ChiakiCongestionControl *control, const ChiakiCongestionUnitSample *sample);
+
+/**
+ * Feed a flushed video frame to the controller. No-op unless control is started.
+ */
+CHIAKI_EXPORT void chiaki_congestion_control_frame(ChiakiCongestionControl *control, const ChiakiCongestionFrameSample *sample);
+
+/**
+ * @return CHIAKI_ERR_UNINITIALIZED if control is not started or its controller has no stats
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_get_stats(ChiakiCongestionControl *control, ChiakiCongestionControllerStats *stats);
+
 #ifdef __cplusplus
 }
 #endif
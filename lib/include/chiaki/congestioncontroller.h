@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_CONGESTIONCONTROLLER_H
+#define CHIAKI_CONGESTIONCONTROLLER_H
+
+#include "common.h"
+#include "log.h"
+#include "seqnum.h"
+#include "takion.h"
+#include "frameprocessor.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum chiaki_congestion_controller_type_t {
+	CHIAKI_CONGESTION_CONTROLLER_LOSS = 0, // report the measured loss, clamped to packet_loss_max
+	CHIAKI_CONGESTION_CONTROLLER_DELAY_LOSS = 1 // also report loss while the delay gradient shows a queue building up, smooth out bursts fec recovered
+} ChiakiCongestionControllerType;
+
+CHIAKI_EXPORT const char *chiaki_congestion_controller_type_name(ChiakiCongestionControllerType type);
+
+typedef enum chiaki_congestion_usage_t {
+	CHIAKI_CONGESTION_USAGE_NORMAL = 0,
+	CHIAKI_CONGESTION_USAGE_UNDERUSE = 1, // delay is decreasing, a queue drains
+	CHIAKI_CONGESTION_USAGE_OVERUSE = 2 // delay is increasing, a queue builds up
+} ChiakiCongestionUsage;
+
+/**
+ * A unit of a video frame that has arrived.
+ */
+typedef struct chiaki_congestion_unit_sample_t
+{
+	uint64_t arrival_us; // monotonic
+	ChiakiSeqNum16 frame_index;
+	uint16_t unit_index;
+	uint16_t units_in_frame_total;
+	size_t size;
+} ChiakiCongestionUnitSample;
+
+/**
+ * A video frame that has been flushed from the frame processor.
+ */
+typedef struct chiaki_congestion_frame_sample_t
+{
+	ChiakiSeqNum16 frame_index;
+	ChiakiFrameProcessorFlushResult result;
+} ChiakiCongestionFrameSample;
+
+typedef struct chiaki_congestion_controller_stats_t
+{
+	ChiakiCongestionUsage usage;
+	double delay_trend; // slope of the smoothed queuing delay over arrival time, > 0 while a queue builds up
+	double delay_threshold; // the trend is compared against, adapts to the jitter of the link
+	double jitter_us; // of the inter-frame arrival times, like RFC 3550
+	double loss_smoothed;
+	double loss_reported; // in the last congestion packet
+	uint64_t frames_fec_recovered;
+	uint64_t frames_failed;
+} ChiakiCongestionControllerStats;
+
+typedef void (*ChiakiCongestionControllerUnitCallback)(const ChiakiCongestionUnitSample *sample, void *user);
+typedef void (*ChiakiCongestionControllerFrameCallback)(const ChiakiCongestionFrameSample *sample, void *user);
+
+/**
+ * Decide what to send in the congestion packet for the interval ending at now_us.
+ *
+ * @param received packets received in the interval, from ChiakiPacketStats
+ * @param lost packets lost in the interval, from ChiakiPacketStats
+ * @param packet zeroed, to be filled
+ */
+typedef void (*ChiakiCongestionControllerReportCallback)(uint64_t now_us, uint64_t received, uint64_t lost, ChiakiTakionCongestionPacket *packet, void *user);
+typedef void (*ChiakiCongestionControllerStatsCallback)(ChiakiCongestionControllerStats *stats, void *user);
+typedef void (*ChiakiCongestionControllerFiniCallback)(void *user);
+
+/**
+ * Decides what ChiakiCongestionControl reports to the console, which adapts its bitrate to it.
+ * The callbacks are never called concurrently and only get time passed in, so a controller behaves
+ * the same when driven by ChiakiCongestionControl or replaying a trace, see chiaki_congestion_sim_run().
+ */
+typedef struct chiaki_congestion_controller_t
+{
+	void *user;
+	ChiakiCongestionControllerUnitCallback unit_cb; // may be NULL
+	ChiakiCongestionControllerFrameCallback frame_cb; // may be NULL
+	ChiakiCongestionControllerReportCallback report_cb;
+	ChiakiCongestionControllerStatsCallback stats_cb; // may be NULL
+	ChiakiCongestionControllerFiniCallback fini_cb; // may be NULL
+} ChiakiCongestionController;
+
+/**
+ * Create one of the built-in controllers.
+ *
+ * @param packet_loss_max upper bound of the reported loss
+ * @param frame_interval_us time between two frames sent by the console, e.g. 16667 for 60 fps
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_controller_init(ChiakiCongestionController *controller, ChiakiCongestionControllerType type,
+		ChiakiLog *log, double packet_loss_max, uint64_t frame_interval_us);
+
+CHIAKI_EXPORT void chiaki_congestion_controller_fini(ChiakiCongestionController *controller);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_CONGESTIONCONTROLLER_H
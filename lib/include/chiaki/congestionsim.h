@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_CONGESTIONSIM_H
+#define CHIAKI_CONGESTIONSIM_H
+
+#include "congestioncontroller.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Part of a network trace. The one-way delay ramps linearly from delay_start_us to delay_end_us over the step,
+ * e.g. rising while a queue builds up.
+ */
+typedef struct chiaki_congestion_sim_step_t
+{
+	uint64_t duration_ms;
+	uint32_t delay_start_us;
+	uint32_t delay_end_us;
+	double loss; // probability for a unit to start a loss burst
+	unsigned int loss_burst; // units lost in a row once a burst starts, 0 or 1 for independent losses
+} ChiakiCongestionSimStep;
+
+typedef struct chiaki_congestion_sim_config_t
+{
+	unsigned int fps;
+	unsigned int units_source; // per frame
+	unsigned int units_fec; // per frame
+	size_t unit_size;
+	uint32_t unit_spacing_us; // between the units of a frame
+	uint64_t report_interval_ms;
+	uint32_t seed; // of the loss pattern
+} ChiakiCongestionSimConfig;
+
+typedef struct chiaki_congestion_sim_result_t
+{
+	uint64_t frames;
+	uint64_t frames_fec_recovered;
+	uint64_t frames_failed;
+	uint64_t reports;
+	double loss_measured_mean;
+	double loss_reported_mean;
+	double loss_reported_max;
+} ChiakiCongestionSimResult;
+
+/**
+ * Called for every congestion packet the controller produced.
+ */
+typedef void (*ChiakiCongestionSimReportCallback)(uint64_t time_ms, uint64_t received, uint64_t lost, const ChiakiTakionCongestionPacket *packet, void *user);
+
+CHIAKI_EXPORT void chiaki_congestion_sim_config_default(ChiakiCongestionSimConfig *config);
+
+/**
+ * Replay a trace through controller on a virtual clock, so controllers can be compared without a console.
+ * Frames are sent every 1/fps, their units arrive in order, delayed and lost as described by steps,
+ * and the controller is asked for a report every report_interval_ms, like ChiakiCongestionControl does.
+ * The same config, steps and controller always give the same result.
+ *
+ * @param cb optional
+ */
+CHIAKI_EXPORT void chiaki_congestion_sim_run(const ChiakiCongestionSimConfig *config, const ChiakiCongestionSimStep *steps, size_t steps_count,
+		ChiakiCongestionController *controller, ChiakiCongestionSimReportCallback cb, void *cb_user, ChiakiCongestionSimResult *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_CONGESTIONSIM_H
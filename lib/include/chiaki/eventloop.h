@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_EVENTLOOP_H
+#define CHIAKI_EVENTLOOP_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__linux__)
+#define CHIAKI_EVENT_LOOP_SUPPORTED 1
+#else
+#define CHIAKI_EVENT_LOOP_SUPPORTED 0
+#endif
+
+#define CHIAKI_EVENT_LOOP_SOURCES_MAX 16
+
+typedef void (*ChiakiEventLoopCallback)(void *user);
+
+/**
+ * A file descriptor or timer watched by a ChiakiEventLoop.
+ * Owned by the caller and must stay valid until it has been removed from the loop.
+ */
+typedef struct chiaki_event_loop_source_t
+{
+	int fd;
+	bool timer; // fd is a timerfd owned by the source
+	uint32_t slot; // index in the loop's source table while added
+	ChiakiEventLoopCallback cb;
+	void *user;
+} ChiakiEventLoopSource;
+
+typedef struct chiaki_event_loop_stats_t
+{
+	uint64_t wakeups; // returns from epoll_wait()
+	uint64_t timer_expirations;
+	uint64_t fd_events;
+} ChiakiEventLoopStats;
+
+/**
+ * Single thread waiting on an epoll instance that dispatches readable fds and timerfd-driven periodic tasks,
+ * so they do not need a thread of their own that wakes up by itself.
+ * Callbacks run on the loop thread with the loop's mutex held and must not block.
+ * Only available on Linux, chiaki_event_loop_init() fails everywhere else.
+ */
+typedef struct chiaki_event_loop_t
+{
+	ChiakiLog *log;
+	int epoll_fd;
+	int stop_fd; // eventfd
+	bool running;
+	ChiakiThread thread;
+
+	ChiakiMutex mutex; // protects everything below, held while dispatching
+	ChiakiEventLoopSource *sources[CHIAKI_EVENT_LOOP_SOURCES_MAX];
+	uint32_t generations[CHIAKI_EVENT_LOOP_SOURCES_MAX]; // incremented on removal to drop stale events
+	ChiakiEventLoopStats stats;
+} ChiakiEventLoop;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_init(ChiakiEventLoop *loop, ChiakiLog *log);
+CHIAKI_EXPORT void chiaki_event_loop_fini(ChiakiEventLoop *loop);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_start(ChiakiEventLoop *loop);
+
+/**
+ * Stop and join the loop thread. Sources stay added.
+ */
+CHIAKI_EXPORT void chiaki_event_loop_stop(ChiakiEventLoop *loop);
+
+/**
+ * Call cb every time fd becomes readable. cb must consume the data, the fd is watched level-triggered.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_add_fd(ChiakiEventLoop *loop, ChiakiEventLoopSource *source, int fd, ChiakiEventLoopCallback cb, void *user);
+
+/**
+ * Call cb every interval_ms. An interval of 0 adds the timer disarmed.
+ * Timers expire on multiples of their interval on the monotonic clock, so the first call happens within interval_ms
+ * and timers with related intervals wake up the loop together.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_add_timer(ChiakiEventLoop *loop, ChiakiEventLoopSource *source, uint64_t interval_ms, ChiakiEventLoopCallback cb, void *user);
+
+/**
+ * Re-arm or, with an interval of 0, disarm a timer source.
+ * Does not take the loop's mutex, so it may be called while holding locks that callbacks take.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_timer_set(ChiakiEventLoopSource *source, uint64_t interval_ms);
+
+/**
+ * Arm a timer source to call its callback once, timeout_ms from now, or disarm it with a timeout of 0.
+ * Unlike chiaki_event_loop_timer_set(), the expiration is not aligned, so it never happens early.
+ * Does not take the loop's mutex either.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_timer_set_oneshot(ChiakiEventLoopSource *source, uint64_t timeout_ms);
+
+/**
+ * Remove source from the loop. Waits for its callback if it is currently running on another thread,
+ * so afterwards source may be freed. May also be called from any callback on the loop thread.
+ */
+CHIAKI_EXPORT void chiaki_event_loop_remove(ChiakiEventLoop *loop, ChiakiEventLoopSource *source);
+
+CHIAKI_EXPORT void chiaki_event_loop_get_stats(ChiakiEventLoop *loop, ChiakiEventLoopStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_EVENTLOOP_H
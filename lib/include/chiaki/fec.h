@@ -6,6 +6,7 @@
 #include "common.h"
 
 #include <stdint.h>
+#include <stdbool.h>
 #ifndef _WIN32
 #include <unistd.h>
 #endif
@@ -16,6 +17,79 @@ extern "C" {
 
 #define CHIAKI_FEC_WORDSIZE 8
 
+#define CHIAKI_FEC_CACHE_MATRICES 4
+#define CHIAKI_FEC_CACHE_SCHEDULES 32
+
+/**
+ * Implementations of the region multiply-accumulate that recovers erased units.
+ * All of them produce byte-identical results.
+ */
+typedef enum chiaki_fec_engine_t
+{
+	CHIAKI_FEC_ENGINE_REFERENCE, // jerasure_matrix_dotprod
+	CHIAKI_FEC_ENGINE_SCALAR, // split nibble tables like the simd engines, one byte at a time
+	CHIAKI_FEC_ENGINE_SSSE3,
+	CHIAKI_FEC_ENGINE_AVX2,
+	CHIAKI_FEC_ENGINE_NEON
+} ChiakiFecEngine;
+
+CHIAKI_EXPORT const char *chiaki_fec_engine_name(ChiakiFecEngine engine);
+
+/**
+ * @return whether engine can be used on the cpu we are running on
+ */
+CHIAKI_EXPORT bool chiaki_fec_engine_supported(ChiakiFecEngine engine);
+
+/**
+ * @return the engine with the widest simd instructions supported by the cpu, detected at runtime,
+ * or CHIAKI_FEC_ENGINE_REFERENCE if there are none
+ */
+CHIAKI_EXPORT ChiakiFecEngine chiaki_fec_engine_best();
+
+struct chiaki_fec_matrix_t;
+struct chiaki_fec_schedule_t;
+
+typedef struct chiaki_fec_cache_stats_t
+{
+	uint64_t matrix_hits;
+	uint64_t matrix_misses;
+	uint64_t schedule_hits;
+	uint64_t schedule_misses;
+} ChiakiFecCacheStats;
+
+/**
+ * Cache of Cauchy coding matrices keyed by (k, m) and of decode schedules keyed by (k, m, erasures),
+ * so recurring loss patterns are decoded without building and inverting matrices again.
+ * Intended to be owned by a single stream, it is not thread-safe.
+ */
+typedef struct chiaki_fec_cache_t
+{
+	ChiakiFecEngine engine; // chiaki_fec_engine_best() by default, may be changed between calls
+	struct chiaki_fec_matrix_t *matrices[CHIAKI_FEC_CACHE_MATRICES];
+	struct chiaki_fec_schedule_t *schedules[CHIAKI_FEC_CACHE_SCHEDULES];
+	uint64_t use_counter; // for lru eviction
+	uint8_t **ptrs; // scratch for the k data ptrs followed by the m coding ptrs
+	size_t ptrs_size;
+	uint64_t *erased; // scratch bitmap of erased units
+	size_t erased_words;
+	ChiakiFecCacheStats stats;
+} ChiakiFecCache;
+
+CHIAKI_EXPORT void chiaki_fec_cache_init(ChiakiFecCache *cache);
+CHIAKI_EXPORT void chiaki_fec_cache_fini(ChiakiFecCache *cache);
+
+/**
+ * Recover the erased source units of frame_buf in place.
+ * Contrary to jerasure_matrix_decode, erased fec units are not re-encoded.
+ *
+ * @param frame_buf k source units followed by m fec units, each of unit_size bytes and starting stride bytes apart
+ * @param erasures indices of the units in frame_buf that have not been received, in any order
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_cache_decode(ChiakiFecCache *cache, uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count);
+
+/**
+ * Same as chiaki_fec_cache_decode() with a temporary cache.
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m);
 
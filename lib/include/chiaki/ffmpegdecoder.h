@@ -4,6 +4,8 @@
 #include <chiaki/config.h>
 #include <chiaki/log.h>
 #include <chiaki/thread.h>
+#include <chiaki/video.h>
+#include <chiaki/presentqueue.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,12 +17,50 @@ typedef struct chiaki_ffmpeg_decoder_t ChiakiFfmpegDecoder;
 
 typedef void (*ChiakiFfmpegFrameAvailable)(ChiakiFfmpegDecoder *decover, void *user);
 
+#define CHIAKI_FFMPEG_DECODER_PACKET_BUFS_MAX 8 // buffers handed out by the alloc cb that have not been submitted yet
+#define CHIAKI_FFMPEG_DECODER_QUEUE_DEPTH_MAX 8
+#define CHIAKI_FFMPEG_DECODER_SAMPLE_INFOS 32 // samples in the codec whose info is kept until they are decoded
+
+typedef enum chiaki_ffmpeg_decoder_profile_t {
+	CHIAKI_FFMPEG_DECODER_PROFILE_DEFAULT = 0, // FFmpeg's defaults, only the newest frame is pulled
+	CHIAKI_FFMPEG_DECODER_PROFILE_LATENCY = 1, // slice threads as far as the stream has slices, low delay flags, only the newest frame is pulled
+	CHIAKI_FFMPEG_DECODER_PROFILE_THROUGHPUT = 2, // frame and slice threads on all cores, frames are pulled in order
+	CHIAKI_FFMPEG_DECODER_PROFILE_CUSTOM = 3
+} ChiakiFfmpegDecoderProfile;
+
+typedef struct chiaki_ffmpeg_decoder_profile_settings_t
+{
+	ChiakiFfmpegDecoderProfile profile;
+	int thread_type; // FF_THREAD_FRAME and/or FF_THREAD_SLICE, 0 to keep FFmpeg's default
+	int thread_count; // 0 for the number of cpus, or for slice threads only as many as the first frame has slices
+	bool low_delay; // AV_CODEC_FLAG_LOW_DELAY
+	bool fast; // AV_CODEC_FLAG2_FAST, allows speedups that are not bit-exact
+	size_t queue_depth; // decoded frames kept for chiaki_ffmpeg_decoder_pull_frame(), beyond that the oldest are dropped
+} ChiakiFfmpegDecoderProfileSettings;
+
+/**
+ * Fill settings with the preset of profile. CHIAKI_FFMPEG_DECODER_PROFILE_CUSTOM starts from the defaults.
+ */
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_profile_settings_init(ChiakiFfmpegDecoderProfileSettings *settings, ChiakiFfmpegDecoderProfile profile);
+CHIAKI_EXPORT const char *chiaki_ffmpeg_decoder_profile_name(ChiakiFfmpegDecoderProfile profile);
+
+typedef struct chiaki_ffmpeg_decoder_stats_t
+{
+	uint64_t samples; // submitted to the codec
+	uint64_t samples_copied; // not in a buffer from chiaki_ffmpeg_decoder_video_sample_alloc_cb(), so the codec had to copy them
+	uint64_t packet_bufs_allocated; // by the packet pool, stops growing once it is warm
+	uint64_t frames_dropped; // decoded, but pushed out of the queue by newer ones before being pulled
+} ChiakiFfmpegDecoderStats;
+
 struct chiaki_ffmpeg_decoder_t
 {
 	ChiakiLog *log;
 	ChiakiMutex mutex;
 	const AVCodec *av_codec;
 	AVCodecContext *codec_context;
+	bool codec_opened; // opening may wait for the first sample with slices to know their count
+	ChiakiCodec codec;
+	ChiakiFfmpegDecoderProfileSettings profile;
 	enum AVPixelFormat hw_pix_fmt;
 	AVBufferRef *hw_device_ctx;
 	bool hdr_enabled;
@@ -30,14 +70,63 @@ struct chiaki_ffmpeg_decoder_t
 	int32_t frames_lost;
 	bool frame_recovered;
 	int32_t session_bitrate_kbps;
+
+	AVPacket *packet; // reused for every sample
+	AVPacket *header_packet; // parameter sets that came before the codec was opened, submitted right after opening
+	AVFrame *drain_frame; // reused to make room in the codec and to receive frames
+	AVFrame *queue[CHIAKI_FFMPEG_DECODER_QUEUE_DEPTH_MAX]; // decoded frames, oldest first
+	ChiakiPresentFrameInfo queue_info[CHIAKI_FFMPEG_DECODER_QUEUE_DEPTH_MAX];
+	size_t queue_count;
+
+	ChiakiVideoSampleInfo sample_info; // from chiaki_ffmpeg_decoder_video_sample_info_cb() for the next sample
+	bool sample_info_valid;
+	int64_t sample_pts; // given to the next sample, to find its info again in sample_infos when it is decoded
+	ChiakiPresentFrameInfo sample_infos[CHIAKI_FFMPEG_DECODER_SAMPLE_INFOS];
+
+	ChiakiMutex packet_pool_mutex; // only guards the pool and packet_bufs, so allocating never waits for decoding
+	AVBufferPool *packet_pool;
+	size_t packet_pool_buf_size;
+	AVBufferRef *packet_bufs[CHIAKI_FFMPEG_DECODER_PACKET_BUFS_MAX];
+	ChiakiFfmpegDecoderStats stats;
 };
 
+/**
+ * @param profile threading and flags of the codec, NULL for CHIAKI_FFMPEG_DECODER_PROFILE_DEFAULT
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
 		ChiakiCodec codec, const char *hw_decoder_name, AVBufferRef *hw_device_ctx,
+		const ChiakiFfmpegDecoderProfileSettings *profile,
 		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user);
 CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder);
 CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user);
+
+/**
+ * ChiakiVideoSampleAllocCallback that hands out refcounted buffers from a pool.
+ * Samples in these buffers are passed to the codec without being copied again.
+ */
+CHIAKI_EXPORT uint8_t *chiaki_ffmpeg_decoder_video_sample_alloc_cb(size_t size, void *user);
+
+/**
+ * To be set with chiaki_session_set_video_sample_info_cb(), so pulled frames carry their frame index and receive time.
+ */
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_video_sample_info_cb(const ChiakiVideoSampleInfo *info, void *user);
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_get_stats(ChiakiFfmpegDecoder *decoder, ChiakiFfmpegDecoderStats *stats);
+
+/**
+ * Receive everything the codec has decoded into the queue and take the oldest frame out of it.
+ * With a queue depth of 1, this is always the newest frame.
+ *
+ * @return frame owned by the caller, or NULL if there is none
+ */
 CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *decoder, int32_t *frames_lost);
+
+/**
+ * Like chiaki_ffmpeg_decoder_pull_frame(), but also get the info of the frame, with the time it was pulled as handoff_us.
+ * The info can be pushed into a ChiakiPresentQueue together with the frame.
+ *
+ * @param info may be NULL
+ */
+CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame_info(ChiakiFfmpegDecoder *decoder, int32_t *frames_lost, ChiakiPresentFrameInfo *info);
 CHIAKI_EXPORT enum AVPixelFormat chiaki_ffmpeg_decoder_get_pixel_format(ChiakiFfmpegDecoder *decoder);
 
 #ifdef __cplusplus
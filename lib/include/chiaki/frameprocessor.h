@@ -6,6 +6,7 @@
 #include "common.h"
 #include "takion.h"
 #include "packetstats.h"
+#include "fec.h"
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -27,6 +28,33 @@ CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uin
 struct chiaki_frame_unit_t;
 typedef struct chiaki_frame_unit_t ChiakiFrameUnit;
 
+struct chiaki_frame_processor_fec_worker_t;
+
+/**
+ * @return buffer of at least size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE bytes to assemble a frame into, or NULL on failure
+ */
+typedef uint8_t *(*ChiakiFrameProcessorAllocCallback)(size_t size, void *user);
+
+/**
+ * Monotonic timestamps in us of a frame passing through the frame processor.
+ */
+typedef struct chiaki_frame_processor_times_t
+{
+	uint64_t first_unit_us; // first unit of the frame arrived
+	uint64_t decodable_us; // enough units arrived to recover the whole frame, 0 if that never happened
+	uint64_t emitted_us; // the frame was flushed
+} ChiakiFrameProcessorTimes;
+
+/**
+ * First NAL unit of a frame, located while assembling the frame's first unit,
+ * so its slice header can be parsed without searching the frame again.
+ */
+typedef struct chiaki_frame_processor_nal_t
+{
+	size_t offset; // of the NAL unit header in the frame, right after the start code
+	size_t size; // bytes of the NAL unit that came from the first unit, 0 if it was not found
+} ChiakiFrameProcessorNal;
+
 typedef struct chiaki_frame_processor_t
 {
 	ChiakiLog *log;
@@ -41,7 +69,14 @@ typedef struct chiaki_frame_processor_t
 	ChiakiFrameUnit *unit_slots;
 	size_t unit_slots_size;
 	bool flushed; // whether we have already flushed the current frame, i.e. are only interested in stats, not data.
+	ChiakiSeqNum16 frame_index; // of the current frame
 	ChiakiStreamStats stream_stats;
+	ChiakiFecCache fec_cache;
+	ChiakiFrameProcessorTimes times; // of the current frame
+	ChiakiFrameProcessorNal nal; // of the current frame, valid after flushing
+	struct chiaki_frame_processor_fec_worker_t *fec_worker; // NULL unless chiaki_frame_processor_fec_worker_start() or chiaki_frame_processor_fec_worker_share() was called
+	ChiakiFrameProcessorAllocCallback alloc_cb; // if set, the fec worker emits frames assembled into buffers from it
+	void *alloc_cb_user;
 } ChiakiFrameProcessor;
 
 typedef enum chiaki_frame_flush_result_t {
@@ -54,6 +89,16 @@ typedef enum chiaki_frame_flush_result_t {
 CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiLog *log);
 CHIAKI_EXPORT void chiaki_frame_processor_fini(ChiakiFrameProcessor *frame_processor);
 
+/**
+ * Let frames be assembled into buffers from alloc_cb, see chiaki_frame_processor_flush_alloc().
+ * Only affects frames emitted by the fec worker, synchronous flushes choose the function themselves.
+ */
+static inline void chiaki_frame_processor_set_alloc_cb(ChiakiFrameProcessor *frame_processor, ChiakiFrameProcessorAllocCallback alloc_cb, void *alloc_cb_user)
+{
+	frame_processor->alloc_cb = alloc_cb;
+	frame_processor->alloc_cb_user = alloc_cb_user;
+}
+
 CHIAKI_EXPORT void chiaki_frame_processor_report_packet_stats(ChiakiFrameProcessor *frame_processor, ChiakiPacketStats *packet_stats);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet);
@@ -64,6 +109,57 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
  */
 CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size);
 
+/**
+ * Like chiaki_frame_processor_flush(), but instead of compacting the frame inside the internal buffer,
+ * its payload is copied exactly once into a buffer from alloc_cb, e.g. one owned by the decoder.
+ * The padding after the frame is zeroed.
+ *
+ * @param frame unless CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED returned, will receive the buffer returned by alloc_cb.
+ */
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush_alloc(ChiakiFrameProcessor *frame_processor,
+		ChiakiFrameProcessorAllocCallback alloc_cb, void *alloc_cb_user, uint8_t **frame, size_t *frame_size);
+
+/**
+ * Called on the fec worker thread for every frame handed over with chiaki_frame_processor_flush_async().
+ * frame, times and nal are only valid during the call.
+ */
+typedef void (*ChiakiFrameProcessorFrameCallback)(ChiakiFrameProcessorFlushResult result, ChiakiSeqNum16 frame_index,
+		uint8_t *frame, size_t frame_size, ChiakiFrameProcessorTimes *times, ChiakiFrameProcessorNal *nal, void *user);
+
+/**
+ * Start a thread that recovers and assembles frames handed over by chiaki_frame_processor_flush_async(),
+ * so the thread putting units can continue with the next frame in the meantime.
+ * The worker is stopped by chiaki_frame_processor_fini() of the last frame processor using it.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_fec_worker_start(ChiakiFrameProcessor *frame_processor, ChiakiFrameProcessorFrameCallback cb, void *cb_user);
+
+/**
+ * Let frame_processor hand its frames over to the fec worker of owner, so the frames of both are emitted
+ * by the same thread in the order they were handed over.
+ * All frame processors using a worker must be used from the same thread. No-op if owner has no fec worker.
+ */
+CHIAKI_EXPORT void chiaki_frame_processor_fec_worker_share(ChiakiFrameProcessor *frame_processor, ChiakiFrameProcessor *owner);
+
+/**
+ * Like chiaki_frame_processor_flush(), but the frame is flushed on the fec worker and passed to its callback.
+ * The worker keeps its own copy of the frame and queues up to a few of them, so this only waits
+ * if it is that many frames behind. Frames are always emitted in the order they were handed over.
+ * Afterwards, frame_processor is ready for the next frame while still counting late units of the current one.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_flush_async(ChiakiFrameProcessor *frame_processor);
+
+/**
+ * Wait until the fec worker has emitted all frames handed over to it.
+ * Everything the callback did happens before this returns. No-op if there is no fec worker.
+ */
+CHIAKI_EXPORT void chiaki_frame_processor_fec_wait(ChiakiFrameProcessor *frame_processor);
+
+/**
+ * @return whether frames handed over to the fec worker have not been emitted yet, without waiting for them.
+ * If not, everything the callback did happens before this returns.
+ */
+CHIAKI_EXPORT bool chiaki_frame_processor_fec_pending(ChiakiFrameProcessor *frame_processor);
+
 static inline bool chiaki_frame_processor_flush_possible(ChiakiFrameProcessor *frame_processor)
 {
 	return frame_processor->units_source_received + frame_processor->units_fec_received
@@ -14,6 +14,11 @@
 extern "C" {
 #endif
 
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+#include "mbedtls/aes.h"
+#include "mbedtls/gcm.h"
+#endif
+
 #define CHIAKI_GKCRYPT_BLOCK_SIZE 0x10
 #define CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT 0x20 // 2MB
 #define CHIAKI_GKCRYPT_GMAC_SIZE 4
@@ -25,16 +30,33 @@ typedef struct chiaki_key_state_t
    uint64_t prev;
 } ChiakiKeyState;
 
+typedef struct chiaki_gkcrypt_key_buf_stats_t
+{
+	uint64_t hits; // key stream requests served from key_buf
+	uint64_t misses; // key stream requests that had to be generated synchronously
+	uint64_t skips; // times key_buf_thread skipped ahead because requests were beyond key_buf
+} ChiakiGKCryptKeyBufStats;
+
 typedef struct chiaki_gkcrypt_t {
 	uint8_t index;
 
-	uint8_t *key_buf; // circular buffer of the ctr mode key stream
+	/*
+	 * Ring buffer of the ctr mode key stream, the key stream for key pos p is at key_buf[p % key_buf_size].
+	 * key_buf_thread is the only producer and publishes whole chunks by advancing key_buf_head.
+	 * Consumers (chiaki_gkcrypt_get_key_stream/chiaki_gkcrypt_decrypt, whose calls must not run concurrently)
+	 * never take key_buf_mutex while the key stream is available, which only protects the producer's sleep.
+	 * All key_buf_* fields below and last_key_pos are accessed atomically.
+	 */
+	uint8_t *key_buf;
 	uint64_t key_buf_size;
-	uint64_t key_buf_populated; // size of key_buf that is already populated (on startup)
-	uint64_t key_buf_key_pos_min; // minimal key pos currently in key_buf
-	size_t key_buf_start_offset; // offset in key_buf of the minimal key pos
-	uint64_t last_key_pos;        // last key pos that has been requested
+	uint64_t key_buf_head; // end of the key stream published in key_buf
+	uint64_t key_buf_tail; // minimal key pos still in key_buf
+	uint64_t key_buf_reader_pos; // key pos the consumer is currently reading from key_buf, UINT64_MAX if none
+	uint64_t key_buf_lookahead; // how much key stream key_buf_thread keeps ready beyond last_key_pos
+	uint64_t last_key_pos; // end of the last key stream that has been requested
+	bool key_buf_thread_waiting;
 	bool key_buf_thread_stop;
+	ChiakiGKCryptKeyBufStats key_buf_stats;
 	ChiakiMutex key_buf_mutex;
 	ChiakiCond key_buf_cond;
 	ChiakiThread key_buf_thread;
@@ -44,6 +66,25 @@ typedef struct chiaki_gkcrypt_t {
 	uint8_t key_gmac_base[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint8_t key_gmac_current[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint64_t key_gmac_index_current;
+
+	// AES contexts are keyed once and reused for every call.
+	// ecb_ctx and the gmac contexts follow the same threading rules as the functions using them,
+	// key_buf_ecb_ctx is exclusively used by key_buf_thread.
+	// The gmac contexts are re-keyed lazily when their index differs from the requested one.
+	uint64_t gmac_ctx_index; // index of the gmac key that gmac_ctx is currently keyed with, UINT64_MAX if none
+	uint64_t gmac_tmp_ctx_index; // same for gmac_tmp_ctx, which is used for packets with older key positions
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_aes_context ecb_ctx;
+	mbedtls_aes_context key_buf_ecb_ctx;
+	mbedtls_gcm_context gmac_ctx;
+	mbedtls_gcm_context gmac_tmp_ctx;
+#else
+	struct evp_cipher_ctx_st *ecb_ctx;
+	struct evp_cipher_ctx_st *key_buf_ecb_ctx;
+	struct evp_cipher_ctx_st *gmac_ctx;
+	struct evp_cipher_ctx_st *gmac_tmp_ctx;
+#endif
+
 	ChiakiLog *log;
 } ChiakiGKCrypt;
 
@@ -55,6 +96,19 @@ struct chiaki_session_t;
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
 
 CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt);
+
+/**
+ * Set how much key stream the key buf thread keeps generated ahead of the last requested key pos.
+ * Defaults to half of key_buf_chunks. Clamped to [1, key_buf_chunks - 1] chunks, where possible.
+ */
+CHIAKI_EXPORT void chiaki_gkcrypt_set_key_buf_lookahead(ChiakiGKCrypt *gkcrypt, size_t chunks);
+
+CHIAKI_EXPORT void chiaki_gkcrypt_get_key_buf_stats(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptKeyBufStats *stats);
+
+/**
+ * @return whether the key stream for [key_pos, key_pos + size) is currently available in the key buf
+ */
+CHIAKI_EXPORT bool chiaki_gkcrypt_key_buf_contains(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, size_t size);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
@@ -22,13 +22,43 @@ typedef enum {
 
 #define CHIAKI_LOG_ALL ((1 << 5) - 1)
 
+/**
+ * Levels that the CHIAKI_LOG* macros compile in at all.
+ * Defining CHIAKI_LOG_DISABLE_DEBUG removes verbose and debug messages, including the evaluation of their arguments.
+ */
+#ifdef CHIAKI_LOG_DISABLE_DEBUG
+#define CHIAKI_LOG_COMPILED_MASK (CHIAKI_LOG_ALL & ~(CHIAKI_LOG_VERBOSE | CHIAKI_LOG_DEBUG))
+#else
+#define CHIAKI_LOG_COMPILED_MASK CHIAKI_LOG_ALL
+#endif
+
+typedef enum {
+	CHIAKI_LOG_SUBSYSTEM_GENERAL = 0,
+	CHIAKI_LOG_SUBSYSTEM_TAKION,
+	CHIAKI_LOG_SUBSYSTEM_VIDEO,
+	CHIAKI_LOG_SUBSYSTEM_AUDIO,
+	CHIAKI_LOG_SUBSYSTEM_CRYPT,
+	CHIAKI_LOG_SUBSYSTEM_HOLEPUNCH,
+	CHIAKI_LOG_SUBSYSTEM_COUNT
+} ChiakiLogSubsystem;
+
+/**
+ * Subsystem that the CHIAKI_LOG* macros log for.
+ * Source files of a subsystem define this before including anything.
+ */
+#ifndef CHIAKI_LOG_SUBSYSTEM
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_GENERAL
+#endif
+
 CHIAKI_EXPORT char chiaki_log_level_char(ChiakiLogLevel level);
+CHIAKI_EXPORT const char *chiaki_log_subsystem_name(ChiakiLogSubsystem subsystem);
 
 typedef void (*ChiakiLogCb)(ChiakiLogLevel level, const char *msg, void *user);
 
 typedef struct chiaki_log_t
 {
 	uint32_t level_mask;
+	uint32_t subsystem_level_mask[CHIAKI_LOG_SUBSYSTEM_COUNT]; // enabled in addition to level_mask for messages of a subsystem
 	ChiakiLogCb cb;
 	void *user;
 } ChiakiLog;
@@ -36,20 +66,51 @@ typedef struct chiaki_log_t
 CHIAKI_EXPORT void chiaki_log_init(ChiakiLog *log, uint32_t level_mask, ChiakiLogCb cb, void *user);
 CHIAKI_EXPORT void chiaki_log_set_level(ChiakiLog *log, uint32_t level_mask);
 
+/**
+ * Enable levels for one subsystem in addition to level_mask, e.g. verbose logging for Takion only.
+ */
+CHIAKI_EXPORT void chiaki_log_set_subsystem_level(ChiakiLog *log, ChiakiLogSubsystem subsystem, uint32_t level_mask);
+
+/**
+ * Enable verbose and debug logging for the subsystems in a comma-separated list of names, e.g. "takion,video".
+ *
+ * @return CHIAKI_ERR_INVALID_DATA if a name is unknown, all known ones are still enabled
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_log_set_subsystems_verbose(ChiakiLog *log, const char *subsystems);
+
+static inline bool chiaki_log_enabled(ChiakiLog *log, ChiakiLogSubsystem subsystem, ChiakiLogLevel level)
+{
+	return !log || ((log->level_mask | log->subsystem_level_mask[subsystem]) & level);
+}
+
 /**
  * Logging callback (ChiakiLogCb) that prints to stdout
  */
 CHIAKI_EXPORT void chiaki_log_cb_print(ChiakiLogLevel level, const char *msg, void *user);
 
 CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *fmt, ...);
+
+/**
+ * Like chiaki_log(), but without checking the level, e.g. because chiaki_log_enabled() was already checked.
+ */
+CHIAKI_EXPORT void chiaki_log_unmasked(ChiakiLog *log, ChiakiLogLevel level, const char *fmt, ...);
 CHIAKI_EXPORT void chiaki_log_hexdump(ChiakiLog *log, ChiakiLogLevel level, const uint8_t *buf, size_t buf_size);
 CHIAKI_EXPORT void chiaki_log_hexdump_raw(ChiakiLog *log, ChiakiLogLevel level, const uint8_t *buf, size_t buf_size);
 
-#define CHIAKI_LOGD(log, ...) do { chiaki_log((log), CHIAKI_LOG_DEBUG, __VA_ARGS__); } while(0)
-#define CHIAKI_LOGV(log, ...) do { chiaki_log((log), CHIAKI_LOG_VERBOSE, __VA_ARGS__); } while(0)
-#define CHIAKI_LOGI(log, ...) do { chiaki_log((log), CHIAKI_LOG_INFO, __VA_ARGS__); } while(0)
-#define CHIAKI_LOGW(log, ...) do { chiaki_log((log), CHIAKI_LOG_WARNING, __VA_ARGS__); } while(0)
-#define CHIAKI_LOGE(log, ...) do { chiaki_log((log), CHIAKI_LOG_ERROR, __VA_ARGS__); } while(0)
+/**
+ * Check the level before evaluating any of the arguments.
+ */
+#define CHIAKI_LOG_SUBSYSTEM_LEVEL(log, subsystem, level, ...) do { \
+		ChiakiLog *chiaki_log_macro_log_ = (log); \
+		if((CHIAKI_LOG_COMPILED_MASK & (level)) && chiaki_log_enabled(chiaki_log_macro_log_, (subsystem), (level))) \
+			chiaki_log_unmasked(chiaki_log_macro_log_, (level), __VA_ARGS__); \
+	} while(0)
+
+#define CHIAKI_LOGD(log, ...) CHIAKI_LOG_SUBSYSTEM_LEVEL((log), CHIAKI_LOG_SUBSYSTEM, CHIAKI_LOG_DEBUG, __VA_ARGS__)
+#define CHIAKI_LOGV(log, ...) CHIAKI_LOG_SUBSYSTEM_LEVEL((log), CHIAKI_LOG_SUBSYSTEM, CHIAKI_LOG_VERBOSE, __VA_ARGS__)
+#define CHIAKI_LOGI(log, ...) CHIAKI_LOG_SUBSYSTEM_LEVEL((log), CHIAKI_LOG_SUBSYSTEM, CHIAKI_LOG_INFO, __VA_ARGS__)
+#define CHIAKI_LOGW(log, ...) CHIAKI_LOG_SUBSYSTEM_LEVEL((log), CHIAKI_LOG_SUBSYSTEM, CHIAKI_LOG_WARNING, __VA_ARGS__)
+#define CHIAKI_LOGE(log, ...) CHIAKI_LOG_SUBSYSTEM_LEVEL((log), CHIAKI_LOG_SUBSYSTEM, CHIAKI_LOG_ERROR, __VA_ARGS__)
 
 typedef struct chiaki_log_sniffer_t
 {
@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_LOGASYNC_H
+#define CHIAKI_LOGASYNC_H
+
+#include "log.h"
+#include "thread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_LOG_ASYNC_MSG_SIZE 0xf0 // longer messages are copied to the heap
+#define CHIAKI_LOG_ASYNC_SIZE_DEFAULT 1024
+
+/**
+ * Log that never calls the callback of forward_log on the logging thread.
+ *
+ * Messages are copied into a bounded lock-free ring and a writer thread forwards them,
+ * so threads like Takion or the video receiver are never blocked by e.g. file I/O in the callback.
+ * If the ring is full, messages are dropped and counted, except for levels in sync_level_mask,
+ * which are then forwarded directly on the logging thread instead.
+ */
+typedef struct chiaki_log_async_t
+{
+	ChiakiLog *forward_log; // where everything is forwarded from the writer thread
+	ChiakiLog async_log; // the log where others will log into
+	uint32_t sync_level_mask;
+
+	struct chiaki_log_async_record_t *records;
+	size_t records_count; // power of 2
+	uint64_t enqueue_pos; // shared by all logging threads
+	uint64_t dequeue_pos; // only used by the writer thread
+	uint64_t dropped;
+	uint64_t dropped_reported; // only used by the writer thread
+	uint64_t truncated;
+	bool writer_waiting;
+
+	ChiakiThread thread;
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool stop;
+} ChiakiLogAsync;
+
+/**
+ * @param size number of messages that can be queued, rounded up to a power of 2, 0 for CHIAKI_LOG_ASYNC_SIZE_DEFAULT
+ * @param sync_level_mask levels that are forwarded synchronously instead of dropped while the ring is full
+ * @param forward_log its level_mask and subsystem levels are applied to the async log, NULL to print everything
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_log_async_init(ChiakiLogAsync *log_async, size_t size, uint32_t sync_level_mask, ChiakiLog *forward_log);
+
+/**
+ * Forward everything that is still queued and stop the writer thread.
+ * Nothing may log into the async log anymore at this point.
+ */
+CHIAKI_EXPORT void chiaki_log_async_fini(ChiakiLogAsync *log_async);
+
+static inline ChiakiLog *chiaki_log_async_get_log(ChiakiLogAsync *log_async) { return &log_async->async_log; }
+
+/**
+ * @return number of messages dropped so far because the ring was full
+ */
+CHIAKI_EXPORT uint64_t chiaki_log_async_dropped(ChiakiLogAsync *log_async);
+
+/**
+ * @return number of messages that were too long for a record and could not be copied to the heap either,
+ * so they were forwarded truncated, ending in "..."
+ */
+CHIAKI_EXPORT uint64_t chiaki_log_async_truncated(ChiakiLogAsync *log_async);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_LOGASYNC_H
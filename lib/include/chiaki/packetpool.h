@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_PACKETPOOL_H
+#define CHIAKI_PACKETPOOL_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Size of a single buffer inside the pool, large enough for any datagram with an MTU of 1500
+ * and a multiple of CHIAKI_PACKET_POOL_ALIGNMENT.
+ */
+#define CHIAKI_PACKET_POOL_BUF_SIZE 1536
+#define CHIAKI_PACKET_POOL_ALIGNMENT 64
+
+typedef struct chiaki_packet_pool_t ChiakiPacketPool;
+
+typedef struct chiaki_packet_buf_t
+{
+	ChiakiPacketPool *pool;
+	struct chiaki_packet_buf_t *next_free;
+	uint32_t refs;
+	bool heap; // allocated separately because the pool was exhausted
+	uint8_t *data;
+	size_t capacity;
+	size_t size; // actually used size of data, set by the user
+} ChiakiPacketBuf;
+
+/**
+ * Fixed pool of MTU-sized, cache-line-aligned buffers with reference-counted handles.
+ *
+ * Not thread-safe, all functions (including ref/unref of acquired buffers) must be called from the same thread.
+ */
+struct chiaki_packet_pool_t
+{
+	uint8_t *mem;
+	ChiakiPacketBuf *bufs;
+	size_t bufs_count;
+	ChiakiPacketBuf *free_list;
+	size_t free_count;
+
+	uint64_t acquired; // total number of acquired buffers
+	uint64_t heap_allocs; // number of buffers that had to be allocated on the heap because the pool was exhausted
+};
+
+/**
+ * @param count number of buffers to preallocate
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_pool_init(ChiakiPacketPool *pool, size_t count);
+
+/**
+ * All acquired buffers must have been released before.
+ */
+CHIAKI_EXPORT void chiaki_packet_pool_fini(ChiakiPacketPool *pool);
+
+/**
+ * Get a free buffer with a reference count of 1 and size set to 0.
+ * If the pool is exhausted, a buffer is allocated on the heap and pool->heap_allocs is incremented.
+ *
+ * @return the buffer or NULL if the heap allocation failed
+ */
+CHIAKI_EXPORT ChiakiPacketBuf *chiaki_packet_pool_acquire(ChiakiPacketPool *pool);
+
+static inline ChiakiPacketBuf *chiaki_packet_buf_ref(ChiakiPacketBuf *buf)
+{
+	buf->refs++;
+	return buf;
+}
+
+/**
+ * Drop a reference and give the buffer back to its pool when it was the last one.
+ */
+CHIAKI_EXPORT void chiaki_packet_buf_unref(ChiakiPacketBuf *buf);
+
+static inline size_t chiaki_packet_pool_free_count(ChiakiPacketPool *pool)
+{
+	return pool->free_count;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_PACKETPOOL_H
@@ -10,27 +10,95 @@
 extern "C" {
 #endif
 
-typedef struct chiaki_packet_stats_t
+#define CHIAKI_PACKET_STATS_HIST_BUCKETS 20
+#define CHIAKI_PACKET_STATS_HIST_INTERVALS 8 // histograms cover the last intervals, one interval ends with every reset
+
+typedef enum chiaki_packet_stats_hist_t {
+	CHIAKI_PACKET_STATS_HIST_LOSS_BURST = 0, // length of runs of consecutively lost packets
+	CHIAKI_PACKET_STATS_HIST_FRAME_LOSS = 1, // units lost per video frame
+	CHIAKI_PACKET_STATS_HIST_JITTER = 2, // deviation of the inter-arrival time of video frames from the frame interval in us
+	CHIAKI_PACKET_STATS_HIST_COUNT
+} ChiakiPacketStatsHist;
+
+typedef enum chiaki_packet_stats_frame_result_t {
+	CHIAKI_PACKET_STATS_FRAME_COMPLETE = 0,
+	CHIAKI_PACKET_STATS_FRAME_FEC_RECOVERED = 1,
+	CHIAKI_PACKET_STATS_FRAME_FAILED = 2,
+	CHIAKI_PACKET_STATS_FRAME_RESULT_COUNT
+} ChiakiPacketStatsFrameResult;
+
+/**
+ * Bucket 0 counts the value 0, bucket i > 0 the values in [2^(i-1), 2^i) and the last bucket everything above.
+ */
+typedef struct chiaki_packet_stats_histogram_t
 {
-	ChiakiMutex mutex;
+	uint64_t buckets[CHIAKI_PACKET_STATS_HIST_BUCKETS];
+} ChiakiPacketStatsHistogram;
 
+typedef struct chiaki_packet_stats_histograms_t
+{
+	ChiakiPacketStatsHistogram hist[CHIAKI_PACKET_STATS_HIST_COUNT];
+	uint64_t frames[CHIAKI_PACKET_STATS_FRAME_RESULT_COUNT];
+} ChiakiPacketStatsHistograms;
+
+/**
+ * Packet statistics that producers push to without ever blocking.
+ * Everything is updated with atomics, so pushing may happen from any thread,
+ * while chiaki_packet_stats_get() and chiaki_packet_stats_reset() must only be called from one thread at a time.
+ */
+typedef struct chiaki_packet_stats_t
+{
 	// For generations of packets, i.e. where we know the number of expected packets per generation
-	uint64_t gen_received;
-	uint64_t gen_lost;
+	uint64_t gen; // received in the low, lost in the high 32 bits since the last reset
 
 	// For sequential packets, i.e. where packets are identified by a sequence number
-	ChiakiSeqNum16 seq_min; // sequence number that was max at the last reset
-	ChiakiSeqNum16 seq_max; // currently maximal sequence number
-	uint64_t seq_received; // total received packets since the last reset
+	uint64_t seq; // currently maximal sequence number in bits 0-15, bit 16 set once a packet was pushed, received packets since the last reset above
+	ChiakiSeqNum16 seq_min; // sequence number that was max at the last reset, only used by the resetting thread
+	bool seq_min_valid;
+
+	uint32_t interval; // index of the current interval, incremented on every reset
+	ChiakiPacketStatsHistograms intervals[CHIAKI_PACKET_STATS_HIST_INTERVALS];
 } ChiakiPacketStats;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_stats_init(ChiakiPacketStats *stats);
 CHIAKI_EXPORT void chiaki_packet_stats_fini(ChiakiPacketStats *stats);
 CHIAKI_EXPORT void chiaki_packet_stats_reset(ChiakiPacketStats *stats);
+
+/**
+ * Count a generation of packets, e.g. the units of a video frame. lost is also added to CHIAKI_PACKET_STATS_HIST_FRAME_LOSS.
+ */
 CHIAKI_EXPORT void chiaki_packet_stats_push_generation(ChiakiPacketStats *stats, uint64_t received, uint64_t lost);
+
+/**
+ * Count a packet identified by a sequence number. Gaps are added to CHIAKI_PACKET_STATS_HIST_LOSS_BURST.
+ */
 CHIAKI_EXPORT void chiaki_packet_stats_push_seq(ChiakiPacketStats *stats, ChiakiSeqNum16 seq_num);
+
+/**
+ * @param reset start a new interval, i.e. count from zero again and drop the oldest interval from the histograms
+ */
 CHIAKI_EXPORT void chiaki_packet_stats_get(ChiakiPacketStats *stats, bool reset, uint64_t *received, uint64_t *lost);
 
+/**
+ * Add value to one of the histograms of the current interval.
+ */
+CHIAKI_EXPORT void chiaki_packet_stats_push_hist(ChiakiPacketStats *stats, ChiakiPacketStatsHist hist, uint64_t value);
+CHIAKI_EXPORT void chiaki_packet_stats_push_frame(ChiakiPacketStats *stats, ChiakiPacketStatsFrameResult result);
+
+/**
+ * Sum of the histograms over the last CHIAKI_PACKET_STATS_HIST_INTERVALS intervals, including the current one.
+ * Does not block producers and may be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_packet_stats_get_histograms(ChiakiPacketStats *stats, ChiakiPacketStatsHistograms *histograms);
+
+/**
+ * @return smallest value that falls into the given bucket
+ */
+static inline uint64_t chiaki_packet_stats_hist_bucket_min(size_t bucket)
+{
+	return bucket ? (uint64_t)1 << (bucket - 1) : 0;
+}
+
 #ifdef __cplusplus
 }
 #endif
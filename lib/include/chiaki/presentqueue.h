@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_PRESENTQUEUE_H
+#define CHIAKI_PRESENTQUEUE_H
+
+#include "thread.h"
+#include "seqnum.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_PRESENT_QUEUE_SIZE_MAX 8
+
+typedef enum chiaki_present_policy_t {
+	CHIAKI_PRESENT_POLICY_LATEST = 0, // always present the newest frame, drop everything older
+	CHIAKI_PRESENT_POLICY_PACED = 1 // present one frame per display refresh, delayed just enough to absorb the jitter of decoded frames
+} ChiakiPresentPolicy;
+
+/**
+ * Monotonic timestamps in us of a frame on its way to the display, 0 if unknown.
+ */
+typedef struct chiaki_present_frame_info_t
+{
+	ChiakiSeqNum16 frame_index;
+	uint64_t receive_us; // first unit of the frame arrived
+	uint64_t decoded_us; // the decoder output the frame
+	uint64_t handoff_us; // the frame was handed to the renderer
+} ChiakiPresentFrameInfo;
+
+typedef struct chiaki_present_queue_stats_t
+{
+	uint64_t pushed;
+	uint64_t presented;
+	uint64_t dropped; // pushed, but never presented
+	uint64_t late; // presented more than a refresh interval after they were due
+	uint64_t repeated; // refreshes where the previous frame stayed on screen because there was none due
+	uint64_t receive_to_decoded_us; // sum over all presented frames with a known receive time
+	uint64_t decoded_to_handoff_us; // sum over all presented frames
+	uint64_t target_delay_us; // current delay of paced frames after decoding
+} ChiakiPresentQueueStats;
+
+typedef void (*ChiakiPresentQueueFreeCallback)(void *frame, void *user);
+
+typedef struct chiaki_present_queue_entry_t
+{
+	void *frame;
+	ChiakiPresentFrameInfo info;
+} ChiakiPresentQueueEntry;
+
+/**
+ * Frames between the decoder and the display.
+ *
+ * The decoder side pushes frames as they are decoded, the display side calls chiaki_present_queue_present()
+ * on every refresh. Both may run on different threads.
+ */
+typedef struct chiaki_present_queue_t
+{
+	ChiakiMutex mutex;
+	ChiakiPresentPolicy policy;
+	uint64_t refresh_interval_us;
+	size_t size;
+	ChiakiPresentQueueEntry entries[CHIAKI_PRESENT_QUEUE_SIZE_MAX]; // oldest first
+	size_t count;
+	bool presented_any;
+
+	uint64_t decoded_prev_us; // of the last pushed frame
+	int64_t interval_avg_us; // smoothed interval between decoded frames
+	int64_t jitter_us; // smoothed deviation from interval_avg_us
+
+	ChiakiPresentQueueFreeCallback free_cb;
+	void *free_cb_user;
+	ChiakiPresentQueueStats stats;
+} ChiakiPresentQueue;
+
+/**
+ * @param refresh_interval_us of the display, only used by CHIAKI_PRESENT_POLICY_PACED
+ * @param size maximum number of queued frames, 0 for CHIAKI_PRESENT_QUEUE_SIZE_MAX
+ * @param free_cb called for every frame that is dropped, never with the mutex of the queue held
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_present_queue_init(ChiakiPresentQueue *queue, ChiakiPresentPolicy policy, uint64_t refresh_interval_us, size_t size,
+		ChiakiPresentQueueFreeCallback free_cb, void *free_cb_user);
+
+/**
+ * Frees all frames that are still queued.
+ */
+CHIAKI_EXPORT void chiaki_present_queue_fini(ChiakiPresentQueue *queue);
+
+CHIAKI_EXPORT void chiaki_present_queue_set_refresh_interval(ChiakiPresentQueue *queue, uint64_t refresh_interval_us);
+
+/**
+ * @param info decoded_us of 0 is replaced by the current time
+ */
+CHIAKI_EXPORT void chiaki_present_queue_push(ChiakiPresentQueue *queue, void *frame, const ChiakiPresentFrameInfo *info);
+
+/**
+ * Take the frame to show now, to be called on every display refresh.
+ *
+ * @param now_us monotonic time of the refresh, which becomes the handoff time
+ * @param info if not NULL, set to the info of the returned frame
+ * @return frame owned by the caller, or NULL if the previous one should stay on screen
+ */
+CHIAKI_EXPORT void *chiaki_present_queue_present(ChiakiPresentQueue *queue, uint64_t now_us, ChiakiPresentFrameInfo *info);
+
+CHIAKI_EXPORT void chiaki_present_queue_get_stats(ChiakiPresentQueue *queue, ChiakiPresentQueueStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_PRESENTQUEUE_H
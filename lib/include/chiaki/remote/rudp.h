@@ -22,6 +22,7 @@
 #include <chiaki/common.h>
 #include <chiaki/sock.h>
 #include <chiaki/stoppipe.h>
+#include <chiaki/rttestimator.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -223,6 +224,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_stop_pipe_select_single(ChiakiRudp rud
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_ack_packet(ChiakiRudp rudp, uint16_t counter_to_ack);
 
+/**
+ * Get the rtt measured from acks of sent packets
+ *
+ * @param rudp Pointer to the Rudp instance to use
+ * @param[out] stats rtt stats, samples is 0 if nothing has been acked yet
+*/
+CHIAKI_EXPORT void chiaki_rudp_get_rtt_stats(ChiakiRudp rudp, ChiakiRttStats *stats);
+
 /**
  * Print Rudp Message
  *
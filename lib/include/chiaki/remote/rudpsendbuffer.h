@@ -7,6 +7,7 @@
 #include "../log.h"
 #include "../thread.h"
 #include "../seqnum.h"
+#include "../rttestimator.h"
 #include "../sock.h"
 #include "../remote/rudp.h"
 
@@ -27,6 +28,8 @@ typedef struct chiaki_rudp_send_buffer_t
 	size_t packets_size; // allocated size
 	size_t packets_count; // current count
 
+	ChiakiRttEstimator rtt; // re-send timeout from the rtt of acks
+
 	ChiakiMutex mutex;
 	ChiakiCond cond;
 	bool should_stop;
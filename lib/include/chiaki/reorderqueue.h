@@ -19,9 +19,10 @@ typedef enum chiaki_reorder_queue_drop_strategy_t {
 typedef struct chiaki_reorder_queue_entry_t
 {
 	void *user;
-	bool set;
 } ChiakiReorderQueueEntry;
 
+#define CHIAKI_REORDER_QUEUE_SIZE_EXP_MAX 15 // keeps the queue smaller than half of the ChiakiSeqNum16 space
+
 typedef void (*ChiakiReorderQueueDropCb)(uint64_t seq_num, void *elem_user, void *cb_user);
 typedef bool (*ChiakiReorderQueueSeqNumGt)(uint64_t a, uint64_t b);
 typedef bool (*ChiakiReorderQueueSeqNumLt)(uint64_t a, uint64_t b);
@@ -32,6 +33,7 @@ typedef struct chiaki_reorder_queue_t
 {
 	size_t size_exp; // real size = 2^size * sizeof(ChiakiReorderQueueEntry)
 	ChiakiReorderQueueEntry *queue;
+	uint64_t *bitmap; // one bit per entry, set iff it holds an element, always clear outside of [begin, begin + count)
 	uint64_t begin;
 	uint64_t count;
 	ChiakiReorderQueueSeqNumGt seq_num_gt;
@@ -44,7 +46,7 @@ typedef struct chiaki_reorder_queue_t
 } ChiakiReorderQueue;
 
 /**
- * @param size exponent for 2
+ * @param size exponent for 2, at most CHIAKI_REORDER_QUEUE_SIZE_EXP_MAX
  * @param seq_num_start sequence number of the first expected element
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init(ChiakiReorderQueue *queue, size_t size_exp,
@@ -83,6 +85,19 @@ static inline uint64_t chiaki_reorder_queue_count(ChiakiReorderQueue *queue)
 	return queue->count;
 }
 
+/**
+ * Check whether there is an element at a specific index without touching the entries.
+ *
+ * @param index Offset to be added to the begin sequence number, this is NOT a sequence number itself!
+ */
+static inline bool chiaki_reorder_queue_is_set(ChiakiReorderQueue *queue, uint64_t index)
+{
+	if(index >= queue->count)
+		return false;
+	size_t i = (size_t)(queue->seq_num_add(queue->begin, index) & (chiaki_reorder_queue_size(queue) - 1));
+	return (queue->bitmap[i / 64] >> (i % 64)) & 1;
+}
+
 /**
  * Push a packet into the queue.
  *
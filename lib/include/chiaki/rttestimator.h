@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_RTTESTIMATOR_H
+#define CHIAKI_RTTESTIMATOR_H
+
+#include "common.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chiaki_rtt_stats_t
+{
+	uint64_t srtt_us; // 0 if there are no samples yet
+	uint64_t rttvar_us;
+	uint64_t rto_ms;
+	uint64_t samples;
+} ChiakiRttStats;
+
+/**
+ * Smoothed rtt and re-send timeout as in RFC 6298.
+ * Must only be updated by one thread at a time (e.g. under the lock of its send buffer),
+ * but can be read from any thread.
+ */
+typedef struct chiaki_rtt_estimator_t
+{
+	uint64_t srtt_us;
+	uint64_t rttvar_us;
+	uint64_t rto_ms;
+	uint64_t rto_min_ms;
+	uint64_t rto_max_ms;
+	uint64_t samples;
+} ChiakiRttEstimator;
+
+CHIAKI_EXPORT void chiaki_rtt_estimator_init(ChiakiRttEstimator *estimator, uint64_t rto_initial_ms, uint64_t rto_min_ms, uint64_t rto_max_ms);
+
+/**
+ * Karn's rule: only pass samples of packets that were never re-sent,
+ * because the ack of a re-sent packet may belong to any of its copies.
+ */
+CHIAKI_EXPORT void chiaki_rtt_estimator_sample(ChiakiRttEstimator *estimator, uint64_t rtt_us);
+
+/**
+ * Double the re-send timeout after it expired, until the next sample.
+ */
+CHIAKI_EXPORT void chiaki_rtt_estimator_backoff(ChiakiRttEstimator *estimator);
+
+CHIAKI_EXPORT uint64_t chiaki_rtt_estimator_rto_ms(ChiakiRttEstimator *estimator);
+CHIAKI_EXPORT void chiaki_rtt_estimator_get_stats(ChiakiRttEstimator *estimator, ChiakiRttStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_RTTESTIMATOR_H
@@ -14,6 +14,7 @@
 #include "audio.h"
 #include "controller.h"
 #include "stoppipe.h"
+#include "eventloop.h"
 #include "remote/holepunch.h"
 #include "remote/rudp.h"
 #include "regist.h"
@@ -88,6 +89,13 @@ typedef struct chiaki_connect_info_t
 	chiaki_socket_t *rudp_sock;
 	uint8_t psn_account_id[CHIAKI_PSN_ACCOUNT_ID_SIZE];
 	double packet_loss_max;
+	bool video_fec_async; // recover lost video units on a separate thread, video_sample_cb may then be called from it
+	bool audio_async; // call the audio and haptics sinks from two separate threads, "Chiaki Audio" and "Chiaki Haptics", and play out audio through a jitter buffer
+	size_t video_reorder_frames; // video frames assembled at the same time to tolerate reordering, 0 or 1 for none, at most CHIAKI_VIDEO_RECEIVER_FRAME_SLOTS_MAX
+	uint64_t video_reorder_deadline_us; // how long to wait for late units of a frame once a newer one started, 0 for default
+	bool event_loop; // run periodic tasks like congestion control and takion re-sends on one event loop thread, only supported on Linux
+	ChiakiCongestionControllerType congestion_controller; // decides what loss is reported to the console to steer its bitrate
+	size_t data_window; // reliable data packets held back while one before them is missing, 0 for CHIAKI_TAKION_DATA_WINDOW_DEFAULT
 } ChiakiConnectInfo;
 
 
@@ -146,6 +154,18 @@ typedef struct chiaki_trigger_effects_event_t
 	uint8_t right[10];
 } ChiakiTriggerEffectsEvent;
 
+/**
+ * A P frame referenced a frame that was never decoded, so it was changed to reference an older one.
+ * It will show artifacts until the next keyframe. To get one right away instead of waiting for the console,
+ * stream_connection_send_corrupt_frame() may be called with frame_index from the event callback.
+ */
+typedef struct chiaki_video_recovered_event_t
+{
+	ChiakiSeqNum16 frame_index;
+	ChiakiSeqNum16 reference_frame_index_missing; // referenced originally
+	ChiakiSeqNum16 reference_frame_index; // referenced now
+} ChiakiVideoRecoveredEvent;
+
 typedef enum {
 	CHIAKI_EVENT_CONNECTED,
 	CHIAKI_EVENT_LOGIN_PIN_REQUEST,
@@ -163,6 +183,7 @@ typedef enum {
 	CHIAKI_EVENT_PLAYER_INDEX,
 	CHIAKI_EVENT_HAPTIC_INTENSITY,
 	CHIAKI_EVENT_TRIGGER_INTENSITY,
+	CHIAKI_EVENT_VIDEO_RECOVERED, // sent from the thread that emits video samples
 } ChiakiEventType;
 
 typedef struct chiaki_event_t
@@ -175,6 +196,7 @@ typedef struct chiaki_event_t
 		ChiakiRumbleEvent rumble;
 		ChiakiRegisteredHost host;
 		ChiakiTriggerEffectsEvent trigger_effects;
+		ChiakiVideoRecoveredEvent video_recovered;
 		uint8_t led_state[0x3];
 		uint8_t player_index;
 		struct
@@ -198,6 +220,18 @@ typedef void (*ChiakiEventCallback)(ChiakiEvent *event, void *user);
  */
 typedef bool (*ChiakiVideoSampleCallback)(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user);
 
+/**
+ * Optionally provides the buffers that frames are assembled into before being passed to the video sample callback,
+ * e.g. from a pool of the decoder, so it does not have to copy them. Not every buffer is necessarily passed on.
+ * @return buffer of at least size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE bytes, or NULL on failure
+ */
+typedef uint8_t *(*ChiakiVideoSampleAllocCallback)(size_t size, void *user);
+
+/**
+ * Optionally called right before the video sample callback with info about the sample that follows.
+ */
+typedef void (*ChiakiVideoSampleInfoCallback)(const ChiakiVideoSampleInfo *info, void *user);
+
 
 
 typedef struct chiaki_session_t
@@ -216,6 +250,12 @@ typedef struct chiaki_session_t
 		ChiakiDisableAudioVideo disable_audio_video;
 		bool enable_keyboard;
 		bool enable_dualsense;
+		bool video_fec_async;
+		bool audio_async;
+		size_t video_reorder_frames;
+		uint64_t video_reorder_deadline_us;
+		ChiakiCongestionControllerType congestion_controller;
+		size_t data_window;
 		uint8_t psn_account_id[CHIAKI_PSN_ACCOUNT_ID_SIZE];
 	} connect_info;
 
@@ -237,6 +277,8 @@ typedef struct chiaki_session_t
 	ChiakiEventCallback event_cb;
 	void *event_cb_user;
 	ChiakiVideoSampleCallback video_sample_cb;
+	ChiakiVideoSampleAllocCallback video_sample_alloc_cb; // called with video_sample_cb_user
+	ChiakiVideoSampleInfoCallback video_sample_info_cb; // called with video_sample_cb_user
 	void *video_sample_cb_user;
 	ChiakiAudioSink audio_sink;
 	ChiakiAudioSink haptics_sink;
@@ -247,6 +289,8 @@ typedef struct chiaki_session_t
 	ChiakiCond state_cond;
 	ChiakiMutex state_mutex;
 	ChiakiStopPipe stop_pipe;
+	ChiakiEventLoop event_loop;
+	bool event_loop_enabled; // event_loop has been initialized
 	bool auto_regist;
 	bool should_stop;
 	bool ctrl_failed;
@@ -286,6 +330,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_reject(ChiakiSession *sess
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_accept(ChiakiSession *session);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_go_home(ChiakiSession *session);
 
+/**
+ * Get the current rtt, measured from Takion data acks while streaming or from RUDP acks before that.
+ * If neither has samples yet, srtt_us is the rtt measured by Senkusha and samples is 0.
+ */
+CHIAKI_EXPORT void chiaki_session_get_rtt(ChiakiSession *session, ChiakiRttStats *stats);
+
 static inline void chiaki_session_set_event_cb(ChiakiSession *session, ChiakiEventCallback cb, void *user)
 {
 	session->event_cb = cb;
@@ -298,6 +348,22 @@ static inline void chiaki_session_set_video_sample_cb(ChiakiSession *session, Ch
 	session->video_sample_cb_user = user;
 }
 
+/**
+ * alloc_cb is called with the user given to chiaki_session_set_video_sample_cb().
+ */
+static inline void chiaki_session_set_video_sample_alloc_cb(ChiakiSession *session, ChiakiVideoSampleAllocCallback alloc_cb)
+{
+	session->video_sample_alloc_cb = alloc_cb;
+}
+
+/**
+ * info_cb is called with the user given to chiaki_session_set_video_sample_cb().
+ */
+static inline void chiaki_session_set_video_sample_info_cb(ChiakiSession *session, ChiakiVideoSampleInfoCallback info_cb)
+{
+	session->video_sample_info_cb = info_cb;
+}
+
 /**
  * @param sink contents are copied
  */
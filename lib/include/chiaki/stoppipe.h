@@ -15,6 +15,10 @@
 #include <arpa/inet.h>
 #endif
 
+#if defined(__linux__) && !defined(__SWITCH__)
+#define CHIAKI_STOP_PIPE_EVENTFD
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -32,17 +36,36 @@ typedef struct chiaki_stop_pipe_t
 	// this fd is audited by 'select' as
 	// fd_set *readfds
 	int fd;
+#elif defined(CHIAKI_STOP_PIPE_EVENTFD)
+	int fd; // eventfd, readable while stopped
 #else
 	int fds[2];
 #endif
 } ChiakiStopPipe;
 
+typedef struct chiaki_stop_pipe_wait_fd_t
+{
+	chiaki_socket_t fd;
+	bool write; // wait for fd to become writable instead of readable
+	bool ready; // set by chiaki_stop_pipe_select_multi()
+} ChiakiStopPipeWaitFd;
+
 struct sockaddr;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_init(ChiakiStopPipe *stop_pipe);
 CHIAKI_EXPORT void chiaki_stop_pipe_fini(ChiakiStopPipe *stop_pipe);
 CHIAKI_EXPORT void chiaki_stop_pipe_stop(ChiakiStopPipe *stop_pipe);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_single(ChiakiStopPipe *stop_pipe, chiaki_socket_t fd, bool write, uint64_t timeout_ms);
+
+/**
+ * Wait until any of fds is ready, stop_pipe is stopped or timeout_ms (UINT64_MAX for infinite) has passed.
+ * Not limited by FD_SETSIZE except on Switch. On Windows, at most WSA_MAXIMUM_WAIT_EVENTS - 1 fds are supported.
+ *
+ * @return CHIAKI_ERR_SUCCESS if at least one fd is ready, as marked in its ready field,
+ * CHIAKI_ERR_CANCELED if stopped, CHIAKI_ERR_TIMEOUT on timeout
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_multi(ChiakiStopPipe *stop_pipe, ChiakiStopPipeWaitFd *fds, size_t fds_count, uint64_t timeout_ms);
+
 /**
  * Like connect(), but can be canceled by the stop pipe. Only makes sense with a non-blocking socket.
  */
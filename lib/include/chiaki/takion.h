@@ -12,6 +12,7 @@
 #include "reorderqueue.h"
 #include "feedback.h"
 #include "takionsendbuffer.h"
+#include "packetpool.h"
 
 #include <stdbool.h>
 
@@ -104,6 +105,21 @@ typedef struct chiaki_takion_event_t
 
 typedef void (*ChiakiTakionCallback)(ChiakiTakionEvent *event, void *user);
 
+/**
+ * Default number of datagrams received per syscall in batched receive mode.
+ */
+#define CHIAKI_TAKION_RECV_BATCH_SIZE_DEFAULT 32
+
+/**
+ * Default number of reliable data packets held back while one before them is missing.
+ */
+#define CHIAKI_TAKION_DATA_WINDOW_DEFAULT 128
+
+/**
+ * Default time a data ack is held back, so a single ack covers a burst of data packets.
+ */
+#define CHIAKI_TAKION_DATA_ACK_DELAY_MS_DEFAULT 5
+
 typedef struct chiaki_takion_connect_info_t
 {
 	ChiakiLog *log;
@@ -117,8 +133,38 @@ typedef struct chiaki_takion_connect_info_t
 	bool enable_dualsense;
 	uint8_t protocol_version;
 	bool close_socket; // close socket when finishing takion
+
+	/**
+	 * Maximum number of datagrams to receive with a single syscall (recvmmsg) after waiting for the socket.
+	 * Only supported on Linux, 0 or 1 always uses a single recv per datagram.
+	 */
+	size_t recv_batch_size;
+
+	/**
+	 * Maximum number of reliable data packets held back while one before them is missing, rounded up to a power of two.
+	 * 0 for CHIAKI_TAKION_DATA_WINDOW_DEFAULT.
+	 */
+	size_t data_window;
+
+	/**
+	 * Data acks are coalesced and sent at most this long after the first data packet they cover.
+	 * With 0, there is still only one ack per batch of received datagrams.
+	 */
+	uint64_t data_ack_delay_ms;
+
+	ChiakiEventLoop *event_loop; // if not NULL, the send buffer re-sends packets from a timer on this loop instead of an own thread
 } ChiakiTakionConnectInfo;
 
+typedef struct chiaki_takion_recv_stats_t
+{
+	uint64_t packets; // received datagrams
+	uint64_t bytes;
+	uint64_t wait_calls; // waits on the stop pipe and socket
+	uint64_t recv_calls; // recv()/recvmmsg() calls
+	uint64_t data_packets; // reliable data packets delivered in order
+	uint64_t data_acks; // data acks sent
+} ChiakiTakionRecvStats;
+
 
 typedef struct chiaki_takion_t
 {
@@ -152,7 +198,33 @@ typedef struct chiaki_takion_t
 
 	ChiakiGKCrypt *gkcrypt_remote; // if NULL (default), remote gmacs are IGNORED (!) and everything is expected to be unencrypted
 
+	/**
+	 * Preallocated buffers for all received datagrams.
+	 * Owned by the Takion thread, packets are passed around as references into this pool.
+	 */
+	ChiakiPacketPool packet_pool;
+
+	size_t recv_batch_size;
+	struct chiaki_takion_recv_batch_t *recv_batch; // NULL if batched receive is disabled or unsupported
+
+	/**
+	 * Only written by the Takion thread.
+	 */
+	ChiakiTakionRecvStats recv_stats;
+
 	ChiakiReorderQueue data_queue;
+	size_t data_queue_size_exp;
+
+	/**
+	 * Data ack that is held back to be coalesced with the next ones, only used by the Takion thread.
+	 */
+	uint64_t data_ack_delay_ms;
+	bool data_ack_pending;
+	ChiakiSeqNum32 data_ack_seq_num;
+	size_t data_ack_pending_count; // data packets covered by the pending ack
+	uint64_t data_ack_deadline_ms;
+
+	ChiakiEventLoop *event_loop;
 	ChiakiTakionSendBuffer send_buffer;
 
 	ChiakiTakionCallback cb;
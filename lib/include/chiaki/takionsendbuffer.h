@@ -7,6 +7,8 @@
 #include "log.h"
 #include "thread.h"
 #include "seqnum.h"
+#include "eventloop.h"
+#include "rttestimator.h"
 
 #include <stdbool.h>
 
@@ -18,38 +20,91 @@ typedef struct chiaki_takion_t ChiakiTakion;
 
 typedef struct chiaki_takion_send_buffer_packet_t ChiakiTakionSendBufferPacket;
 
+#define CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS 128
+#define CHIAKI_TAKION_SEND_BUFFER_WHEEL_TICK_MS 10
+
+typedef struct chiaki_takion_send_buffer_stats_t
+{
+	uint64_t resends;
+	uint64_t give_ups;
+	uint64_t backpressure_waits; // pushes that had to wait for acks to make room
+	uint64_t overflows; // pushes that failed because the window stayed full
+} ChiakiTakionSendBufferStats;
+
+/**
+ * Packets are stored in a ring indexed by seq_num, so all packets in the buffer
+ * must lie within a window of packets_size consecutive seq nums.
+ * Re-send deadlines are kept in a timer wheel, so only due packets are visited.
+ */
 typedef struct chiaki_takion_send_buffer_t
 {
 	ChiakiLog *log;
 	ChiakiTakion *takion;
 
 	ChiakiTakionSendBufferPacket *packets;
-	size_t packets_size; // allocated size
-	size_t packets_count; // current count
+	size_t packets_size; // allocated size, power of 2
+	size_t packets_count; // current count, including reserved slots
+	size_t packets_reserved; // slots reserved for packets that are being sent, not pushed yet
+	ChiakiSeqNum32 seq_num_first; // lowest seq num in the buffer, only valid if packets_count > 0
+	ChiakiSeqNum32 seq_num_last; // highest seq num pushed, may already be gone if packets_count > 0
+
+	uint32_t wheel[CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS]; // heads of the per-tick packet lists
+	uint64_t wheel_tick; // last tick that has been processed
+
+	ChiakiRttEstimator rtt; // re-send timeout from the rtt of acks
+
+	ChiakiTakionSendBufferStats stats;
 
 	ChiakiMutex mutex;
 	ChiakiCond cond;
+	ChiakiCond space_cond; // signaled when packets are removed
 	bool should_stop;
 	ChiakiThread thread;
+
+	ChiakiEventLoop *event_loop; // if not NULL, resend_timer is used instead of thread
+	ChiakiEventLoopSource resend_timer; // only armed while there are packets
 } ChiakiTakionSendBuffer;
 
 
 /**
  * Init a Send Buffer and start a thread that automatically re-sends packets on takion.
  *
- * @param takion if NULL, the Send Buffer thread will effectively do nothing (for unit testing)
- * @param size number of packet slots
+ * @param takion if NULL, packets are not actually re-sent (for unit testing)
+ * @param size number of packet slots, rounded up to a power of 2
+ * @param event_loop if not NULL, re-send from a timer on this loop instead of an own thread
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size, ChiakiEventLoop *event_loop);
 CHIAKI_EXPORT void chiaki_takion_send_buffer_fini(ChiakiTakionSendBuffer *send_buffer);
 
 /**
+ * Take the slot for seq_num before sending the packet, so a full window holds back the sender
+ * instead of the packet going out untracked. Follow up with chiaki_takion_send_buffer_push()
+ * once sent or chiaki_takion_send_buffer_cancel() if sending failed.
+ *
+ * @param timeout_ms how long to wait for acks if seq_num does not fit into the window yet.
+ * 0 fails immediately with CHIAKI_ERR_OVERFLOW, which must be used on the thread that handles acks.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_reserve(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint64_t timeout_ms);
+
+/**
+ * Give up a slot taken by chiaki_takion_send_buffer_reserve().
+ */
+CHIAKI_EXPORT void chiaki_takion_send_buffer_cancel(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num);
+
+/**
+ * Store a sent packet for re-sending until it is acked. If seq_num has been reserved, this fills the reserved slot
+ * and never waits, otherwise the slot is reserved first like chiaki_takion_send_buffer_reserve().
+ *
  * @param buf ownership of this is taken by the ChiakiTakionSendBuffer, which will free it automatically later!
  * On error, buf is freed immediately.
+ * @param timeout_ms see chiaki_takion_send_buffer_reserve(), unused if seq_num has been reserved
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size, uint64_t timeout_ms);
 
 /**
+ * Remove all packets up to and including seq_num. The newest of them that has never been re-sent
+ * gives an rtt sample for send_buffer->rtt.
+ *
  * @param acked_seq_nums optional array of size of at least send_buffer->packets_size where acked seq nums will be stored
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, ChiakiSeqNum32 *acked_seq_nums, size_t *acked_seq_nums_count);
@@ -37,6 +37,16 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_join(ChiakiThread *thread, void **re
 CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_timedjoin(ChiakiThread *thread, void **retval, uint64_t timeout_ms);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_set_name(ChiakiThread *thread, const char *name);
 
+/**
+ * @return whether the calling thread is thread
+ */
+CHIAKI_EXPORT bool chiaki_thread_is_current(ChiakiThread *thread);
+
+/**
+ * Give up the rest of the current time slice, e.g. while spinning on another thread.
+ */
+CHIAKI_EXPORT void chiaki_thread_yield();
+
 
 typedef struct chiaki_mutex_t
 {
@@ -18,6 +18,15 @@ typedef struct chiaki_video_profile_t
 	uint8_t *header;
 } ChiakiVideoProfile;
 
+/**
+ * Where a video sample came from, for accounting its latency.
+ */
+typedef struct chiaki_video_sample_info_t
+{
+	uint16_t frame_index;
+	uint64_t receive_us; // monotonic time the first unit of the frame arrived
+} ChiakiVideoSampleInfo;
+
 /**
  * Padding for FFMPEG
  */
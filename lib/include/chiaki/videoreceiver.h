@@ -15,6 +15,38 @@ extern "C" {
 #endif
 
 #define CHIAKI_VIDEO_PROFILES_MAX 8
+#define CHIAKI_VIDEO_RECEIVER_FRAME_SLOTS_MAX 4
+#define CHIAKI_VIDEO_RECEIVER_REORDER_DEADLINE_US_DEFAULT 4000
+#define CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE 16
+
+/**
+ * Frames that can be referenced by the following ones, as a bitset over the last
+ * CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE frame indexes up to the newest one added.
+ * All comparisons are done in sequence number arithmetic, so the window slides across wraparound.
+ */
+typedef struct chiaki_video_reference_window_t
+{
+	ChiakiSeqNum16 newest; // only meaningful if bits != 0
+	uint16_t bits; // bit i set if frame newest - i can be referenced
+} ChiakiVideoReferenceWindow;
+
+/**
+ * One of the frames that are assembled at the same time.
+ */
+typedef struct chiaki_video_receiver_frame_slot_t
+{
+	int32_t frame_index; // < 0 if unused
+	bool flushed; // frame has been emitted or handed over to the fec worker, only late units are counted now
+	uint64_t overtaken_us; // when a newer frame started while this one was not decodable yet, 0 if that did not happen
+	ChiakiFrameProcessor frame_processor;
+} ChiakiVideoReceiverFrameSlot;
+
+typedef struct chiaki_video_receiver_reorder_stats_t
+{
+	uint64_t frames_rescued; // frames that were overtaken by a newer frame, but became decodable before being flushed
+	uint64_t frames_deadline; // overtaken frames flushed incomplete because their deadline expired
+	uint64_t frames_evicted; // frames flushed incomplete because all slots were in use
+} ChiakiVideoReceiverReorderStats;
 
 typedef struct chiaki_video_receiver_t
 {
@@ -24,14 +56,32 @@ typedef struct chiaki_video_receiver_t
 	size_t profiles_count;
 	int profile_cur; // < 1 if no profile selected yet, else index in profiles
 
-	int32_t frame_index_cur; // frame that is currently being filled
+	int32_t frame_index_cur; // newest frame that is currently being filled
+	int32_t frame_index_flush; // frame that was flushed last, i.e. emitted or handed over to the fec worker
+
+	// updated when frames are emitted, so with the fec worker they belong to it while it has frames
 	int32_t frame_index_prev; // last frame that has been at least partially decoded
 	int32_t frame_index_prev_complete; // last frame that has been completely decoded
-	ChiakiFrameProcessor frame_processor;
+
+	/*
+	 * Frames are assembled in up to frame_slots_count slots at the same time, so units of a frame arriving
+	 * after units of the next one do not make it incomplete right away.
+	 * Frames are always flushed in order, as soon as they are decodable or, once a newer frame has started,
+	 * after reorder_deadline_us. With a single slot, a frame is flushed when the next one starts.
+	 */
+	ChiakiVideoReceiverFrameSlot frame_slots[CHIAKI_VIDEO_RECEIVER_FRAME_SLOTS_MAX];
+	size_t frame_slots_count;
+	uint64_t reorder_deadline_us;
+	ChiakiVideoReceiverReorderStats reorder_stats;
+	ChiakiStreamStats stream_stats; // of all frame slots
+	ChiakiFrameProcessorTimes frame_times; // of the last emitted frame, see chiaki_frame_processor_fec_wait() when using the fec worker
 	ChiakiPacketStats *packet_stats;
+	uint64_t frame_interval_us; // at the maximum framerate, to measure the jitter of frame arrivals
+	uint64_t frame_cur_first_unit_us; // arrival of the first unit of frame_index_cur
+	struct chiaki_congestion_control_t *congestion_control; // fed with unit arrivals and frame outcomes if not NULL
 
 	int32_t frames_lost;
-	int32_t reference_frames[16];
+	ChiakiVideoReferenceWindow reference_frames;
 	ChiakiBitstream bitstream;
 } ChiakiVideoReceiver;
 
@@ -49,6 +99,30 @@ CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_
 
 CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet);
 
+/**
+ * Must be called from the same thread as chiaki_video_receiver_av_packet().
+ */
+CHIAKI_EXPORT void chiaki_video_receiver_get_reorder_stats(ChiakiVideoReceiver *video_receiver, ChiakiVideoReceiverReorderStats *stats);
+
+CHIAKI_EXPORT void chiaki_video_reference_window_reset(ChiakiVideoReferenceWindow *window);
+
+/**
+ * Mark frame_index as a valid reference. Adding a frame newer than the newest one slides the window forward,
+ * dropping everything that falls out of it.
+ */
+CHIAKI_EXPORT void chiaki_video_reference_window_add(ChiakiVideoReferenceWindow *window, ChiakiSeqNum16 frame_index);
+
+CHIAKI_EXPORT bool chiaki_video_reference_window_contains(ChiakiVideoReferenceWindow *window, ChiakiSeqNum16 frame_index);
+
+/**
+ * Find the nearest valid reference of frame_index that is at least distance_min and at most
+ * CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE frames before it.
+ *
+ * @param distance_min >= 1
+ * @return distance to the reference, i.e. the reference is frame_index - distance, or 0 if there is none
+ */
+CHIAKI_EXPORT unsigned int chiaki_video_reference_window_nearest(ChiakiVideoReferenceWindow *window, ChiakiSeqNum16 frame_index, unsigned int distance_min);
+
 static inline ChiakiVideoReceiver *chiaki_video_receiver_new(struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
 {
 	ChiakiVideoReceiver *video_receiver = CHIAKI_NEW(ChiakiVideoReceiver);
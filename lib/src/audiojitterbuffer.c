@@ -0,0 +1,205 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/audiojitterbuffer.h>
+
+#include <string.h>
+
+#define JITTER_BUFFER_SMOOTHING 16
+// frames buffered beyond the target delay before the oldest ones are dropped
+#define JITTER_BUFFER_DELAY_HYSTERESIS 2
+
+CHIAKI_EXPORT void chiaki_audio_jitter_buffer_init(ChiakiAudioJitterBuffer *jitter_buffer, uint64_t frame_duration_us, size_t delay_min, size_t delay_max)
+{
+	jitter_buffer->frame_duration_us = frame_duration_us ? frame_duration_us : 1;
+	jitter_buffer->delay_max = delay_max ? delay_max : CHIAKI_AUDIO_JITTER_BUFFER_DELAY_MAX_DEFAULT;
+	if(jitter_buffer->delay_max > CHIAKI_AUDIO_JITTER_BUFFER_SIZE / 2)
+		jitter_buffer->delay_max = CHIAKI_AUDIO_JITTER_BUFFER_SIZE / 2;
+	jitter_buffer->delay_min = delay_min ? delay_min : CHIAKI_AUDIO_JITTER_BUFFER_DELAY_MIN_DEFAULT;
+	if(jitter_buffer->delay_min > jitter_buffer->delay_max)
+		jitter_buffer->delay_min = jitter_buffer->delay_max;
+	jitter_buffer->jitter_us = 0;
+	memset(&jitter_buffer->stats, 0, sizeof(jitter_buffer->stats));
+	chiaki_audio_jitter_buffer_reset(jitter_buffer);
+}
+
+CHIAKI_EXPORT void chiaki_audio_jitter_buffer_reset(ChiakiAudioJitterBuffer *jitter_buffer)
+{
+	for(size_t i=0; i<CHIAKI_AUDIO_JITTER_BUFFER_SIZE; i++)
+		jitter_buffer->slots[i].filled = false;
+	jitter_buffer->empty = true;
+	jitter_buffer->started = false;
+	jitter_buffer->play_index = 0;
+	jitter_buffer->newest_index = 0;
+	jitter_buffer->underruns_consecutive = 0;
+	jitter_buffer->arrival_prev_us = 0;
+	jitter_buffer->arrival_prev_index = 0;
+}
+
+static ChiakiAudioJitterBufferSlot *jitter_buffer_slot(ChiakiAudioJitterBuffer *jitter_buffer, ChiakiSeqNum16 frame_index)
+{
+	ChiakiAudioJitterBufferSlot *slot = &jitter_buffer->slots[frame_index & (CHIAKI_AUDIO_JITTER_BUFFER_SIZE - 1)];
+	return slot->filled && slot->frame_index == frame_index ? slot : NULL;
+}
+
+/**
+ * @return number of frames from play_index up to the newest one, whether they have arrived or not
+ */
+static size_t jitter_buffer_level(ChiakiAudioJitterBuffer *jitter_buffer)
+{
+	if(jitter_buffer->empty || chiaki_seq_num_16_lt(jitter_buffer->newest_index, jitter_buffer->play_index))
+		return 0;
+	return (ChiakiSeqNum16)(jitter_buffer->newest_index - jitter_buffer->play_index) + 1;
+}
+
+static void jitter_buffer_update_jitter(ChiakiAudioJitterBuffer *jitter_buffer, ChiakiSeqNum16 frame_index, uint64_t arrival_us)
+{
+	if(jitter_buffer->arrival_prev_us)
+	{
+		int64_t expected_us = (int64_t)(int16_t)(frame_index - jitter_buffer->arrival_prev_index) * (int64_t)jitter_buffer->frame_duration_us;
+		int64_t deviation = (int64_t)(arrival_us - jitter_buffer->arrival_prev_us) - expected_us;
+		if(deviation < 0)
+			deviation = -deviation;
+		// a single interruption should not push the delay to the maximum right away
+		int64_t deviation_max = (int64_t)(jitter_buffer->delay_max * jitter_buffer->frame_duration_us);
+		if(deviation > deviation_max)
+			deviation = deviation_max;
+		int64_t jitter = (int64_t)jitter_buffer->jitter_us;
+		jitter += (deviation - jitter) / JITTER_BUFFER_SMOOTHING;
+		jitter_buffer->jitter_us = jitter > 0 ? (uint64_t)jitter : 0;
+	}
+	jitter_buffer->arrival_prev_us = arrival_us;
+	jitter_buffer->arrival_prev_index = frame_index;
+}
+
+CHIAKI_EXPORT bool chiaki_audio_jitter_buffer_put(ChiakiAudioJitterBuffer *jitter_buffer, ChiakiSeqNum16 frame_index,
+		const uint8_t *buf, size_t buf_size, uint64_t arrival_us)
+{
+	if(buf_size > CHIAKI_AUDIO_FRAME_SIZE_MAX)
+		return false;
+
+	if(jitter_buffer->empty)
+	{
+		jitter_buffer->empty = false;
+		jitter_buffer->play_index = frame_index;
+		jitter_buffer->newest_index = frame_index;
+	}
+	else if(chiaki_seq_num_16_lt(frame_index, jitter_buffer->play_index))
+	{
+		if(jitter_buffer->started
+			|| (ChiakiSeqNum16)(jitter_buffer->newest_index - frame_index) >= CHIAKI_AUDIO_JITTER_BUFFER_SIZE)
+		{
+			jitter_buffer->stats.late++;
+			return false;
+		}
+		// still buffering, so an older frame just starts the playout earlier
+		jitter_buffer->play_index = frame_index;
+	}
+	else if((ChiakiSeqNum16)(frame_index - jitter_buffer->play_index) >= CHIAKI_AUDIO_JITTER_BUFFER_SIZE)
+	{
+		// too far ahead of the playout, e.g. after an interruption, so start over from this frame
+		for(size_t i=0; i<CHIAKI_AUDIO_JITTER_BUFFER_SIZE; i++)
+		{
+			if(jitter_buffer->slots[i].filled)
+				jitter_buffer->stats.overruns++;
+		}
+		uint64_t jitter_us = jitter_buffer->jitter_us;
+		chiaki_audio_jitter_buffer_reset(jitter_buffer);
+		jitter_buffer->jitter_us = jitter_us;
+		jitter_buffer->empty = false;
+		jitter_buffer->play_index = frame_index;
+		jitter_buffer->newest_index = frame_index;
+	}
+
+	ChiakiAudioJitterBufferSlot *slot = &jitter_buffer->slots[frame_index & (CHIAKI_AUDIO_JITTER_BUFFER_SIZE - 1)];
+	if(slot->filled && slot->frame_index == frame_index)
+		return false;
+	slot->filled = true;
+	slot->frame_index = frame_index;
+	slot->size = buf_size;
+	memcpy(slot->buf, buf, buf_size);
+
+	if(chiaki_seq_num_16_gt(frame_index, jitter_buffer->newest_index))
+		jitter_buffer->newest_index = frame_index;
+	jitter_buffer_update_jitter(jitter_buffer, frame_index, arrival_us);
+	return true;
+}
+
+CHIAKI_EXPORT size_t chiaki_audio_jitter_buffer_target_delay(ChiakiAudioJitterBuffer *jitter_buffer)
+{
+	uint64_t frame_duration_us = jitter_buffer->frame_duration_us;
+	size_t delay = 1 + (size_t)((2 * jitter_buffer->jitter_us + frame_duration_us - 1) / frame_duration_us);
+	if(delay < jitter_buffer->delay_min)
+		return jitter_buffer->delay_min;
+	if(delay > jitter_buffer->delay_max)
+		return jitter_buffer->delay_max;
+	return delay;
+}
+
+CHIAKI_EXPORT ChiakiAudioJitterBufferAction chiaki_audio_jitter_buffer_pull(ChiakiAudioJitterBuffer *jitter_buffer, const uint8_t **buf, size_t *buf_size)
+{
+	*buf = NULL;
+	*buf_size = 0;
+
+	size_t target = chiaki_audio_jitter_buffer_target_delay(jitter_buffer);
+	size_t level = jitter_buffer_level(jitter_buffer);
+	if(!jitter_buffer->started)
+	{
+		if(level < target)
+			return CHIAKI_AUDIO_JITTER_BUFFER_WAIT;
+		jitter_buffer->started = true;
+		jitter_buffer->underruns_consecutive = 0;
+	}
+
+	// anything beyond the target only adds latency
+	while(level > target + JITTER_BUFFER_DELAY_HYSTERESIS)
+	{
+		ChiakiAudioJitterBufferSlot *slot = jitter_buffer_slot(jitter_buffer, jitter_buffer->play_index);
+		if(slot)
+		{
+			slot->filled = false;
+			jitter_buffer->stats.overruns++;
+		}
+		jitter_buffer->play_index++;
+		level--;
+	}
+
+	ChiakiAudioJitterBufferSlot *slot = jitter_buffer_slot(jitter_buffer, jitter_buffer->play_index);
+	if(slot)
+	{
+		slot->filled = false;
+		jitter_buffer->play_index++;
+		jitter_buffer->underruns_consecutive = 0;
+		jitter_buffer->stats.decoded++;
+		*buf = slot->buf;
+		*buf_size = slot->size;
+		return CHIAKI_AUDIO_JITTER_BUFFER_DECODE;
+	}
+
+	if(!level)
+	{
+		// nothing has arrived yet, so stretch the playout instead of skipping the frame
+		jitter_buffer->stats.underruns++;
+		if(++jitter_buffer->underruns_consecutive > jitter_buffer->delay_max)
+		{
+			// the stream has most likely stopped, buffer up again once it continues
+			jitter_buffer->started = false;
+			return CHIAKI_AUDIO_JITTER_BUFFER_WAIT;
+		}
+		jitter_buffer->stats.concealed++;
+		return CHIAKI_AUDIO_JITTER_BUFFER_CONCEAL;
+	}
+
+	// lost, but later frames are here, so the following one might carry it as fec data
+	jitter_buffer->underruns_consecutive = 0;
+	jitter_buffer->play_index++;
+	ChiakiAudioJitterBufferSlot *next = jitter_buffer_slot(jitter_buffer, jitter_buffer->play_index);
+	if(next)
+	{
+		jitter_buffer->stats.fec_recovered++;
+		*buf = next->buf;
+		*buf_size = next->size;
+		return CHIAKI_AUDIO_JITTER_BUFFER_DECODE_FEC;
+	}
+	jitter_buffer->stats.concealed++;
+	return CHIAKI_AUDIO_JITTER_BUFFER_CONCEAL;
+}
@@ -1,11 +1,35 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_AUDIO
+
 #include <chiaki/audioreceiver.h>
 #include <chiaki/session.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 
-static void chiaki_audio_receiver_frame(ChiakiAudioReceiver *audio_receiver, ChiakiSeqNum16 frame_index, bool is_haptics, uint8_t *buf, size_t buf_size);
+// the audio thread also wakes up by itself this often while it is not playing out
+#define AUDIO_RECEIVER_POLL_MS 20
+
+typedef enum audio_receiver_entry_type_t
+{
+	AUDIO_RECEIVER_ENTRY_HEADER,
+	AUDIO_RECEIVER_ENTRY_FRAME
+} AudioReceiverEntryType;
+
+typedef struct chiaki_audio_receiver_entry_t
+{
+	AudioReceiverEntryType type;
+	ChiakiAudioHeader header;
+	ChiakiSeqNum16 frame_index;
+	bool is_haptics;
+	uint64_t arrival_us;
+	size_t size;
+	uint8_t buf[CHIAKI_AUDIO_FRAME_SIZE_MAX];
+} ChiakiAudioReceiverEntry;
+
+static void chiaki_audio_receiver_frame(ChiakiAudioReceiver *audio_receiver, ChiakiSeqNum16 frame_index, bool is_haptics, uint8_t *buf, size_t buf_size, uint64_t arrival_us);
+static void *audio_receiver_thread_func(void *user);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_receiver_init(ChiakiAudioReceiver *audio_receiver, ChiakiSession *session, ChiakiPacketStats *packet_stats)
 {
@@ -16,25 +40,115 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_receiver_init(ChiakiAudioReceiver *au
 	audio_receiver->frame_index_prev = 0;
 	audio_receiver->frame_index_startup = true;
 
+	audio_receiver->async = false;
+	audio_receiver->queue = NULL;
+	audio_receiver->queue_write = 0;
+	audio_receiver->queue_read = 0;
+	audio_receiver->queue_overruns = 0;
+	audio_receiver->thread_waiting = false;
+	audio_receiver->stop = false;
+	audio_receiver->header_received = false;
+	chiaki_audio_jitter_buffer_init(&audio_receiver->jitter_buffer, 0, 0, 0);
+	memset(&audio_receiver->jitter_buffer_stats, 0, sizeof(audio_receiver->jitter_buffer_stats));
+
 	ChiakiErrorCode err = chiaki_mutex_init(&audio_receiver->mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
+	if(!session->connect_info.audio_async)
+		return CHIAKI_ERR_SUCCESS;
+
+	audio_receiver->queue = malloc(CHIAKI_AUDIO_RECEIVER_QUEUE_SIZE * sizeof(ChiakiAudioReceiverEntry));
+	if(!audio_receiver->queue)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto error_mutex;
+	}
+
+	err = chiaki_cond_init(&audio_receiver->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_queue;
+
+	err = chiaki_thread_create(&audio_receiver->thread, audio_receiver_thread_func, audio_receiver);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+	// the haptics receiver is the one without packet stats
+	chiaki_thread_set_name(&audio_receiver->thread, packet_stats ? "Chiaki Audio" : "Chiaki Haptics");
+	audio_receiver->async = true;
+
 	return CHIAKI_ERR_SUCCESS;
+error_cond:
+	chiaki_cond_fini(&audio_receiver->cond);
+error_queue:
+	free(audio_receiver->queue);
+error_mutex:
+	chiaki_mutex_fini(&audio_receiver->mutex);
+	return err;
 }
 
 CHIAKI_EXPORT void chiaki_audio_receiver_fini(ChiakiAudioReceiver *audio_receiver)
 {
-#ifdef CHIAKI_LIB_ENABLE_OPUS
-	opus_decoder_destroy(audio_receiver->opus_decoder);
-#endif
+	if(audio_receiver->async)
+	{
+		chiaki_mutex_lock(&audio_receiver->mutex);
+		audio_receiver->stop = true;
+		chiaki_mutex_unlock(&audio_receiver->mutex);
+		chiaki_cond_signal(&audio_receiver->cond);
+		chiaki_thread_join(&audio_receiver->thread, NULL);
+		chiaki_cond_fini(&audio_receiver->cond);
+		free(audio_receiver->queue);
+
+		ChiakiAudioJitterBufferStats *stats = &audio_receiver->jitter_buffer_stats;
+		if(audio_receiver->header_received)
+			CHIAKI_LOGI(audio_receiver->log, "Audio Receiver decoded %llu frames, recovered %llu with fec, concealed %llu, "
+					"%llu underruns, %llu overruns, %llu late, %llu dropped by the queue",
+					(unsigned long long)stats->decoded,
+					(unsigned long long)stats->fec_recovered,
+					(unsigned long long)stats->concealed,
+					(unsigned long long)stats->underruns,
+					(unsigned long long)stats->overruns,
+					(unsigned long long)stats->late,
+					(unsigned long long)audio_receiver->queue_overruns);
+	}
 	chiaki_mutex_fini(&audio_receiver->mutex);
 }
 
-CHIAKI_EXPORT void chiaki_audio_receiver_stream_info(ChiakiAudioReceiver *audio_receiver, ChiakiAudioHeader *audio_header)
+CHIAKI_EXPORT void chiaki_audio_receiver_get_stats(ChiakiAudioReceiver *audio_receiver, ChiakiAudioReceiverStats *stats)
 {
 	chiaki_mutex_lock(&audio_receiver->mutex);
+	stats->jitter_buffer = audio_receiver->jitter_buffer_stats;
+	chiaki_mutex_unlock(&audio_receiver->mutex);
+	stats->queue_overruns = __atomic_load_n(&audio_receiver->queue_overruns, __ATOMIC_RELAXED);
+}
 
+/**
+ * @return the entry for the caller to fill, NULL if the queue is full
+ */
+static ChiakiAudioReceiverEntry *audio_receiver_queue_reserve(ChiakiAudioReceiver *audio_receiver)
+{
+	uint64_t write = audio_receiver->queue_write;
+	if(write - __atomic_load_n(&audio_receiver->queue_read, __ATOMIC_ACQUIRE) == CHIAKI_AUDIO_RECEIVER_QUEUE_SIZE)
+	{
+		__atomic_fetch_add(&audio_receiver->queue_overruns, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	return &audio_receiver->queue[write & (CHIAKI_AUDIO_RECEIVER_QUEUE_SIZE - 1)];
+}
+
+static void audio_receiver_queue_commit(ChiakiAudioReceiver *audio_receiver)
+{
+	__atomic_store_n(&audio_receiver->queue_write, audio_receiver->queue_write + 1, __ATOMIC_SEQ_CST);
+	if(__atomic_exchange_n(&audio_receiver->thread_waiting, false, __ATOMIC_SEQ_CST))
+	{
+		// the thread checks the queue and starts waiting with mutex held, so the signal can not fall in between
+		chiaki_mutex_lock(&audio_receiver->mutex);
+		chiaki_cond_signal(&audio_receiver->cond);
+		chiaki_mutex_unlock(&audio_receiver->mutex);
+	}
+}
+
+CHIAKI_EXPORT void chiaki_audio_receiver_stream_info(ChiakiAudioReceiver *audio_receiver, ChiakiAudioHeader *audio_header)
+{
 	CHIAKI_LOGI(audio_receiver->log, "Audio Header:");
 	CHIAKI_LOGI(audio_receiver->log, "  channels = %d", audio_header->channels);
 	CHIAKI_LOGI(audio_receiver->log, "  bits = %d", audio_header->bits);
@@ -42,9 +156,24 @@ CHIAKI_EXPORT void chiaki_audio_receiver_stream_info(ChiakiAudioReceiver *audio_
 	CHIAKI_LOGI(audio_receiver->log, "  frame size = %d", audio_header->frame_size);
 	CHIAKI_LOGI(audio_receiver->log, "  unknown = %d", audio_header->unknown);
 
+	if(audio_receiver->async)
+	{
+		// goes through the queue too, so the audio thread sees it in order with the frames
+		ChiakiAudioReceiverEntry *entry = audio_receiver_queue_reserve(audio_receiver);
+		if(!entry)
+		{
+			CHIAKI_LOGE(audio_receiver->log, "Audio Receiver queue is full, dropping audio header");
+			return;
+		}
+		entry->type = AUDIO_RECEIVER_ENTRY_HEADER;
+		entry->header = *audio_header;
+		audio_receiver_queue_commit(audio_receiver);
+		return;
+	}
+
+	chiaki_mutex_lock(&audio_receiver->mutex);
 	if(audio_receiver->session->audio_sink.header_cb)
 		audio_receiver->session->audio_sink.header_cb(audio_header, audio_receiver->session->audio_sink.user);
-
 	chiaki_mutex_unlock(&audio_receiver->mutex);
 }
 
@@ -85,6 +214,13 @@ CHIAKI_EXPORT void chiaki_audio_receiver_av_packet(ChiakiAudioReceiver *audio_re
 	if(packet->frame_index > (1 << 15))
 		audio_receiver->frame_index_startup = false;
 
+	// the audio thread never touches frame_index_prev, so only the sinks called from here need the mutex
+	uint64_t arrival_us = 0;
+	if(audio_receiver->async)
+		arrival_us = chiaki_time_now_monotonic_us();
+	else
+		chiaki_mutex_lock(&audio_receiver->mutex);
+
 	for(size_t i = 0; i < source_units_count + fec_units_count; i++)
 	{
 		ChiakiSeqNum16 frame_index;
@@ -102,26 +238,178 @@ CHIAKI_EXPORT void chiaki_audio_receiver_av_packet(ChiakiAudioReceiver *audio_re
 			frame_index = packet->frame_index - fec_units_count + fec_index;
 		}
 
-		chiaki_audio_receiver_frame(audio_receiver, frame_index, packet->is_haptics, packet->data + unit_size * i, unit_size);
+		chiaki_audio_receiver_frame(audio_receiver, frame_index, packet->is_haptics, packet->data + unit_size * i, unit_size, arrival_us);
 	}
 
+	if(!audio_receiver->async)
+		chiaki_mutex_unlock(&audio_receiver->mutex);
+
 	if(audio_receiver->packet_stats)
 		chiaki_packet_stats_push_seq(audio_receiver->packet_stats, packet->frame_index);
 }
 
-static void chiaki_audio_receiver_frame(ChiakiAudioReceiver *audio_receiver, ChiakiSeqNum16 frame_index, bool is_haptics, uint8_t *buf, size_t buf_size)
+static void chiaki_audio_receiver_frame(ChiakiAudioReceiver *audio_receiver, ChiakiSeqNum16 frame_index, bool is_haptics, uint8_t *buf, size_t buf_size, uint64_t arrival_us)
 {
-	chiaki_mutex_lock(&audio_receiver->mutex);
-
 	if(!chiaki_seq_num_16_gt(frame_index, audio_receiver->frame_index_prev))
-		goto beach;
+		return;
 	audio_receiver->frame_index_prev = frame_index;
 
+	if(audio_receiver->async)
+	{
+		if(buf_size > CHIAKI_AUDIO_FRAME_SIZE_MAX)
+			return;
+		ChiakiAudioReceiverEntry *entry = audio_receiver_queue_reserve(audio_receiver);
+		if(!entry)
+			return;
+		entry->type = AUDIO_RECEIVER_ENTRY_FRAME;
+		entry->frame_index = frame_index;
+		entry->is_haptics = is_haptics;
+		entry->arrival_us = arrival_us;
+		entry->size = buf_size;
+		memcpy(entry->buf, buf, buf_size);
+		audio_receiver_queue_commit(audio_receiver);
+		return;
+	}
+
 	if(is_haptics && audio_receiver->session->haptics_sink.frame_cb)
 		audio_receiver->session->haptics_sink.frame_cb(buf, buf_size, audio_receiver->session->haptics_sink.user);
 	else if(!is_haptics && audio_receiver->session->audio_sink.frame_cb)
 		audio_receiver->session->audio_sink.frame_cb(buf, buf_size, audio_receiver->session->audio_sink.user);
+}
+
+static void audio_receiver_header(ChiakiAudioReceiver *audio_receiver, ChiakiAudioHeader *header)
+{
+	ChiakiAudioSink *sink = &audio_receiver->session->audio_sink;
+	if(sink->header_cb)
+		sink->header_cb(header, sink->user);
+
+	if(!header->rate || !header->frame_size)
+	{
+		CHIAKI_LOGE(audio_receiver->log, "Audio Receiver got invalid audio header, passing frames on without jitter buffer");
+		audio_receiver->header_received = false;
+		return;
+	}
+	uint64_t frame_duration_us = (uint64_t)header->frame_size * 1000000 / header->rate;
+	ChiakiAudioJitterBufferStats stats = audio_receiver->jitter_buffer.stats;
+	chiaki_audio_jitter_buffer_init(&audio_receiver->jitter_buffer, frame_duration_us, 0, 0);
+	audio_receiver->jitter_buffer.stats = stats;
+	audio_receiver->header_received = true;
+	CHIAKI_LOGI(audio_receiver->log, "Audio Receiver playing out %llu us frames through jitter buffer", (unsigned long long)frame_duration_us);
+}
+
+/**
+ * Handle everything the takion thread has queued so far.
+ */
+static void audio_receiver_drain(ChiakiAudioReceiver *audio_receiver)
+{
+	uint64_t write = __atomic_load_n(&audio_receiver->queue_write, __ATOMIC_SEQ_CST);
+	for(uint64_t read = audio_receiver->queue_read; read != write; read++)
+	{
+		ChiakiAudioReceiverEntry *entry = &audio_receiver->queue[read & (CHIAKI_AUDIO_RECEIVER_QUEUE_SIZE - 1)];
+		if(entry->type == AUDIO_RECEIVER_ENTRY_HEADER)
+			audio_receiver_header(audio_receiver, &entry->header);
+		else if(entry->is_haptics)
+		{
+			if(audio_receiver->session->haptics_sink.frame_cb)
+				audio_receiver->session->haptics_sink.frame_cb(entry->buf, entry->size, audio_receiver->session->haptics_sink.user);
+		}
+		else if(audio_receiver->header_received)
+			chiaki_audio_jitter_buffer_put(&audio_receiver->jitter_buffer, entry->frame_index, entry->buf, entry->size, entry->arrival_us);
+		else if(audio_receiver->session->audio_sink.frame_cb)
+			audio_receiver->session->audio_sink.frame_cb(entry->buf, entry->size, audio_receiver->session->audio_sink.user);
+		__atomic_store_n(&audio_receiver->queue_read, read + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Pass all frames that are due by now_us to the audio sink.
+ *
+ * @param playout_next_us when the next frame is due, 0 if the jitter buffer is still buffering
+ */
+static void audio_receiver_playout(ChiakiAudioReceiver *audio_receiver, uint64_t now_us, uint64_t *playout_next_us)
+{
+	if(!audio_receiver->header_received)
+	{
+		*playout_next_us = 0;
+		return;
+	}
+
+	ChiakiAudioJitterBuffer *jitter_buffer = &audio_receiver->jitter_buffer;
+	ChiakiAudioSink *sink = &audio_receiver->session->audio_sink;
+	while(!*playout_next_us || *playout_next_us <= now_us)
+	{
+		const uint8_t *buf;
+		size_t buf_size;
+		ChiakiAudioJitterBufferAction action = chiaki_audio_jitter_buffer_pull(jitter_buffer, &buf, &buf_size);
+		if(action == CHIAKI_AUDIO_JITTER_BUFFER_WAIT)
+		{
+			*playout_next_us = 0;
+			return;
+		}
+
+		// after a stall, e.g. because of a slow sink, continue from now instead of catching up in a burst
+		if(!*playout_next_us || now_us - *playout_next_us > jitter_buffer->delay_max * jitter_buffer->frame_duration_us)
+			*playout_next_us = now_us;
+		*playout_next_us += jitter_buffer->frame_duration_us;
 
-beach:
+		switch(action)
+		{
+			case CHIAKI_AUDIO_JITTER_BUFFER_DECODE:
+				if(sink->frame_cb)
+					sink->frame_cb((uint8_t *)buf, buf_size, sink->user);
+				break;
+			case CHIAKI_AUDIO_JITTER_BUFFER_DECODE_FEC:
+				if(sink->conceal_cb)
+					sink->conceal_cb((uint8_t *)buf, buf_size, sink->user);
+				break;
+			case CHIAKI_AUDIO_JITTER_BUFFER_CONCEAL:
+				if(sink->conceal_cb)
+					sink->conceal_cb(NULL, 0, sink->user);
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+static bool audio_receiver_queue_ready(ChiakiAudioReceiver *audio_receiver)
+{
+	return __atomic_load_n(&audio_receiver->queue_write, __ATOMIC_SEQ_CST) != audio_receiver->queue_read;
+}
+
+static void *audio_receiver_thread_func(void *user)
+{
+	ChiakiAudioReceiver *audio_receiver = user;
+	uint64_t playout_next_us = 0;
+
+	chiaki_mutex_lock(&audio_receiver->mutex);
+	while(true)
+	{
+		bool stop = audio_receiver->stop;
+		chiaki_mutex_unlock(&audio_receiver->mutex);
+		audio_receiver_drain(audio_receiver);
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		audio_receiver_playout(audio_receiver, now_us, &playout_next_us);
+		chiaki_mutex_lock(&audio_receiver->mutex);
+		chiaki_audio_jitter_buffer_get_stats(&audio_receiver->jitter_buffer, &audio_receiver->jitter_buffer_stats);
+		if(stop)
+			break;
+		if(audio_receiver->stop)
+			continue;
+
+		uint64_t timeout_ms = AUDIO_RECEIVER_POLL_MS;
+		if(playout_next_us)
+		{
+			now_us = chiaki_time_now_monotonic_us();
+			if(playout_next_us <= now_us)
+				continue;
+			timeout_ms = (playout_next_us - now_us + 999) / 1000;
+		}
+		__atomic_store_n(&audio_receiver->thread_waiting, true, __ATOMIC_SEQ_CST);
+		if(audio_receiver_queue_ready(audio_receiver)) // queued before it could see thread_waiting
+			continue;
+		chiaki_cond_timedwait(&audio_receiver->cond, &audio_receiver->mutex, timeout_ms);
+	}
 	chiaki_mutex_unlock(&audio_receiver->mutex);
+	return NULL;
 }
@@ -1,5 +1,7 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_AUDIO
+
 #include <chiaki/audiosender.h>
 #include <string.h>
 #include <stdlib.h>
@@ -1,41 +1,175 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_VIDEO
+
 #include <chiaki/bitstream.h>
 
 #include <string.h>
 
-#include "vl_rbsp.h"
+#define STARTCODE_SEARCH_MAX 64
+#define RBSP_EPB_MAX 16
+
+/**
+ * Reader for the RBSP of a NAL unit, i.e. its payload without emulation prevention bytes.
+ * Bytes are loaded a word at a time as long as they can not contain an emulation prevention byte,
+ * and only as far as something is actually read, so the rest of the NAL unit is never touched.
+ */
+typedef struct rbsp_reader_t
+{
+	const uint8_t *data;
+	size_t size;
+	size_t pos; // of the next byte in data to load
+	unsigned zeros; // zero bytes right before pos
+	uint64_t cache; // loaded bits that have not been read yet, msb first
+	unsigned cache_bits;
+	uint32_t bits_read;
+	uint32_t bytes_loaded;
+	uint32_t epb[RBSP_EPB_MAX]; // index of the rbsp byte following each emulation prevention byte that was removed
+	unsigned epb_count; // may be larger than RBSP_EPB_MAX, then positions in data are not known anymore
+	bool overrun; // read beyond size, all further bits are 0
+} RbspReader;
+
+static void rbsp_init(RbspReader *r, const uint8_t *data, size_t size)
+{
+	memset(r, 0, sizeof(*r));
+	r->data = data;
+	r->size = size;
+}
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline bool has_zero_byte(uint32_t w)
+{
+	return ((w - 0x01010101u) & ~w & 0x80808080u) != 0;
+}
 
-static bool skip_startcode(struct vl_vlc *vlc)
+static void rbsp_fill(RbspReader *r)
 {
-	vl_vlc_fillbits(vlc);
-	for(unsigned i=0; i<64 && vl_vlc_bits_left(vlc)>=32; i++)
+	while(r->cache_bits <= 56)
 	{
-		if (vl_vlc_peekbits(vlc, 32) == 1)
-			break;
-		vl_vlc_eatbits(vlc, 8);
-		vl_vlc_fillbits(vlc);
+		// no zero byte means no emulation prevention in this word
+		if(r->cache_bits <= 32 && !r->zeros && r->pos + 4 <= r->size)
+		{
+			uint32_t w = load_be32(r->data + r->pos);
+			if(!has_zero_byte(w))
+			{
+				r->cache |= (uint64_t)w << (32 - r->cache_bits);
+				r->cache_bits += 32;
+				r->pos += 4;
+				r->bytes_loaded += 4;
+				continue;
+			}
+		}
+		if(r->pos >= r->size)
+			return;
+		uint8_t b = r->data[r->pos++];
+		if(r->zeros >= 2 && b == 3)
+		{
+			if(r->epb_count < RBSP_EPB_MAX)
+				r->epb[r->epb_count] = r->bytes_loaded;
+			r->epb_count++;
+			r->zeros = 0;
+			continue;
+		}
+		r->zeros = b ? 0 : r->zeros + 1;
+		r->cache |= (uint64_t)b << (56 - r->cache_bits);
+		r->cache_bits += 8;
+		r->bytes_loaded++;
 	}
-	if(vl_vlc_peekbits(vlc, 32) != 1)
+}
+
+/**
+ * @param n at most 32
+ */
+static uint32_t rbsp_u(RbspReader *r, unsigned n)
+{
+	if(!n)
+		return 0;
+	if(r->cache_bits < n)
+	{
+		rbsp_fill(r);
+		if(r->cache_bits < n)
+		{
+			r->overrun = true;
+			r->cache_bits = n;
+		}
+	}
+	uint32_t value = (uint32_t)(r->cache >> (64 - n));
+	r->cache <<= n;
+	r->cache_bits -= n;
+	r->bits_read += n;
+	return value;
+}
+
+static uint32_t rbsp_ue(RbspReader *r)
+{
+	unsigned zeros = 0;
+	while(!rbsp_u(r, 1))
+	{
+		if(++zeros > 31 || r->overrun)
+		{
+			r->overrun = true;
+			return 0;
+		}
+	}
+	return ((1u << zeros) - 1) + rbsp_u(r, zeros);
+}
+
+/**
+ * @param pos set to the position of the next bit to read in data
+ * @return false if too many emulation prevention bytes have been removed to know it
+ */
+static bool rbsp_data_bit_pos(RbspReader *r, uint32_t *pos)
+{
+	// an emulation prevention byte right before the next bit is only seen when loading it
+	if(!r->cache_bits)
+		rbsp_fill(r);
+	if(r->epb_count > RBSP_EPB_MAX || r->overrun)
 		return false;
-	vl_vlc_eatbits(vlc, 32);
-	vl_vlc_fillbits(vlc);
+	uint32_t byte = r->bits_read / 8;
+	uint32_t bit = r->bits_read;
+	for(unsigned i=0; i<r->epb_count; i++)
+	{
+		if(r->epb[i] <= byte)
+			bit += 8;
+	}
+	*pos = bit;
 	return true;
 }
 
+/**
+ * @return offset of the NAL unit header after the first start code in data at or after pos, or size if there is none
+ */
+static size_t find_nal(const uint8_t *data, size_t size, size_t pos, size_t search_max)
+{
+	size_t end = size;
+	if(search_max && pos + search_max < end)
+		end = pos + search_max;
+	for(; pos + 3 <= end; pos++)
+	{
+		if(data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 1)
+			return pos + 3;
+	}
+	return size;
+}
+
 static bool header_h264(ChiakiBitstream *bitstream, uint8_t *data, unsigned size)
 {
-	struct vl_vlc vlc = {0};
-	vl_vlc_init(&vlc, data, size);
-	if(!skip_startcode(&vlc))
+	size_t nal = find_nal(data, size, 0, STARTCODE_SEARCH_MAX);
+	if(nal >= size)
 	{
 		CHIAKI_LOGW(bitstream->log, "parse_sps_h264: No startcode found");
 		return false;
 	}
 
-	vl_vlc_eatbits(&vlc, 1); // forbidden_zero_bit
-	vl_vlc_eatbits(&vlc, 2); // nal_ref_idc
-	unsigned nal_unit_type = vl_vlc_get_uimsbf(&vlc, 5);
+	RbspReader r;
+	rbsp_init(&r, data + nal, size - nal);
+	rbsp_u(&r, 1); // forbidden_zero_bit
+	rbsp_u(&r, 2); // nal_ref_idc
+	unsigned nal_unit_type = rbsp_u(&r, 5);
 
 	if(nal_unit_type != 7)
 	{
@@ -43,16 +177,13 @@ static bool header_h264(ChiakiBitstream *bitstream, uint8_t *data, unsigned size
 		return false;
 	}
 
-	struct vl_rbsp rbsp;
-	vl_rbsp_init(&rbsp, &vlc, ~0);
-
-	unsigned profile_idc = vl_rbsp_u(&rbsp, 8);
+	unsigned profile_idc = rbsp_u(&r, 8);
 
-	vl_rbsp_u(&rbsp, 6); // constraint_set_flags
-	vl_rbsp_u(&rbsp, 2); // reserved_zero_2bits
-	vl_rbsp_u(&rbsp, 8); // level_idc
+	rbsp_u(&r, 6); // constraint_set_flags
+	rbsp_u(&r, 2); // reserved_zero_2bits
+	rbsp_u(&r, 8); // level_idc
 
-	vl_rbsp_ue(&rbsp); // seq_parameter_set_id
+	rbsp_ue(&r); // seq_parameter_set_id
 
 	if(profile_idc == 100 || profile_idc == 110 ||
 		profile_idc == 122 || profile_idc == 244 || profile_idc == 44 ||
@@ -60,18 +191,18 @@ static bool header_h264(ChiakiBitstream *bitstream, uint8_t *data, unsigned size
 		profile_idc == 128 || profile_idc == 138 || profile_idc == 139 ||
 		profile_idc == 134 || profile_idc == 135)
 	{
-		if (vl_rbsp_ue(&rbsp) == 3) // chroma_format_idc
-			vl_rbsp_u(&rbsp, 1); // separate_colour_plane_flag
+		if (rbsp_ue(&r) == 3) // chroma_format_idc
+			rbsp_u(&r, 1); // separate_colour_plane_flag
 
-		vl_rbsp_ue(&rbsp); // bit_depth_luma_minus8
-		vl_rbsp_ue(&rbsp); // bit_depth_chroma_minus8
-		vl_rbsp_u(&rbsp, 1); // qpprime_y_zero_transform_bypass_flag
+		rbsp_ue(&r); // bit_depth_luma_minus8
+		rbsp_ue(&r); // bit_depth_chroma_minus8
+		rbsp_u(&r, 1); // qpprime_y_zero_transform_bypass_flag
 
-		if (vl_rbsp_u(&rbsp, 1)) // seq_scaling_matrix_present_flag
+		if (rbsp_u(&r, 1)) // seq_scaling_matrix_present_flag
 			return false;
 	}
 
-	bitstream->h264.sps.log2_max_frame_num_minus4 = vl_rbsp_ue(&rbsp);
+	bitstream->h264.sps.log2_max_frame_num_minus4 = rbsp_ue(&r);
 	if(bitstream->h264.sps.log2_max_frame_num_minus4 > 12)
 	{
 		CHIAKI_LOGW(bitstream->log, "parse_sps_h264: Unexpected log2_max_frame_num_minus4 value %u", bitstream->h264.sps.log2_max_frame_num_minus4);
@@ -83,22 +214,24 @@ static bool header_h264(ChiakiBitstream *bitstream, uint8_t *data, unsigned size
 
 static bool header_h265(ChiakiBitstream *bitstream, uint8_t *data, unsigned size)
 {
-	struct vl_vlc vlc = {0};
-	vl_vlc_init(&vlc, data, size);
-sps_start:
-	if(!skip_startcode(&vlc))
+	RbspReader r;
+	size_t nal = 0;
+	unsigned nal_unit_type;
+	do
 	{
-		CHIAKI_LOGW(bitstream->log, "parse_sps_h265: No startcode found");
-		return false;
-	}
-
-	vl_vlc_eatbits(&vlc, 1); // forbidden_zero_bit
-	unsigned nal_unit_type = vl_vlc_get_uimsbf(&vlc, 6);
-	vl_vlc_eatbits(&vlc, 6); // nuh_layer_id
-	vl_vlc_eatbits(&vlc, 3); // nuh_temporal_id_plus1
+		nal = find_nal(data, size, nal, STARTCODE_SEARCH_MAX);
+		if(nal >= size)
+		{
+			CHIAKI_LOGW(bitstream->log, "parse_sps_h265: No startcode found");
+			return false;
+		}
 
-	if(nal_unit_type == 32) // VPS
-		goto sps_start;
+		rbsp_init(&r, data + nal, size - nal);
+		rbsp_u(&r, 1); // forbidden_zero_bit
+		nal_unit_type = rbsp_u(&r, 6);
+		rbsp_u(&r, 6); // nuh_layer_id
+		rbsp_u(&r, 3); // nuh_temporal_id_plus1
+	} while(nal_unit_type == 32); // VPS
 
 	if(nal_unit_type != 33)
 	{
@@ -106,44 +239,41 @@ sps_start:
 		return false;
 	}
 
-	struct vl_rbsp rbsp;
-	vl_rbsp_init(&rbsp, &vlc, ~0);
-
-	vl_rbsp_u(&rbsp, 4); // sps_video_parameter_set_id
-	vl_rbsp_u(&rbsp, 3); // sps_max_sub_layers_minus1
-	vl_rbsp_u(&rbsp, 1); // sps_temporal_id_nesting_flag
-
-	vl_rbsp_u(&rbsp, 2); // general_profile_space
-	vl_rbsp_u(&rbsp, 1); // general_tier_flag
-	vl_rbsp_u(&rbsp, 5); // general_profile_idc
-	vl_rbsp_u(&rbsp, 32); // general_profile_compatibility_flag[0-31]
-	vl_rbsp_u(&rbsp, 1); // general_progressive_source_flag
-	vl_rbsp_u(&rbsp, 1); // general_interlaced_source_flag
-	vl_rbsp_u(&rbsp, 1); // general_non_packed_constraint_flag
-	vl_rbsp_u(&rbsp, 1); // general_frame_only_constraint_flag
-	vl_rbsp_u(&rbsp, 32); vl_rbsp_u(&rbsp, 11); // general_reserved_zero_43bits
-	vl_rbsp_u(&rbsp, 1); // general_inbld_flag / general_reserved_zero_bit
-	vl_rbsp_u(&rbsp, 8); // general_level_idc
-
-	vl_rbsp_ue(&rbsp); // sps_seq_parameter_set_id
-	if(vl_rbsp_ue(&rbsp) == 3) // chroma_format_idc
-		vl_rbsp_u(&rbsp, 1); // separate_colour_plane_flag
-
-	vl_rbsp_ue(&rbsp); // pic_width_in_luma_samples
-	vl_rbsp_ue(&rbsp); // pic_height_in_luma_samples
-
-	if(vl_rbsp_u(&rbsp, 1)) // conformance_window_flag
+	rbsp_u(&r, 4); // sps_video_parameter_set_id
+	rbsp_u(&r, 3); // sps_max_sub_layers_minus1
+	rbsp_u(&r, 1); // sps_temporal_id_nesting_flag
+
+	rbsp_u(&r, 2); // general_profile_space
+	rbsp_u(&r, 1); // general_tier_flag
+	rbsp_u(&r, 5); // general_profile_idc
+	rbsp_u(&r, 32); // general_profile_compatibility_flag[0-31]
+	rbsp_u(&r, 1); // general_progressive_source_flag
+	rbsp_u(&r, 1); // general_interlaced_source_flag
+	rbsp_u(&r, 1); // general_non_packed_constraint_flag
+	rbsp_u(&r, 1); // general_frame_only_constraint_flag
+	rbsp_u(&r, 32); rbsp_u(&r, 11); // general_reserved_zero_43bits
+	rbsp_u(&r, 1); // general_inbld_flag / general_reserved_zero_bit
+	rbsp_u(&r, 8); // general_level_idc
+
+	rbsp_ue(&r); // sps_seq_parameter_set_id
+	if(rbsp_ue(&r) == 3) // chroma_format_idc
+		rbsp_u(&r, 1); // separate_colour_plane_flag
+
+	rbsp_ue(&r); // pic_width_in_luma_samples
+	rbsp_ue(&r); // pic_height_in_luma_samples
+
+	if(rbsp_u(&r, 1)) // conformance_window_flag
 	{
-		vl_rbsp_ue(&rbsp); // conf_win_left_offset
-		vl_rbsp_ue(&rbsp); // conf_win_right_offset
-		vl_rbsp_ue(&rbsp); // conf_win_top_offset
-		vl_rbsp_ue(&rbsp); // conf_win_bottom_offset
+		rbsp_ue(&r); // conf_win_left_offset
+		rbsp_ue(&r); // conf_win_right_offset
+		rbsp_ue(&r); // conf_win_top_offset
+		rbsp_ue(&r); // conf_win_bottom_offset
 	}
 
-	vl_rbsp_ue(&rbsp); // bit_depth_luma_minus8
-	vl_rbsp_ue(&rbsp); // bit_depth_chroma_minus8
+	rbsp_ue(&r); // bit_depth_luma_minus8
+	rbsp_ue(&r); // bit_depth_chroma_minus8
 
-	bitstream->h265.sps.log2_max_pic_order_cnt_lsb_minus4 = vl_rbsp_ue(&rbsp);
+	bitstream->h265.sps.log2_max_pic_order_cnt_lsb_minus4 = rbsp_ue(&r);
 	if(bitstream->h265.sps.log2_max_pic_order_cnt_lsb_minus4 > 12)
 	{
 		CHIAKI_LOGW(bitstream->log, "parse_sps_h265: Unexpected log2_max_pic_order_cnt_lsb_minus4 value %u", bitstream->h265.sps.log2_max_pic_order_cnt_lsb_minus4);
@@ -153,19 +283,13 @@ sps_start:
 	return true;
 }
 
-static bool slice_h264(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, ChiakiBitstreamSlice *slice)
+static bool slice_h264(ChiakiBitstream *bitstream, uint8_t *nal, unsigned nal_size, ChiakiBitstreamSlice *slice)
 {
-	struct vl_vlc vlc = {0};
-	vl_vlc_init(&vlc, data, size);
-	if(!skip_startcode(&vlc))
-	{
-		CHIAKI_LOGW(bitstream->log, "parse_slice_h264: No startcode found");
-		return false;
-	}
-
-	vl_vlc_eatbits(&vlc, 1); // forbidden_zero_bit
-	vl_vlc_eatbits(&vlc, 2); // nal_ref_idc
-	unsigned nal_unit_type = vl_vlc_get_uimsbf(&vlc, 5);
+	RbspReader r;
+	rbsp_init(&r, nal, nal_size);
+	rbsp_u(&r, 1); // forbidden_zero_bit
+	rbsp_u(&r, 2); // nal_ref_idc
+	unsigned nal_unit_type = rbsp_u(&r, 5);
 
 	if(nal_unit_type != 1 && nal_unit_type != 5)
 	{
@@ -173,11 +297,9 @@ static bool slice_h264(ChiakiBitstream *bitstream, uint8_t *data, unsigned size,
 		return false;
 	}
 
-	struct vl_rbsp rbsp;
-	vl_rbsp_init(&rbsp, &vlc, ~0);
-	vl_rbsp_ue(&rbsp); // first_mb_in_slice
+	rbsp_ue(&r); // first_mb_in_slice
 
-	switch(vl_rbsp_ue(&rbsp))
+	switch(rbsp_ue(&r))
 	{
 		case 0:
 		case 5:
@@ -195,26 +317,26 @@ static bool slice_h264(ChiakiBitstream *bitstream, uint8_t *data, unsigned size,
 	if(nal_unit_type == 1)
 	{
 		slice->reference_frame = 0;
-		vl_rbsp_ue(&rbsp); // pic_parameter_set_id
-		vl_rbsp_u(&rbsp, bitstream->h264.sps.log2_max_frame_num_minus4 + 4); // frame_num
-		if(vl_rbsp_u(&rbsp, 1)) // num_ref_idx_active_override_flag
-			if(vl_rbsp_u(&rbsp, 1)) // num_ref_idx_active_override_flag
-				vl_rbsp_ue(&rbsp); // num_ref_idx_l0_active_minus1
-		if(vl_rbsp_u(&rbsp, 1)) // ref_pic_list_modification_flag_l0
+		rbsp_ue(&r); // pic_parameter_set_id
+		rbsp_u(&r, bitstream->h264.sps.log2_max_frame_num_minus4 + 4); // frame_num
+		if(rbsp_u(&r, 1)) // num_ref_idx_active_override_flag
+			if(rbsp_u(&r, 1)) // num_ref_idx_active_override_flag
+				rbsp_ue(&r); // num_ref_idx_l0_active_minus1
+		if(rbsp_u(&r, 1)) // ref_pic_list_modification_flag_l0
 		{
 			unsigned i = 0;
-			unsigned modification_of_pic_nums_idc = vl_rbsp_ue(&rbsp);
+			unsigned modification_of_pic_nums_idc = rbsp_ue(&r);
 			while(i++<3)
 			{
 				if(modification_of_pic_nums_idc == 0)
-					slice->reference_frame = vl_rbsp_ue(&rbsp); // abs_diff_pic_num_minus1
+					slice->reference_frame = rbsp_ue(&r); // abs_diff_pic_num_minus1
 				else if(modification_of_pic_nums_idc < 3)
-					vl_rbsp_ue(&rbsp); // abs_diff_pic_num_minus1 or long_term_pic_num
+					rbsp_ue(&r); // abs_diff_pic_num_minus1 or long_term_pic_num
 				else if(modification_of_pic_nums_idc == 3)
 					return true;
 				else
 					break;
-				modification_of_pic_nums_idc = vl_rbsp_ue(&rbsp);
+				modification_of_pic_nums_idc = rbsp_ue(&r);
 			}
 			CHIAKI_LOGW(bitstream->log, "parse_slice_h264: Failed to parse ref_pic_list_modification");
 			return false;
@@ -224,21 +346,14 @@ static bool slice_h264(ChiakiBitstream *bitstream, uint8_t *data, unsigned size,
 	return true;
 }
 
-static bool slice_h265(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, ChiakiBitstreamSlice *slice)
+static bool slice_h265(ChiakiBitstream *bitstream, uint8_t *nal, unsigned nal_size, ChiakiBitstreamSlice *slice)
 {
-	struct vl_vlc vlc = {0};
-	vl_vlc_init(&vlc, data, size);
-
-	if(!skip_startcode(&vlc))
-	{
-		CHIAKI_LOGW(bitstream->log, "parse_slice_h265: No startcode found");
-		return false;
-	}
-
-	vl_vlc_eatbits(&vlc, 1); // forbidden_zero_bit
-	unsigned nal_unit_type = vl_vlc_get_uimsbf(&vlc, 6);
-	vl_vlc_eatbits(&vlc, 6); // nuh_layer_id
-	vl_vlc_eatbits(&vlc, 3); // nuh_temporal_id_plus1
+	RbspReader r;
+	rbsp_init(&r, nal, nal_size);
+	rbsp_u(&r, 1); // forbidden_zero_bit
+	unsigned nal_unit_type = rbsp_u(&r, 6);
+	rbsp_u(&r, 6); // nuh_layer_id
+	rbsp_u(&r, 3); // nuh_temporal_id_plus1
 
 	if(nal_unit_type != 1 && nal_unit_type != 20)
 	{
@@ -246,17 +361,15 @@ static bool slice_h265(ChiakiBitstream *bitstream, uint8_t *data, unsigned size,
 		return false;
 	}
 
-	struct vl_rbsp rbsp;
-	vl_rbsp_init(&rbsp, &vlc, ~0);
-	unsigned first_slice_segment_in_pic_flag = vl_rbsp_u(&rbsp, 1);
+	unsigned first_slice_segment_in_pic_flag = rbsp_u(&r, 1);
 	if(nal_unit_type == 20)
-		vl_rbsp_u(&rbsp, 1); // no_output_of_prior_pics_flag
+		rbsp_u(&r, 1); // no_output_of_prior_pics_flag
 
-	vl_rbsp_ue(&rbsp); // slice_pic_parameter_set_id
+	rbsp_ue(&r); // slice_pic_parameter_set_id
 	if(!first_slice_segment_in_pic_flag)
-		vl_rbsp_ue(&rbsp); // slice_segment_address
+		rbsp_ue(&r); // slice_segment_address
 
-	switch(vl_rbsp_ue(&rbsp))
+	switch(rbsp_ue(&r))
 	{
 		case 1:
 			slice->slice_type = CHIAKI_BITSTREAM_SLICE_P;
@@ -272,24 +385,25 @@ static bool slice_h265(ChiakiBitstream *bitstream, uint8_t *data, unsigned size,
 	if(nal_unit_type == 1)
 	{
 		slice->reference_frame = 0xff;
-		vl_rbsp_u(&rbsp, bitstream->h265.sps.log2_max_pic_order_cnt_lsb_minus4 + 4); // slice_pic_order_cnt_lsb
-		if(!vl_rbsp_u(&rbsp, 1)) // short_term_ref_pic_set_sps_flag
+		rbsp_u(&r, bitstream->h265.sps.log2_max_pic_order_cnt_lsb_minus4 + 4); // slice_pic_order_cnt_lsb
+		if(!rbsp_u(&r, 1)) // short_term_ref_pic_set_sps_flag
 		{
-			unsigned num_negative_pics = vl_rbsp_ue(&rbsp);
-			if(num_negative_pics > 16)
+			unsigned num_negative_pics = rbsp_ue(&r);
+			if(num_negative_pics > CHIAKI_BITSTREAM_REF_FLAGS_MAX)
 			{
 				CHIAKI_LOGW(bitstream->log, "parse_slice_h265: Unexpected num_negative_pics %u", num_negative_pics);
 				return false;
 			}
-			vl_rbsp_ue(&rbsp); // num_positive_pics
-			for(unsigned i=0; i<num_negative_pics; i++)
+			rbsp_ue(&r); // num_positive_pics
+			// the positions of all flags are remembered, so the reference can be rewritten without parsing again
+			for(unsigned i=0; i<num_negative_pics && !r.overrun; i++)
 			{
-				vl_rbsp_ue(&rbsp); // delta_poc_s0_minus1[i]
-				if(vl_rbsp_u(&rbsp, 1)) // used_by_curr_pic_s0_flag[i]
-				{
+				rbsp_ue(&r); // delta_poc_s0_minus1[i]
+				uint32_t bit;
+				if(slice->ref_flags_count == i && rbsp_data_bit_pos(&r, &bit) && bit < nal_size * 8)
+					slice->ref_flag_bits[slice->ref_flags_count++] = bit;
+				if(rbsp_u(&r, 1) && slice->reference_frame == 0xff) // used_by_curr_pic_s0_flag[i]
 					slice->reference_frame = i;
-					break;
-				}
 			}
 		}
 		if(slice->reference_frame == 0xff)
@@ -299,74 +413,54 @@ static bool slice_h265(ChiakiBitstream *bitstream, uint8_t *data, unsigned size,
 	return true;
 }
 
-static bool slice_set_reference_frame_h265(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, unsigned reference_frame)
+/**
+ * @return whether data contains one of 0x000000 to 0x000003 starting at one of the bytes that end at byte
+ */
+static bool start_code_emulation_at(const uint8_t *data, size_t size, size_t byte)
 {
-	struct vl_vlc vlc = {0};
-	vl_vlc_init(&vlc, data, size);
-	if(!skip_startcode(&vlc))
+	for(size_t i = byte >= 2 ? byte - 2 : 0; i <= byte && i + 2 < size; i++)
 	{
-		CHIAKI_LOGW(bitstream->log, "slice_set_reference_frame_h265: No startcode found");
-		return false;
+		if(data[i] == 0 && data[i + 1] == 0 && data[i + 2] <= 3)
+			return true;
 	}
+	return false;
+}
 
-	vl_vlc_eatbits(&vlc, 1); // forbidden_zero_bit
-	unsigned nal_unit_type = vl_vlc_get_uimsbf(&vlc, 6);
-	vl_vlc_eatbits(&vlc, 6); // nuh_layer_id
-	vl_vlc_eatbits(&vlc, 3); // nuh_temporal_id_plus1
-
-	if(nal_unit_type != 1)
-	{
-		CHIAKI_LOGW(bitstream->log, "slice_set_reference_frame_h265: Unexpected NAL unit type %u", nal_unit_type);
-		return false;
-	}
-
-	struct vl_rbsp rbsp;
-	vl_rbsp_init(&rbsp, &vlc, ~0);
-	unsigned first_slice_segment_in_pic_flag = vl_rbsp_u(&rbsp, 1);
-
-	vl_rbsp_ue(&rbsp); // slice_pic_parameter_set_id
-	if(!first_slice_segment_in_pic_flag)
-		vl_rbsp_ue(&rbsp); // slice_segment_address
-
-	if(vl_rbsp_ue(&rbsp) != 1)
+static bool slice_rewrite_reference_frame_h265(ChiakiBitstream *bitstream, ChiakiBitstreamSlice *slice, unsigned reference_frame)
+{
+	if(slice->slice_type != CHIAKI_BITSTREAM_SLICE_P || !slice->nal)
 	{
 		CHIAKI_LOGW(bitstream->log, "slice_set_reference_frame_h265: Not P slice");
 		return false;
 	}
+	if(reference_frame >= slice->ref_flags_count)
+		return false;
 
-	vl_rbsp_u(&rbsp, bitstream->h265.sps.log2_max_pic_order_cnt_lsb_minus4 + 4); // slice_pic_order_cnt_lsb
-	if(!vl_rbsp_u(&rbsp, 1)) // short_term_ref_pic_set_sps_flag
+	// set used_by_curr_pic_s0_flag only for the new reference and clear it for all nearer ones
+	uint8_t *nal = slice->nal;
+	uint8_t prev[CHIAKI_BITSTREAM_REF_FLAGS_MAX];
+	for(unsigned i=0; i<=reference_frame; i++)
 	{
-		unsigned num_negative_pics = vl_rbsp_ue(&rbsp);
-		if(num_negative_pics > 16)
+		uint32_t bit = slice->ref_flag_bits[i];
+		uint8_t *b = nal + bit / 8;
+		uint8_t mask = 0x80 >> (bit % 8);
+		prev[i] = *b;
+		uint8_t v = i == reference_frame ? *b | mask : *b & ~mask;
+		if(v == *b)
+			continue;
+		// the changed byte may not be one of the zeros escaped by an existing 0x03, nor form a new start code prefix
+		bool emulation_before = start_code_emulation_at(nal, slice->nal_size, bit / 8);
+		*b = v;
+		if(emulation_before || start_code_emulation_at(nal, slice->nal_size, bit / 8))
 		{
-			CHIAKI_LOGW(bitstream->log, "slice_set_reference_frame_h265: Unexpected num_negative_pics %u", num_negative_pics);
+			CHIAKI_LOGW(bitstream->log, "slice_set_reference_frame_h265: Rewriting would %s emulation prevention", emulation_before ? "break" : "need");
+			for(unsigned j=i+1; j-->0;)
+				nal[slice->ref_flag_bits[j] / 8] = prev[j];
 			return false;
 		}
-		vl_rbsp_ue(&rbsp); // num_positive_pics
-		for(unsigned i=0; i<num_negative_pics; i++)
-		{
-			vl_rbsp_ue(&rbsp); // delta_poc_s0_minus1[i]
-			uint32_t *d = (uint32_t*)rbsp.nal.data;
-			uint64_t hi = ntohl(d[-2]);
-			uint64_t lo = ntohl(d[-1]);
-			uint64_t buffer = lo | (hi << 32);
-			uint64_t mask = (uint64_t)1 << (64 - 1 - (64 - (32 - rbsp.nal.invalid_bits)));
-			if (i == reference_frame)
-				buffer |= mask; // set 1
-			else
-				buffer &= ~mask; // set 0
-			hi = htonl(buffer >> 32);
-			lo = htonl(buffer & 0xffffffff);
-			d[-2] = hi;
-			d[-1] = lo;
-			if (i == reference_frame)
-				return true;
-			vl_rbsp_u(&rbsp, 1); // used_by_curr_pic_s0_flag[i]
-		}
 	}
-
-	return false;
+	slice->reference_frame = reference_frame;
+	return true;
 }
 
 void chiaki_bitstream_init(ChiakiBitstream *bitstream, ChiakiLog *log, ChiakiCodec codec)
@@ -391,16 +485,38 @@ bool chiaki_bitstream_header(ChiakiBitstream *bitstream, uint8_t *data, unsigned
 
 bool chiaki_bitstream_slice(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, ChiakiBitstreamSlice *slice)
 {
+	size_t nal = find_nal(data, size, 0, STARTCODE_SEARCH_MAX);
+	if(nal >= size)
+	{
+		CHIAKI_LOGW(bitstream->log, "parse_slice: No startcode found");
+		return false;
+	}
+	return chiaki_bitstream_slice_nal(bitstream, data + nal, size - nal, slice);
+}
+
+bool chiaki_bitstream_slice_nal(ChiakiBitstream *bitstream, uint8_t *nal, unsigned nal_size, ChiakiBitstreamSlice *slice)
+{
+	slice->nal = nal;
+	slice->nal_size = nal_size;
+	slice->ref_flags_count = 0;
 	if(bitstream->codec == CHIAKI_CODEC_H264)
-		return slice_h264(bitstream, data, size, slice);
+		return slice_h264(bitstream, nal, nal_size, slice);
 	else
-		return slice_h265(bitstream, data, size, slice);
+		return slice_h265(bitstream, nal, nal_size, slice);
 }
 
-bool chiaki_bitstream_slice_set_reference_frame(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, unsigned reference_frame)
+bool chiaki_bitstream_slice_rewrite_reference_frame(ChiakiBitstream *bitstream, ChiakiBitstreamSlice *slice, unsigned reference_frame)
 {
 	if(bitstream->codec == CHIAKI_CODEC_H264)
 		return false;
 	else
-		return slice_set_reference_frame_h265(bitstream, data, size, reference_frame);
+		return slice_rewrite_reference_frame_h265(bitstream, slice, reference_frame);
+}
+
+bool chiaki_bitstream_slice_set_reference_frame(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, unsigned reference_frame)
+{
+	ChiakiBitstreamSlice slice;
+	if(!chiaki_bitstream_slice(bitstream, data, size, &slice))
+		return false;
+	return chiaki_bitstream_slice_rewrite_reference_frame(bitstream, &slice, reference_frame);
 }
@@ -1,9 +1,34 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_TAKION
+
 #include <chiaki/congestioncontrol.h>
+#include <chiaki/time.h>
+
+#include <string.h>
 
 #define CONGESTION_CONTROL_INTERVAL_MS 200
 
+static void congestion_control_tick(void *user)
+{
+	ChiakiCongestionControl *control = user;
+
+	uint64_t received;
+	uint64_t lost;
+	chiaki_packet_stats_get(control->stats, true, &received, &lost);
+	uint64_t total = received + lost;
+	control->packet_loss = total > 0 ? (double)lost / total : 0;
+
+	ChiakiTakionCongestionPacket packet = { 0 };
+	chiaki_mutex_lock(&control->controller_mutex);
+	control->controller.report_cb(chiaki_time_now_monotonic_us(), received, lost, &packet, control->controller.user);
+	chiaki_mutex_unlock(&control->controller_mutex);
+
+	CHIAKI_LOGV(control->takion->log, "Sending Congestion Control Packet, received: %u, lost: %u",
+		(unsigned int)packet.received, (unsigned int)packet.lost);
+	chiaki_takion_send_congestion(control->takion, &packet);
+}
+
 static void *congestion_control_thread_func(void *user)
 {
 	ChiakiCongestionControl *control = user;
@@ -18,54 +43,85 @@ static void *congestion_control_thread_func(void *user)
 		if(err != CHIAKI_ERR_TIMEOUT)
 			break;
 
-		uint64_t received;
-		uint64_t lost;
-		chiaki_packet_stats_get(control->stats, true, &received, &lost);
-		ChiakiTakionCongestionPacket packet = { 0 };
-		uint64_t total = received + lost;
-		control->packet_loss = total > 0 ? (double)lost / total : 0;
-		if(control->packet_loss > control->packet_loss_max)
-		{
-			CHIAKI_LOGW(control->takion->log, "Increasing received packets to reduce hit on stream quality");
-			lost = total * control->packet_loss_max;
-			received = total - lost;
-		}
-		packet.received = (uint16_t)received;
-		packet.lost = (uint16_t)lost;
-		CHIAKI_LOGV(control->takion->log, "Sending Congestion Control Packet, received: %u, lost: %u",
-			(unsigned int)packet.received, (unsigned int)packet.lost);
-		chiaki_takion_send_congestion(control->takion, &packet);
+		congestion_control_tick(control);
 	}
 
 	chiaki_bool_pred_cond_unlock(&control->stop_cond);
 	return NULL;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats, double packet_loss_max)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_init(ChiakiCongestionControl *control)
+{
+	memset(control, 0, sizeof(*control));
+	return chiaki_mutex_init(&control->controller_mutex, false);
+}
+
+CHIAKI_EXPORT void chiaki_congestion_control_fini(ChiakiCongestionControl *control)
+{
+	chiaki_mutex_fini(&control->controller_mutex);
+}
+
+static void congestion_control_controller_fini(ChiakiCongestionControl *control)
+{
+	__atomic_store_n(&control->units_wanted, false, __ATOMIC_RELEASE);
+	chiaki_mutex_lock(&control->controller_mutex);
+	chiaki_congestion_controller_fini(&control->controller);
+	chiaki_mutex_unlock(&control->controller_mutex);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats, ChiakiCongestionController *controller, ChiakiEventLoop *event_loop)
 {
 	control->takion = takion;
 	control->stats = stats;
-	control->packet_loss_max = packet_loss_max;
 	control->packet_loss = 0;
+	control->event_loop = NULL;
+
+	chiaki_mutex_lock(&control->controller_mutex);
+	control->controller = *controller;
+	chiaki_mutex_unlock(&control->controller_mutex);
+	__atomic_store_n(&control->units_wanted, controller->unit_cb != NULL, __ATOMIC_RELEASE);
+
+	if(event_loop)
+	{
+		ChiakiErrorCode err = chiaki_event_loop_add_timer(event_loop, &control->timer, CONGESTION_CONTROL_INTERVAL_MS, congestion_control_tick, control);
+		if(err == CHIAKI_ERR_SUCCESS)
+		{
+			control->event_loop = event_loop;
+			return CHIAKI_ERR_SUCCESS;
+		}
+		CHIAKI_LOGW(takion->log, "Congestion Control failed to add timer to Event Loop, falling back to a thread");
+	}
 
 	ChiakiErrorCode err = chiaki_bool_pred_cond_init(&control->stop_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
+		goto error_controller;
 
 	err = chiaki_thread_create(&control->thread, congestion_control_thread_func, control);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		chiaki_bool_pred_cond_fini(&control->stop_cond);
-		return err;
+		goto error_controller;
 	}
 
 	chiaki_thread_set_name(&control->thread, "Chiaki Congestion Control");
 
 	return CHIAKI_ERR_SUCCESS;
+
+error_controller:
+	congestion_control_controller_fini(control);
+	return err;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionControl *control)
 {
+	if(control->event_loop)
+	{
+		chiaki_event_loop_remove(control->event_loop, &control->timer);
+		control->event_loop = NULL;
+		congestion_control_controller_fini(control);
+		return CHIAKI_ERR_SUCCESS;
+	}
+
 	ChiakiErrorCode err = chiaki_bool_pred_cond_signal(&control->stop_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
@@ -74,6 +130,44 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionCon
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 	control->thread.thread = 0;
+	congestion_control_controller_fini(control);
 
 	return chiaki_bool_pred_cond_fini(&control->stop_cond);
 }
+
+CHIAKI_EXPORT bool chiaki_congestion_control_wants_units(ChiakiCongestionControl *control)
+{
+	return __atomic_load_n(&control->units_wanted, __ATOMIC_ACQUIRE);
+}
+
+CHIAKI_EXPORT void chiaki_congestion_control_unit(ChiakiCongestionControl *control, const ChiakiCongestionUnitSample *sample)
+{
+	// called for every video unit, so don't touch the mutex if nobody is interested
+	if(!chiaki_congestion_control_wants_units(control))
+		return;
+	chiaki_mutex_lock(&control->controller_mutex);
+	if(control->controller.unit_cb)
+		control->controller.unit_cb(sample, control->controller.user);
+	chiaki_mutex_unlock(&control->controller_mutex);
+}
+
+CHIAKI_EXPORT void chiaki_congestion_control_frame(ChiakiCongestionControl *control, const ChiakiCongestionFrameSample *sample)
+{
+	chiaki_mutex_lock(&control->controller_mutex);
+	if(control->controller.frame_cb)
+		control->controller.frame_cb(sample, control->controller.user);
+	chiaki_mutex_unlock(&control->controller_mutex);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_get_stats(ChiakiCongestionControl *control, ChiakiCongestionControllerStats *stats)
+{
+	ChiakiErrorCode err = CHIAKI_ERR_UNINITIALIZED;
+	chiaki_mutex_lock(&control->controller_mutex);
+	if(control->controller.stats_cb)
+	{
+		control->controller.stats_cb(stats, control->controller.user);
+		err = CHIAKI_ERR_SUCCESS;
+	}
+	chiaki_mutex_unlock(&control->controller_mutex);
+	return err;
+}
@@ -0,0 +1,391 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_TAKION
+
+#include <chiaki/congestioncontroller.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*
+ * The delay-gradient part follows the trendline estimator and overuse detector of Google Congestion Control
+ * (draft-ietf-rmcat-gcc). The console does not put a send timestamp into av packets, but it sends one frame
+ * every frame_interval_us, so frames are used as packet groups and their send time is derived from the frame index.
+ */
+#define DELAY_LOSS_TREND_WINDOW 20
+#define DELAY_LOSS_TREND_SMOOTHING 0.9
+#define DELAY_LOSS_TREND_GAIN 4.0
+#define DELAY_LOSS_TREND_DELTAS_MAX 60
+#define DELAY_LOSS_THRESHOLD_INITIAL 12.5
+#define DELAY_LOSS_THRESHOLD_MIN 6.0
+#define DELAY_LOSS_THRESHOLD_MAX 600.0
+#define DELAY_LOSS_THRESHOLD_K_UP 0.0087
+#define DELAY_LOSS_THRESHOLD_K_DOWN 0.039
+#define DELAY_LOSS_OVERUSE_TIME_MS 10.0
+#define DELAY_LOSS_RESET_GAP_US 1000000 // no frame for this long, e.g. the stream was paused
+
+#define DELAY_LOSS_LOSS_SMOOTHING 0.3 // weight of the newest interval
+#define DELAY_LOSS_OVERUSE_LOSS_MIN 0.02 // reported in the first interval with overuse
+#define DELAY_LOSS_OVERUSE_LOSS_GROWTH 1.5 // per further interval with overuse
+
+CHIAKI_EXPORT const char *chiaki_congestion_controller_type_name(ChiakiCongestionControllerType type)
+{
+	switch(type)
+	{
+		case CHIAKI_CONGESTION_CONTROLLER_LOSS:
+			return "loss";
+		case CHIAKI_CONGESTION_CONTROLLER_DELAY_LOSS:
+			return "delay-loss";
+		default:
+			return "unknown";
+	}
+}
+
+static void stats_frame(ChiakiCongestionControllerStats *stats, const ChiakiCongestionFrameSample *sample)
+{
+	switch(sample->result)
+	{
+		case CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS:
+			stats->frames_fec_recovered++;
+			break;
+		case CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED:
+		case CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED:
+			stats->frames_failed++;
+			break;
+		default:
+			break;
+	}
+}
+
+static void packet_set_loss(ChiakiTakionCongestionPacket *packet, uint64_t total, double loss)
+{
+	// rounded down like the clamping of the loss controller, so packet_loss_max is never exceeded
+	uint64_t lost = (uint64_t)(total * loss + 1e-6);
+	if(lost > total)
+		lost = total;
+	packet->received = (uint16_t)(total - lost);
+	packet->lost = (uint16_t)lost;
+}
+
+typedef struct loss_controller_t
+{
+	ChiakiLog *log;
+	double packet_loss_max;
+	ChiakiCongestionControllerStats stats;
+} LossController;
+
+static void loss_controller_frame(const ChiakiCongestionFrameSample *sample, void *user)
+{
+	LossController *controller = user;
+	stats_frame(&controller->stats, sample);
+}
+
+static void loss_controller_report(uint64_t now_us, uint64_t received, uint64_t lost, ChiakiTakionCongestionPacket *packet, void *user)
+{
+	LossController *controller = user;
+	uint64_t total = received + lost;
+	double loss = total > 0 ? (double)lost / total : 0;
+	controller->stats.loss_smoothed = loss;
+	if(loss > controller->packet_loss_max)
+	{
+		CHIAKI_LOGW(controller->log, "Increasing received packets to reduce hit on stream quality");
+		lost = total * controller->packet_loss_max;
+		received = total - lost;
+		loss = controller->packet_loss_max;
+	}
+	packet->received = (uint16_t)received;
+	packet->lost = (uint16_t)lost;
+	controller->stats.loss_reported = loss;
+}
+
+static void loss_controller_stats(ChiakiCongestionControllerStats *stats, void *user)
+{
+	LossController *controller = user;
+	*stats = controller->stats;
+}
+
+typedef struct delay_loss_controller_t
+{
+	ChiakiLog *log;
+	double packet_loss_max;
+	uint64_t frame_interval_us;
+
+	bool prev_valid;
+	ChiakiSeqNum16 prev_frame_index;
+	uint64_t prev_arrival_us; // of the first unit of prev_frame_index
+	uint64_t first_arrival_us;
+
+	double delay_accumulated_ms;
+	double delay_smoothed_ms;
+	double trend_x[DELAY_LOSS_TREND_WINDOW]; // arrival time in ms since first_arrival_us
+	double trend_y[DELAY_LOSS_TREND_WINDOW]; // delay_smoothed_ms
+	size_t trend_count;
+	size_t trend_next;
+	unsigned int deltas_count;
+	double trend_prev;
+
+	double overuse_time_ms; // < 0 if the trend is not above the threshold
+	unsigned int overuse_count;
+	uint64_t threshold_update_us;
+	ChiakiCongestionUsage usage_interval; // worst usage since the last report
+
+	uint64_t frames_failed_reported;
+	double overuse_loss; // 0 unless the last interval had overuse
+
+	ChiakiCongestionControllerStats stats;
+} DelayLossController;
+
+static void delay_loss_controller_reset(DelayLossController *controller)
+{
+	controller->prev_valid = false;
+	controller->delay_accumulated_ms = 0.0;
+	controller->delay_smoothed_ms = 0.0;
+	controller->trend_count = 0;
+	controller->trend_next = 0;
+	controller->deltas_count = 0;
+	controller->trend_prev = 0.0;
+	controller->overuse_time_ms = -1.0;
+	controller->overuse_count = 0;
+	controller->threshold_update_us = 0;
+	controller->stats.usage = CHIAKI_CONGESTION_USAGE_NORMAL;
+	controller->stats.delay_trend = 0.0;
+}
+
+/**
+ * Least squares slope of the smoothed delay over arrival time
+ */
+static double delay_loss_trend(DelayLossController *controller)
+{
+	size_t n = controller->trend_count;
+	double x_avg = 0.0, y_avg = 0.0;
+	for(size_t i=0; i<n; i++)
+	{
+		x_avg += controller->trend_x[i];
+		y_avg += controller->trend_y[i];
+	}
+	x_avg /= n;
+	y_avg /= n;
+	double num = 0.0, den = 0.0;
+	for(size_t i=0; i<n; i++)
+	{
+		double dx = controller->trend_x[i] - x_avg;
+		num += dx * (controller->trend_y[i] - y_avg);
+		den += dx * dx;
+	}
+	return den != 0.0 ? num / den : controller->trend_prev;
+}
+
+static void delay_loss_threshold_update(DelayLossController *controller, double modified_trend, uint64_t now_us)
+{
+	if(!controller->threshold_update_us)
+		controller->threshold_update_us = now_us;
+	double abs_trend = fabs(modified_trend);
+	double threshold = controller->stats.delay_threshold;
+	// a single huge spike, e.g. a hiccup of the console, should not raise the threshold
+	if(abs_trend > threshold + 15.0)
+	{
+		controller->threshold_update_us = now_us;
+		return;
+	}
+	double k = abs_trend < threshold ? DELAY_LOSS_THRESHOLD_K_DOWN : DELAY_LOSS_THRESHOLD_K_UP;
+	double dt_ms = (now_us - controller->threshold_update_us) / 1000.0;
+	if(dt_ms > 100.0)
+		dt_ms = 100.0;
+	threshold += k * (abs_trend - threshold) * dt_ms;
+	if(threshold < DELAY_LOSS_THRESHOLD_MIN)
+		threshold = DELAY_LOSS_THRESHOLD_MIN;
+	else if(threshold > DELAY_LOSS_THRESHOLD_MAX)
+		threshold = DELAY_LOSS_THRESHOLD_MAX;
+	controller->stats.delay_threshold = threshold;
+	controller->threshold_update_us = now_us;
+}
+
+static void delay_loss_detect(DelayLossController *controller, double trend, double send_delta_ms, uint64_t now_us)
+{
+	unsigned int deltas = controller->deltas_count < DELAY_LOSS_TREND_DELTAS_MAX ? controller->deltas_count : DELAY_LOSS_TREND_DELTAS_MAX;
+	double modified_trend = deltas * trend * DELAY_LOSS_TREND_GAIN;
+	double threshold = controller->stats.delay_threshold;
+	ChiakiCongestionUsage usage = controller->stats.usage;
+
+	if(modified_trend > threshold)
+	{
+		if(controller->overuse_time_ms < 0.0)
+			controller->overuse_time_ms = send_delta_ms / 2.0;
+		else
+			controller->overuse_time_ms += send_delta_ms;
+		controller->overuse_count++;
+		if(controller->overuse_time_ms > DELAY_LOSS_OVERUSE_TIME_MS && controller->overuse_count > 1
+			&& trend >= controller->trend_prev)
+		{
+			controller->overuse_time_ms = 0.0;
+			controller->overuse_count = 0;
+			usage = CHIAKI_CONGESTION_USAGE_OVERUSE;
+		}
+	}
+	else
+	{
+		controller->overuse_time_ms = -1.0;
+		controller->overuse_count = 0;
+		usage = modified_trend < -threshold ? CHIAKI_CONGESTION_USAGE_UNDERUSE : CHIAKI_CONGESTION_USAGE_NORMAL;
+	}
+
+	if(usage != controller->stats.usage)
+	{
+		if(usage == CHIAKI_CONGESTION_USAGE_OVERUSE)
+			CHIAKI_LOGI(controller->log, "Congestion Controller detected delay increasing, trend %f above threshold %f", modified_trend, threshold);
+		else
+			CHIAKI_LOGV(controller->log, "Congestion Controller delay usage changed to %d", (int)usage);
+	}
+	controller->stats.usage = usage;
+	controller->trend_prev = trend;
+	if(usage > controller->usage_interval)
+		controller->usage_interval = usage;
+
+	delay_loss_threshold_update(controller, modified_trend, now_us);
+}
+
+static void delay_loss_controller_unit(const ChiakiCongestionUnitSample *sample, void *user)
+{
+	DelayLossController *controller = user;
+	if(!controller->prev_valid)
+		goto first;
+
+	// only the first arriving unit of every frame is used, late units of older frames are ignored
+	int16_t frames_delta = (int16_t)(sample->frame_index - controller->prev_frame_index);
+	if(frames_delta <= 0)
+		return;
+
+	uint64_t arrival_delta_us = sample->arrival_us - controller->prev_arrival_us;
+	if(sample->arrival_us < controller->prev_arrival_us || arrival_delta_us > DELAY_LOSS_RESET_GAP_US)
+	{
+		delay_loss_controller_reset(controller);
+		goto first;
+	}
+
+	uint64_t send_delta_us = (uint64_t)frames_delta * controller->frame_interval_us;
+	double delay_delta_ms = ((double)arrival_delta_us - (double)send_delta_us) / 1000.0;
+	controller->prev_frame_index = sample->frame_index;
+	controller->prev_arrival_us = sample->arrival_us;
+
+	controller->stats.jitter_us += (fabs(delay_delta_ms * 1000.0) - controller->stats.jitter_us) / 16.0;
+
+	controller->delay_accumulated_ms += delay_delta_ms;
+	controller->delay_smoothed_ms = DELAY_LOSS_TREND_SMOOTHING * controller->delay_smoothed_ms
+		+ (1.0 - DELAY_LOSS_TREND_SMOOTHING) * controller->delay_accumulated_ms;
+	controller->trend_x[controller->trend_next] = (sample->arrival_us - controller->first_arrival_us) / 1000.0;
+	controller->trend_y[controller->trend_next] = controller->delay_smoothed_ms;
+	controller->trend_next = (controller->trend_next + 1) % DELAY_LOSS_TREND_WINDOW;
+	if(controller->trend_count < DELAY_LOSS_TREND_WINDOW)
+		controller->trend_count++;
+	if(controller->deltas_count < DELAY_LOSS_TREND_DELTAS_MAX)
+		controller->deltas_count++;
+
+	if(controller->trend_count < DELAY_LOSS_TREND_WINDOW)
+		return;
+	double trend = delay_loss_trend(controller);
+	controller->stats.delay_trend = trend;
+	delay_loss_detect(controller, trend, send_delta_us / 1000.0, sample->arrival_us);
+	return;
+
+first:
+	controller->prev_valid = true;
+	controller->prev_frame_index = sample->frame_index;
+	controller->prev_arrival_us = sample->arrival_us;
+	controller->first_arrival_us = sample->arrival_us;
+}
+
+static void delay_loss_controller_frame(const ChiakiCongestionFrameSample *sample, void *user)
+{
+	DelayLossController *controller = user;
+	stats_frame(&controller->stats, sample);
+}
+
+static void delay_loss_controller_report(uint64_t now_us, uint64_t received, uint64_t lost, ChiakiTakionCongestionPacket *packet, void *user)
+{
+	DelayLossController *controller = user;
+	uint64_t total = received + lost;
+	double measured = total > 0 ? (double)lost / total : 0.0;
+	if(total > 0)
+		controller->stats.loss_smoothed += DELAY_LOSS_LOSS_SMOOTHING * (measured - controller->stats.loss_smoothed);
+
+	// a single burst that fec recovered should not cost bitrate for long, but loss fec could not hide is reported right away
+	double loss = controller->stats.loss_smoothed;
+	bool frames_failed = controller->stats.frames_failed != controller->frames_failed_reported;
+	controller->frames_failed_reported = controller->stats.frames_failed;
+	if(frames_failed && measured > loss)
+		loss = measured;
+
+	// the console only reacts to loss, so report some while a queue builds up, before packets are actually dropped
+	if(controller->usage_interval == CHIAKI_CONGESTION_USAGE_OVERUSE)
+	{
+		controller->overuse_loss = controller->overuse_loss > 0.0
+			? controller->overuse_loss * DELAY_LOSS_OVERUSE_LOSS_GROWTH
+			: DELAY_LOSS_OVERUSE_LOSS_MIN;
+		if(loss < controller->overuse_loss)
+			loss = controller->overuse_loss;
+	}
+	else
+		controller->overuse_loss = 0.0;
+	controller->usage_interval = controller->stats.usage;
+
+	if(loss > controller->packet_loss_max)
+		loss = controller->packet_loss_max;
+	packet_set_loss(packet, total, loss);
+	controller->stats.loss_reported = total > 0 ? loss : 0.0;
+}
+
+static void delay_loss_controller_stats(ChiakiCongestionControllerStats *stats, void *user)
+{
+	DelayLossController *controller = user;
+	*stats = controller->stats;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_controller_init(ChiakiCongestionController *controller, ChiakiCongestionControllerType type,
+		ChiakiLog *log, double packet_loss_max, uint64_t frame_interval_us)
+{
+	memset(controller, 0, sizeof(*controller));
+	controller->fini_cb = free;
+	switch(type)
+	{
+		case CHIAKI_CONGESTION_CONTROLLER_LOSS: {
+			LossController *loss = calloc(1, sizeof(LossController));
+			if(!loss)
+				return CHIAKI_ERR_MEMORY;
+			loss->log = log;
+			loss->packet_loss_max = packet_loss_max;
+			controller->user = loss;
+			controller->frame_cb = loss_controller_frame;
+			controller->report_cb = loss_controller_report;
+			controller->stats_cb = loss_controller_stats;
+			return CHIAKI_ERR_SUCCESS;
+		}
+		case CHIAKI_CONGESTION_CONTROLLER_DELAY_LOSS: {
+			if(!frame_interval_us)
+				return CHIAKI_ERR_INVALID_DATA;
+			DelayLossController *delay_loss = calloc(1, sizeof(DelayLossController));
+			if(!delay_loss)
+				return CHIAKI_ERR_MEMORY;
+			delay_loss->log = log;
+			delay_loss->packet_loss_max = packet_loss_max;
+			delay_loss->frame_interval_us = frame_interval_us;
+			delay_loss->stats.delay_threshold = DELAY_LOSS_THRESHOLD_INITIAL;
+			delay_loss_controller_reset(delay_loss);
+			controller->user = delay_loss;
+			controller->unit_cb = delay_loss_controller_unit;
+			controller->frame_cb = delay_loss_controller_frame;
+			controller->report_cb = delay_loss_controller_report;
+			controller->stats_cb = delay_loss_controller_stats;
+			return CHIAKI_ERR_SUCCESS;
+		}
+		default:
+			return CHIAKI_ERR_INVALID_DATA;
+	}
+}
+
+CHIAKI_EXPORT void chiaki_congestion_controller_fini(ChiakiCongestionController *controller)
+{
+	if(controller->fini_cb)
+		controller->fini_cb(controller->user);
+	memset(controller, 0, sizeof(*controller));
+}
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/congestionsim.h>
+
+#include <string.h>
+
+typedef struct sim_t
+{
+	const ChiakiCongestionSimConfig *config;
+	ChiakiCongestionController *controller;
+	ChiakiCongestionSimReportCallback cb;
+	void *cb_user;
+	ChiakiCongestionSimResult *result;
+
+	uint32_t rng;
+	unsigned int burst_left;
+
+	uint64_t next_report_us;
+	uint64_t received; // since the last report
+	uint64_t lost;
+	uint64_t loss_samples; // reports with any packets
+	double loss_measured_sum;
+	double loss_reported_sum;
+} Sim;
+
+/**
+ * xorshift32, so traces replay the same everywhere
+ */
+static double sim_random(Sim *sim)
+{
+	uint32_t x = sim->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	sim->rng = x;
+	return (x >> 8) / 16777216.0;
+}
+
+static bool sim_unit_lost(Sim *sim, const ChiakiCongestionSimStep *step)
+{
+	if(sim->burst_left)
+	{
+		sim->burst_left--;
+		return true;
+	}
+	if(step->loss <= 0.0 || sim_random(sim) >= step->loss)
+		return false;
+	sim->burst_left = step->loss_burst > 1 ? step->loss_burst - 1 : 0;
+	return true;
+}
+
+/**
+ * Ask the controller for all reports that are due up to now_us
+ */
+static void sim_report_until(Sim *sim, uint64_t now_us)
+{
+	while(sim->next_report_us <= now_us)
+	{
+		ChiakiTakionCongestionPacket packet = { 0 };
+		sim->controller->report_cb(sim->next_report_us, sim->received, sim->lost, &packet, sim->controller->user);
+
+		ChiakiCongestionSimResult *result = sim->result;
+		result->reports++;
+		uint64_t total = sim->received + sim->lost;
+		uint64_t reported_total = (uint64_t)packet.received + packet.lost;
+		if(total > 0 && reported_total > 0)
+		{
+			double reported = (double)packet.lost / reported_total;
+			sim->loss_samples++;
+			sim->loss_measured_sum += (double)sim->lost / total;
+			sim->loss_reported_sum += reported;
+			if(reported > result->loss_reported_max)
+				result->loss_reported_max = reported;
+		}
+		if(sim->cb)
+			sim->cb(sim->next_report_us / 1000, sim->received, sim->lost, &packet, sim->cb_user);
+
+		sim->received = 0;
+		sim->lost = 0;
+		sim->next_report_us += sim->config->report_interval_ms * 1000;
+	}
+}
+
+CHIAKI_EXPORT void chiaki_congestion_sim_config_default(ChiakiCongestionSimConfig *config)
+{
+	config->fps = 60;
+	config->units_source = 20;
+	config->units_fec = 4;
+	config->unit_size = 1400;
+	config->unit_spacing_us = 50;
+	config->report_interval_ms = 200;
+	config->seed = 1;
+}
+
+CHIAKI_EXPORT void chiaki_congestion_sim_run(const ChiakiCongestionSimConfig *config, const ChiakiCongestionSimStep *steps, size_t steps_count,
+		ChiakiCongestionController *controller, ChiakiCongestionSimReportCallback cb, void *cb_user, ChiakiCongestionSimResult *result)
+{
+	memset(result, 0, sizeof(*result));
+	Sim sim = { 0 };
+	sim.config = config;
+	sim.controller = controller;
+	sim.cb = cb;
+	sim.cb_user = cb_user;
+	sim.result = result;
+	sim.rng = config->seed ? config->seed : 1;
+	sim.next_report_us = config->report_interval_ms * 1000;
+
+	uint64_t frame_interval_us = 1000000 / config->fps;
+	unsigned int units_total = config->units_source + config->units_fec;
+	ChiakiSeqNum16 frame_index = 0;
+	uint64_t send_us = 0;
+	uint64_t arrival_last_us = 0;
+	uint64_t step_start_us = 0;
+
+	for(size_t s=0; s<steps_count; s++)
+	{
+		const ChiakiCongestionSimStep *step = &steps[s];
+		uint64_t step_us = step->duration_ms * 1000;
+		uint64_t step_end_us = step_start_us + step_us;
+		for(; send_us < step_end_us; send_us += frame_interval_us, frame_index++)
+		{
+			double pos = (double)(send_us - step_start_us) / step_us;
+			uint64_t delay_us = (uint64_t)(step->delay_start_us + ((double)step->delay_end_us - step->delay_start_us) * pos);
+
+			unsigned int units_received = 0;
+			unsigned int units_source_received = 0;
+			for(unsigned int u=0; u<units_total; u++)
+			{
+				// the link is a fifo, units never overtake each other
+				uint64_t arrival_us = send_us + delay_us + u * config->unit_spacing_us;
+				if(arrival_us < arrival_last_us)
+					arrival_us = arrival_last_us;
+				arrival_last_us = arrival_us;
+				sim_report_until(&sim, arrival_us);
+
+				if(sim_unit_lost(&sim, step))
+				{
+					sim.lost++;
+					continue;
+				}
+				sim.received++;
+				units_received++;
+				if(u < config->units_source)
+					units_source_received++;
+				if(controller->unit_cb)
+				{
+					ChiakiCongestionUnitSample sample = {
+						.arrival_us = arrival_us,
+						.frame_index = frame_index,
+						.unit_index = u,
+						.units_in_frame_total = units_total,
+						.size = config->unit_size
+					};
+					controller->unit_cb(&sample, controller->user);
+				}
+			}
+
+			ChiakiCongestionFrameSample sample = { .frame_index = frame_index };
+			if(units_source_received == config->units_source)
+				sample.result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS;
+			else if(units_received >= config->units_source)
+			{
+				sample.result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS;
+				result->frames_fec_recovered++;
+			}
+			else
+			{
+				sample.result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
+				result->frames_failed++;
+			}
+			result->frames++;
+			if(controller->frame_cb)
+				controller->frame_cb(&sample, controller->user);
+		}
+		step_start_us = step_end_us;
+	}
+	sim_report_until(&sim, arrival_last_us > send_us ? arrival_last_us : send_us);
+
+	if(sim.loss_samples)
+	{
+		result->loss_measured_mean = sim.loss_measured_sum / sim.loss_samples;
+		result->loss_reported_mean = sim.loss_reported_sum / sim.loss_samples;
+	}
+}
@@ -0,0 +1,301 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/eventloop.h>
+
+#include <string.h>
+
+#if CHIAKI_EVENT_LOOP_SUPPORTED
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#define EVENT_LOOP_EVENTS_MAX 16
+#define EVENT_LOOP_STOP_DATA UINT64_MAX
+
+static void *event_loop_thread_func(void *user);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_init(ChiakiEventLoop *loop, ChiakiLog *log)
+{
+	loop->log = log;
+	loop->running = false;
+	memset(loop->sources, 0, sizeof(loop->sources));
+	memset(loop->generations, 0, sizeof(loop->generations));
+	memset(&loop->stats, 0, sizeof(loop->stats));
+
+	ChiakiErrorCode err = chiaki_mutex_init(&loop->mutex, true);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(loop->epoll_fd < 0)
+	{
+		CHIAKI_LOGE(log, "Event Loop failed to create epoll instance: %s", strerror(errno));
+		err = CHIAKI_ERR_UNKNOWN;
+		goto error_mutex;
+	}
+
+	loop->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(loop->stop_fd < 0)
+	{
+		CHIAKI_LOGE(log, "Event Loop failed to create eventfd: %s", strerror(errno));
+		err = CHIAKI_ERR_UNKNOWN;
+		goto error_epoll;
+	}
+
+	struct epoll_event ev = { 0 };
+	ev.events = EPOLLIN;
+	ev.data.u64 = EVENT_LOOP_STOP_DATA;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->stop_fd, &ev) < 0)
+	{
+		CHIAKI_LOGE(log, "Event Loop failed to watch eventfd: %s", strerror(errno));
+		err = CHIAKI_ERR_UNKNOWN;
+		goto error_stop_fd;
+	}
+
+	return CHIAKI_ERR_SUCCESS;
+error_stop_fd:
+	close(loop->stop_fd);
+error_epoll:
+	close(loop->epoll_fd);
+error_mutex:
+	chiaki_mutex_fini(&loop->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_fini(ChiakiEventLoop *loop)
+{
+	chiaki_event_loop_stop(loop);
+	close(loop->stop_fd);
+	close(loop->epoll_fd);
+	chiaki_mutex_fini(&loop->mutex);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_start(ChiakiEventLoop *loop)
+{
+	if(loop->running)
+		return CHIAKI_ERR_SUCCESS;
+	ChiakiErrorCode err = chiaki_thread_create(&loop->thread, event_loop_thread_func, loop);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	chiaki_thread_set_name(&loop->thread, "Chiaki Event Loop");
+	loop->running = true;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_stop(ChiakiEventLoop *loop)
+{
+	if(!loop->running)
+		return;
+	uint64_t v = 1;
+	if(write(loop->stop_fd, &v, sizeof(v)) != sizeof(v))
+		CHIAKI_LOGE(loop->log, "Event Loop failed to signal eventfd: %s", strerror(errno));
+	chiaki_thread_join(&loop->thread, NULL);
+	loop->running = false;
+
+	// reset for a later start
+	while(read(loop->stop_fd, &v, sizeof(v)) == sizeof(v));
+}
+
+static ChiakiErrorCode event_loop_add(ChiakiEventLoop *loop, ChiakiEventLoopSource *source)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&loop->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	uint32_t slot;
+	for(slot=0; slot<CHIAKI_EVENT_LOOP_SOURCES_MAX; slot++)
+	{
+		if(!loop->sources[slot])
+			break;
+	}
+	if(slot == CHIAKI_EVENT_LOOP_SOURCES_MAX)
+	{
+		CHIAKI_LOGE(loop->log, "Event Loop has no free source slots");
+		err = CHIAKI_ERR_OVERFLOW;
+		goto beach;
+	}
+
+	struct epoll_event ev = { 0 };
+	ev.events = EPOLLIN;
+	ev.data.u64 = ((uint64_t)loop->generations[slot] << 32) | slot;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &ev) < 0)
+	{
+		CHIAKI_LOGE(loop->log, "Event Loop failed to watch fd %d: %s", source->fd, strerror(errno));
+		err = CHIAKI_ERR_UNKNOWN;
+		goto beach;
+	}
+	source->slot = slot;
+	loop->sources[slot] = source;
+
+beach:
+	chiaki_mutex_unlock(&loop->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_add_fd(ChiakiEventLoop *loop, ChiakiEventLoopSource *source, int fd, ChiakiEventLoopCallback cb, void *user)
+{
+	source->fd = fd;
+	source->timer = false;
+	source->cb = cb;
+	source->user = user;
+	return event_loop_add(loop, source);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_add_timer(ChiakiEventLoop *loop, ChiakiEventLoopSource *source, uint64_t interval_ms, ChiakiEventLoopCallback cb, void *user)
+{
+	source->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(source->fd < 0)
+	{
+		CHIAKI_LOGE(loop->log, "Event Loop failed to create timerfd: %s", strerror(errno));
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	source->timer = true;
+	source->cb = cb;
+	source->user = user;
+
+	ChiakiErrorCode err = chiaki_event_loop_timer_set(source, interval_ms);
+	if(err == CHIAKI_ERR_SUCCESS)
+		err = event_loop_add(loop, source);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		close(source->fd);
+		source->fd = -1;
+	}
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_timer_set(ChiakiEventLoopSource *source, uint64_t interval_ms)
+{
+	if(!source->timer)
+		return CHIAKI_ERR_INVALID_DATA;
+	struct itimerspec spec = { 0 };
+	if(interval_ms)
+	{
+		struct timespec now;
+		if(clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+			return CHIAKI_ERR_UNKNOWN;
+		// expire on multiples of the interval, so timers with related intervals share wakeups
+		uint64_t interval_ns = interval_ms * 1000000;
+		uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+		uint64_t next_ns = (now_ns / interval_ns + 1) * interval_ns;
+		spec.it_value.tv_sec = next_ns / 1000000000;
+		spec.it_value.tv_nsec = next_ns % 1000000000;
+		spec.it_interval.tv_sec = interval_ms / 1000;
+		spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+	}
+	if(timerfd_settime(source->fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+		return CHIAKI_ERR_UNKNOWN;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_timer_set_oneshot(ChiakiEventLoopSource *source, uint64_t timeout_ms)
+{
+	if(!source->timer)
+		return CHIAKI_ERR_INVALID_DATA;
+	struct itimerspec spec = { 0 };
+	spec.it_value.tv_sec = timeout_ms / 1000;
+	spec.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+	if(timerfd_settime(source->fd, 0, &spec, NULL) < 0)
+		return CHIAKI_ERR_UNKNOWN;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_remove(ChiakiEventLoop *loop, ChiakiEventLoopSource *source)
+{
+	chiaki_mutex_lock(&loop->mutex);
+	if(source->slot < CHIAKI_EVENT_LOOP_SOURCES_MAX && loop->sources[source->slot] == source)
+	{
+		epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+		loop->sources[source->slot] = NULL;
+		// events that have already been returned for this slot are dropped by the loop
+		loop->generations[source->slot]++;
+	}
+	source->slot = CHIAKI_EVENT_LOOP_SOURCES_MAX;
+	chiaki_mutex_unlock(&loop->mutex);
+
+	if(source->timer && source->fd >= 0)
+	{
+		close(source->fd);
+		source->fd = -1;
+	}
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_get_stats(ChiakiEventLoop *loop, ChiakiEventLoopStats *stats)
+{
+	chiaki_mutex_lock(&loop->mutex);
+	*stats = loop->stats;
+	chiaki_mutex_unlock(&loop->mutex);
+}
+
+static void *event_loop_thread_func(void *user)
+{
+	ChiakiEventLoop *loop = user;
+	struct epoll_event events[EVENT_LOOP_EVENTS_MAX];
+	bool stop = false;
+	while(!stop)
+	{
+		int count = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_EVENTS_MAX, -1);
+		if(count < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			CHIAKI_LOGE(loop->log, "Event Loop epoll_wait failed: %s", strerror(errno));
+			break;
+		}
+
+		chiaki_mutex_lock(&loop->mutex);
+		loop->stats.wakeups++;
+		for(int i=0; i<count; i++)
+		{
+			if(events[i].data.u64 == EVENT_LOOP_STOP_DATA)
+			{
+				stop = true;
+				continue;
+			}
+			uint32_t slot = (uint32_t)events[i].data.u64;
+			uint32_t generation = (uint32_t)(events[i].data.u64 >> 32);
+			ChiakiEventLoopSource *source = loop->sources[slot];
+			if(!source || loop->generations[slot] != generation)
+				continue;
+			if(source->timer)
+			{
+				uint64_t expirations;
+				if(read(source->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+					continue; // disarmed in the meantime
+				loop->stats.timer_expirations += expirations;
+			}
+			else
+				loop->stats.fd_events++;
+			source->cb(source->user);
+		}
+		chiaki_mutex_unlock(&loop->mutex);
+	}
+	return NULL;
+}
+
+#else
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_init(ChiakiEventLoop *loop, ChiakiLog *log)
+{
+	memset(loop, 0, sizeof(*loop));
+	loop->log = log;
+	loop->epoll_fd = -1;
+	loop->stop_fd = -1;
+	CHIAKI_LOGE(log, "Event Loop is not supported on this platform");
+	return CHIAKI_ERR_UNKNOWN;
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_fini(ChiakiEventLoop *loop) {}
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_start(ChiakiEventLoop *loop) { return CHIAKI_ERR_UNKNOWN; }
+CHIAKI_EXPORT void chiaki_event_loop_stop(ChiakiEventLoop *loop) {}
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_add_fd(ChiakiEventLoop *loop, ChiakiEventLoopSource *source, int fd, ChiakiEventLoopCallback cb, void *user) { return CHIAKI_ERR_UNKNOWN; }
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_add_timer(ChiakiEventLoop *loop, ChiakiEventLoopSource *source, uint64_t interval_ms, ChiakiEventLoopCallback cb, void *user) { return CHIAKI_ERR_UNKNOWN; }
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_timer_set(ChiakiEventLoopSource *source, uint64_t interval_ms) { return CHIAKI_ERR_UNKNOWN; }
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_timer_set_oneshot(ChiakiEventLoopSource *source, uint64_t timeout_ms) { return CHIAKI_ERR_UNKNOWN; }
+CHIAKI_EXPORT void chiaki_event_loop_remove(ChiakiEventLoop *loop, ChiakiEventLoopSource *source) {}
+CHIAKI_EXPORT void chiaki_event_loop_get_stats(ChiakiEventLoop *loop, ChiakiEventLoopStats *stats) { memset(stats, 0, sizeof(*stats)); }
+
+#endif
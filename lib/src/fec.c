@@ -2,75 +2,514 @@
 
 #include <chiaki/fec.h>
 
+#include "utils.h"
+
 #include <jerasure.h>
 #include <cauchy.h>
+#include <galois.h>
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define FEC_ENGINE_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define FEC_ENGINE_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define FEC_TARGET(t) __attribute__((target(t)))
+#else
+#define FEC_TARGET(t)
+#endif
+
 int *create_matrix(unsigned int k, unsigned int m)
 {
 	return cauchy_original_coding_matrix(k, m, CHIAKI_FEC_WORDSIZE);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count)
+#define GF8_TABLES_SIZE 0x20
+
+/**
+ * dst ^= c * src in GF(2^8), where tables contains c * x for all low nibbles x, followed by c * (x << 4) for all high nibbles x.
+ */
+typedef void (*Gf8MulXorFunc)(uint8_t *dst, const uint8_t *src, const uint8_t *tables, size_t size);
+
+static void gf8_mul_xor_scalar(uint8_t *dst, const uint8_t *src, const uint8_t *tables, size_t size)
 {
-	if(stride < unit_size)
-		return CHIAKI_ERR_INVALID_DATA;
-	int *matrix = create_matrix(k, m);
-	if(!matrix)
-		return CHIAKI_ERR_MEMORY;
+	for(size_t i=0; i<size; i++)
+		dst[i] ^= tables[src[i] & 0xf] ^ tables[0x10 + (src[i] >> 4)];
+}
 
-	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+#ifdef FEC_ENGINE_X86
+FEC_TARGET("ssse3")
+static void gf8_mul_xor_ssse3(uint8_t *dst, const uint8_t *src, const uint8_t *tables, size_t size)
+{
+	__m128i lo = _mm_loadu_si128((const __m128i *)tables);
+	__m128i hi = _mm_loadu_si128((const __m128i *)(tables + 0x10));
+	__m128i mask = _mm_set1_epi8(0xf);
+	size_t i = 0;
+	for(; i + 0x10 <= size; i += 0x10)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i p = _mm_xor_si128(
+				_mm_shuffle_epi8(lo, _mm_and_si128(s, mask)),
+				_mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, p));
+	}
+	gf8_mul_xor_scalar(dst + i, src + i, tables, size - i);
+}
 
-	int *jerasures = calloc(erasures_count + 1, sizeof(int));
-	if(!jerasures)
+FEC_TARGET("avx2")
+static void gf8_mul_xor_avx2(uint8_t *dst, const uint8_t *src, const uint8_t *tables, size_t size)
+{
+	__m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables));
+	__m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(tables + 0x10)));
+	__m256i mask = _mm256_set1_epi8(0xf);
+	size_t i = 0;
+	for(; i + 0x20 <= size; i += 0x20)
 	{
-		err = CHIAKI_ERR_MEMORY;
-		goto error_matrix;
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i p = _mm256_xor_si256(
+				_mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask)),
+				_mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, p));
 	}
-	memcpy(jerasures, erasures, erasures_count * sizeof(int));
-	jerasures[erasures_count] = -1;
+	gf8_mul_xor_scalar(dst + i, src + i, tables, size - i);
+}
 
-	uint8_t **data_ptrs = calloc(k, sizeof(uint8_t *));
-	if(!data_ptrs)
+static void fec_cpuid(unsigned int leaf, unsigned int subleaf, unsigned int regs[4])
+{
+#if defined(_MSC_VER)
+	int r[4];
+	__cpuidex(r, (int)leaf, (int)subleaf);
+	for(size_t i=0; i<4; i++)
+		regs[i] = (unsigned int)r[i];
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+FEC_TARGET("xsave")
+static uint64_t fec_xgetbv()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+static bool fec_cpu_supports(ChiakiFecEngine engine)
+{
+	unsigned int regs[4];
+	fec_cpuid(0, 0, regs);
+	unsigned int max_leaf = regs[0];
+	if(max_leaf < 1)
+		return false;
+	fec_cpuid(1, 0, regs);
+	bool ssse3 = regs[2] & (1 << 9);
+	if(engine == CHIAKI_FEC_ENGINE_SSSE3)
+		return ssse3;
+	if(engine != CHIAKI_FEC_ENGINE_AVX2 || max_leaf < 7)
+		return false;
+	bool osxsave = regs[2] & (1 << 27);
+	bool avx = regs[2] & (1 << 28);
+	if(!osxsave || !avx || (fec_xgetbv() & 6) != 6) // xmm and ymm state enabled by the os
+		return false;
+	fec_cpuid(7, 0, regs);
+	return regs[1] & (1 << 5);
+}
+#endif
+
+#ifdef FEC_ENGINE_NEON
+static void gf8_mul_xor_neon(uint8_t *dst, const uint8_t *src, const uint8_t *tables, size_t size)
+{
+	uint8x16_t lo = vld1q_u8(tables);
+	uint8x16_t hi = vld1q_u8(tables + 0x10);
+	uint8x16_t mask = vdupq_n_u8(0xf);
+	size_t i = 0;
+	for(; i + 0x10 <= size; i += 0x10)
 	{
-		err = CHIAKI_ERR_MEMORY;
-		goto error_jerasures;
+		uint8x16_t s = vld1q_u8(src + i);
+		uint8x16_t p = veorq_u8(vqtbl1q_u8(lo, vandq_u8(s, mask)), vqtbl1q_u8(hi, vshrq_n_u8(s, 4)));
+		vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), p));
 	}
+	gf8_mul_xor_scalar(dst + i, src + i, tables, size - i);
+}
+#endif
 
-	uint8_t **coding_ptrs = calloc(m, sizeof(uint8_t *));
-	if(!coding_ptrs)
+CHIAKI_EXPORT const char *chiaki_fec_engine_name(ChiakiFecEngine engine)
+{
+	switch(engine)
 	{
-		err = CHIAKI_ERR_MEMORY;
-		goto error_data_ptrs;
+		case CHIAKI_FEC_ENGINE_REFERENCE:
+			return "reference";
+		case CHIAKI_FEC_ENGINE_SCALAR:
+			return "scalar";
+		case CHIAKI_FEC_ENGINE_SSSE3:
+			return "ssse3";
+		case CHIAKI_FEC_ENGINE_AVX2:
+			return "avx2";
+		case CHIAKI_FEC_ENGINE_NEON:
+			return "neon";
+		default:
+			return "unknown";
 	}
+}
 
-	for(size_t i=0; i<k+m; i++)
+CHIAKI_EXPORT bool chiaki_fec_engine_supported(ChiakiFecEngine engine)
+{
+	switch(engine)
 	{
-		uint8_t *buf_ptr = frame_buf + stride * i;
-		if(i < k)
-			data_ptrs[i] = buf_ptr;
-		else
-			coding_ptrs[i - k] = buf_ptr;
+		case CHIAKI_FEC_ENGINE_REFERENCE:
+		case CHIAKI_FEC_ENGINE_SCALAR:
+			return true;
+#ifdef FEC_ENGINE_X86
+		case CHIAKI_FEC_ENGINE_SSSE3:
+		case CHIAKI_FEC_ENGINE_AVX2:
+			return fec_cpu_supports(engine);
+#endif
+#ifdef FEC_ENGINE_NEON
+		case CHIAKI_FEC_ENGINE_NEON:
+			return true;
+#endif
+		default:
+			return false;
 	}
+}
 
-	int res = jerasure_matrix_decode(k, m, CHIAKI_FEC_WORDSIZE, matrix, 0, jerasures,
-									 (char **)data_ptrs, (char **)coding_ptrs, unit_size);
+CHIAKI_EXPORT ChiakiFecEngine chiaki_fec_engine_best()
+{
+	static const ChiakiFecEngine engines[] = { CHIAKI_FEC_ENGINE_AVX2, CHIAKI_FEC_ENGINE_SSSE3, CHIAKI_FEC_ENGINE_NEON };
+	for(size_t i=0; i<sizeof(engines) / sizeof(engines[0]); i++)
+	{
+		if(chiaki_fec_engine_supported(engines[i]))
+			return engines[i];
+	}
+	// jerasure's region multiply uses full product tables, faster than split nibbles without simd
+	return CHIAKI_FEC_ENGINE_REFERENCE;
+}
 
-	if(res < 0)
-		err = CHIAKI_ERR_FEC_FAILED;
-	else
-		err = CHIAKI_ERR_SUCCESS;
+static Gf8MulXorFunc gf8_mul_xor_func(ChiakiFecEngine engine)
+{
+	switch(engine)
+	{
+#ifdef FEC_ENGINE_X86
+		case CHIAKI_FEC_ENGINE_SSSE3:
+			return gf8_mul_xor_ssse3;
+		case CHIAKI_FEC_ENGINE_AVX2:
+			return gf8_mul_xor_avx2;
+#endif
+#ifdef FEC_ENGINE_NEON
+		case CHIAKI_FEC_ENGINE_NEON:
+			return gf8_mul_xor_neon;
+#endif
+		default:
+			return gf8_mul_xor_scalar;
+	}
+}
 
-	free(coding_ptrs);
-error_data_ptrs:
-	free(data_ptrs);
-error_jerasures:
-	free(jerasures);
-error_matrix:
+struct chiaki_fec_matrix_t
+{
+	unsigned int k;
+	unsigned int m;
+	uint64_t last_used;
+	int *matrix; // m x k cauchy coding matrix
+};
+
+struct chiaki_fec_schedule_t
+{
+	unsigned int k;
+	unsigned int m;
+	uint64_t last_used;
+	uint64_t *erased; // bitmap of the k + m units
+	int *dm_ids; // the k surviving units that the erased source units are recovered from
+	unsigned int rows_count;
+	unsigned int *rows_dst; // erased source unit recovered by each row
+	int *rows; // rows_count x k, the rows of the decoding matrix for the erased source units
+	uint8_t *tables; // rows_count x k x GF8_TABLES_SIZE, nibble tables of each coefficient in rows for Gf8MulXorFunc
+};
+
+#define ERASED_WORDS(n) (((n) + 63) / 64)
+#define ERASED_GET(erased, i) (((erased)[(i) / 64] >> ((i) % 64)) & 1)
+
+static void fec_matrix_free(struct chiaki_fec_matrix_t *matrix)
+{
+	if(!matrix)
+		return;
+	free(matrix->matrix);
 	free(matrix);
+}
+
+static void fec_schedule_free(struct chiaki_fec_schedule_t *schedule)
+{
+	if(!schedule)
+		return;
+	free(schedule->erased);
+	free(schedule->dm_ids);
+	free(schedule->rows_dst);
+	free(schedule->rows);
+	free(schedule->tables);
+	free(schedule);
+}
+
+CHIAKI_EXPORT void chiaki_fec_cache_init(ChiakiFecCache *cache)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->engine = chiaki_fec_engine_best();
+}
+
+CHIAKI_EXPORT void chiaki_fec_cache_fini(ChiakiFecCache *cache)
+{
+	for(size_t i=0; i<CHIAKI_FEC_CACHE_MATRICES; i++)
+		fec_matrix_free(cache->matrices[i]);
+	for(size_t i=0; i<CHIAKI_FEC_CACHE_SCHEDULES; i++)
+		fec_schedule_free(cache->schedules[i]);
+	free(cache->ptrs);
+	free(cache->erased);
+}
+
+static struct chiaki_fec_matrix_t *fec_cache_matrix(ChiakiFecCache *cache, unsigned int k, unsigned int m)
+{
+	size_t slot = 0;
+	for(size_t i=0; i<CHIAKI_FEC_CACHE_MATRICES; i++)
+	{
+		struct chiaki_fec_matrix_t *matrix = cache->matrices[i];
+		if(matrix && matrix->k == k && matrix->m == m)
+		{
+			matrix->last_used = ++cache->use_counter;
+			cache->stats.matrix_hits++;
+			return matrix;
+		}
+		if(cache->matrices[slot] && (!matrix || matrix->last_used < cache->matrices[slot]->last_used))
+			slot = i;
+	}
+
+	cache->stats.matrix_misses++;
+	struct chiaki_fec_matrix_t *matrix = malloc(sizeof(struct chiaki_fec_matrix_t));
+	if(!matrix)
+		return NULL;
+	matrix->k = k;
+	matrix->m = m;
+	matrix->matrix = create_matrix(k, m);
+	if(!matrix->matrix)
+	{
+		free(matrix);
+		return NULL;
+	}
+	matrix->last_used = ++cache->use_counter;
+	fec_matrix_free(cache->matrices[slot]);
+	cache->matrices[slot] = matrix;
+	return matrix;
+}
+
+static struct chiaki_fec_schedule_t *fec_schedule_create(struct chiaki_fec_matrix_t *matrix, const uint64_t *erased)
+{
+	unsigned int k = matrix->k;
+	unsigned int n = k + matrix->m;
+	struct chiaki_fec_schedule_t *schedule = calloc(1, sizeof(struct chiaki_fec_schedule_t));
+	if(!schedule)
+		return NULL;
+	schedule->k = k;
+	schedule->m = matrix->m;
+
+	int *erased_units = NULL;
+	int *decoding_matrix = NULL;
+
+	schedule->erased = malloc(ERASED_WORDS(n) * sizeof(uint64_t));
+	schedule->dm_ids = malloc(k * sizeof(int));
+	erased_units = malloc(n * sizeof(int));
+	decoding_matrix = malloc((size_t)k * k * sizeof(int));
+	if(!schedule->erased || !schedule->dm_ids || !erased_units || !decoding_matrix)
+		goto error;
+	memcpy(schedule->erased, erased, ERASED_WORDS(n) * sizeof(uint64_t));
+
+	for(unsigned int i=0; i<n; i++)
+	{
+		erased_units[i] = (int)ERASED_GET(erased, i);
+		if(i < k && erased_units[i])
+			schedule->rows_count++;
+	}
+
+	if(jerasure_make_decoding_matrix(k, matrix->m, CHIAKI_FEC_WORDSIZE, matrix->matrix, erased_units, decoding_matrix, schedule->dm_ids) < 0)
+		goto error;
+
+	// only the rows for erased source units are ever needed
+	schedule->rows_dst = malloc(schedule->rows_count * sizeof(unsigned int));
+	schedule->rows = malloc((size_t)schedule->rows_count * k * sizeof(int));
+	schedule->tables = malloc((size_t)schedule->rows_count * k * GF8_TABLES_SIZE);
+	if(!schedule->rows_dst || !schedule->rows || !schedule->tables)
+		goto error;
+	unsigned int row = 0;
+	for(unsigned int i=0; i<k; i++)
+	{
+		if(!erased_units[i])
+			continue;
+		schedule->rows_dst[row] = i;
+		memcpy(schedule->rows + (size_t)row * k, decoding_matrix + (size_t)i * k, k * sizeof(int));
+		row++;
+	}
+
+	// products are taken from jerasure's field so all engines stay identical to the reference
+	for(size_t j=0; j<(size_t)schedule->rows_count * k; j++)
+	{
+		uint8_t *tables = schedule->tables + j * GF8_TABLES_SIZE;
+		for(int x=0; x<0x10; x++)
+		{
+			tables[x] = (uint8_t)galois_single_multiply(schedule->rows[j], x, CHIAKI_FEC_WORDSIZE);
+			tables[0x10 + x] = (uint8_t)galois_single_multiply(schedule->rows[j], x << 4, CHIAKI_FEC_WORDSIZE);
+		}
+	}
+
+	free(erased_units);
+	free(decoding_matrix);
+	return schedule;
+error:
+	free(erased_units);
+	free(decoding_matrix);
+	fec_schedule_free(schedule);
+	return NULL;
+}
+
+static struct chiaki_fec_schedule_t *fec_cache_schedule(ChiakiFecCache *cache, unsigned int k, unsigned int m)
+{
+	size_t erased_words = ERASED_WORDS(k + m);
+	size_t slot = 0;
+	for(size_t i=0; i<CHIAKI_FEC_CACHE_SCHEDULES; i++)
+	{
+		struct chiaki_fec_schedule_t *schedule = cache->schedules[i];
+		if(schedule && schedule->k == k && schedule->m == m
+			&& !memcmp(schedule->erased, cache->erased, erased_words * sizeof(uint64_t)))
+		{
+			schedule->last_used = ++cache->use_counter;
+			cache->stats.schedule_hits++;
+			return schedule;
+		}
+		if(cache->schedules[slot] && (!schedule || schedule->last_used < cache->schedules[slot]->last_used))
+			slot = i;
+	}
+
+	cache->stats.schedule_misses++;
+	struct chiaki_fec_matrix_t *matrix = fec_cache_matrix(cache, k, m);
+	if(!matrix)
+		return NULL;
+	struct chiaki_fec_schedule_t *schedule = fec_schedule_create(matrix, cache->erased);
+	if(!schedule)
+		return NULL;
+	schedule->last_used = ++cache->use_counter;
+	fec_schedule_free(cache->schedules[slot]);
+	cache->schedules[slot] = schedule;
+	return schedule;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_cache_decode(ChiakiFecCache *cache, uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count)
+{
+	if(stride < unit_size || !k)
+		return CHIAKI_ERR_INVALID_DATA;
+	size_t n = (size_t)k + m;
+
+	size_t erased_words = ERASED_WORDS(n);
+	if(cache->erased_words < erased_words)
+	{
+		free(cache->erased);
+		cache->erased = malloc(erased_words * sizeof(uint64_t));
+		if(!cache->erased)
+		{
+			cache->erased_words = 0;
+			return CHIAKI_ERR_MEMORY;
+		}
+		cache->erased_words = erased_words;
+	}
+	memset(cache->erased, 0, erased_words * sizeof(uint64_t));
+
+	size_t erased_count = 0;
+	size_t erased_source_count = 0;
+	for(size_t i=0; i<erasures_count; i++)
+	{
+		unsigned int e = erasures[i];
+		if(e >= n)
+			return CHIAKI_ERR_INVALID_DATA;
+		if(ERASED_GET(cache->erased, e))
+			continue;
+		cache->erased[e / 64] |= 1ull << (e % 64);
+		erased_count++;
+		if(e < k)
+			erased_source_count++;
+	}
+	if(erased_count > m)
+		return CHIAKI_ERR_FEC_FAILED;
+	if(!erased_source_count)
+		return CHIAKI_ERR_SUCCESS;
+
+	struct chiaki_fec_schedule_t *schedule = fec_cache_schedule(cache, k, m);
+	if(!schedule)
+		return CHIAKI_ERR_FEC_FAILED;
+
+	if(cache->ptrs_size < n)
+	{
+		free(cache->ptrs);
+		cache->ptrs = malloc(n * sizeof(uint8_t *));
+		if(!cache->ptrs)
+		{
+			cache->ptrs_size = 0;
+			return CHIAKI_ERR_MEMORY;
+		}
+		cache->ptrs_size = n;
+	}
+	for(size_t i=0; i<n; i++)
+		cache->ptrs[i] = frame_buf + stride * i;
+
+	if(cache->engine == CHIAKI_FEC_ENGINE_REFERENCE)
+	{
+		char **data_ptrs = (char **)cache->ptrs;
+		char **coding_ptrs = data_ptrs + k;
+		for(unsigned int row=0; row<schedule->rows_count; row++)
+		{
+			jerasure_matrix_dotprod(k, CHIAKI_FEC_WORDSIZE, schedule->rows + (size_t)row * k, schedule->dm_ids,
+					schedule->rows_dst[row], data_ptrs, coding_ptrs, unit_size);
+		}
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	Gf8MulXorFunc mul_xor = gf8_mul_xor_func(cache->engine);
+	for(unsigned int row=0; row<schedule->rows_count; row++)
+	{
+		uint8_t *dst = cache->ptrs[schedule->rows_dst[row]];
+		memset(dst, 0, unit_size);
+		const int *coefs = schedule->rows + (size_t)row * k;
+		const uint8_t *tables = schedule->tables + (size_t)row * k * GF8_TABLES_SIZE;
+		for(unsigned int j=0; j<k; j++)
+		{
+			const uint8_t *src = cache->ptrs[schedule->dm_ids[j]];
+			if(coefs[j] == 1)
+				xor_bytes(dst, src, unit_size);
+			else if(coefs[j])
+				mul_xor(dst, src, tables + (size_t)j * GF8_TABLES_SIZE, unit_size);
+		}
+	}
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count)
+{
+	ChiakiFecCache cache;
+	chiaki_fec_cache_init(&cache);
+	ChiakiErrorCode err = chiaki_fec_cache_decode(&cache, frame_buf, unit_size, stride, k, m, erasures, erasures_count);
+	chiaki_fec_cache_fini(&cache);
 	return err;
 }
 
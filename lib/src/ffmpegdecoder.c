@@ -1,9 +1,18 @@
 
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_VIDEO
+
 #include <chiaki/ffmpegdecoder.h>
+#include <chiaki/video.h>
+#include <chiaki/time.h>
 
 #include <libavcodec/avcodec.h>
+#include <libavutil/cpu.h>
 #include <libavutil/pixdesc.h>
 
+#include <string.h>
+
+#define PACKET_POOL_BUF_ALIGN 0x10000 // so the pool is not recreated for every slightly larger frame
+
 static enum AVCodecID chiaki_codec_av_codec_id(ChiakiCodec codec)
 {
 	switch(codec)
@@ -16,8 +25,137 @@ static enum AVCodecID chiaki_codec_av_codec_id(ChiakiCodec codec)
 	}
 }
 
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_profile_settings_init(ChiakiFfmpegDecoderProfileSettings *settings, ChiakiFfmpegDecoderProfile profile)
+{
+	memset(settings, 0, sizeof(*settings));
+	settings->profile = profile;
+	settings->queue_depth = 1;
+	switch(profile)
+	{
+		case CHIAKI_FFMPEG_DECODER_PROFILE_LATENCY:
+			// frame threads add a frame of delay per thread, slice threads don't
+			settings->thread_type = FF_THREAD_SLICE;
+			settings->low_delay = true;
+			settings->fast = true;
+			break;
+		case CHIAKI_FFMPEG_DECODER_PROFILE_THROUGHPUT:
+			settings->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+			settings->queue_depth = 4;
+			break;
+		default:
+			break;
+	}
+}
+
+CHIAKI_EXPORT const char *chiaki_ffmpeg_decoder_profile_name(ChiakiFfmpegDecoderProfile profile)
+{
+	switch(profile)
+	{
+		case CHIAKI_FFMPEG_DECODER_PROFILE_DEFAULT:
+			return "default";
+		case CHIAKI_FFMPEG_DECODER_PROFILE_LATENCY:
+			return "latency";
+		case CHIAKI_FFMPEG_DECODER_PROFILE_THROUGHPUT:
+			return "throughput";
+		case CHIAKI_FFMPEG_DECODER_PROFILE_CUSTOM:
+			return "custom";
+		default:
+			return "unknown";
+	}
+}
+
+/**
+ * Whether the thread count depends on the slices of the stream, so opening has to wait for the first sample with slices.
+ */
+static bool decoder_threads_from_slices(ChiakiFfmpegDecoder *decoder)
+{
+	return !decoder->hw_device_ctx && decoder->profile.thread_type == FF_THREAD_SLICE && !decoder->profile.thread_count;
+}
+
+/**
+ * @return number of slices of the first picture in an Annex B sample
+ */
+static int sample_slices_count(ChiakiCodec codec, const uint8_t *buf, size_t buf_size)
+{
+	int slices = 0;
+	for(size_t i=0; i+3<buf_size; i++)
+	{
+		if(buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 1)
+			continue;
+		const uint8_t *nal = buf + i + 3;
+		size_t nal_size = buf_size - i - 3;
+		bool vcl, first_slice;
+		if(chiaki_codec_is_h265(codec))
+		{
+			vcl = ((nal[0] >> 1) & 0x3f) < 32;
+			first_slice = nal_size > 2 && (nal[2] & 0x80); // first_slice_segment_in_pic_flag
+		}
+		else
+		{
+			unsigned int type = nal[0] & 0x1f;
+			vcl = type >= 1 && type <= 5;
+			first_slice = nal_size > 1 && (nal[1] & 0x80); // first_mb_in_slice == 0
+		}
+		if(!vcl)
+			continue;
+		if(first_slice && slices)
+			break;
+		slices++;
+		i += 3;
+	}
+	return slices;
+}
+
+/**
+ * Apply the profile and open the codec context.
+ *
+ * @param slices of the stream if known, 0 otherwise
+ */
+static bool decoder_open(ChiakiFfmpegDecoder *decoder, int slices)
+{
+	ChiakiFfmpegDecoderProfileSettings *profile = &decoder->profile;
+	AVCodecContext *ctx = decoder->codec_context;
+	if(profile->low_delay)
+		ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+	if(profile->fast)
+		ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+	if(decoder->hw_device_ctx)
+	{
+		// the work happens on the gpu, more threads only delay frames
+		if(profile->profile == CHIAKI_FFMPEG_DECODER_PROFILE_LATENCY)
+			ctx->thread_count = 1;
+	}
+	else if(profile->thread_type)
+	{
+		ctx->thread_type = profile->thread_type;
+		int thread_count = profile->thread_count;
+		if(!thread_count)
+		{
+			thread_count = av_cpu_count();
+			if(profile->thread_type == FF_THREAD_SLICE && slices > 0 && slices < thread_count)
+				thread_count = slices;
+		}
+		ctx->thread_count = thread_count;
+	}
+
+	if(avcodec_open2(ctx, decoder->av_codec, NULL) < 0)
+	{
+		CHIAKI_LOGE(decoder->log, "Failed to open codec context");
+		return false;
+	}
+	decoder->codec_opened = true;
+	CHIAKI_LOGI(decoder->log, "FFMPEG decoder opened with profile %s, %d threads (%s%s)%s",
+			chiaki_ffmpeg_decoder_profile_name(profile->profile),
+			ctx->thread_count,
+			ctx->active_thread_type & FF_THREAD_FRAME ? "frame" : "",
+			ctx->active_thread_type & FF_THREAD_SLICE ? "slice" : "",
+			slices ? "" : ", slices unknown");
+	return true;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
 		ChiakiCodec codec, const char *hw_decoder_name, AVBufferRef *hw_device_ctx,
+		const ChiakiFfmpegDecoderProfileSettings *profile,
 		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user)
 {
 	ChiakiErrorCode err = chiaki_mutex_init(&decoder->mutex, false);
@@ -28,8 +166,50 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *de
 	decoder->frame_available_cb = frame_available_cb;
 	decoder->frame_available_cb_user = frame_available_cb_user;
 	decoder->hdr_enabled = codec == CHIAKI_CODEC_H265_HDR;
+	decoder->codec = codec;
+	decoder->codec_opened = false;
+	if(profile)
+		decoder->profile = *profile;
+	else
+		chiaki_ffmpeg_decoder_profile_settings_init(&decoder->profile, CHIAKI_FFMPEG_DECODER_PROFILE_DEFAULT);
+	if(decoder->profile.queue_depth < 1)
+		decoder->profile.queue_depth = 1;
+	else if(decoder->profile.queue_depth > CHIAKI_FFMPEG_DECODER_QUEUE_DEPTH_MAX)
+		decoder->profile.queue_depth = CHIAKI_FFMPEG_DECODER_QUEUE_DEPTH_MAX;
+	decoder->queue_count = 0;
+	decoder->sample_info_valid = false;
+	decoder->sample_pts = 0;
 	decoder->frames_lost = 0;
 	decoder->frame_recovered = false;
+	decoder->packet_pool = NULL;
+	decoder->packet_pool_buf_size = 0;
+	memset(decoder->packet_bufs, 0, sizeof(decoder->packet_bufs));
+	memset(&decoder->stats, 0, sizeof(decoder->stats));
+
+	err = chiaki_mutex_init(&decoder->packet_pool_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	decoder->packet = av_packet_alloc();
+	if(!decoder->packet)
+	{
+		CHIAKI_LOGE(log, "Failed to alloc AVPacket");
+		goto error_packet_pool_mutex;
+	}
+
+	decoder->header_packet = av_packet_alloc();
+	if(!decoder->header_packet)
+	{
+		CHIAKI_LOGE(log, "Failed to alloc AVPacket");
+		goto error_packet;
+	}
+
+	decoder->drain_frame = av_frame_alloc();
+	if(!decoder->drain_frame)
+	{
+		CHIAKI_LOGE(log, "Failed to alloc AVFrame");
+		goto error_header_packet;
+	}
 
 	decoder->hw_device_ctx = hw_device_ctx ? av_buffer_ref(hw_device_ctx) : NULL;
 	decoder->hw_pix_fmt = AV_PIX_FMT_NONE;
@@ -42,14 +222,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *de
 	if(!decoder->av_codec)
 	{
 		CHIAKI_LOGE(log, "%s Codec not available", chiaki_codec_name(codec));
-		goto error_mutex;
+		goto error_hw_device_ctx;
 	}
 
 	decoder->codec_context = avcodec_alloc_context3(decoder->av_codec);
 	if(!decoder->codec_context)
 	{
 		CHIAKI_LOGE(log, "Failed to alloc codec context");
-		goto error_mutex;
+		goto error_hw_device_ctx;
 	}
 
 	if(hw_decoder_name)
@@ -86,17 +266,22 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *de
 		CHIAKI_LOGI(log, "Using hardware decoder \"%s\" with pix_fmt=%s", hw_decoder_name, av_get_pix_fmt_name(decoder->hw_pix_fmt));
 	}
 
-	if(avcodec_open2(decoder->codec_context, decoder->av_codec, NULL) < 0)
-	{
-		CHIAKI_LOGE(log, "Failed to open codec context");
+	if(!decoder_threads_from_slices(decoder) && !decoder_open(decoder, 0))
 		goto error_codec_context;
-	}
 	chiaki_mutex_unlock(&decoder->mutex);
 	return CHIAKI_ERR_SUCCESS;
 error_codec_context:
+	avcodec_free_context(&decoder->codec_context);
+error_hw_device_ctx:
 	if(decoder->hw_device_ctx)
 		av_buffer_unref(&decoder->hw_device_ctx);
-	avcodec_free_context(&decoder->codec_context);
+	av_frame_free(&decoder->drain_frame);
+error_header_packet:
+	av_packet_free(&decoder->header_packet);
+error_packet:
+	av_packet_free(&decoder->packet);
+error_packet_pool_mutex:
+	chiaki_mutex_fini(&decoder->packet_pool_mutex);
 error_mutex:
 	chiaki_mutex_unlock(&decoder->mutex);
 	chiaki_mutex_fini(&decoder->mutex);
@@ -109,20 +294,186 @@ CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder)
 	avcodec_free_context(&decoder->codec_context);
 	if(decoder->hw_device_ctx)
 		av_buffer_unref(&decoder->hw_device_ctx);
+	for(size_t i=0; i<decoder->queue_count; i++)
+		av_frame_free(&decoder->queue[i]);
+	av_frame_free(&decoder->drain_frame);
+	av_packet_free(&decoder->header_packet);
+	av_packet_free(&decoder->packet);
 	chiaki_mutex_unlock(&decoder->mutex);
 	chiaki_mutex_fini(&decoder->mutex);
+
+	for(size_t i=0; i<CHIAKI_FFMPEG_DECODER_PACKET_BUFS_MAX; i++)
+		av_buffer_unref(&decoder->packet_bufs[i]);
+	// buffers still referenced elsewhere keep the pool alive until they are released
+	av_buffer_pool_uninit(&decoder->packet_pool);
+	chiaki_mutex_fini(&decoder->packet_pool_mutex);
 }
 
-CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user)
+#if LIBAVUTIL_VERSION_MAJOR < 57
+static AVBufferRef *packet_pool_alloc(void *opaque, int size)
+#else
+static AVBufferRef *packet_pool_alloc(void *opaque, size_t size)
+#endif
+{
+	ChiakiFfmpegDecoder *decoder = opaque;
+	decoder->stats.packet_bufs_allocated++; // pool only used with packet_pool_mutex locked
+	return av_buffer_alloc(size);
+}
+
+CHIAKI_EXPORT uint8_t *chiaki_ffmpeg_decoder_video_sample_alloc_cb(size_t size, void *user)
 {
 	ChiakiFfmpegDecoder *decoder = user;
+	size_t buf_size = size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE;
+
+	chiaki_mutex_lock(&decoder->packet_pool_mutex);
+	if(!decoder->packet_pool || decoder->packet_pool_buf_size < buf_size)
+	{
+		av_buffer_pool_uninit(&decoder->packet_pool);
+		decoder->packet_pool_buf_size = ((buf_size + PACKET_POOL_BUF_ALIGN - 1) / PACKET_POOL_BUF_ALIGN) * PACKET_POOL_BUF_ALIGN;
+		decoder->packet_pool = av_buffer_pool_init2(decoder->packet_pool_buf_size, decoder, packet_pool_alloc, NULL);
+		if(!decoder->packet_pool)
+		{
+			decoder->packet_pool_buf_size = 0;
+			chiaki_mutex_unlock(&decoder->packet_pool_mutex);
+			CHIAKI_LOGE(decoder->log, "Failed to create packet buffer pool");
+			return NULL;
+		}
+	}
+
+	AVBufferRef *buf = av_buffer_pool_get(decoder->packet_pool);
+	if(!buf)
+	{
+		chiaki_mutex_unlock(&decoder->packet_pool_mutex);
+		CHIAKI_LOGE(decoder->log, "Failed to get packet buffer from pool");
+		return NULL;
+	}
+
+	// the oldest buffer that was never submitted, e.g. because its frame could not be completed, is given up on
+	if(decoder->packet_bufs[CHIAKI_FFMPEG_DECODER_PACKET_BUFS_MAX - 1])
+	{
+		av_buffer_unref(&decoder->packet_bufs[0]);
+		memmove(&decoder->packet_bufs[0], &decoder->packet_bufs[1], (CHIAKI_FFMPEG_DECODER_PACKET_BUFS_MAX - 1) * sizeof(AVBufferRef *));
+		decoder->packet_bufs[CHIAKI_FFMPEG_DECODER_PACKET_BUFS_MAX - 1] = NULL;
+	}
+	for(size_t i=0; i<CHIAKI_FFMPEG_DECODER_PACKET_BUFS_MAX; i++)
+	{
+		if(!decoder->packet_bufs[i])
+		{
+			decoder->packet_bufs[i] = buf;
+			break;
+		}
+	}
+	chiaki_mutex_unlock(&decoder->packet_pool_mutex);
+	return buf->data;
+}
 
+/**
+ * @return the buffer from chiaki_ffmpeg_decoder_video_sample_alloc_cb() that data was assembled into, now owned by the caller, or NULL
+ */
+static AVBufferRef *packet_buf_take(ChiakiFfmpegDecoder *decoder, uint8_t *data)
+{
+	AVBufferRef *buf = NULL;
+	chiaki_mutex_lock(&decoder->packet_pool_mutex);
+	for(size_t i=0; i<CHIAKI_FFMPEG_DECODER_PACKET_BUFS_MAX && decoder->packet_bufs[i]; i++)
+	{
+		if(decoder->packet_bufs[i]->data != data)
+			continue;
+		buf = decoder->packet_bufs[i];
+		memmove(&decoder->packet_bufs[i], &decoder->packet_bufs[i + 1], (CHIAKI_FFMPEG_DECODER_PACKET_BUFS_MAX - i - 1) * sizeof(AVBufferRef *));
+		decoder->packet_bufs[CHIAKI_FFMPEG_DECODER_PACKET_BUFS_MAX - 1] = NULL;
+		break;
+	}
+	chiaki_mutex_unlock(&decoder->packet_pool_mutex);
+	return buf;
+}
+
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_get_stats(ChiakiFfmpegDecoder *decoder, ChiakiFfmpegDecoderStats *stats)
+{
 	chiaki_mutex_lock(&decoder->mutex);
-	decoder->frames_lost += frames_lost;
-	decoder->frame_recovered = frame_recovered;
-	AVPacket *packet = av_packet_alloc();
-	packet->data = buf;
-	packet->size = buf_size;
+	*stats = decoder->stats;
+	chiaki_mutex_unlock(&decoder->mutex);
+	chiaki_mutex_lock(&decoder->packet_pool_mutex);
+	stats->packet_bufs_allocated = decoder->stats.packet_bufs_allocated;
+	chiaki_mutex_unlock(&decoder->packet_pool_mutex);
+}
+
+/**
+ * Move the frame received into drain_frame to the end of the queue, dropping the oldest one if it is full.
+ */
+static void decoder_queue_push(ChiakiFfmpegDecoder *decoder)
+{
+	ChiakiPresentFrameInfo info = { 0 };
+	int64_t pts = decoder->drain_frame->pts;
+	if(pts != AV_NOPTS_VALUE && pts >= 0 && pts < decoder->sample_pts && decoder->sample_pts - pts <= CHIAKI_FFMPEG_DECODER_SAMPLE_INFOS)
+		info = decoder->sample_infos[pts % CHIAKI_FFMPEG_DECODER_SAMPLE_INFOS];
+	info.decoded_us = chiaki_time_now_monotonic_us();
+
+	AVFrame *frame;
+	if(decoder->queue_count == decoder->profile.queue_depth)
+	{
+		frame = decoder->queue[0];
+		memmove(&decoder->queue[0], &decoder->queue[1], (decoder->queue_count - 1) * sizeof(AVFrame *));
+		memmove(&decoder->queue_info[0], &decoder->queue_info[1], (decoder->queue_count - 1) * sizeof(ChiakiPresentFrameInfo));
+		decoder->queue_count--;
+		av_frame_unref(frame);
+		decoder->stats.frames_dropped++;
+	}
+	else
+	{
+		frame = av_frame_alloc();
+		if(!frame)
+		{
+			CHIAKI_LOGE(decoder->log, "Failed to alloc AVFrame");
+			av_frame_unref(decoder->drain_frame);
+			return;
+		}
+	}
+	av_frame_move_ref(frame, decoder->drain_frame);
+	decoder->queue_info[decoder->queue_count] = info;
+	decoder->queue[decoder->queue_count++] = frame;
+}
+
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_video_sample_info_cb(const ChiakiVideoSampleInfo *info, void *user)
+{
+	ChiakiFfmpegDecoder *decoder = user;
+	chiaki_mutex_lock(&decoder->mutex);
+	decoder->sample_info = *info;
+	decoder->sample_info_valid = true;
+	chiaki_mutex_unlock(&decoder->mutex);
+}
+
+/**
+ * Keep a sample without any slices until the codec is opened.
+ *
+ * @param packet_buf taken over if not NULL, otherwise buf is copied
+ */
+static bool decoder_hold_header(ChiakiFfmpegDecoder *decoder, AVBufferRef *packet_buf, uint8_t *buf, size_t buf_size)
+{
+	AVPacket *packet = decoder->header_packet;
+	av_packet_unref(packet);
+	if(packet_buf)
+	{
+		packet->buf = packet_buf;
+		packet->data = buf;
+		packet->size = buf_size;
+		return true;
+	}
+	if(av_new_packet(packet, buf_size) < 0)
+	{
+		CHIAKI_LOGE(decoder->log, "Failed to alloc header packet");
+		return false;
+	}
+	memcpy(packet->data, buf, buf_size);
+	decoder->stats.samples_copied++;
+	return true;
+}
+
+/**
+ * Send packet to the codec, receiving frames into the queue to make room if necessary. packet is unreferenced afterwards.
+ */
+static bool decoder_send_packet(ChiakiFfmpegDecoder *decoder, AVPacket *packet)
+{
+	decoder->stats.samples++;
 	int r;
 send_packet:
 	r = avcodec_send_packet(decoder->codec_context, packet);
@@ -131,19 +482,13 @@ send_packet:
 		if(r == AVERROR(EAGAIN))
 		{
 			CHIAKI_LOGE(decoder->log, "AVCodec internal buffer is full removing frames before pushing");
-			AVFrame *frame = av_frame_alloc();
-			if(!frame)
-			{
-				CHIAKI_LOGE(decoder->log, "Failed to alloc AVFrame");
-				goto hell;
-			}
-			r = avcodec_receive_frame(decoder->codec_context, frame);
-			av_frame_free(&frame);
+			r = avcodec_receive_frame(decoder->codec_context, decoder->drain_frame);
 			if(r != 0)
 			{
 				CHIAKI_LOGE(decoder->log, "Failed to pull frame");
 				goto hell;
 			}
+			decoder_queue_push(decoder);
 			goto send_packet;
 		}
 		else
@@ -154,49 +499,103 @@ send_packet:
 			goto hell;
 		}
 	}
-	av_packet_free(&packet);
-	chiaki_mutex_unlock(&decoder->mutex);
-
-	decoder->frame_available_cb(decoder, decoder->frame_available_cb_user);
+	av_packet_unref(packet);
 	return true;
 hell:
-	av_packet_free(&packet);
-	chiaki_mutex_unlock(&decoder->mutex);
+	av_packet_unref(packet);
 	return false;
 }
 
-CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *decoder, int32_t *frames_lost)
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user)
 {
+	ChiakiFfmpegDecoder *decoder = user;
+	AVBufferRef *packet_buf = packet_buf_take(decoder, buf);
+
 	chiaki_mutex_lock(&decoder->mutex);
-	// always try to pull as much as possible and return only the very last frame
-	AVFrame *frame_last = NULL;
-	AVFrame *frame = NULL;
-	while(true)
+	decoder->frames_lost += frames_lost;
+	decoder->frame_recovered = frame_recovered;
+	if(!decoder->codec_opened)
 	{
-		AVFrame *next_frame;
-		if(frame_last)
-		{
-			av_frame_unref(frame_last);
-			next_frame = frame_last;
-		}
-		else
+		int slices = sample_slices_count(decoder->codec, buf, buf_size);
+		if(!slices)
 		{
-			next_frame = av_frame_alloc();
-			if(!next_frame)
-				break;
+			// e.g. the profile header with only the parameter sets, which is always sent first,
+			// so wait for the first picture to know the slice count
+			bool held = decoder_hold_header(decoder, packet_buf, buf, buf_size);
+			decoder->sample_info_valid = false;
+			chiaki_mutex_unlock(&decoder->mutex);
+			return held;
 		}
-		frame_last = frame;
-		frame = next_frame;
-		int r = avcodec_receive_frame(decoder->codec_context, frame);
+		if(!decoder_open(decoder, slices))
+			goto error_packet_buf;
+		if(decoder->header_packet->size && !decoder_send_packet(decoder, decoder->header_packet))
+			goto error_packet_buf;
+	}
+
+	AVPacket *packet = decoder->packet;
+	// without a refcounted buffer, the codec copies the data
+	packet->buf = packet_buf;
+	packet->data = buf;
+	packet->size = buf_size;
+	packet->pts = decoder->sample_pts;
+	ChiakiPresentFrameInfo *info = &decoder->sample_infos[decoder->sample_pts % CHIAKI_FFMPEG_DECODER_SAMPLE_INFOS];
+	memset(info, 0, sizeof(*info));
+	if(decoder->sample_info_valid)
+	{
+		info->frame_index = decoder->sample_info.frame_index;
+		info->receive_us = decoder->sample_info.receive_us;
+		decoder->sample_info_valid = false;
+	}
+	decoder->sample_pts++;
+	if(!packet_buf)
+		decoder->stats.samples_copied++;
+	bool sent = decoder_send_packet(decoder, packet);
+	chiaki_mutex_unlock(&decoder->mutex);
+
+	if(sent)
+		decoder->frame_available_cb(decoder, decoder->frame_available_cb_user);
+	return sent;
+error_packet_buf:
+	av_buffer_unref(&packet_buf);
+	chiaki_mutex_unlock(&decoder->mutex);
+	return false;
+}
+
+CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *decoder, int32_t *frames_lost)
+{
+	return chiaki_ffmpeg_decoder_pull_frame_info(decoder, frames_lost, NULL);
+}
+
+CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame_info(ChiakiFfmpegDecoder *decoder, int32_t *frames_lost, ChiakiPresentFrameInfo *info)
+{
+	chiaki_mutex_lock(&decoder->mutex);
+	// always try to pull as much as possible, the queue only keeps the newest frames
+	while(decoder->codec_opened)
+	{
+		int r = avcodec_receive_frame(decoder->codec_context, decoder->drain_frame);
 		if(r)
 		{
 			if(r != AVERROR(EAGAIN))
 				CHIAKI_LOGE(decoder->log, "Decoding with FFMPEG failed");
-			av_frame_free(&frame);
-			frame = frame_last;
 			break;
 		}
+		decoder_queue_push(decoder);
+	}
+	AVFrame *frame = NULL;
+	if(decoder->queue_count)
+	{
+		frame = decoder->queue[0];
+		if(info)
+		{
+			*info = decoder->queue_info[0];
+			info->handoff_us = chiaki_time_now_monotonic_us();
+		}
+		decoder->queue_count--;
+		memmove(&decoder->queue[0], &decoder->queue[1], decoder->queue_count * sizeof(AVFrame *));
+		memmove(&decoder->queue_info[0], &decoder->queue_info[1], decoder->queue_count * sizeof(ChiakiPresentFrameInfo));
 	}
+	else if(info)
+		memset(info, 0, sizeof(*info));
 	*frames_lost = decoder->frames_lost;
 	if(frame && decoder->frame_recovered)
 	{
@@ -1,8 +1,12 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_VIDEO
+
 #include <chiaki/frameprocessor.h>
 #include <chiaki/fec.h>
 #include <chiaki/video.h>
+#include <chiaki/thread.h>
+#include <chiaki/time.h>
 
 #include <jerasure.h>
 
@@ -13,6 +17,8 @@
 #include <arpa/inet.h>
 #endif
 
+#define NAL_SEARCH_MAX 64 // the first NAL unit of a frame is expected right at the beginning
+
 CHIAKI_EXPORT void chiaki_stream_stats_reset(ChiakiStreamStats *stats)
 {
 	stats->frames = 0;
@@ -39,8 +45,28 @@ CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uin
 struct chiaki_frame_unit_t
 {
 	size_t data_size;
+	bool erased; // missing when fec was attempted, data_size may have been restored since
 };
 
+#define FEC_WORKER_QUEUE_SIZE 2
+
+struct chiaki_frame_processor_fec_worker_t
+{
+	ChiakiFrameProcessor frames[FEC_WORKER_QUEUE_SIZE]; // own the buffers of the frames that have been handed over
+	size_t users; // frame processors using the worker
+	ChiakiThread thread;
+	ChiakiMutex mutex; // protects everything below
+	ChiakiCond cond;
+	uint64_t queue_read; // frames from queue_read to queue_write have been handed over and not been emitted yet
+	uint64_t queue_write;
+	ChiakiStreamStats stream_stats; // of emitted frames, not collected by a frame processor yet
+	bool stop;
+	ChiakiFrameProcessorFrameCallback cb;
+	void *cb_user;
+};
+
+static void fec_worker_stop(ChiakiFrameProcessor *frame_processor);
+
 CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiLog *log)
 {
 	frame_processor->log = log;
@@ -55,13 +81,21 @@ CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_proce
 	frame_processor->unit_slots = NULL;
 	frame_processor->unit_slots_size = 0;
 	frame_processor->flushed = true;
+	frame_processor->frame_index = 0;
 	chiaki_stream_stats_reset(&frame_processor->stream_stats);
+	chiaki_fec_cache_init(&frame_processor->fec_cache);
+	memset(&frame_processor->times, 0, sizeof(frame_processor->times));
+	frame_processor->fec_worker = NULL;
+	frame_processor->alloc_cb = NULL;
+	frame_processor->alloc_cb_user = NULL;
 }
 
 CHIAKI_EXPORT void chiaki_frame_processor_fini(ChiakiFrameProcessor *frame_processor)
 {
+	fec_worker_stop(frame_processor);
 	free(frame_processor->frame_buf);
 	free(frame_processor->unit_slots);
+	chiaki_fec_cache_fini(&frame_processor->fec_cache);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet)
@@ -73,6 +107,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 	}
 
 	frame_processor->flushed = false;
+	frame_processor->frame_index = packet->frame_index;
+	memset(&frame_processor->times, 0, sizeof(frame_processor->times));
+	frame_processor->times.first_unit_us = chiaki_time_now_monotonic_us();
 	frame_processor->units_source_expected = packet->units_in_frame_total - packet->units_in_frame_fec;
 	frame_processor->units_fec_expected = packet->units_in_frame_fec;
 	if(frame_processor->units_fec_expected < 1)
@@ -142,7 +179,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 		}
 		frame_processor->frame_buf_size = frame_buf_size_required;
 	}
-	memset(frame_processor->frame_buf, 0, frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	// frame_buf is not cleared, put_unit() zeroes what fec reads beyond each unit's data
+	// and the fec decoder overwrites erased units completely
 
 	return CHIAKI_ERR_SUCCESS;
 }
@@ -177,9 +215,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
 	unit->data_size = packet->data_size;
 	if(!frame_processor->flushed)
 	{
-		memcpy(frame_processor->frame_buf + packet->unit_index * frame_processor->buf_stride_per_unit,
-				packet->data,
-				packet->data_size);
+		uint8_t *buf_ptr = frame_processor->frame_buf + packet->unit_index * frame_processor->buf_stride_per_unit;
+		memcpy(buf_ptr, packet->data, packet->data_size);
+		memset(buf_ptr + packet->data_size, 0, frame_processor->buf_size_per_unit - packet->data_size);
 	}
 
 	if(packet->unit_index < frame_processor->units_source_expected)
@@ -187,6 +225,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
 	else
 		frame_processor->units_fec_received++;
 
+	if(!frame_processor->times.decodable_us && chiaki_frame_processor_flush_possible(frame_processor))
+		frame_processor->times.decodable_us = chiaki_time_now_monotonic_us();
+
 	return CHIAKI_ERR_SUCCESS;
 }
 
@@ -195,6 +236,24 @@ CHIAKI_EXPORT void chiaki_frame_processor_report_packet_stats(ChiakiFrameProcess
 	uint64_t received = frame_processor->units_source_received + frame_processor->units_fec_received;
 	uint64_t expected = frame_processor->units_source_expected + frame_processor->units_fec_expected;
 	chiaki_packet_stats_push_generation(packet_stats, received, expected - received);
+	if(received == expected)
+		return;
+
+	uint64_t burst = 0;
+	for(size_t i=0; i<expected; i++)
+	{
+		ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
+		if(!unit->data_size || unit->erased)
+		{
+			burst++;
+			continue;
+		}
+		if(burst)
+			chiaki_packet_stats_push_hist(packet_stats, CHIAKI_PACKET_STATS_HIST_LOSS_BURST, burst);
+		burst = 0;
+	}
+	if(burst)
+		chiaki_packet_stats_push_hist(packet_stats, CHIAKI_PACKET_STATS_HIST_LOSS_BURST, burst);
 }
 
 static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_processor)
@@ -224,11 +283,12 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 				return CHIAKI_ERR_UNKNOWN;
 			}
 			erasures[erasure_index++] = (unsigned int)i;
+			slot->erased = true;
 		}
 	}
 	assert(erasure_index == erasures_count);
 
-	ChiakiErrorCode err = chiaki_fec_decode(frame_processor->frame_buf,
+	ChiakiErrorCode err = chiaki_fec_cache_decode(&frame_processor->fec_cache, frame_processor->frame_buf,
 			frame_processor->buf_size_per_unit, frame_processor->buf_stride_per_unit,
 			frame_processor->units_source_expected, frame_processor->units_fec_expected,
 			erasures, erasures_count);
@@ -264,7 +324,7 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 	return err;
 }
 
-CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size)
+static ChiakiFrameProcessorFlushResult frame_processor_flush_fec(ChiakiFrameProcessor *frame_processor)
 {
 	if(frame_processor->units_source_expected == 0 || frame_processor->flushed)
 		return CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED;
@@ -273,40 +333,317 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 	//		frame_processor->units_source_expected,
 	//		frame_processor->units_fec_expected);
 
-	ChiakiFrameProcessorFlushResult result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS;
-	if(frame_processor->units_source_received < frame_processor->units_source_expected)
+	if(frame_processor->units_source_received >= frame_processor->units_source_expected)
+		return CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS;
+
+	ChiakiErrorCode err = chiaki_frame_processor_fec(frame_processor);
+	if(err == CHIAKI_ERR_SUCCESS)
+		return CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS;
+	return CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
+}
+
+/**
+ * @return whether source unit i has a payload to be emitted
+ */
+static bool frame_processor_unit_valid(ChiakiFrameProcessor *frame_processor, size_t i, bool log)
+{
+	ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
+	if(!unit->data_size)
 	{
-		ChiakiErrorCode err = chiaki_frame_processor_fec(frame_processor);
-		if(err == CHIAKI_ERR_SUCCESS)
-			result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS;
-		else
-			result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
+		if(log)
+			CHIAKI_LOGW(frame_processor->log, "Missing unit %#llx", (unsigned long long)i);
+		return false;
 	}
-
-	size_t cur = 0;
-	for(size_t i=0; i<frame_processor->units_source_expected; i++)
+	if(unit->data_size < 2)
 	{
-		ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
-		if(!unit->data_size)
+		if(log)
 		{
-			CHIAKI_LOGW(frame_processor->log, "Missing unit %#llx", (unsigned long long)i);
-			continue;
+			CHIAKI_LOGE(frame_processor->log, "Saved unit has size < 2");
+			chiaki_log_hexdump(frame_processor->log, CHIAKI_LOG_VERBOSE, frame_processor->frame_buf + i*frame_processor->buf_stride_per_unit, 0x50);
 		}
-		if(unit->data_size < 2)
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Find the first NAL unit at the beginning of the first unit of a frame.
+ */
+static void frame_processor_locate_nal(ChiakiFrameProcessor *frame_processor, const uint8_t *unit, size_t unit_size)
+{
+	size_t end = unit_size < NAL_SEARCH_MAX ? unit_size : NAL_SEARCH_MAX;
+	for(size_t i=0; i+3<=end; i++)
+	{
+		if(unit[i] == 0 && unit[i+1] == 0 && unit[i+2] == 1)
 		{
-			CHIAKI_LOGE(frame_processor->log, "Saved unit has size < 2");
-			chiaki_log_hexdump(frame_processor->log, CHIAKI_LOG_VERBOSE, frame_processor->frame_buf + i*frame_processor->buf_size_per_unit, 0x50);
-			continue;
+			frame_processor->nal.offset = i + 3;
+			frame_processor->nal.size = unit_size - (i + 3);
+			return;
 		}
-		size_t part_size = unit->data_size - 2;
+	}
+}
+
+/**
+ * Concatenate the payloads of all source units into dst, which may be frame_buf itself.
+ */
+static size_t frame_processor_assemble(ChiakiFrameProcessor *frame_processor, uint8_t *dst)
+{
+	size_t cur = 0;
+	memset(&frame_processor->nal, 0, sizeof(frame_processor->nal));
+	for(size_t i=0; i<frame_processor->units_source_expected; i++)
+	{
+		if(!frame_processor_unit_valid(frame_processor, i, true))
+			continue;
+		size_t part_size = frame_processor->unit_slots[i].data_size - 2;
 		uint8_t *buf_ptr = frame_processor->frame_buf + i*frame_processor->buf_stride_per_unit;
-		memmove(frame_processor->frame_buf + cur, buf_ptr + 2, part_size);
+		if(dst == frame_processor->frame_buf)
+			memmove(dst + cur, buf_ptr + 2, part_size);
+		else
+			memcpy(dst + cur, buf_ptr + 2, part_size);
+		if(i == 0)
+			frame_processor_locate_nal(frame_processor, dst, part_size);
 		cur += part_size;
 	}
+	memset(dst + cur, 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
 
 	chiaki_stream_stats_frame(&frame_processor->stream_stats, (uint64_t)cur);
+	frame_processor->times.emitted_us = chiaki_time_now_monotonic_us();
+	return cur;
+}
 
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size)
+{
+	ChiakiFrameProcessorFlushResult result = frame_processor_flush_fec(frame_processor);
+	if(result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED)
+		return result;
+	*frame_size = frame_processor_assemble(frame_processor, frame_processor->frame_buf);
 	*frame = frame_processor->frame_buf;
-	*frame_size = cur;
 	return result;
 }
+
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush_alloc(ChiakiFrameProcessor *frame_processor,
+		ChiakiFrameProcessorAllocCallback alloc_cb, void *alloc_cb_user, uint8_t **frame, size_t *frame_size)
+{
+	ChiakiFrameProcessorFlushResult result = frame_processor_flush_fec(frame_processor);
+	if(result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED)
+		return result;
+
+	size_t size = 0;
+	for(size_t i=0; i<frame_processor->units_source_expected; i++)
+	{
+		if(frame_processor_unit_valid(frame_processor, i, false))
+			size += frame_processor->unit_slots[i].data_size - 2;
+	}
+
+	uint8_t *buf = alloc_cb(size, alloc_cb_user);
+	if(!buf)
+	{
+		CHIAKI_LOGE(frame_processor->log, "Failed to allocate buffer for frame of %#llx bytes", (unsigned long long)size);
+		return CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED;
+	}
+	*frame_size = frame_processor_assemble(frame_processor, buf);
+	*frame = buf;
+	return result;
+}
+
+static void *fec_worker_thread_func(void *user)
+{
+	struct chiaki_frame_processor_fec_worker_t *worker = user;
+	chiaki_mutex_lock(&worker->mutex);
+	while(true)
+	{
+		// frames that have been handed over are still emitted when stopping
+		while(worker->queue_read == worker->queue_write && !worker->stop)
+			chiaki_cond_wait(&worker->cond, &worker->mutex);
+		if(worker->queue_read == worker->queue_write)
+			break;
+		ChiakiFrameProcessor *frame_processor = &worker->frames[worker->queue_read % FEC_WORKER_QUEUE_SIZE];
+		chiaki_mutex_unlock(&worker->mutex);
+
+		uint8_t *frame;
+		size_t frame_size;
+		ChiakiFrameProcessorFlushResult result = frame_processor->alloc_cb
+			? chiaki_frame_processor_flush_alloc(frame_processor, frame_processor->alloc_cb, frame_processor->alloc_cb_user, &frame, &frame_size)
+			: chiaki_frame_processor_flush(frame_processor, &frame, &frame_size);
+		worker->cb(result, frame_processor->frame_index, frame, frame_size, &frame_processor->times, &frame_processor->nal, worker->cb_user);
+
+		chiaki_mutex_lock(&worker->mutex);
+		worker->stream_stats.frames += frame_processor->stream_stats.frames;
+		worker->stream_stats.bytes += frame_processor->stream_stats.bytes;
+		chiaki_stream_stats_reset(&frame_processor->stream_stats);
+		worker->queue_read++;
+		// wakes up both a thread handing over a frame and one waiting for the queue to drain
+		chiaki_cond_broadcast(&worker->cond);
+	}
+	chiaki_mutex_unlock(&worker->mutex);
+	return NULL;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_fec_worker_start(ChiakiFrameProcessor *frame_processor, ChiakiFrameProcessorFrameCallback cb, void *cb_user)
+{
+	if(frame_processor->fec_worker)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	struct chiaki_frame_processor_fec_worker_t *worker = calloc(1, sizeof(struct chiaki_frame_processor_fec_worker_t));
+	if(!worker)
+		return CHIAKI_ERR_MEMORY;
+	for(size_t i=0; i<FEC_WORKER_QUEUE_SIZE; i++)
+	{
+		chiaki_frame_processor_init(&worker->frames[i], frame_processor->log);
+		worker->frames[i].fec_cache.engine = frame_processor->fec_cache.engine;
+	}
+	worker->users = 1;
+	worker->queue_read = 0;
+	worker->queue_write = 0;
+	chiaki_stream_stats_reset(&worker->stream_stats);
+	worker->stop = false;
+	worker->cb = cb;
+	worker->cb_user = cb_user;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&worker->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_worker;
+	err = chiaki_cond_init(&worker->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+	err = chiaki_thread_create(&worker->thread, fec_worker_thread_func, worker);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+	chiaki_thread_set_name(&worker->thread, "Chiaki FEC");
+
+	frame_processor->fec_worker = worker;
+	return CHIAKI_ERR_SUCCESS;
+
+error_cond:
+	chiaki_cond_fini(&worker->cond);
+error_mutex:
+	chiaki_mutex_fini(&worker->mutex);
+error_worker:
+	for(size_t i=0; i<FEC_WORKER_QUEUE_SIZE; i++)
+		chiaki_frame_processor_fini(&worker->frames[i]);
+	free(worker);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_frame_processor_fec_worker_share(ChiakiFrameProcessor *frame_processor, ChiakiFrameProcessor *owner)
+{
+	if(frame_processor->fec_worker || !owner->fec_worker)
+		return;
+	frame_processor->fec_worker = owner->fec_worker;
+	frame_processor->fec_worker->users++;
+}
+
+static void fec_worker_stop(ChiakiFrameProcessor *frame_processor)
+{
+	struct chiaki_frame_processor_fec_worker_t *worker = frame_processor->fec_worker;
+	if(!worker)
+		return;
+	frame_processor->fec_worker = NULL;
+	if(--worker->users)
+		return;
+	chiaki_mutex_lock(&worker->mutex);
+	worker->stop = true;
+	chiaki_cond_signal(&worker->cond);
+	chiaki_mutex_unlock(&worker->mutex);
+	chiaki_thread_join(&worker->thread, NULL);
+	chiaki_cond_fini(&worker->cond);
+	chiaki_mutex_fini(&worker->mutex);
+	for(size_t i=0; i<FEC_WORKER_QUEUE_SIZE; i++)
+		chiaki_frame_processor_fini(&worker->frames[i]);
+	free(worker);
+}
+
+/**
+ * Frames flushed by the worker still count for the stats of the frame processor that handed them over.
+ * Must be called with the worker's mutex held.
+ */
+static void fec_worker_collect_stats(struct chiaki_frame_processor_fec_worker_t *worker, ChiakiFrameProcessor *frame_processor)
+{
+	frame_processor->stream_stats.frames += worker->stream_stats.frames;
+	frame_processor->stream_stats.bytes += worker->stream_stats.bytes;
+	chiaki_stream_stats_reset(&worker->stream_stats);
+}
+
+CHIAKI_EXPORT void chiaki_frame_processor_fec_wait(ChiakiFrameProcessor *frame_processor)
+{
+	struct chiaki_frame_processor_fec_worker_t *worker = frame_processor->fec_worker;
+	if(!worker)
+		return;
+	chiaki_mutex_lock(&worker->mutex);
+	while(worker->queue_read != worker->queue_write)
+		chiaki_cond_wait(&worker->cond, &worker->mutex);
+	fec_worker_collect_stats(worker, frame_processor);
+	chiaki_mutex_unlock(&worker->mutex);
+}
+
+CHIAKI_EXPORT bool chiaki_frame_processor_fec_pending(ChiakiFrameProcessor *frame_processor)
+{
+	struct chiaki_frame_processor_fec_worker_t *worker = frame_processor->fec_worker;
+	if(!worker)
+		return false;
+	chiaki_mutex_lock(&worker->mutex);
+	bool pending = worker->queue_read != worker->queue_write;
+	fec_worker_collect_stats(worker, frame_processor);
+	chiaki_mutex_unlock(&worker->mutex);
+	return pending;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_flush_async(ChiakiFrameProcessor *frame_processor)
+{
+	struct chiaki_frame_processor_fec_worker_t *worker = frame_processor->fec_worker;
+	if(!worker)
+		return CHIAKI_ERR_UNINITIALIZED;
+	if(frame_processor->units_source_expected == 0 || frame_processor->flushed)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	// only wait if the worker is still busy with all the frames it can hold
+	chiaki_mutex_lock(&worker->mutex);
+	while(worker->queue_write - worker->queue_read >= FEC_WORKER_QUEUE_SIZE)
+		chiaki_cond_wait(&worker->cond, &worker->mutex);
+	fec_worker_collect_stats(worker, frame_processor);
+	chiaki_mutex_unlock(&worker->mutex);
+
+	// queue_write is only changed by the thread handing frames over, and the worker leaves this entry alone until it is
+	ChiakiFrameProcessor *frame = &worker->frames[worker->queue_write % FEC_WORKER_QUEUE_SIZE];
+
+	// unit slots are copied because late units of this frame are still counted,
+	// the frame buffers are swapped and the worker's old one will be reused for the next frame
+	if(frame->unit_slots_size != frame_processor->unit_slots_size)
+	{
+		free(frame->unit_slots);
+		frame->unit_slots = malloc(frame_processor->unit_slots_size * sizeof(ChiakiFrameUnit));
+		if(!frame->unit_slots)
+		{
+			frame->unit_slots_size = 0;
+			return CHIAKI_ERR_MEMORY;
+		}
+		frame->unit_slots_size = frame_processor->unit_slots_size;
+	}
+	memcpy(frame->unit_slots, frame_processor->unit_slots, frame_processor->unit_slots_size * sizeof(ChiakiFrameUnit));
+
+	uint8_t *frame_buf = frame->frame_buf;
+	size_t frame_buf_size = frame->frame_buf_size;
+	frame->frame_buf = frame_processor->frame_buf;
+	frame->frame_buf_size = frame_processor->frame_buf_size;
+	frame_processor->frame_buf = frame_buf;
+	frame_processor->frame_buf_size = frame_buf_size;
+
+	frame->buf_size_per_unit = frame_processor->buf_size_per_unit;
+	frame->buf_stride_per_unit = frame_processor->buf_stride_per_unit;
+	frame->units_source_expected = frame_processor->units_source_expected;
+	frame->units_fec_expected = frame_processor->units_fec_expected;
+	frame->units_source_received = frame_processor->units_source_received;
+	frame->units_fec_received = frame_processor->units_fec_received;
+	frame->frame_index = frame_processor->frame_index;
+	frame->times = frame_processor->times;
+	frame->alloc_cb = frame_processor->alloc_cb;
+	frame->alloc_cb_user = frame_processor->alloc_cb_user;
+	frame->flushed = false;
+	frame_processor->flushed = true;
+
+	chiaki_mutex_lock(&worker->mutex);
+	worker->queue_write++;
+	chiaki_cond_signal(&worker->cond);
+	chiaki_mutex_unlock(&worker->mutex);
+	return CHIAKI_ERR_SUCCESS;
+}
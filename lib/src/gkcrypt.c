@@ -1,5 +1,7 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_CRYPT
+
 #include <chiaki/gkcrypt.h>
 #include <chiaki/session.h>
 
@@ -22,6 +24,8 @@
 #define KEY_BUF_CHUNK_SIZE 0x1000
 
 static ChiakiErrorCode gkcrypt_gen_key_iv(ChiakiGKCrypt *gkcrypt, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
+static ChiakiErrorCode gkcrypt_contexts_init(ChiakiGKCrypt *gkcrypt);
+static void gkcrypt_contexts_fini(ChiakiGKCrypt *gkcrypt);
 
 static void *gkcrypt_thread_func(void *user);
 
@@ -31,11 +35,16 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 	gkcrypt->index = index;
 
 	gkcrypt->key_buf_size = key_buf_chunks * KEY_BUF_CHUNK_SIZE;
-	gkcrypt->key_buf_populated = 0;
-	gkcrypt->key_buf_key_pos_min = 0;
-	gkcrypt->key_buf_start_offset = 0;
+	gkcrypt->key_buf_head = 0;
+	gkcrypt->key_buf_tail = 0;
+	gkcrypt->key_buf_reader_pos = UINT64_MAX;
+	gkcrypt->key_buf_lookahead = 0;
 	gkcrypt->last_key_pos = 0;
+	gkcrypt->key_buf_thread_waiting = false;
 	gkcrypt->key_buf_thread_stop = false;
+	memset(&gkcrypt->key_buf_stats, 0, sizeof(gkcrypt->key_buf_stats));
+	if(key_buf_chunks)
+		chiaki_gkcrypt_set_key_buf_lookahead(gkcrypt, key_buf_chunks / 2);
 
 	ChiakiErrorCode err;
 	if(gkcrypt->key_buf_size)
@@ -70,17 +79,26 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 	gkcrypt->key_gmac_index_current = 0;
 	memcpy(gkcrypt->key_gmac_current, gkcrypt->key_gmac_base, sizeof(gkcrypt->key_gmac_current));
 
+	err = gkcrypt_contexts_init(gkcrypt);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(gkcrypt->log, "GKCrypt failed to initialize AES contexts");
+		goto error_key_buf_cond;
+	}
+
 	if(gkcrypt->key_buf)
 	{
 		err = chiaki_thread_create(&gkcrypt->key_buf_thread, gkcrypt_thread_func, gkcrypt);
 		if(err != CHIAKI_ERR_SUCCESS)
-			goto error_key_buf_cond;
+			goto error_contexts;
 
 		chiaki_thread_set_name(&gkcrypt->key_buf_thread, "Chiaki GKCrypt");
 	}
 
 	return CHIAKI_ERR_SUCCESS;
 
+error_contexts:
+	gkcrypt_contexts_fini(gkcrypt);
 error_key_buf_cond:
 	if(gkcrypt->key_buf)
 		chiaki_cond_fini(&gkcrypt->key_buf_cond);
@@ -102,10 +120,105 @@ CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt)
 		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
 		chiaki_cond_signal(&gkcrypt->key_buf_cond);
 		chiaki_thread_join(&gkcrypt->key_buf_thread, NULL);
+		ChiakiGKCryptKeyBufStats stats;
+		chiaki_gkcrypt_get_key_buf_stats(gkcrypt, &stats);
+		CHIAKI_LOGI(gkcrypt->log, "GKCrypt %d key buf had %llu hits, %llu misses and %llu skips",
+				(int)gkcrypt->index,
+				(unsigned long long)stats.hits,
+				(unsigned long long)stats.misses,
+				(unsigned long long)stats.skips);
 		chiaki_cond_fini(&gkcrypt->key_buf_cond);
 		chiaki_mutex_fini(&gkcrypt->key_buf_mutex);
 		chiaki_aligned_free(gkcrypt->key_buf);
 	}
+	gkcrypt_contexts_fini(gkcrypt);
+}
+
+#ifndef CHIAKI_LIB_ENABLE_MBEDTLS
+static EVP_CIPHER_CTX *gkcrypt_ecb_ctx_new(const uint8_t *key)
+{
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if(!ctx)
+		return NULL;
+
+	if(!EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, key, NULL)
+		|| !EVP_CIPHER_CTX_set_padding(ctx, 0))
+	{
+		EVP_CIPHER_CTX_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+static EVP_CIPHER_CTX *gkcrypt_gcm_ctx_new()
+{
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if(!ctx)
+		return NULL;
+
+	if(!EVP_CipherInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL, 1)
+		|| !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL))
+	{
+		EVP_CIPHER_CTX_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+#endif
+
+static ChiakiErrorCode gkcrypt_contexts_init(ChiakiGKCrypt *gkcrypt)
+{
+	gkcrypt->gmac_ctx_index = UINT64_MAX;
+	gkcrypt->gmac_tmp_ctx_index = UINT64_MAX;
+
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_aes_init(&gkcrypt->ecb_ctx);
+	mbedtls_aes_init(&gkcrypt->key_buf_ecb_ctx);
+	mbedtls_gcm_init(&gkcrypt->gmac_ctx);
+	mbedtls_gcm_init(&gkcrypt->gmac_tmp_ctx);
+
+	if(mbedtls_aes_setkey_enc(&gkcrypt->ecb_ctx, gkcrypt->key_base, 128) != 0
+		|| mbedtls_aes_setkey_enc(&gkcrypt->key_buf_ecb_ctx, gkcrypt->key_base, 128) != 0)
+	{
+		gkcrypt_contexts_fini(gkcrypt);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+#else
+	gkcrypt->ecb_ctx = gkcrypt_ecb_ctx_new(gkcrypt->key_base);
+	gkcrypt->key_buf_ecb_ctx = gkcrypt_ecb_ctx_new(gkcrypt->key_base);
+	gkcrypt->gmac_ctx = gkcrypt_gcm_ctx_new();
+	gkcrypt->gmac_tmp_ctx = gkcrypt_gcm_ctx_new();
+
+	if(!gkcrypt->ecb_ctx || !gkcrypt->key_buf_ecb_ctx || !gkcrypt->gmac_ctx || !gkcrypt->gmac_tmp_ctx)
+	{
+		gkcrypt_contexts_fini(gkcrypt);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+#endif
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void gkcrypt_contexts_fini(ChiakiGKCrypt *gkcrypt)
+{
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_aes_free(&gkcrypt->ecb_ctx);
+	mbedtls_aes_free(&gkcrypt->key_buf_ecb_ctx);
+	mbedtls_gcm_free(&gkcrypt->gmac_ctx);
+	mbedtls_gcm_free(&gkcrypt->gmac_tmp_ctx);
+#else
+	// EVP_CIPHER_CTX_free accepts NULL
+	EVP_CIPHER_CTX_free(gkcrypt->ecb_ctx);
+	EVP_CIPHER_CTX_free(gkcrypt->key_buf_ecb_ctx);
+	EVP_CIPHER_CTX_free(gkcrypt->gmac_ctx);
+	EVP_CIPHER_CTX_free(gkcrypt->gmac_tmp_ctx);
+	gkcrypt->ecb_ctx = NULL;
+	gkcrypt->key_buf_ecb_ctx = NULL;
+	gkcrypt->gmac_ctx = NULL;
+	gkcrypt->gmac_tmp_ctx = NULL;
+#endif
 }
 
 static ChiakiErrorCode gkcrypt_gen_key_iv(ChiakiGKCrypt *gkcrypt, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
@@ -214,288 +327,339 @@ CHIAKI_EXPORT void chiaki_gkcrypt_gen_tmp_gmac_key(ChiakiGKCrypt *gkcrypt, uint6
 		memcpy(key_out, gkcrypt->key_gmac_base, sizeof(gkcrypt->key_gmac_base));
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+/**
+ * @param key_buf_thread whether this is called from key_buf_thread, which uses its own context
+ */
+static ChiakiErrorCode gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, bool key_buf_thread, uint64_t key_pos, uint8_t *buf, size_t buf_size)
 {
 	assert(key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
 	assert(buf_size % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
 
-#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-	// build mbedtls aes context
-	mbedtls_aes_context ctx;
-	mbedtls_aes_init(&ctx);
-
-	if(mbedtls_aes_setkey_enc(&ctx, gkcrypt->key_base, 128) != 0)
-	{
-		mbedtls_aes_free(&ctx);
-		return CHIAKI_ERR_UNKNOWN;
-	}
-
-#else
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	if(!ctx)
-		return CHIAKI_ERR_UNKNOWN;
-
-	if(!EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, gkcrypt->key_base, NULL))
-	{
-		EVP_CIPHER_CTX_free(ctx);
-		return CHIAKI_ERR_UNKNOWN;
-	}
-
-	if(!EVP_CIPHER_CTX_set_padding(ctx, 0))
-	{
-		EVP_CIPHER_CTX_free(ctx);
-		return CHIAKI_ERR_UNKNOWN;
-	}
-#endif
 	uint64_t counter_offset = (key_pos / CHIAKI_GKCRYPT_BLOCK_SIZE);
 
 	for(uint8_t *cur = buf, *end = buf + buf_size; cur < end; cur += CHIAKI_GKCRYPT_BLOCK_SIZE)
 		counter_add(cur, gkcrypt->iv, counter_offset++);
 
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-	for(int i = 0; i < buf_size; i = i + 16)
+	mbedtls_aes_context *ctx = key_buf_thread ? &gkcrypt->key_buf_ecb_ctx : &gkcrypt->ecb_ctx;
+	for(size_t i = 0; i < buf_size; i += CHIAKI_GKCRYPT_BLOCK_SIZE)
 	{
 		// loop over all blocks of 16 bytes (128 bits)
-		if(mbedtls_aes_crypt_ecb(&ctx, MBEDTLS_AES_ENCRYPT, buf + i, buf + i) != 0)
-		{
-			mbedtls_aes_free(&ctx);
+		if(mbedtls_aes_crypt_ecb(ctx, MBEDTLS_AES_ENCRYPT, buf + i, buf + i) != 0)
 			return CHIAKI_ERR_UNKNOWN;
-		}
 	}
-
-	mbedtls_aes_free(&ctx);
 #else
+	EVP_CIPHER_CTX *ctx = key_buf_thread ? gkcrypt->key_buf_ecb_ctx : gkcrypt->ecb_ctx;
+	// without padding and with whole blocks, the context holds no state between updates
 	int outl;
-	EVP_EncryptUpdate(ctx, buf, &outl, buf, (int)buf_size);
-	if(outl != buf_size)
-	{
-		EVP_CIPHER_CTX_free(ctx);
+	if(!EVP_EncryptUpdate(ctx, buf, &outl, buf, (int)buf_size) || outl != buf_size)
 		return CHIAKI_ERR_UNKNOWN;
-	}
-
-	EVP_CIPHER_CTX_free(ctx);
 #endif
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static bool gkcrypt_key_buf_should_generate(ChiakiGKCrypt *gkcrypt)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
 {
-	return gkcrypt->last_key_pos > gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated / 2;
+	return gkcrypt_gen_key_stream(gkcrypt, false, key_pos, buf, buf_size);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+CHIAKI_EXPORT void chiaki_gkcrypt_set_key_buf_lookahead(ChiakiGKCrypt *gkcrypt, size_t chunks)
+{
+	size_t key_buf_chunks = gkcrypt->key_buf_size / KEY_BUF_CHUNK_SIZE;
+	if(chunks + 1 > key_buf_chunks)
+		chunks = key_buf_chunks - 1;
+	if(chunks < 1)
+		chunks = 1;
+	__atomic_store_n(&gkcrypt->key_buf_lookahead, (uint64_t)chunks * KEY_BUF_CHUNK_SIZE, __ATOMIC_RELAXED);
+}
+
+CHIAKI_EXPORT void chiaki_gkcrypt_get_key_buf_stats(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptKeyBufStats *stats)
+{
+	stats->hits = __atomic_load_n(&gkcrypt->key_buf_stats.hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&gkcrypt->key_buf_stats.misses, __ATOMIC_RELAXED);
+	stats->skips = __atomic_load_n(&gkcrypt->key_buf_stats.skips, __ATOMIC_RELAXED);
+}
+
+CHIAKI_EXPORT bool chiaki_gkcrypt_key_buf_contains(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, size_t size)
 {
 	if(!gkcrypt->key_buf)
-		return chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
+		return false;
+	uint64_t tail = __atomic_load_n(&gkcrypt->key_buf_tail, __ATOMIC_ACQUIRE);
+	uint64_t head = __atomic_load_n(&gkcrypt->key_buf_head, __ATOMIC_ACQUIRE);
+	return key_pos >= tail && key_pos + size <= head;
+}
 
-	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
+/**
+ * Whether key_buf_thread should wake up, i.e. when half of the look-ahead has been consumed.
+ */
+static bool gkcrypt_key_buf_should_generate(ChiakiGKCrypt *gkcrypt)
+{
+	uint64_t last_key_pos = __atomic_load_n(&gkcrypt->last_key_pos, __ATOMIC_SEQ_CST);
+	uint64_t lookahead = __atomic_load_n(&gkcrypt->key_buf_lookahead, __ATOMIC_RELAXED);
+	return __atomic_load_n(&gkcrypt->key_buf_head, __ATOMIC_ACQUIRE) < last_key_pos + lookahead / 2;
+}
 
-	if(key_pos + buf_size > gkcrypt->last_key_pos)
-		gkcrypt->last_key_pos = key_pos + buf_size;
-	bool signal = gkcrypt_key_buf_should_generate(gkcrypt);
+/**
+ * Copy (or xor if xor is true) the key stream for [key_pos, key_pos + buf_size) from key_buf into buf.
+ * Lock-free unless key_buf_thread is sleeping and has to be woken up.
+ *
+ * Before reading, the consumer announces key_pos in key_buf_reader_pos, then checks the range against
+ * key_buf_tail. key_buf_thread raises key_buf_tail before recycling a chunk and waits for any reader
+ * below the new tail to finish, so with sequentially consistent accesses on both sides,
+ * a chunk is never overwritten while it is being read.
+ *
+ * @return false if the requested range is not in key_buf
+ */
+static bool gkcrypt_key_buf_apply(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size, bool xor)
+{
+	uint64_t end = key_pos + buf_size;
+	if(end > __atomic_load_n(&gkcrypt->last_key_pos, __ATOMIC_RELAXED))
+		__atomic_store_n(&gkcrypt->last_key_pos, end, __ATOMIC_SEQ_CST);
+
+	__atomic_store_n(&gkcrypt->key_buf_reader_pos, key_pos, __ATOMIC_SEQ_CST);
+	uint64_t tail = __atomic_load_n(&gkcrypt->key_buf_tail, __ATOMIC_SEQ_CST);
+	uint64_t head = __atomic_load_n(&gkcrypt->key_buf_head, __ATOMIC_ACQUIRE);
+	bool found = key_pos >= tail && end <= head;
+	if(found)
+	{
+		size_t offset_in_buf = key_pos % gkcrypt->key_buf_size;
+		size_t end_in_buf = offset_in_buf + buf_size;
+		size_t excess = end_in_buf > gkcrypt->key_buf_size ? end_in_buf - gkcrypt->key_buf_size : 0;
+		if(xor)
+		{
+			xor_bytes(buf, gkcrypt->key_buf + offset_in_buf, buf_size - excess);
+			xor_bytes(buf + (buf_size - excess), gkcrypt->key_buf, excess);
+		}
+		else
+		{
+			memcpy(buf, gkcrypt->key_buf + offset_in_buf, buf_size - excess);
+			memcpy(buf + (buf_size - excess), gkcrypt->key_buf, excess);
+		}
+	}
+	__atomic_store_n(&gkcrypt->key_buf_reader_pos, UINT64_MAX, __ATOMIC_RELEASE);
 
-	ChiakiErrorCode err;
-	if(key_pos < gkcrypt->key_buf_key_pos_min
-		|| key_pos + buf_size >= gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated)
+	if(found)
+		__atomic_fetch_add(&gkcrypt->key_buf_stats.hits, 1, __ATOMIC_RELAXED);
+	else
 	{
+		__atomic_fetch_add(&gkcrypt->key_buf_stats.misses, 1, __ATOMIC_RELAXED);
 		CHIAKI_LOGW(gkcrypt->log, "Requested key stream for key pos %#llx on GKCrypt %d, but it's not in the buffer:"
-				" key buf size %#llx, start offset: %#llx, populated: %#llx, min key pos: %#llx, last key pos: %#llx",
+				" key buf size %#llx, tail: %#llx, head: %#llx, last key pos: %#llx",
 				(unsigned long long)key_pos,
 				gkcrypt->index,
 				(unsigned long long)gkcrypt->key_buf_size,
-				(unsigned long long)gkcrypt->key_buf_start_offset,
-				(unsigned long long)gkcrypt->key_buf_populated,
-				(unsigned long long)gkcrypt->key_buf_key_pos_min,
-				(unsigned long long)gkcrypt->last_key_pos);
-		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
-		err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
+				(unsigned long long)tail,
+				(unsigned long long)head,
+				(unsigned long long)__atomic_load_n(&gkcrypt->last_key_pos, __ATOMIC_RELAXED));
 	}
-	else
+
+	// key_buf_thread sets waiting before checking gkcrypt_key_buf_should_generate() under the mutex,
+	// so either it sees our last_key_pos or we see it waiting.
+	if(__atomic_load_n(&gkcrypt->key_buf_thread_waiting, __ATOMIC_SEQ_CST) && gkcrypt_key_buf_should_generate(gkcrypt))
 	{
-		size_t offset_in_buf = key_pos - gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_start_offset;
-		offset_in_buf %= gkcrypt->key_buf_size;
-		size_t end = offset_in_buf + buf_size;
-		if(end > gkcrypt->key_buf_size)
-		{
-			size_t excess = end - gkcrypt->key_buf_size;
-			memcpy(buf, gkcrypt->key_buf + offset_in_buf, buf_size - excess);
-			memcpy(buf + (buf_size - excess), gkcrypt->key_buf, excess);
-		}
-		else
-			memcpy(buf, gkcrypt->key_buf + offset_in_buf, buf_size);
-		err = CHIAKI_ERR_SUCCESS;
+		chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
+		chiaki_cond_signal(&gkcrypt->key_buf_cond);
 		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
 	}
 
-	if(signal)
-		chiaki_cond_signal(&gkcrypt->key_buf_cond);
+	return found;
+}
 
-	return err;
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	if(gkcrypt->key_buf && gkcrypt_key_buf_apply(gkcrypt, key_pos, buf, buf_size, false))
+		return CHIAKI_ERR_SUCCESS;
+	return chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
 }
 
+#define DECRYPT_KEY_STREAM_TMP_SIZE 0x200
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
 {
+	if(gkcrypt->key_buf && gkcrypt_key_buf_apply(gkcrypt, key_pos, buf, buf_size, true))
+		return CHIAKI_ERR_SUCCESS;
+
+	// generate the key stream in small pieces on the stack
+	uint8_t key_stream[DECRYPT_KEY_STREAM_TMP_SIZE];
 	uint64_t padding_pre = key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE;
-	size_t full_size = ((padding_pre + buf_size + CHIAKI_GKCRYPT_BLOCK_SIZE - 1) / CHIAKI_GKCRYPT_BLOCK_SIZE) * CHIAKI_GKCRYPT_BLOCK_SIZE;
+	key_pos -= padding_pre;
+	while(buf_size > 0)
+	{
+		size_t full_size = ((padding_pre + buf_size + CHIAKI_GKCRYPT_BLOCK_SIZE - 1) / CHIAKI_GKCRYPT_BLOCK_SIZE) * CHIAKI_GKCRYPT_BLOCK_SIZE;
+		if(full_size > sizeof(key_stream))
+			full_size = sizeof(key_stream);
 
-	uint8_t *key_stream = malloc(full_size);
-	if(!key_stream)
-		return CHIAKI_ERR_MEMORY;
+		ChiakiErrorCode err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, key_stream, full_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
 
-	ChiakiErrorCode err = chiaki_gkcrypt_get_key_stream(gkcrypt, key_pos - padding_pre, key_stream, full_size);
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		free(key_stream);
-		return err;
-	}
+		size_t size = full_size - padding_pre;
+		if(size > buf_size)
+			size = buf_size;
+		xor_bytes(buf, key_stream + padding_pre, size);
 
-	xor_bytes(buf, key_stream + padding_pre, buf_size);
-	free(key_stream);
+		buf += size;
+		buf_size -= size;
+		key_pos += full_size;
+		padding_pre = 0;
+	}
 
 	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
-{
-	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
-
-	uint8_t *gmac_key = gkcrypt->key_gmac_current;
-	uint8_t gmac_key_tmp[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	uint64_t key_index = (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
-
-	if(key_index > gkcrypt->key_gmac_index_current)
-	{
-		chiaki_gkcrypt_gen_new_gmac_key(gkcrypt, key_index);
-	}
-	else if(key_index < gkcrypt->key_gmac_index_current)
-	{
-		chiaki_gkcrypt_gen_tmp_gmac_key(gkcrypt, key_index, gmac_key_tmp);
-		gmac_key = gmac_key_tmp;
-	}
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+typedef mbedtls_gcm_context GKCryptGCMCtx;
+#define GMAC_CTX(name) (&gkcrypt->name)
+#else
+typedef EVP_CIPHER_CTX GKCryptGCMCtx;
+#define GMAC_CTX(name) (gkcrypt->name)
+#endif
 
+static ChiakiErrorCode gkcrypt_gmac_ctx_set_key(GKCryptGCMCtx *ctx, const uint8_t *key)
+{
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-	// build mbedtls gcm context AES_128_GCM
-	// Encryption
-	mbedtls_gcm_context actx;
-	mbedtls_gcm_init(&actx);
-	// set gmac_key 128 bits key
-	if(mbedtls_gcm_setkey(&actx, MBEDTLS_CIPHER_ID_AES, gmac_key, CHIAKI_GKCRYPT_BLOCK_SIZE * 8) != 0)
-	{
-		mbedtls_gcm_free(&actx);
+	if(mbedtls_gcm_setkey(ctx, MBEDTLS_CIPHER_ID_AES, key, CHIAKI_GKCRYPT_BLOCK_SIZE * 8) != 0)
 		return CHIAKI_ERR_UNKNOWN;
-	}
-
-	// encrypt without additional data
-	if(mbedtls_gcm_starts(&actx, MBEDTLS_GCM_ENCRYPT, iv, CHIAKI_GKCRYPT_BLOCK_SIZE) != 0)
-	{
-		mbedtls_gcm_free(&actx);
+#else
+	if(!EVP_CipherInit_ex(ctx, NULL, NULL, key, NULL, 1))
 		return CHIAKI_ERR_UNKNOWN;
-	}
+#endif
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode gkcrypt_gmac_ctx_tag(GKCryptGCMCtx *ctx, const uint8_t *iv, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
 	// set "additional data" only whitout input nor output
 	// to get the same result as:
 	// EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size)
-	if(mbedtls_gcm_crypt_and_tag(&actx, MBEDTLS_GCM_ENCRYPT,
+	if(mbedtls_gcm_crypt_and_tag(ctx, MBEDTLS_GCM_ENCRYPT,
 		   0, iv, CHIAKI_GKCRYPT_BLOCK_SIZE,
 		   buf, buf_size, NULL, NULL,
 		   CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out) != 0)
-	{
+		return CHIAKI_ERR_UNKNOWN;
+#else
+	// setting only the iv keeps the expanded key and GHASH key of the context
+	if(!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, 1))
+		return CHIAKI_ERR_UNKNOWN;
 
-		mbedtls_gcm_free(&actx);
+	int len;
+	if(!EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size))
 		return CHIAKI_ERR_UNKNOWN;
-	}
 
-	mbedtls_gcm_free(&actx);
+	if(!EVP_EncryptFinal_ex(ctx, NULL, &len))
+		return CHIAKI_ERR_UNKNOWN;
 
+	if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out))
+		return CHIAKI_ERR_UNKNOWN;
+#endif
 	return CHIAKI_ERR_SUCCESS;
-#else
-	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
-
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	if(!ctx)
-	{
-		ret = CHIAKI_ERR_MEMORY;
-		goto fail;
-	}
-
-	if(!EVP_CipherInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL, 1))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+}
 
-	if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
 
-	if(!EVP_CipherInit_ex(ctx, NULL, NULL, gmac_key, iv, 1))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+	uint64_t key_index = (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
 
-	int len;
-	if(!EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+	if(key_index > gkcrypt->key_gmac_index_current)
+		chiaki_gkcrypt_gen_new_gmac_key(gkcrypt, key_index);
 
-	if(!EVP_EncryptFinal_ex(ctx, NULL, &len))
+	ChiakiErrorCode err;
+	if(key_index < gkcrypt->key_gmac_index_current)
 	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
+		if(key_index != gkcrypt->gmac_tmp_ctx_index)
+		{
+			uint8_t gmac_key_tmp[CHIAKI_GKCRYPT_BLOCK_SIZE];
+			chiaki_gkcrypt_gen_tmp_gmac_key(gkcrypt, key_index, gmac_key_tmp);
+			err = gkcrypt_gmac_ctx_set_key(GMAC_CTX(gmac_tmp_ctx), gmac_key_tmp);
+			if(err != CHIAKI_ERR_SUCCESS)
+			{
+				gkcrypt->gmac_tmp_ctx_index = UINT64_MAX;
+				return err;
+			}
+			gkcrypt->gmac_tmp_ctx_index = key_index;
+		}
+		return gkcrypt_gmac_ctx_tag(GMAC_CTX(gmac_tmp_ctx), iv, buf, buf_size, gmac_out);
 	}
 
-	if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out))
+	if(gkcrypt->key_gmac_index_current != gkcrypt->gmac_ctx_index)
 	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
+		err = gkcrypt_gmac_ctx_set_key(GMAC_CTX(gmac_ctx), gkcrypt->key_gmac_current);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			gkcrypt->gmac_ctx_index = UINT64_MAX;
+			return err;
+		}
+		gkcrypt->gmac_ctx_index = gkcrypt->key_gmac_index_current;
 	}
-
-fail_cipher:
-	EVP_CIPHER_CTX_free(ctx);
-fail:
-	return ret;
-#endif
+	return gkcrypt_gmac_ctx_tag(GMAC_CTX(gmac_ctx), iv, buf, buf_size, gmac_out);
 }
 
 static bool key_buf_mutex_pred(void *user)
 {
 	ChiakiGKCrypt *gkcrypt = user;
+	__atomic_store_n(&gkcrypt->key_buf_thread_waiting, true, __ATOMIC_SEQ_CST);
 	if(gkcrypt->key_buf_thread_stop)
 		return true;
 
-	if(gkcrypt->key_buf_populated < gkcrypt->key_buf_size)
-		return true;
-
-	if(gkcrypt_key_buf_should_generate(gkcrypt))
-		return true;
-
-	return false;
+	return gkcrypt_key_buf_should_generate(gkcrypt);
 }
 
-static ChiakiErrorCode gkcrypt_generate_next_chunk(ChiakiGKCrypt *gkcrypt)
+/**
+ * Raise key_buf_tail to tail and wait until the consumer is not reading anything below it anymore.
+ */
+static void gkcrypt_key_buf_recycle(ChiakiGKCrypt *gkcrypt, uint64_t tail)
 {
-	assert(gkcrypt->key_buf_populated + KEY_BUF_CHUNK_SIZE <= gkcrypt->key_buf_size);
-	size_t buf_offset = (gkcrypt->key_buf_start_offset + gkcrypt->key_buf_populated) % gkcrypt->key_buf_size;
-	uint64_t key_pos = gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated;
-	uint8_t *buf_start = gkcrypt->key_buf + buf_offset;
-
-	chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+	__atomic_store_n(&gkcrypt->key_buf_tail, tail, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&gkcrypt->key_buf_reader_pos, __ATOMIC_SEQ_CST) < tail)
+		chiaki_thread_yield();
+}
 
-	ChiakiErrorCode err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf_start, KEY_BUF_CHUNK_SIZE);
-	if(err != CHIAKI_ERR_SUCCESS)
-		CHIAKI_LOGE(gkcrypt->log, "GKCrypt failed to generate key stream chunk");
+/**
+ * Generate chunks until the look-ahead beyond last_key_pos is filled. Called without holding key_buf_mutex.
+ */
+static ChiakiErrorCode gkcrypt_key_buf_fill(ChiakiGKCrypt *gkcrypt)
+{
+	uint64_t head = __atomic_load_n(&gkcrypt->key_buf_head, __ATOMIC_RELAXED); // only written by this thread
+	uint64_t tail = __atomic_load_n(&gkcrypt->key_buf_tail, __ATOMIC_RELAXED);
+	while(true)
+	{
+		uint64_t last_key_pos = __atomic_load_n(&gkcrypt->last_key_pos, __ATOMIC_SEQ_CST);
+		uint64_t lookahead = __atomic_load_n(&gkcrypt->key_buf_lookahead, __ATOMIC_RELAXED);
+		if(head >= last_key_pos + lookahead)
+			break;
 
-	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
+		if(last_key_pos > head)
+		{
+			// skip ahead if the last key pos is already beyond our buffer
+			uint64_t key_pos = (last_key_pos / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
+			CHIAKI_LOGW(gkcrypt->log, "Already requested a higher key pos than in the buffer, skipping ahead from head %#llx to %#llx",
+						(unsigned long long)head,
+						(unsigned long long)key_pos);
+			tail = head = key_pos;
+			gkcrypt_key_buf_recycle(gkcrypt, tail);
+			__atomic_store_n(&gkcrypt->key_buf_head, head, __ATOMIC_RELEASE);
+			__atomic_fetch_add(&gkcrypt->key_buf_stats.skips, 1, __ATOMIC_RELAXED);
+		}
 
-	if(err == CHIAKI_ERR_SUCCESS)
-		gkcrypt->key_buf_populated += KEY_BUF_CHUNK_SIZE;
+		if(head + KEY_BUF_CHUNK_SIZE - tail > gkcrypt->key_buf_size)
+		{
+			tail += KEY_BUF_CHUNK_SIZE;
+			gkcrypt_key_buf_recycle(gkcrypt, tail);
+		}
 
-	return err;
+		ChiakiErrorCode err = gkcrypt_gen_key_stream(gkcrypt, true, head, gkcrypt->key_buf + (head % gkcrypt->key_buf_size), KEY_BUF_CHUNK_SIZE);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(gkcrypt->log, "GKCrypt failed to generate key stream chunk");
+			return err;
+		}
+		head += KEY_BUF_CHUNK_SIZE;
+		__atomic_store_n(&gkcrypt->key_buf_head, head, __ATOMIC_RELEASE);
+	}
+	return CHIAKI_ERR_SUCCESS;
 }
 
 static void *gkcrypt_thread_func(void *user)
@@ -508,38 +672,14 @@ static void *gkcrypt_thread_func(void *user)
 	while(1)
 	{
 		err = chiaki_cond_wait_pred(&gkcrypt->key_buf_cond, &gkcrypt->key_buf_mutex, key_buf_mutex_pred, gkcrypt);
+		__atomic_store_n(&gkcrypt->key_buf_thread_waiting, false, __ATOMIC_RELAXED);
 
 		if(gkcrypt->key_buf_thread_stop || err != CHIAKI_ERR_SUCCESS)
 			break;
 
-		/*
-		CHIAKI_LOGV(gkcrypt->log, "GKCrypt %d key buf size %#llx, start offset: %#llx, populated: %#llx, min key pos: %#llx, last key pos: %#llx, generating next chunk",
-					(int)gkcrypt->index,
-					(unsigned long long)gkcrypt->key_buf_size,
-					(unsigned long long)gkcrypt->key_buf_start_offset,
-					(unsigned long long)gkcrypt->key_buf_populated,
-					(unsigned long long)gkcrypt->key_buf_key_pos_min,
-					(unsigned long long)gkcrypt->last_key_pos);
-		*/
-
-		if(gkcrypt->last_key_pos > gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated)
-		{
-			// skip ahead if the last key pos is already beyond our buffer
-			uint64_t key_pos = (gkcrypt->last_key_pos / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
-			CHIAKI_LOGW(gkcrypt->log, "Already requested a higher key pos than in the buffer, skipping ahead from min %#llx to %#llx",
-						(unsigned long long)gkcrypt->key_buf_key_pos_min,
-						(unsigned long long)key_pos);
-			gkcrypt->key_buf_key_pos_min = key_pos;
-			gkcrypt->key_buf_start_offset = 0;
-			gkcrypt->key_buf_populated = 0;
-		}
-		else if(gkcrypt->key_buf_populated == gkcrypt->key_buf_size)
-		{
-			gkcrypt->key_buf_start_offset = (gkcrypt->key_buf_start_offset + KEY_BUF_CHUNK_SIZE) % gkcrypt->key_buf_size;
-			gkcrypt->key_buf_key_pos_min += KEY_BUF_CHUNK_SIZE;
-			gkcrypt->key_buf_populated -= KEY_BUF_CHUNK_SIZE;
-		}
-		err = gkcrypt_generate_next_chunk(gkcrypt);
+		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+		err = gkcrypt_key_buf_fill(gkcrypt);
+		chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
 		if(err != CHIAKI_ERR_SUCCESS)
 			break;
 	}
@@ -25,9 +25,26 @@ CHIAKI_EXPORT char chiaki_log_level_char(ChiakiLogLevel level)
 	}
 }
 
+static const char *subsystem_names[CHIAKI_LOG_SUBSYSTEM_COUNT] = {
+	"general",
+	"takion",
+	"video",
+	"audio",
+	"crypt",
+	"holepunch"
+};
+
+CHIAKI_EXPORT const char *chiaki_log_subsystem_name(ChiakiLogSubsystem subsystem)
+{
+	if(subsystem < 0 || subsystem >= CHIAKI_LOG_SUBSYSTEM_COUNT)
+		return "unknown";
+	return subsystem_names[subsystem];
+}
+
 CHIAKI_EXPORT void chiaki_log_init(ChiakiLog *log, uint32_t level_mask, ChiakiLogCb cb, void *user)
 {
 	log->level_mask = level_mask;
+	memset(log->subsystem_level_mask, 0, sizeof(log->subsystem_level_mask));
 	log->cb = cb;
 	log->user = user;
 }
@@ -37,6 +54,43 @@ CHIAKI_EXPORT void chiaki_log_set_level(ChiakiLog *log, uint32_t level_mask)
 	log->level_mask = level_mask;
 }
 
+CHIAKI_EXPORT void chiaki_log_set_subsystem_level(ChiakiLog *log, ChiakiLogSubsystem subsystem, uint32_t level_mask)
+{
+	if(subsystem < 0 || subsystem >= CHIAKI_LOG_SUBSYSTEM_COUNT)
+		return;
+	log->subsystem_level_mask[subsystem] = level_mask;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_log_set_subsystems_verbose(ChiakiLog *log, const char *subsystems)
+{
+	ChiakiErrorCode r = CHIAKI_ERR_SUCCESS;
+	const char *cur = subsystems;
+	while(*cur)
+	{
+		size_t len = strcspn(cur, ",");
+		if(len)
+		{
+			ChiakiLogSubsystem subsystem = CHIAKI_LOG_SUBSYSTEM_COUNT;
+			for(int i=0; i<CHIAKI_LOG_SUBSYSTEM_COUNT; i++)
+			{
+				if(strlen(subsystem_names[i]) == len && !strncmp(subsystem_names[i], cur, len))
+				{
+					subsystem = i;
+					break;
+				}
+			}
+			if(subsystem != CHIAKI_LOG_SUBSYSTEM_COUNT)
+				log->subsystem_level_mask[subsystem] |= CHIAKI_LOG_VERBOSE | CHIAKI_LOG_DEBUG;
+			else
+				r = CHIAKI_ERR_INVALID_DATA;
+		}
+		cur += len;
+		if(*cur == ',')
+			cur++;
+	}
+	return r;
+}
+
 CHIAKI_EXPORT void chiaki_log_cb_print(ChiakiLogLevel level, const char *msg, void *user)
 {
 	(void)user;
@@ -66,18 +120,15 @@ CHIAKI_EXPORT void chiaki_log_cb_print(ChiakiLogLevel level, const char *msg, vo
 	printf("%s\n", msg);
 }
 
-CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *fmt, ...)
+static void log_va(ChiakiLog *log, ChiakiLogLevel level, const char *fmt, va_list args)
 {
-	if(log && !(log->level_mask & level))
-		return;
-
-	va_list args;
 	char buf[0x100];
 	char *msg = buf;
 
-	va_start(args, fmt);
-	int written = vsnprintf(buf, sizeof(buf), fmt, args);
-	va_end(args);
+	va_list args_copy;
+	va_copy(args_copy, args);
+	int written = vsnprintf(buf, sizeof(buf), fmt, args_copy);
+	va_end(args_copy);
 
 	if(written < 0)
 		return;
@@ -88,9 +139,7 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 		if(!msg)
 			return;
 
-		va_start(args, fmt);
 		written = vsnprintf(msg, written + 1, fmt, args);
-		va_end(args);
 
 		if(written < 0)
 		{
@@ -107,6 +156,25 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 		free(msg);
 }
 
+CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *fmt, ...)
+{
+	if(log && !(log->level_mask & level))
+		return;
+
+	va_list args;
+	va_start(args, fmt);
+	log_va(log, level, fmt, args);
+	va_end(args);
+}
+
+CHIAKI_EXPORT void chiaki_log_unmasked(ChiakiLog *log, ChiakiLogLevel level, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	log_va(log, level, fmt, args);
+	va_end(args);
+}
+
 #define HEXDUMP_WIDTH 0x10
 
 static const char hex_char[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
@@ -227,6 +295,13 @@ static void log_sniffer_cb(ChiakiLogLevel level, const char *msg, void *user)
 	ChiakiLogSniffer *sniffer = user;
 	if(level & sniffer->sniff_level_mask)
 		log_sniffer_push(sniffer, level, msg);
-	if(sniffer->forward_log)
-		chiaki_log(sniffer->forward_log, level, "%s", msg);
+	ChiakiLog *forward_log = sniffer->forward_log;
+	if(!forward_log)
+		return;
+	// the subsystem is not known here anymore, so forward what any of the subsystems of forward_log would log
+	uint32_t forward_mask = forward_log->level_mask;
+	for(int i=0; i<CHIAKI_LOG_SUBSYSTEM_COUNT; i++)
+		forward_mask |= forward_log->subsystem_level_mask[i];
+	if(level & forward_mask)
+		chiaki_log_unmasked(forward_log, level, "%s", msg);
 }
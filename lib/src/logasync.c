@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/logasync.h>
+
+#include <stdio.h>
+#include <string.h>
+
+// the writer also wakes up by itself this often, in case it missed a signal
+#define LOG_ASYNC_POLL_MS 20
+
+typedef struct chiaki_log_async_record_t
+{
+	uint64_t seq; // == pos when free for the producer at pos, pos + 1 when filled for the writer
+	ChiakiLogLevel level;
+	char *msg_heap; // if not NULL, the message did not fit into msg and is owned by the record
+	char msg[CHIAKI_LOG_ASYNC_MSG_SIZE];
+} ChiakiLogAsyncRecord;
+
+static void log_async_cb(ChiakiLogLevel level, const char *msg, void *user);
+static void *log_async_thread_func(void *user);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_log_async_init(ChiakiLogAsync *log_async, size_t size, uint32_t sync_level_mask, ChiakiLog *forward_log)
+{
+	if(!size)
+		size = CHIAKI_LOG_ASYNC_SIZE_DEFAULT;
+	size_t records_count = 1;
+	while(records_count < size)
+		records_count <<= 1;
+
+	log_async->forward_log = forward_log;
+	chiaki_log_init(&log_async->async_log, forward_log ? forward_log->level_mask : CHIAKI_LOG_ALL, log_async_cb, log_async);
+	if(forward_log)
+		memcpy(log_async->async_log.subsystem_level_mask, forward_log->subsystem_level_mask, sizeof(forward_log->subsystem_level_mask));
+	log_async->sync_level_mask = sync_level_mask;
+	log_async->records_count = records_count;
+	log_async->enqueue_pos = 0;
+	log_async->dequeue_pos = 0;
+	log_async->dropped = 0;
+	log_async->dropped_reported = 0;
+	log_async->truncated = 0;
+	log_async->writer_waiting = false;
+	log_async->stop = false;
+
+	log_async->records = malloc(records_count * sizeof(ChiakiLogAsyncRecord));
+	if(!log_async->records)
+		return CHIAKI_ERR_MEMORY;
+	for(size_t i=0; i<records_count; i++)
+		log_async->records[i].seq = i;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&log_async->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_records;
+
+	err = chiaki_cond_init(&log_async->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_thread_create(&log_async->thread, log_async_thread_func, log_async);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+	chiaki_thread_set_name(&log_async->thread, "Chiaki Log");
+
+	return CHIAKI_ERR_SUCCESS;
+error_cond:
+	chiaki_cond_fini(&log_async->cond);
+error_mutex:
+	chiaki_mutex_fini(&log_async->mutex);
+error_records:
+	free(log_async->records);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_log_async_fini(ChiakiLogAsync *log_async)
+{
+	chiaki_mutex_lock(&log_async->mutex);
+	log_async->stop = true;
+	chiaki_mutex_unlock(&log_async->mutex);
+	chiaki_cond_signal(&log_async->cond);
+	chiaki_thread_join(&log_async->thread, NULL);
+	chiaki_cond_fini(&log_async->cond);
+	chiaki_mutex_fini(&log_async->mutex);
+	free(log_async->records);
+}
+
+CHIAKI_EXPORT uint64_t chiaki_log_async_dropped(ChiakiLogAsync *log_async)
+{
+	return __atomic_load_n(&log_async->dropped, __ATOMIC_RELAXED);
+}
+
+CHIAKI_EXPORT uint64_t chiaki_log_async_truncated(ChiakiLogAsync *log_async)
+{
+	return __atomic_load_n(&log_async->truncated, __ATOMIC_RELAXED);
+}
+
+static void log_async_forward(ChiakiLogAsync *log_async, ChiakiLogLevel level, const char *msg)
+{
+	ChiakiLog *log = log_async->forward_log;
+	ChiakiLogCb cb = log && log->cb ? log->cb : chiaki_log_cb_print;
+	cb(level, msg, log ? log->user : NULL);
+}
+
+/**
+ * @return the record reserved for the caller to fill, NULL if the ring is full
+ */
+static ChiakiLogAsyncRecord *log_async_reserve(ChiakiLogAsync *log_async, uint64_t *pos)
+{
+	uint64_t p = __atomic_load_n(&log_async->enqueue_pos, __ATOMIC_RELAXED);
+	while(true)
+	{
+		ChiakiLogAsyncRecord *record = &log_async->records[p & (log_async->records_count - 1)];
+		uint64_t seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - p);
+		if(diff == 0)
+		{
+			if(__atomic_compare_exchange_n(&log_async->enqueue_pos, &p, p + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				*pos = p;
+				return record;
+			}
+		}
+		else if(diff < 0)
+			return NULL; // the writer has not consumed this record yet
+		else
+			p = __atomic_load_n(&log_async->enqueue_pos, __ATOMIC_RELAXED);
+	}
+}
+
+static void log_async_cb(ChiakiLogLevel level, const char *msg, void *user)
+{
+	ChiakiLogAsync *log_async = user;
+	uint64_t pos;
+	ChiakiLogAsyncRecord *record = log_async_reserve(log_async, &pos);
+	if(!record)
+	{
+		if(level & log_async->sync_level_mask)
+			log_async_forward(log_async, level, msg);
+		else
+			__atomic_fetch_add(&log_async->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	record->level = level;
+	record->msg_heap = NULL;
+	size_t len = strlen(msg);
+	if(len < sizeof(record->msg))
+		memcpy(record->msg, msg, len + 1);
+	else
+	{
+		// rare, e.g. hexdumps, so like chiaki_log, fall back to the heap
+		record->msg_heap = malloc(len + 1);
+		if(record->msg_heap)
+			memcpy(record->msg_heap, msg, len + 1);
+		else
+		{
+			static const char marker[] = "...";
+			len = sizeof(record->msg) - sizeof(marker);
+			memcpy(record->msg, msg, len);
+			memcpy(record->msg + len, marker, sizeof(marker));
+			__atomic_fetch_add(&log_async->truncated, 1, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_store_n(&record->seq, pos + 1, __ATOMIC_RELEASE);
+
+	if(__atomic_exchange_n(&log_async->writer_waiting, false, __ATOMIC_SEQ_CST))
+		chiaki_cond_signal(&log_async->cond);
+}
+
+static bool log_async_ready(ChiakiLogAsync *log_async)
+{
+	uint64_t pos = log_async->dequeue_pos;
+	ChiakiLogAsyncRecord *record = &log_async->records[pos & (log_async->records_count - 1)];
+	return __atomic_load_n(&record->seq, __ATOMIC_SEQ_CST) == pos + 1;
+}
+
+/**
+ * Forward all records that are ready, in order.
+ */
+static void log_async_drain(ChiakiLogAsync *log_async)
+{
+	char msg[CHIAKI_LOG_ASYNC_MSG_SIZE];
+	while(log_async_ready(log_async))
+	{
+		uint64_t pos = log_async->dequeue_pos;
+		ChiakiLogAsyncRecord *record = &log_async->records[pos & (log_async->records_count - 1)];
+		// free the record before the callback, which may be slow
+		ChiakiLogLevel level = record->level;
+		char *msg_heap = record->msg_heap;
+		if(!msg_heap)
+			memcpy(msg, record->msg, strlen(record->msg) + 1);
+		__atomic_store_n(&record->seq, pos + log_async->records_count, __ATOMIC_RELEASE);
+		log_async->dequeue_pos = pos + 1;
+		log_async_forward(log_async, level, msg_heap ? msg_heap : msg);
+		free(msg_heap);
+	}
+
+	uint64_t dropped = chiaki_log_async_dropped(log_async);
+	if(dropped != log_async->dropped_reported)
+	{
+		snprintf(msg, sizeof(msg), "Async log dropped %llu messages", (unsigned long long)(dropped - log_async->dropped_reported));
+		log_async_forward(log_async, CHIAKI_LOG_WARNING, msg);
+		log_async->dropped_reported = dropped;
+	}
+}
+
+static void *log_async_thread_func(void *user)
+{
+	ChiakiLogAsync *log_async = user;
+	chiaki_mutex_lock(&log_async->mutex);
+	while(true)
+	{
+		bool stop = log_async->stop;
+		chiaki_mutex_unlock(&log_async->mutex);
+		log_async_drain(log_async);
+		chiaki_mutex_lock(&log_async->mutex);
+		if(stop)
+			break;
+		if(log_async->stop)
+			continue;
+		__atomic_store_n(&log_async->writer_waiting, true, __ATOMIC_SEQ_CST);
+		if(log_async_ready(log_async)) // logged before it could see writer_waiting
+			continue;
+		chiaki_cond_timedwait(&log_async->cond, &log_async->mutex, LOG_ASYNC_POLL_MS);
+	}
+	chiaki_mutex_unlock(&log_async->mutex);
+	return NULL;
+}
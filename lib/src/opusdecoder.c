@@ -1,5 +1,7 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_AUDIO
+
 #include <chiaki/config.h>
 #if CHIAKI_LIB_ENABLE_OPUS
 
@@ -11,6 +13,7 @@
 
 static void chiaki_opus_decoder_header(ChiakiAudioHeader *header, void *user);
 static void chiaki_opus_decoder_frame(uint8_t *buf, size_t buf_size, void *user);
+static void chiaki_opus_decoder_conceal(uint8_t *next_buf, size_t next_buf_size, void *user);
 
 CHIAKI_EXPORT void chiaki_opus_decoder_init(ChiakiOpusDecoder *decoder, ChiakiLog *log)
 {
@@ -38,6 +41,7 @@ CHIAKI_EXPORT void chiaki_opus_decoder_get_sink(ChiakiOpusDecoder *decoder, Chia
 	sink->user = decoder;
 	sink->header_cb = chiaki_opus_decoder_header;
 	sink->frame_cb = chiaki_opus_decoder_frame;
+	sink->conceal_cb = chiaki_opus_decoder_conceal;
 }
 
 static void chiaki_opus_decoder_header(ChiakiAudioHeader *header, void *user)
@@ -96,4 +100,20 @@ static void chiaki_opus_decoder_frame(uint8_t *buf, size_t buf_size, void *user)
 		decoder->frame_cb(decoder->pcm_buf, (size_t)r, decoder->cb_user);
 }
 
+static void chiaki_opus_decoder_conceal(uint8_t *next_buf, size_t next_buf_size, void *user)
+{
+	ChiakiOpusDecoder *decoder = user;
+	if(!decoder->opus_decoder)
+		return;
+
+	// recover the lost frame from the fec data of the following one if possible, otherwise let opus extrapolate it
+	int r = next_buf
+		? opus_decode(decoder->opus_decoder, next_buf, (opus_int32)next_buf_size, decoder->pcm_buf, decoder->audio_header.frame_size, 1)
+		: opus_decode(decoder->opus_decoder, NULL, 0, decoder->pcm_buf, decoder->audio_header.frame_size, 0);
+	if(r < 1)
+		CHIAKI_LOGE(decoder->log, "Concealing lost audio frame with opus failed: %s", opus_strerror(r));
+	else if(decoder->frame_cb)
+		decoder->frame_cb(decoder->pcm_buf, (size_t)r, decoder->cb_user);
+}
+
 #endif
\ No newline at end of file
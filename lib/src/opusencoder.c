@@ -1,5 +1,7 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_AUDIO
+
 #include <chiaki/config.h>
 #if CHIAKI_LIB_ENABLE_OPUS
 
@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/packetpool.h>
+
+#include <stdlib.h>
+#include <assert.h>
+
+// heap fallback buffers store their handle in front of the data, padded to keep the data aligned
+#define HEAP_BUF_HEADER_SIZE ((sizeof(ChiakiPacketBuf) + CHIAKI_PACKET_POOL_ALIGNMENT - 1) & ~((size_t)CHIAKI_PACKET_POOL_ALIGNMENT - 1))
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_pool_init(ChiakiPacketPool *pool, size_t count)
+{
+	pool->bufs_count = count;
+	pool->free_list = NULL;
+	pool->free_count = 0;
+	pool->acquired = 0;
+	pool->heap_allocs = 0;
+
+	pool->mem = chiaki_aligned_alloc(CHIAKI_PACKET_POOL_ALIGNMENT, count * CHIAKI_PACKET_POOL_BUF_SIZE);
+	if(!pool->mem)
+		return CHIAKI_ERR_MEMORY;
+
+	pool->bufs = calloc(count, sizeof(ChiakiPacketBuf));
+	if(!pool->bufs)
+	{
+		chiaki_aligned_free(pool->mem);
+		return CHIAKI_ERR_MEMORY;
+	}
+
+	// build the free list so that the lowest addresses are handed out first
+	for(size_t i=count; i>0; i--)
+	{
+		ChiakiPacketBuf *buf = &pool->bufs[i-1];
+		buf->pool = pool;
+		buf->heap = false;
+		buf->data = pool->mem + (i-1) * CHIAKI_PACKET_POOL_BUF_SIZE;
+		buf->capacity = CHIAKI_PACKET_POOL_BUF_SIZE;
+		buf->next_free = pool->free_list;
+		pool->free_list = buf;
+		pool->free_count++;
+	}
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_packet_pool_fini(ChiakiPacketPool *pool)
+{
+	assert(pool->free_count == pool->bufs_count);
+	free(pool->bufs);
+	chiaki_aligned_free(pool->mem);
+}
+
+CHIAKI_EXPORT ChiakiPacketBuf *chiaki_packet_pool_acquire(ChiakiPacketPool *pool)
+{
+	ChiakiPacketBuf *buf = pool->free_list;
+	if(buf)
+	{
+		pool->free_list = buf->next_free;
+		pool->free_count--;
+	}
+	else
+	{
+		buf = chiaki_aligned_alloc(CHIAKI_PACKET_POOL_ALIGNMENT, HEAP_BUF_HEADER_SIZE + CHIAKI_PACKET_POOL_BUF_SIZE);
+		if(!buf)
+			return NULL;
+		buf->pool = pool;
+		buf->heap = true;
+		buf->data = (uint8_t *)buf + HEAP_BUF_HEADER_SIZE;
+		buf->capacity = CHIAKI_PACKET_POOL_BUF_SIZE;
+		pool->heap_allocs++;
+	}
+	buf->next_free = NULL;
+	buf->refs = 1;
+	buf->size = 0;
+	pool->acquired++;
+	return buf;
+}
+
+CHIAKI_EXPORT void chiaki_packet_buf_unref(ChiakiPacketBuf *buf)
+{
+	assert(buf->refs > 0);
+	if(--buf->refs > 0)
+		return;
+	if(buf->heap)
+	{
+		chiaki_aligned_free(buf);
+		return;
+	}
+	ChiakiPacketPool *pool = buf->pool;
+	buf->next_free = pool->free_list;
+	pool->free_list = buf;
+	pool->free_count++;
+}
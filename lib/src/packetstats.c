@@ -2,82 +2,154 @@
 
 #include <chiaki/packetstats.h>
 #include <chiaki/log.h>
-#include <assert.h>
+
+#include <string.h>
+
+#define GEN_LOST_SHIFT 32
+#define GEN_RECEIVED_MASK 0xffffffffull
+
+#define SEQ_MAX_MASK 0xffffull
+#define SEQ_VALID ((uint64_t)1 << 16)
+#define SEQ_RECEIVED_SHIFT 17
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_stats_init(ChiakiPacketStats *stats)
 {
-	ChiakiErrorCode err = chiaki_mutex_init(&stats->mutex, false);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-	err = chiaki_mutex_lock(&stats->mutex);
-	assert(err == CHIAKI_ERR_SUCCESS);
-	stats->gen_received = 0;
-	stats->gen_lost = 0;
-	stats->seq_min = 0;
-	stats->seq_max = 0;
-	stats->seq_received = 0;
-	err = chiaki_mutex_unlock(&stats->mutex);
-	return err;
+	memset(stats, 0, sizeof(*stats));
+	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_fini(ChiakiPacketStats *stats)
 {
-	chiaki_mutex_fini(&stats->mutex);
 }
 
-static void reset_stats(ChiakiPacketStats *stats)
+static void next_interval(ChiakiPacketStats *stats)
 {
-	stats->gen_received = 0;
-	stats->gen_lost = 0;
-	stats->seq_min = stats->seq_max;
-	stats->seq_received = 0;
+	// producers that still see the current interval keep writing to its slot, never to the one cleared here
+	uint32_t next = __atomic_load_n(&stats->interval, __ATOMIC_RELAXED) + 1;
+	ChiakiPacketStatsHistograms *slot = &stats->intervals[next % CHIAKI_PACKET_STATS_HIST_INTERVALS];
+	for(size_t h=0; h<CHIAKI_PACKET_STATS_HIST_COUNT; h++)
+		for(size_t b=0; b<CHIAKI_PACKET_STATS_HIST_BUCKETS; b++)
+			__atomic_store_n(&slot->hist[h].buckets[b], 0, __ATOMIC_RELAXED);
+	for(size_t r=0; r<CHIAKI_PACKET_STATS_FRAME_RESULT_COUNT; r++)
+		__atomic_store_n(&slot->frames[r], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->interval, next, __ATOMIC_RELEASE);
+}
+
+/**
+ * Take the seq counters, resetting the received count if reset is set
+ */
+static uint64_t take_seq(ChiakiPacketStats *stats, bool reset)
+{
+	uint64_t seq = __atomic_load_n(&stats->seq, __ATOMIC_ACQUIRE);
+	if(!reset)
+		return seq;
+	while(!__atomic_compare_exchange_n(&stats->seq, &seq, seq & (SEQ_MAX_MASK | SEQ_VALID),
+				true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return seq;
+}
+
+static void reset_stats(ChiakiPacketStats *stats, uint64_t seq)
+{
+	if(seq & SEQ_VALID)
+	{
+		stats->seq_min = (ChiakiSeqNum16)(seq & SEQ_MAX_MASK);
+		stats->seq_min_valid = true;
+	}
+	next_interval(stats);
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_reset(ChiakiPacketStats *stats)
 {
-	chiaki_mutex_lock(&stats->mutex);
-	reset_stats(stats);
-	chiaki_mutex_unlock(&stats->mutex);
+	__atomic_store_n(&stats->gen, 0, __ATOMIC_RELAXED);
+	reset_stats(stats, take_seq(stats, true));
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_push_generation(ChiakiPacketStats *stats, uint64_t received, uint64_t lost)
 {
-	chiaki_mutex_lock(&stats->mutex);
-	stats->gen_received += received;
-	stats->gen_lost += lost;
-	chiaki_mutex_unlock(&stats->mutex);
+	// both halves in one add, so a snapshot never sees only one of them
+	__atomic_fetch_add(&stats->gen, (received & GEN_RECEIVED_MASK) | (lost << GEN_LOST_SHIFT), __ATOMIC_RELAXED);
+	chiaki_packet_stats_push_hist(stats, CHIAKI_PACKET_STATS_HIST_FRAME_LOSS, lost);
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_push_seq(ChiakiPacketStats *stats, ChiakiSeqNum16 seq_num)
 {
-	stats->seq_received++;
-	if(chiaki_seq_num_16_gt(seq_num, stats->seq_max))
-		stats->seq_max = seq_num;
+	uint64_t seq = __atomic_load_n(&stats->seq, __ATOMIC_RELAXED);
+	uint64_t seq_new;
+	ChiakiSeqNum16 seq_max;
+	do
+	{
+		seq_max = (ChiakiSeqNum16)(seq & SEQ_MAX_MASK);
+		seq_new = seq + ((uint64_t)1 << SEQ_RECEIVED_SHIFT);
+		if(!(seq & SEQ_VALID) || chiaki_seq_num_16_gt(seq_num, seq_max))
+			seq_new = (seq_new & ~SEQ_MAX_MASK) | SEQ_VALID | seq_num;
+	} while(!__atomic_compare_exchange_n(&stats->seq, &seq, seq_new, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	if(seq & SEQ_VALID)
+	{
+		ChiakiSeqNum16 gap = seq_num - seq_max - 1;
+		if(chiaki_seq_num_16_gt(seq_num, seq_max) && gap)
+			chiaki_packet_stats_push_hist(stats, CHIAKI_PACKET_STATS_HIST_LOSS_BURST, gap);
+	}
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_get(ChiakiPacketStats *stats, bool reset, uint64_t *received, uint64_t *lost)
 {
-	chiaki_mutex_lock(&stats->mutex);
-
 	// gen
-	*received = stats->gen_received;
-	*lost = stats->gen_lost;
-
-	//CHIAKI_LOGD(NULL, "gen received: %llu, lost: %llu",
-	//		(unsigned long long)stats->gen_received,
-	//		(unsigned long long)stats->gen_lost);
+	uint64_t gen = reset
+		? __atomic_exchange_n(&stats->gen, 0, __ATOMIC_RELAXED)
+		: __atomic_load_n(&stats->gen, __ATOMIC_RELAXED);
+	*received = gen & GEN_RECEIVED_MASK;
+	*lost = gen >> GEN_LOST_SHIFT;
 
 	// seq
-	uint64_t seq_diff = stats->seq_max - stats->seq_min; // overflow on purpose if max < min
-	uint64_t seq_lost = stats->seq_received > seq_diff ? seq_diff : seq_diff - stats->seq_received;
-	*received += stats->seq_received;
-	*lost += seq_lost;
-
-	//CHIAKI_LOGD(NULL, "seq received: %llu, lost: %llu",
-	//		(unsigned long long)stats->seq_received,
-	//		(unsigned long long)seq_lost);
+	uint64_t seq = take_seq(stats, reset);
+	uint64_t seq_received = seq >> SEQ_RECEIVED_SHIFT;
+	*received += seq_received;
+	if(stats->seq_min_valid)
+	{
+		uint64_t seq_diff = (ChiakiSeqNum16)((seq & SEQ_MAX_MASK) - stats->seq_min);
+		*lost += seq_received < seq_diff ? seq_diff - seq_received : 0;
+	}
 
 	if(reset)
-		reset_stats(stats);
-	chiaki_mutex_unlock(&stats->mutex);
+		reset_stats(stats, seq);
+}
+
+static size_t hist_bucket(uint64_t value)
+{
+	size_t bucket = 0;
+	while(value && bucket < CHIAKI_PACKET_STATS_HIST_BUCKETS - 1)
+	{
+		value >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+CHIAKI_EXPORT void chiaki_packet_stats_push_hist(ChiakiPacketStats *stats, ChiakiPacketStatsHist hist, uint64_t value)
+{
+	uint32_t interval = __atomic_load_n(&stats->interval, __ATOMIC_ACQUIRE);
+	ChiakiPacketStatsHistograms *slot = &stats->intervals[interval % CHIAKI_PACKET_STATS_HIST_INTERVALS];
+	__atomic_fetch_add(&slot->hist[hist].buckets[hist_bucket(value)], 1, __ATOMIC_RELAXED);
+}
+
+CHIAKI_EXPORT void chiaki_packet_stats_push_frame(ChiakiPacketStats *stats, ChiakiPacketStatsFrameResult result)
+{
+	uint32_t interval = __atomic_load_n(&stats->interval, __ATOMIC_ACQUIRE);
+	ChiakiPacketStatsHistograms *slot = &stats->intervals[interval % CHIAKI_PACKET_STATS_HIST_INTERVALS];
+	__atomic_fetch_add(&slot->frames[result], 1, __ATOMIC_RELAXED);
+}
+
+CHIAKI_EXPORT void chiaki_packet_stats_get_histograms(ChiakiPacketStats *stats, ChiakiPacketStatsHistograms *histograms)
+{
+	memset(histograms, 0, sizeof(*histograms));
+	for(size_t i=0; i<CHIAKI_PACKET_STATS_HIST_INTERVALS; i++)
+	{
+		ChiakiPacketStatsHistograms *slot = &stats->intervals[i];
+		for(size_t h=0; h<CHIAKI_PACKET_STATS_HIST_COUNT; h++)
+			for(size_t b=0; b<CHIAKI_PACKET_STATS_HIST_BUCKETS; b++)
+				histograms->hist[h].buckets[b] += __atomic_load_n(&slot->hist[h].buckets[b], __ATOMIC_RELAXED);
+		for(size_t r=0; r<CHIAKI_PACKET_STATS_FRAME_RESULT_COUNT; r++)
+			histograms->frames[r] += __atomic_load_n(&slot->frames[r], __ATOMIC_RELAXED);
+	}
 }
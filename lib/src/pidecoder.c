@@ -1,4 +1,6 @@
 
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_VIDEO
+
 #include <chiaki/pidecoder.h>
 
 #include <bcm_host.h>
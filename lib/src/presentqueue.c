@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/presentqueue.h>
+#include <chiaki/time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PRESENT_QUEUE_SMOOTHING 16
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_present_queue_init(ChiakiPresentQueue *queue, ChiakiPresentPolicy policy, uint64_t refresh_interval_us, size_t size,
+		ChiakiPresentQueueFreeCallback free_cb, void *free_cb_user)
+{
+	memset(queue, 0, sizeof(*queue));
+	queue->policy = policy;
+	queue->refresh_interval_us = refresh_interval_us;
+	queue->size = size && size < CHIAKI_PRESENT_QUEUE_SIZE_MAX ? size : CHIAKI_PRESENT_QUEUE_SIZE_MAX;
+	queue->free_cb = free_cb;
+	queue->free_cb_user = free_cb_user;
+	return chiaki_mutex_init(&queue->mutex, false);
+}
+
+static void present_queue_free_frames(ChiakiPresentQueue *queue, void **frames, size_t frames_count)
+{
+	if(!queue->free_cb)
+		return;
+	for(size_t i=0; i<frames_count; i++)
+		queue->free_cb(frames[i], queue->free_cb_user);
+}
+
+CHIAKI_EXPORT void chiaki_present_queue_fini(ChiakiPresentQueue *queue)
+{
+	void *frames[CHIAKI_PRESENT_QUEUE_SIZE_MAX];
+	for(size_t i=0; i<queue->count; i++)
+		frames[i] = queue->entries[i].frame;
+	present_queue_free_frames(queue, frames, queue->count);
+	queue->count = 0;
+	chiaki_mutex_fini(&queue->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_present_queue_set_refresh_interval(ChiakiPresentQueue *queue, uint64_t refresh_interval_us)
+{
+	chiaki_mutex_lock(&queue->mutex);
+	queue->refresh_interval_us = refresh_interval_us;
+	chiaki_mutex_unlock(&queue->mutex);
+}
+
+/**
+ * How long paced frames are held back after decoding, enough to cover the jitter, but not more than the queue can hold.
+ */
+static uint64_t present_queue_target_delay(ChiakiPresentQueue *queue)
+{
+	if(queue->policy != CHIAKI_PRESENT_POLICY_PACED)
+		return 0;
+	uint64_t delay = 2 * (uint64_t)queue->jitter_us;
+	uint64_t delay_max = (queue->size - 1) * queue->refresh_interval_us;
+	return delay < delay_max ? delay : delay_max;
+}
+
+static void present_queue_update_jitter(ChiakiPresentQueue *queue, uint64_t decoded_us)
+{
+	if(queue->decoded_prev_us && decoded_us > queue->decoded_prev_us)
+	{
+		int64_t interval = (int64_t)(decoded_us - queue->decoded_prev_us);
+		if(!queue->interval_avg_us)
+			queue->interval_avg_us = interval;
+		else
+			queue->interval_avg_us += (interval - queue->interval_avg_us) / PRESENT_QUEUE_SMOOTHING;
+		int64_t deviation = llabs(interval - queue->interval_avg_us);
+		queue->jitter_us += (deviation - queue->jitter_us) / PRESENT_QUEUE_SMOOTHING;
+	}
+	queue->decoded_prev_us = decoded_us;
+}
+
+CHIAKI_EXPORT void chiaki_present_queue_push(ChiakiPresentQueue *queue, void *frame, const ChiakiPresentFrameInfo *info)
+{
+	void *dropped = NULL;
+	chiaki_mutex_lock(&queue->mutex);
+	if(queue->count == queue->size)
+	{
+		dropped = queue->entries[0].frame;
+		memmove(&queue->entries[0], &queue->entries[1], (queue->count - 1) * sizeof(ChiakiPresentQueueEntry));
+		queue->count--;
+		queue->stats.dropped++;
+	}
+	ChiakiPresentQueueEntry *entry = &queue->entries[queue->count++];
+	entry->frame = frame;
+	entry->info = *info;
+	if(!entry->info.decoded_us)
+		entry->info.decoded_us = chiaki_time_now_monotonic_us();
+	entry->info.handoff_us = 0;
+	present_queue_update_jitter(queue, entry->info.decoded_us);
+	queue->stats.pushed++;
+	chiaki_mutex_unlock(&queue->mutex);
+
+	if(dropped)
+		present_queue_free_frames(queue, &dropped, 1);
+}
+
+CHIAKI_EXPORT void *chiaki_present_queue_present(ChiakiPresentQueue *queue, uint64_t now_us, ChiakiPresentFrameInfo *info)
+{
+	void *dropped[CHIAKI_PRESENT_QUEUE_SIZE_MAX];
+	size_t dropped_count = 0;
+	void *frame = NULL;
+
+	chiaki_mutex_lock(&queue->mutex);
+	uint64_t target_delay = present_queue_target_delay(queue);
+
+	// frames are pushed in decoding order, so the due ones are always at the front
+	size_t due = 0;
+	while(due < queue->count && queue->entries[due].info.decoded_us + target_delay <= now_us)
+		due++;
+	if(!due)
+	{
+		if(queue->presented_any)
+			queue->stats.repeated++;
+		goto beach;
+	}
+
+	// keep as many due frames as the target delay covers, anything beyond only adds latency
+	size_t keep = 1;
+	if(queue->policy == CHIAKI_PRESENT_POLICY_PACED && queue->refresh_interval_us)
+		keep += target_delay / queue->refresh_interval_us;
+	if(due > keep)
+	{
+		dropped_count = due - keep;
+		for(size_t i=0; i<dropped_count; i++)
+			dropped[i] = queue->entries[i].frame;
+		queue->stats.dropped += dropped_count;
+	}
+
+	ChiakiPresentQueueEntry *entry = &queue->entries[dropped_count];
+	frame = entry->frame;
+	entry->info.handoff_us = now_us;
+	uint64_t decoded_to_handoff_us = now_us > entry->info.decoded_us ? now_us - entry->info.decoded_us : 0;
+	if(queue->refresh_interval_us && decoded_to_handoff_us > target_delay + queue->refresh_interval_us)
+		queue->stats.late++;
+	queue->stats.presented++;
+	queue->stats.decoded_to_handoff_us += decoded_to_handoff_us;
+	if(entry->info.receive_us && entry->info.decoded_us > entry->info.receive_us)
+		queue->stats.receive_to_decoded_us += entry->info.decoded_us - entry->info.receive_us;
+	if(info)
+		*info = entry->info;
+	queue->presented_any = true;
+
+	queue->count -= dropped_count + 1;
+	memmove(&queue->entries[0], &queue->entries[dropped_count + 1], queue->count * sizeof(ChiakiPresentQueueEntry));
+
+beach:
+	chiaki_mutex_unlock(&queue->mutex);
+	present_queue_free_frames(queue, dropped, dropped_count);
+	return frame;
+}
+
+CHIAKI_EXPORT void chiaki_present_queue_get_stats(ChiakiPresentQueue *queue, ChiakiPresentQueueStats *stats)
+{
+	chiaki_mutex_lock(&queue->mutex);
+	*stats = queue->stats;
+	stats->target_delay_us = present_queue_target_delay(queue);
+	chiaki_mutex_unlock(&queue->mutex);
+}
@@ -16,6 +16,8 @@
  
 // TODO: Make portable for Switch
 
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_HOLEPUNCH
+
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
@@ -1,3 +1,5 @@
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_HOLEPUNCH
+
 #include <chiaki/remote/rudp.h>
 #include <chiaki/random.h>
 #include <chiaki/thread.h>
@@ -586,6 +588,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_ack_packet(RudpInstance *rudp, uint16_
     return err;
 }
 
+CHIAKI_EXPORT void chiaki_rudp_get_rtt_stats(RudpInstance *rudp, ChiakiRttStats *stats)
+{
+	chiaki_rtt_estimator_get_stats(&rudp->send_buffer.rtt, stats);
+}
+
 CHIAKI_EXPORT void chiaki_rudp_print_message(RudpInstance *rudp, RudpMessage *message)
 {
     CHIAKI_LOGI(rudp->log, "-------------RUDP MESSAGE------------");
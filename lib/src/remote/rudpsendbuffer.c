@@ -2,6 +2,8 @@
 
 #ifndef CHIAKI_UNIT_TEST
 
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_HOLEPUNCH
+
 #include <chiaki/remote/rudpsendbuffer.h>
 #include <chiaki/time.h>
 
@@ -14,8 +16,9 @@
 #include <arpa/inet.h>
 #endif
 
-#define RUDP_DATA_RESEND_TIMEOUT_MS 400
-#define RUDP_DATA_RESEND_WAKEUP_TIMEOUT_MS (RUDP_DATA_RESEND_TIMEOUT_MS/2)
+#define RUDP_DATA_RESEND_TIMEOUT_MS 400 // initial, until there are rtt samples
+#define RUDP_DATA_RESEND_TIMEOUT_MIN_MS 100
+#define RUDP_DATA_RESEND_TIMEOUT_MAX_MS 2000
 #define RUDP_DATA_RESEND_TRIES_MAX 25
 #define RUDP_SEND_BUFFER_SIZE 16
 
@@ -25,6 +28,7 @@ struct chiaki_rudp_send_buffer_packet_t
 {
 	ChiakiSeqNum16 seq_num;
 	uint64_t tries;
+	uint64_t first_send_us; // chiaki_time_now_monotonic_us()
 	uint64_t last_send_ms; // chiaki_time_now_monotonic_ms()
 	uint8_t *buf;
 	size_t buf_size;
@@ -53,6 +57,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_init(ChiakiRudpSendBuffer
 	send_buffer->packets_size = size;
 	send_buffer->packets_count = 0;
 
+	chiaki_rtt_estimator_init(&send_buffer->rtt, RUDP_DATA_RESEND_TIMEOUT_MS, RUDP_DATA_RESEND_TIMEOUT_MIN_MS, RUDP_DATA_RESEND_TIMEOUT_MAX_MS);
+
 	send_buffer->should_stop = false;
 	chiaki_mutex_unlock(&send_buffer->mutex);
 	err = chiaki_cond_init(&send_buffer->cond);
@@ -158,7 +164,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_push(ChiakiRudpSendBuffer
 	ChiakiRudpSendBufferPacket *packet = &send_buffer->packets[send_buffer->packets_count++];
 	packet->seq_num = seq_num;
 	packet->tries = 0;
-	packet->last_send_ms = chiaki_time_now_monotonic_ms();
+	packet->first_send_us = chiaki_time_now_monotonic_us();
+	packet->last_send_ms = packet->first_send_us / 1000;
 	packet->buf = buf;
 	packet->buf_size = buf_size;
 
@@ -186,6 +193,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_ack(ChiakiRudpSendBuffer *
 	if(acked_seq_nums_count)
 		*acked_seq_nums_count = 0;
 
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	uint64_t rtt_us = 0;
+	ChiakiSeqNum16 rtt_seq_num = 0;
+
 	size_t i;
 	size_t shift = 0; // amount to shift back
 	size_t shift_start = SIZE_MAX;
@@ -196,6 +207,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_ack(ChiakiRudpSendBuffer *
 			if(acked_seq_nums && acked_seq_nums_count)
 				acked_seq_nums[(*acked_seq_nums_count)++] = send_buffer->packets[i].seq_num;
 
+			// sample the newest acked packet that was never re-sent
+			if(!send_buffer->packets[i].tries && (!rtt_us || chiaki_seq_num_16_gt(send_buffer->packets[i].seq_num, rtt_seq_num)))
+			{
+				rtt_us = now_us - send_buffer->packets[i].first_send_us;
+				if(!rtt_us)
+					rtt_us = 1;
+				rtt_seq_num = send_buffer->packets[i].seq_num;
+			}
+
 			free(send_buffer->packets[i].buf);
 			if(shift_start == SIZE_MAX)
 			{
@@ -233,6 +253,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_ack(ChiakiRudpSendBuffer *
 		send_buffer->packets_count -= shift;
 	}
 
+	if(rtt_us)
+		chiaki_rtt_estimator_sample(&send_buffer->rtt, rtt_us);
+
 	CHIAKI_LOGV(send_buffer->log, "Acked seq num %#lx from Rudp Send Buffer", (unsigned long)seq_num);
 
 	chiaki_mutex_unlock(&send_buffer->mutex);
@@ -264,7 +287,7 @@ static void *rudp_send_buffer_thread_func(void *user)
 	while(true)
 	{
 		if(send_buffer->packets_count) // if there are packets, wait with timeout
-			err = chiaki_cond_timedwait_pred(&send_buffer->cond, &send_buffer->mutex, RUDP_DATA_RESEND_WAKEUP_TIMEOUT_MS, rudp_send_buffer_check_pred_packets, send_buffer);
+			err = chiaki_cond_timedwait_pred(&send_buffer->cond, &send_buffer->mutex, chiaki_rtt_estimator_rto_ms(&send_buffer->rtt) / 2, rudp_send_buffer_check_pred_packets, send_buffer);
 		else // if not, wait without timeout, but also wakeup if packets become available
 			err = chiaki_cond_wait_pred(&send_buffer->cond, &send_buffer->mutex, rudp_send_buffer_check_pred_no_packets, send_buffer);
 
@@ -288,11 +311,13 @@ static void rudp_send_buffer_resend(ChiakiRudpSendBuffer *send_buffer)
 		return;
 
 	uint64_t now = chiaki_time_now_monotonic_ms();
+	uint64_t rto_ms = chiaki_rtt_estimator_rto_ms(&send_buffer->rtt);
+	bool resent = false;
 
 	for(size_t i=0; i<send_buffer->packets_count; i++)
 	{
 		ChiakiRudpSendBufferPacket *packet = &send_buffer->packets[i];
-		if(now - packet->last_send_ms > RUDP_DATA_RESEND_TIMEOUT_MS)
+		if(now - packet->last_send_ms > rto_ms)
 		{
 			if(packet->tries >= RUDP_DATA_RESEND_TRIES_MAX)
 			{
@@ -312,8 +337,12 @@ static void rudp_send_buffer_resend(ChiakiRudpSendBuffer *send_buffer)
 			packet->last_send_ms = now;
 			chiaki_rudp_send_raw(send_buffer->rudp, packet->buf, packet->buf_size);
 			packet->tries++;
+			resent = true;
 		}
 	}
+
+	if(resent)
+		chiaki_rtt_estimator_backoff(&send_buffer->rtt);
 }
 
 #endif
\ No newline at end of file
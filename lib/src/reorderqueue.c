@@ -9,25 +9,51 @@
 #define ge(a, b) ((a) == (b) || gt((a), (b)))
 #define le(a, b) ((a) == (b) || lt((a), (b)))
 #define add(a, b) (queue->seq_num_add((a), (b)))
-#define QUEUE_SIZE (1 << queue->size_exp)
-#define IDX_MASK ((1 << queue->size_exp) - 1)
-#define idx(seq_num) ((seq_num) & IDX_MASK)
+#define QUEUE_SIZE ((uint64_t)1 << queue->size_exp)
+#define IDX_MASK (((size_t)1 << queue->size_exp) - 1)
+#define idx(seq_num) ((size_t)(seq_num) & IDX_MASK)
+
+#define BITMAP_WORDS(size) (((size) + 63) / 64)
+
+static inline bool entry_is_set(ChiakiReorderQueue *queue, size_t i)
+{
+	return (queue->bitmap[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void entry_set(ChiakiReorderQueue *queue, size_t i)
+{
+	queue->bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static inline void entry_clear(ChiakiReorderQueue *queue, size_t i)
+{
+	queue->bitmap[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init(ChiakiReorderQueue *queue, size_t size_exp,
 		uint64_t seq_num_start, ChiakiReorderQueueSeqNumGt seq_num_gt, ChiakiReorderQueueSeqNumLt seq_num_lt, ChiakiReorderQueueSeqNumAdd seq_num_add)
 {
+	if(size_exp > CHIAKI_REORDER_QUEUE_SIZE_EXP_MAX)
+		return CHIAKI_ERR_INVALID_DATA;
 	queue->size_exp = size_exp;
 	queue->begin = seq_num_start;
 	queue->count = 0;
 	queue->seq_num_gt = seq_num_gt;
 	queue->seq_num_lt = seq_num_lt;
 	queue->seq_num_add = seq_num_add;
+	queue->seq_num_sub = NULL;
 	queue->drop_strategy = CHIAKI_REORDER_QUEUE_DROP_STRATEGY_END;
 	queue->drop_cb = NULL;
 	queue->drop_cb_user = NULL;
-	queue->queue = calloc(1 << size_exp, sizeof(ChiakiReorderQueueEntry));
+	queue->queue = calloc((size_t)1 << size_exp, sizeof(ChiakiReorderQueueEntry));
 	if(!queue->queue)
 		return CHIAKI_ERR_MEMORY;
+	queue->bitmap = calloc(BITMAP_WORDS((size_t)1 << size_exp), sizeof(uint64_t));
+	if(!queue->bitmap)
+	{
+		free(queue->queue);
+		return CHIAKI_ERR_MEMORY;
+	}
 	return CHIAKI_ERR_SUCCESS;
 }
 
@@ -35,11 +61,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init(ChiakiReorderQueue *queu
 static bool seq_num_##bits##_gt(uint64_t a, uint64_t b) { return chiaki_seq_num_##bits##_gt((ChiakiSeqNum##bits)a, (ChiakiSeqNum##bits)b); } \
 static bool seq_num_##bits##_lt(uint64_t a, uint64_t b) { return chiaki_seq_num_##bits##_lt((ChiakiSeqNum##bits)a, (ChiakiSeqNum##bits)b); } \
 static uint64_t seq_num_##bits##_add(uint64_t a, uint64_t b) { return (uint64_t)((ChiakiSeqNum##bits)a + (ChiakiSeqNum##bits)b); } \
+static uint64_t seq_num_##bits##_sub(uint64_t a, uint64_t b) { return (uint64_t)(ChiakiSeqNum##bits)((ChiakiSeqNum##bits)a - (ChiakiSeqNum##bits)b); } \
 \
 CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init_##bits(ChiakiReorderQueue *queue, size_t size_exp, ChiakiSeqNum##bits seq_num_start) \
 { \
-	return chiaki_reorder_queue_init(queue, size_exp, (uint64_t)seq_num_start, \
+	ChiakiErrorCode err = chiaki_reorder_queue_init(queue, size_exp, (uint64_t)seq_num_start, \
 			seq_num_##bits##_gt, seq_num_##bits##_lt, seq_num_##bits##_add); \
+	queue->seq_num_sub = seq_num_##bits##_sub; \
+	return err; \
 }
 
 REORDER_QUEUE_INIT(16)
@@ -52,12 +81,12 @@ CHIAKI_EXPORT void chiaki_reorder_queue_fini(ChiakiReorderQueue *queue)
 		for(uint64_t i=0; i<queue->count; i++)
 		{
 			uint64_t seq_num = add(queue->begin, i);
-			ChiakiReorderQueueEntry *entry = &queue->queue[idx(seq_num)];
-			if(entry->set)
-				queue->drop_cb(seq_num, entry->user, queue->drop_cb_user);
+			if(entry_is_set(queue, idx(seq_num)))
+				queue->drop_cb(seq_num, queue->queue[idx(seq_num)].user, queue->drop_cb_user);
 		}
 	}
 	free(queue->queue);
+	free(queue->bitmap);
 }
 
 CHIAKI_EXPORT void chiaki_reorder_queue_push(ChiakiReorderQueue *queue, uint64_t seq_num, void *user)
@@ -67,11 +96,10 @@ CHIAKI_EXPORT void chiaki_reorder_queue_push(ChiakiReorderQueue *queue, uint64_t
 
 	if(ge(seq_num, queue->begin) && lt(seq_num, end))
 	{
-		ChiakiReorderQueueEntry *entry = &queue->queue[idx(seq_num)];
-		if(entry->set) // received twice
+		if(entry_is_set(queue, idx(seq_num))) // received twice
 			goto drop_it;
-		entry->user = user;
-		entry->set = true;
+		queue->queue[idx(seq_num)].user = user;
+		entry_set(queue, idx(seq_num));
 		return;
 	}
 
@@ -92,9 +120,13 @@ CHIAKI_EXPORT void chiaki_reorder_queue_push(ChiakiReorderQueue *queue, uint64_t
 		// drop first until empty or enough space
 		while(queue->count > 0 && lt(total_end, new_end))
 		{
-			ChiakiReorderQueueEntry *entry = &queue->queue[idx(queue->begin)];
-			if(entry->set && queue->drop_cb)
-				queue->drop_cb(queue->begin, entry->user, queue->drop_cb_user);
+			size_t i = idx(queue->begin);
+			if(entry_is_set(queue, i))
+			{
+				if(queue->drop_cb)
+					queue->drop_cb(queue->begin, queue->queue[i].user, queue->drop_cb_user);
+				entry_clear(queue, i);
+			}
 			queue->begin = add(queue->begin, 1);
 			queue->count--;
 			free_elems = QUEUE_SIZE - queue->count;
@@ -106,19 +138,22 @@ CHIAKI_EXPORT void chiaki_reorder_queue_push(ChiakiReorderQueue *queue, uint64_t
 			queue->begin = seq_num;
 	}
 
-	// move end until new_end
-	end = add(queue->begin, queue->count);
-	while(lt(end, new_end))
+	// move end until new_end, entries beyond the old end are already clear in the bitmap
+	if(queue->seq_num_sub)
+		queue->count = queue->seq_num_sub(new_end, queue->begin);
+	else
 	{
-		queue->count++;
-		queue->queue[idx(end)].set = false;
 		end = add(queue->begin, queue->count);
-		assert(queue->count <= QUEUE_SIZE);
+		while(lt(end, new_end))
+		{
+			queue->count++;
+			end = add(queue->begin, queue->count);
+		}
 	}
+	assert(queue->count <= QUEUE_SIZE);
 
-	ChiakiReorderQueueEntry *entry = &queue->queue[idx(seq_num)];
-	entry->set = true;
-	entry->user = user;
+	queue->queue[idx(seq_num)].user = user;
+	entry_set(queue, idx(seq_num));
 
 	return;
 drop_it:
@@ -132,14 +167,15 @@ CHIAKI_EXPORT bool chiaki_reorder_queue_pull(ChiakiReorderQueue *queue, uint64_t
 	if(queue->count == 0)
 		return false;
 
-	ChiakiReorderQueueEntry *entry = &queue->queue[idx(queue->begin)];
-	if(!entry->set)
+	size_t i = idx(queue->begin);
+	if(!entry_is_set(queue, i))
 		return false;
 
 	if(seq_num)
 		*seq_num = queue->begin;
 	if(user)
-		*user = entry->user;
+		*user = queue->queue[i].user;
+	entry_clear(queue, i);
 	queue->begin = add(queue->begin, 1);
 	queue->count--;
 	return true;
@@ -151,12 +187,11 @@ CHIAKI_EXPORT bool chiaki_reorder_queue_peek(ChiakiReorderQueue *queue, uint64_t
 		return false;
 
 	uint64_t seq_num_val = add(queue->begin, index);
-	ChiakiReorderQueueEntry *entry = &queue->queue[idx(seq_num_val)];
-	if(!entry->set)
+	if(!entry_is_set(queue, idx(seq_num_val)))
 		return false;
 
 	*seq_num = seq_num_val;
-	*user = entry->user;
+	*user = queue->queue[idx(seq_num_val)].user;
 	return true;
 }
 
@@ -166,23 +201,22 @@ CHIAKI_EXPORT void chiaki_reorder_queue_drop(ChiakiReorderQueue *queue, uint64_t
 		return;
 
 	uint64_t seq_num = add(queue->begin, index);
-	ChiakiReorderQueueEntry *entry = &queue->queue[idx(seq_num)];
-	if(!entry->set)
+	if(!entry_is_set(queue, idx(seq_num)))
 		return;
 
 	if(queue->drop_cb)
-		queue->drop_cb(seq_num, entry->user, queue->drop_cb_user);
+		queue->drop_cb(seq_num, queue->queue[idx(seq_num)].user, queue->drop_cb_user);
+	entry_clear(queue, idx(seq_num));
 
 	// reduce count if necessary
 	if(index == queue->count - 1)
 	{
-		while(!entry->set)
+		while(!entry_is_set(queue, idx(seq_num)))
 		{
 			queue->count--;
 			if(queue->count == 0)
 				break;
 			seq_num = add(queue->begin, queue->count - 1);
-			entry = &queue->queue[idx(seq_num)];
 		}
 	}
 }
\ No newline at end of file
@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/rttestimator.h>
+
+// clock granularity G of RFC 6298
+#define RTT_ESTIMATOR_GRANULARITY_US 1000
+
+CHIAKI_EXPORT void chiaki_rtt_estimator_init(ChiakiRttEstimator *estimator, uint64_t rto_initial_ms, uint64_t rto_min_ms, uint64_t rto_max_ms)
+{
+	estimator->srtt_us = 0;
+	estimator->rttvar_us = 0;
+	estimator->rto_ms = rto_initial_ms;
+	estimator->rto_min_ms = rto_min_ms;
+	estimator->rto_max_ms = rto_max_ms;
+	estimator->samples = 0;
+}
+
+static uint64_t rtt_estimator_clamp(ChiakiRttEstimator *estimator, uint64_t rto_ms)
+{
+	if(rto_ms < estimator->rto_min_ms)
+		return estimator->rto_min_ms;
+	if(rto_ms > estimator->rto_max_ms)
+		return estimator->rto_max_ms;
+	return rto_ms;
+}
+
+CHIAKI_EXPORT void chiaki_rtt_estimator_sample(ChiakiRttEstimator *estimator, uint64_t rtt_us)
+{
+	uint64_t srtt_us = estimator->srtt_us;
+	uint64_t rttvar_us = estimator->rttvar_us;
+	if(!estimator->samples)
+	{
+		srtt_us = rtt_us;
+		rttvar_us = rtt_us / 2;
+	}
+	else
+	{
+		uint64_t err_us = rtt_us > srtt_us ? rtt_us - srtt_us : srtt_us - rtt_us;
+		rttvar_us = (3 * rttvar_us + err_us) / 4;
+		srtt_us = (7 * srtt_us + rtt_us) / 8;
+	}
+
+	uint64_t var_us = 4 * rttvar_us;
+	if(var_us < RTT_ESTIMATOR_GRANULARITY_US)
+		var_us = RTT_ESTIMATOR_GRANULARITY_US;
+	uint64_t rto_ms = rtt_estimator_clamp(estimator, (srtt_us + var_us + 999) / 1000);
+
+	__atomic_store_n(&estimator->srtt_us, srtt_us, __ATOMIC_RELAXED);
+	__atomic_store_n(&estimator->rttvar_us, rttvar_us, __ATOMIC_RELAXED);
+	__atomic_store_n(&estimator->rto_ms, rto_ms, __ATOMIC_RELAXED);
+	__atomic_store_n(&estimator->samples, estimator->samples + 1, __ATOMIC_RELEASE);
+}
+
+CHIAKI_EXPORT void chiaki_rtt_estimator_backoff(ChiakiRttEstimator *estimator)
+{
+	__atomic_store_n(&estimator->rto_ms, rtt_estimator_clamp(estimator, estimator->rto_ms * 2), __ATOMIC_RELAXED);
+}
+
+CHIAKI_EXPORT uint64_t chiaki_rtt_estimator_rto_ms(ChiakiRttEstimator *estimator)
+{
+	return __atomic_load_n(&estimator->rto_ms, __ATOMIC_RELAXED);
+}
+
+CHIAKI_EXPORT void chiaki_rtt_estimator_get_stats(ChiakiRttEstimator *estimator, ChiakiRttStats *stats)
+{
+	stats->samples = __atomic_load_n(&estimator->samples, __ATOMIC_ACQUIRE);
+	stats->srtt_us = __atomic_load_n(&estimator->srtt_us, __ATOMIC_RELAXED);
+	stats->rttvar_us = __atomic_load_n(&estimator->rttvar_us, __ATOMIC_RELAXED);
+	stats->rto_ms = __atomic_load_n(&estimator->rto_ms, __ATOMIC_RELAXED);
+}
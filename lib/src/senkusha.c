@@ -156,6 +156,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 	takion_info.disable_audio_video = false;
 	takion_info.enable_dualsense = session->connect_info.enable_dualsense;
 	takion_info.protocol_version = 7;
+	takion_info.recv_batch_size = 0;
+	takion_info.data_window = 0;
+	takion_info.data_ack_delay_ms = 0;
+	takion_info.event_loop = NULL;
 
 	takion_info.cb = senkusha_takion_cb;
 	takion_info.cb_user = senkusha;
@@ -263,6 +263,20 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	session->connect_info.video_profile_auto_downgrade = connect_info->video_profile_auto_downgrade;
 	session->connect_info.enable_keyboard = connect_info->enable_keyboard;
 	session->connect_info.enable_dualsense = connect_info->enable_dualsense;
+	session->connect_info.video_fec_async = connect_info->video_fec_async;
+	session->connect_info.audio_async = connect_info->audio_async;
+	session->connect_info.video_reorder_frames = connect_info->video_reorder_frames;
+	session->connect_info.video_reorder_deadline_us = connect_info->video_reorder_deadline_us;
+	session->connect_info.congestion_controller = connect_info->congestion_controller;
+	session->connect_info.data_window = connect_info->data_window;
+
+	if(connect_info->event_loop)
+	{
+		if(chiaki_event_loop_init(&session->event_loop, log) == CHIAKI_ERR_SUCCESS)
+			session->event_loop_enabled = true;
+		else
+			CHIAKI_LOGW(log, "Failed to initialize Event Loop, using separate threads instead");
+	}
 
 	return CHIAKI_ERR_SUCCESS;
 
@@ -295,6 +309,8 @@ CHIAKI_EXPORT void chiaki_session_fini(ChiakiSession *session)
 		chiaki_rudp_fini(session->rudp);
 	if(session->holepunch_session)
 		chiaki_holepunch_session_fini(session->holepunch_session);
+	if(session->event_loop_enabled)
+		chiaki_event_loop_fini(&session->event_loop);
 	chiaki_stop_pipe_fini(&session->stop_pipe);
 	chiaki_cond_fini(&session->state_cond);
 	chiaki_mutex_fini(&session->state_mutex);
@@ -303,9 +319,20 @@ CHIAKI_EXPORT void chiaki_session_fini(ChiakiSession *session)
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_start(ChiakiSession *session)
 {
-	ChiakiErrorCode err = chiaki_thread_create(&session->session_thread, session_thread_func, session);
+	ChiakiErrorCode err;
+	if(session->event_loop_enabled)
+	{
+		err = chiaki_event_loop_start(&session->event_loop);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	}
+	err = chiaki_thread_create(&session->session_thread, session_thread_func, session);
 	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		if(session->event_loop_enabled)
+			chiaki_event_loop_stop(&session->event_loop);
 		return err;
+	}
 	chiaki_thread_set_name(&session->session_thread, "Chiaki Session");
 	return err;
 }
@@ -443,7 +470,8 @@ static void *session_thread_func(void *arg)
 	if(session->holepunch_session)
 	{
 		chiaki_socket_t *rudp_sock = chiaki_get_holepunch_sock(session->holepunch_session, CHIAKI_HOLEPUNCH_PORT_TYPE_CTRL);
-		session->rudp = chiaki_rudp_init(rudp_sock, session->log);
+		// read from other threads by chiaki_session_get_rtt()
+		__atomic_store_n(&session->rudp, chiaki_rudp_init(rudp_sock, session->log), __ATOMIC_RELEASE);
 		if(!session->rudp)
 		{
 			CHIAKI_LOGE(session->log, "Initializing rudp failed");
@@ -1168,4 +1196,21 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_go_home(ChiakiSession *session)
 	ChiakiErrorCode err;
 	err = ctrl_message_go_home(&session->ctrl);
 	return err;
-}
\ No newline at end of file
+}
+
+CHIAKI_EXPORT void chiaki_session_get_rtt(ChiakiSession *session, ChiakiRttStats *stats)
+{
+	chiaki_rtt_estimator_get_stats(&session->stream_connection.takion.send_buffer.rtt, stats);
+	if(stats->samples)
+		return;
+
+	ChiakiRudp rudp = __atomic_load_n(&session->rudp, __ATOMIC_ACQUIRE);
+	if(rudp)
+	{
+		chiaki_rudp_get_rtt_stats(rudp, stats);
+		if(stats->samples)
+			return;
+	}
+
+	stats->srtt_us = __atomic_load_n(&session->rtt_us, __ATOMIC_RELAXED);
+}
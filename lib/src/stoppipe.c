@@ -4,15 +4,27 @@
 #include <chiaki/sock.h>
 
 #include <fcntl.h>
+#include <stdlib.h>
+#include <limits.h>
 
 #ifdef _WIN32
 #include <ws2tcpip.h>
 #else
 #include <unistd.h>
 #include <sys/socket.h>
+#if defined(__SWITCH__)
 #include <sys/select.h>
+#else
+#include <poll.h>
+#endif
 #endif
 
+#ifdef CHIAKI_STOP_PIPE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+#define STOP_PIPE_POLL_FDS_STACK 8
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_init(ChiakiStopPipe *stop_pipe)
 {
 #ifdef _WIN32
@@ -44,6 +56,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_init(ChiakiStopPipe *stop_pipe)
 		close(stop_pipe->fd);
 		return CHIAKI_ERR_UNKNOWN;
 	}
+#elif defined(CHIAKI_STOP_PIPE_EVENTFD)
+	stop_pipe->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(stop_pipe->fd < 0)
+		return CHIAKI_ERR_UNKNOWN;
 #else
 	int r = pipe(stop_pipe->fds);
 	if(r < 0)
@@ -63,7 +79,7 @@ CHIAKI_EXPORT void chiaki_stop_pipe_fini(ChiakiStopPipe *stop_pipe)
 {
 #ifdef _WIN32
 	WSACloseEvent(stop_pipe->event);
-#elif defined(__SWITCH__)
+#elif defined(__SWITCH__) || defined(CHIAKI_STOP_PIPE_EVENTFD)
 	close(stop_pipe->fd);
 #else
 	close(stop_pipe->fds[0]);
@@ -79,6 +95,9 @@ CHIAKI_EXPORT void chiaki_stop_pipe_stop(ChiakiStopPipe *stop_pipe)
 	// send to local socket (FIXME MSG_CONFIRM)
 	sendto(stop_pipe->fd, "\x00", 1, 0,
 		(struct sockaddr*)&stop_pipe->addr, sizeof(struct sockaddr_in));
+#elif defined(CHIAKI_STOP_PIPE_EVENTFD)
+	uint64_t v = 1;
+	write(stop_pipe->fd, &v, sizeof(v));
 #else
 	write(stop_pipe->fds[1], "\x00", 1);
 #endif
@@ -86,53 +105,77 @@ CHIAKI_EXPORT void chiaki_stop_pipe_stop(ChiakiStopPipe *stop_pipe)
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_single(ChiakiStopPipe *stop_pipe, chiaki_socket_t fd, bool write, uint64_t timeout_ms)
 {
+	ChiakiStopPipeWaitFd wait_fd = { fd, write, false };
+	return chiaki_stop_pipe_select_multi(stop_pipe, &wait_fd, CHIAKI_SOCKET_IS_INVALID(fd) ? 0 : 1, timeout_ms);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_multi(ChiakiStopPipe *stop_pipe, ChiakiStopPipeWaitFd *fds, size_t fds_count, uint64_t timeout_ms)
+{
+	for(size_t i=0; i<fds_count; i++)
+		fds[i].ready = false;
+
 #ifdef _WIN32
-	WSAEVENT events[2];
+	if(fds_count > WSA_MAXIMUM_WAIT_EVENTS - 1)
+		return CHIAKI_ERR_OVERFLOW;
+
+	WSAEVENT events[WSA_MAXIMUM_WAIT_EVENTS];
 	DWORD events_count = 1;
 	events[0] = stop_pipe->event;
 
-	if(!CHIAKI_SOCKET_IS_INVALID(fd))
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	for(size_t i=0; i<fds_count; i++)
 	{
-		events_count = 2;
-		events[1] = WSACreateEvent();
-		if(events[1] == WSA_INVALID_EVENT)
-			return CHIAKI_ERR_UNKNOWN;
-		WSAEventSelect(fd, events[1], write ? FD_WRITE : FD_READ);
+		events[events_count] = WSACreateEvent();
+		if(events[events_count] == WSA_INVALID_EVENT)
+		{
+			err = CHIAKI_ERR_UNKNOWN;
+			goto close_events;
+		}
+		WSAEventSelect(fds[i].fd, events[events_count], fds[i].write ? FD_WRITE : FD_READ);
+		events_count++;
 	}
 
 	DWORD r = WSAWaitForMultipleEvents(events_count, events, FALSE, timeout_ms == UINT64_MAX ? WSA_INFINITE : (DWORD)timeout_ms, FALSE);
 
-	if(events_count == 2)
-		WSACloseEvent(events[1]);
-
-	switch(r)
+	if(r == WSA_WAIT_EVENT_0)
+		err = CHIAKI_ERR_CANCELED;
+	else if(r == WSA_WAIT_TIMEOUT)
+		err = CHIAKI_ERR_TIMEOUT;
+	else if(r > WSA_WAIT_EVENT_0 && r < WSA_WAIT_EVENT_0 + events_count)
 	{
-		case WSA_WAIT_EVENT_0:
-			return CHIAKI_ERR_CANCELED;
-		case WSA_WAIT_EVENT_0+1:
-			return CHIAKI_ERR_SUCCESS;
-		case WSA_WAIT_TIMEOUT:
-			return CHIAKI_ERR_TIMEOUT;
-		default:
-			return CHIAKI_ERR_UNKNOWN;
+		// the first signaled event is returned, check the others for more ready fds
+		for(size_t i=r-WSA_WAIT_EVENT_0-1; i<fds_count; i++)
+		{
+			if(WSAWaitForMultipleEvents(1, &events[i+1], FALSE, 0, FALSE) == WSA_WAIT_EVENT_0)
+				fds[i].ready = true;
+		}
 	}
-#else
+	else
+		err = CHIAKI_ERR_UNKNOWN;
+
+close_events:
+	for(DWORD i=1; i<events_count; i++)
+		WSACloseEvent(events[i]);
+	return err;
+#elif defined(__SWITCH__)
 	fd_set rfds;
 	FD_ZERO(&rfds);
-#if defined(__SWITCH__)
 	// push udp local socket as fd
 	int stop_fd = stop_pipe->fd;
-#else
-	int stop_fd = stop_pipe->fds[0];
-#endif
 	FD_SET(stop_fd, &rfds);
 	int nfds = stop_fd;
 
 	fd_set wfds;
 	FD_ZERO(&wfds);
-	if(!CHIAKI_SOCKET_IS_INVALID(fd))
+	bool any_write = false;
+	for(size_t i=0; i<fds_count; i++)
 	{
-		FD_SET(fd, write ? &wfds : &rfds);
+		int fd = fds[i].fd;
+		if(fd >= FD_SETSIZE)
+			return CHIAKI_ERR_OVERFLOW;
+		FD_SET(fd, fds[i].write ? &wfds : &rfds);
+		if(fds[i].write)
+			any_write = true;
 		if(fd > nfds)
 			nfds = fd;
 	}
@@ -150,12 +193,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_single(ChiakiStopPipe *sto
 	int r;
 	do
 	{
-		r = select(nfds, &rfds, write ? &wfds : NULL, NULL, timeout);
-#ifdef _WIN32
-	} while(r < 0 && WSAGetLastError() == WSAEINTR)
-#else
+		r = select(nfds, &rfds, any_write ? &wfds : NULL, NULL, timeout);
 	} while(r < 0 && errno == EINTR);
-#endif
 
 	if(r < 0)
 		return CHIAKI_ERR_UNKNOWN;
@@ -163,10 +202,68 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_single(ChiakiStopPipe *sto
 	if(FD_ISSET(stop_fd, &rfds))
 		return CHIAKI_ERR_CANCELED;
 
-	if(!CHIAKI_SOCKET_IS_INVALID(fd) && FD_ISSET(fd, write ? &wfds : &rfds))
-		return CHIAKI_ERR_SUCCESS;
+	bool any_ready = false;
+	for(size_t i=0; i<fds_count; i++)
+	{
+		if(FD_ISSET(fds[i].fd, fds[i].write ? &wfds : &rfds))
+			any_ready = fds[i].ready = true;
+	}
+
+	return any_ready ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_TIMEOUT;
+#else
+	// poll() has no FD_SETSIZE limit, so this keeps working with many sessions in one process
+	struct pollfd pfds_stack[STOP_PIPE_POLL_FDS_STACK];
+	struct pollfd *pfds = pfds_stack;
+	if(fds_count + 1 > STOP_PIPE_POLL_FDS_STACK)
+	{
+		pfds = malloc((fds_count + 1) * sizeof(struct pollfd));
+		if(!pfds)
+			return CHIAKI_ERR_MEMORY;
+	}
 
-	return CHIAKI_ERR_TIMEOUT;
+#ifdef CHIAKI_STOP_PIPE_EVENTFD
+	pfds[0].fd = stop_pipe->fd;
+#else
+	pfds[0].fd = stop_pipe->fds[0];
+#endif
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+	for(size_t i=0; i<fds_count; i++)
+	{
+		pfds[i+1].fd = fds[i].fd;
+		pfds[i+1].events = fds[i].write ? POLLOUT : POLLIN;
+		pfds[i+1].revents = 0;
+	}
+
+	int timeout = timeout_ms == UINT64_MAX ? -1 : (timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms);
+
+	int r;
+	do
+	{
+		r = poll(pfds, (nfds_t)(fds_count + 1), timeout);
+	} while(r < 0 && errno == EINTR);
+
+	ChiakiErrorCode err = CHIAKI_ERR_TIMEOUT;
+	if(r < 0)
+		err = CHIAKI_ERR_UNKNOWN;
+	else if(pfds[0].revents)
+		err = CHIAKI_ERR_CANCELED;
+	else
+	{
+		for(size_t i=0; i<fds_count; i++)
+		{
+			// errors and hangups count as ready so the caller's recv()/send() reports them, like with select()
+			if(pfds[i+1].revents)
+			{
+				fds[i].ready = true;
+				err = CHIAKI_ERR_SUCCESS;
+			}
+		}
+	}
+
+	if(pfds != pfds_stack)
+		free(pfds);
+	return err;
 #endif
 }
 
@@ -266,6 +363,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_reset(ChiakiStopPipe *stop_pipe)
 	int r;
 	while((r = read(stop_pipe->fd, &v, sizeof(v))) > 0);
 	return r < 0 ? CHIAKI_ERR_UNKNOWN : CHIAKI_ERR_SUCCESS;
+#elif defined(CHIAKI_STOP_PIPE_EVENTFD)
+	// a single read resets the counter, EAGAIN means it was not stopped
+	uint64_t v;
+	if(read(stop_pipe->fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		return CHIAKI_ERR_UNKNOWN;
+	return CHIAKI_ERR_SUCCESS;
 #else
 	uint8_t v;
 	int r;
@@ -90,13 +90,17 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_state_cond;
 
+	err = chiaki_congestion_control_init(&stream_connection->congestion_control);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_packet_stats;
+
 	stream_connection->video_receiver = NULL;
 	stream_connection->audio_receiver = NULL;
 	stream_connection->haptics_receiver = NULL;
 
 	err = chiaki_mutex_init(&stream_connection->feedback_sender_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_packet_stats;
+		goto error_congestion_control;
 
 	stream_connection->state = STATE_IDLE;
 	stream_connection->state_finished = false;
@@ -107,6 +111,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 
 	return CHIAKI_ERR_SUCCESS;
 
+error_congestion_control:
+	chiaki_congestion_control_fini(&stream_connection->congestion_control);
 error_packet_stats:
 	chiaki_packet_stats_fini(&stream_connection->packet_stats);
 error_state_cond:
@@ -125,8 +131,9 @@ CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_
 	chiaki_gkcrypt_free(stream_connection->gkcrypt_local);
 
 	free(stream_connection->ecdh_secret);
-	if (stream_connection->congestion_control.thread.thread)
+	if (stream_connection->congestion_control.thread.thread || stream_connection->congestion_control.event_loop)
 		chiaki_congestion_control_stop(&stream_connection->congestion_control);
+	chiaki_congestion_control_fini(&stream_connection->congestion_control);
 
 	chiaki_packet_stats_fini(&stream_connection->packet_stats);
 
@@ -167,6 +174,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 	takion_info.enable_dualsense = session->connect_info.enable_dualsense;
 	takion_info.protocol_version = chiaki_target_is_ps5(session->target) ? 12 : 9;
 
+	takion_info.recv_batch_size = CHIAKI_TAKION_RECV_BATCH_SIZE_DEFAULT;
+	takion_info.data_window = session->connect_info.data_window;
+	takion_info.data_ack_delay_ms = CHIAKI_TAKION_DATA_ACK_DELAY_MS_DEFAULT;
+	takion_info.event_loop = session->event_loop_enabled ? &session->event_loop : NULL;
+
 	takion_info.cb = stream_connection_takion_cb;
 	takion_info.cb_user = stream_connection;
 
@@ -206,6 +218,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		chiaki_mutex_unlock(&stream_connection->state_mutex);
 		goto err_haptics_receiver;
 	}
+	stream_connection->video_receiver->congestion_control = &stream_connection->congestion_control;
 
 	stream_connection->state = STATE_TAKION_CONNECT;
 	stream_connection->state_finished = false;
@@ -219,7 +232,21 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		goto err_video_receiver;
 	}
 
-	err = chiaki_congestion_control_start(&stream_connection->congestion_control, &stream_connection->takion, &stream_connection->packet_stats, stream_connection->packet_loss_max);
+	ChiakiCongestionController congestion_controller;
+	unsigned int fps = session->connect_info.video_profile.max_fps ? session->connect_info.video_profile.max_fps : 60;
+	err = chiaki_congestion_controller_init(&congestion_controller, session->connect_info.congestion_controller, session->log,
+			stream_connection->packet_loss_max, 1000000 / fps);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(session->log, "StreamConnection failed to create %s Congestion Controller",
+				chiaki_congestion_controller_type_name(session->connect_info.congestion_controller));
+		goto close_takion;
+	}
+	CHIAKI_LOGI(session->log, "StreamConnection using %s Congestion Controller",
+			chiaki_congestion_controller_type_name(session->connect_info.congestion_controller));
+
+	err = chiaki_congestion_control_start(&stream_connection->congestion_control, &stream_connection->takion, &stream_connection->packet_stats, &congestion_controller,
+			session->event_loop_enabled ? &session->event_loop : NULL);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "StreamConnection failed to start Congestion Control");
@@ -700,9 +727,9 @@ static void stream_connection_takion_data_idle(ChiakiStreamConnection *stream_co
 			 q.target_bitrate, q.upstream_bitrate,
 			 q.upstream_loss,
 			 q.disable_upstream_audio, q.rtt, q.loss);
-		stream_connection->measured_bitrate = chiaki_stream_stats_bitrate(&stream_connection->video_receiver->frame_processor.stream_stats, stream_connection->session->connect_info.video_profile.max_fps) / 1000000.0;
+		stream_connection->measured_bitrate = chiaki_stream_stats_bitrate(&stream_connection->video_receiver->stream_stats, stream_connection->session->connect_info.video_profile.max_fps) / 1000000.0;
 		CHIAKI_LOGV(stream_connection->log, "StreamConnection measured bitrate: %.4f MBit/s", stream_connection->measured_bitrate);
-		chiaki_stream_stats_reset(&stream_connection->video_receiver->frame_processor.stream_stats);
+		chiaki_stream_stats_reset(&stream_connection->video_receiver->stream_stats);
 		break;
 	}
 	case tkproto_TakionMessage_PayloadType_CORRUPTFRAME:
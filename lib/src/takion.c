@@ -1,5 +1,9 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#define _GNU_SOURCE
+
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_TAKION
+
 #include "chiaki/feedback.h"
 #include <chiaki/takion.h>
 #include <chiaki/congestioncontrol.h>
@@ -32,6 +36,11 @@
 #include <sys/socket.h>
 #endif
 
+#if defined(__linux__)
+#define TAKION_RECV_BATCH_SUPPORTED
+#include <sys/uio.h>
+#endif
+
 
 // VERY similar to SCTP, see RFC 4960
 
@@ -39,11 +48,19 @@
 #define TAKION_OUTBOUND_STREAMS 0x64
 #define TAKION_INBOUND_STREAMS 0x64
 
-#define TAKION_REORDER_QUEUE_SIZE_EXP 4 // => 16 entries
-#define TAKION_SEND_BUFFER_SIZE 16
+#define TAKION_SEND_BUFFER_SIZE 256
+
+// a pending data ack is sent right away once it covers this many data packets
+#define TAKION_DATA_ACK_PENDING_MAX 16
+
+// how long senders are blocked while the send buffer is full
+#define TAKION_SEND_BUFFER_RESERVE_TIMEOUT_MS 1000
 
 #define TAKION_POSTPONE_PACKETS_SIZE 32
 
+// added to postponed packets + reorder queue for packets currently being handled
+#define TAKION_PACKET_POOL_HEADROOM 80
+
 #define TAKION_MESSAGE_HEADER_SIZE 0x10
 
 #define TAKION_PACKET_BASE_TYPE_MASK 0xf
@@ -145,37 +162,43 @@ typedef struct takion_message_payload_init_ack_t
 	uint8_t cookie[TAKION_COOKIE_SIZE];
 } TakionMessagePayloadInitAck;
 
-typedef struct
-{
-	uint8_t *packet_buf;
-	size_t packet_size;
-	uint8_t type_b;
-	uint8_t *payload; // inside packet_buf
-	size_t payload_size;
-	uint16_t channel;
-} TakionDataPacketEntry;
-
 typedef struct chiaki_takion_postponed_packet_t
 {
-	uint8_t *buf;
-	size_t buf_size;
+	ChiakiPacketBuf *packet;
 } ChiakiTakionPostponedPacket;
 
+#ifdef TAKION_RECV_BATCH_SUPPORTED
+typedef struct chiaki_takion_recv_batch_t
+{
+	size_t size;
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	ChiakiPacketBuf **packets; // buffers the next recvmmsg() receives into, NULL if not acquired yet
+} ChiakiTakionRecvBatch;
+#endif
+
 static void *takion_thread_func(void *user);
-static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
+static void takion_handle_packet(ChiakiTakion *takion, ChiakiPacketBuf *packet);
 static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
-static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
-static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size);
+static void takion_handle_packet_message(ChiakiTakion *takion, ChiakiPacketBuf *packet);
+static void takion_handle_packet_message_data(ChiakiTakion *takion, ChiakiPacketBuf *packet, uint8_t type_b, uint8_t *payload, size_t payload_size);
 static void takion_handle_packet_message_data_ack(ChiakiTakion *takion, uint8_t flags, uint8_t *buf, size_t buf_size);
 static ChiakiErrorCode takion_parse_message(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, TakionMessage *msg);
 static void takion_write_message_header(uint8_t *buf, uint32_t tag, uint64_t key_pos, uint8_t chunk_type, uint8_t chunk_flags, size_t payload_data_size);
 static ChiakiErrorCode takion_send_message_init(ChiakiTakion *takion, TakionMessagePayloadInit *payload);
 static ChiakiErrorCode takion_send_message_cookie(ChiakiTakion *takion, uint8_t *cookie);
 static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms);
+static ChiakiErrorCode takion_recv_single(ChiakiTakion *takion, bool *crypt_available);
+#ifdef TAKION_RECV_BATCH_SUPPORTED
+static ChiakiErrorCode takion_recv_batch_init(ChiakiTakion *takion);
+static void takion_recv_batch_fini(ChiakiTakion *takion);
+static ChiakiErrorCode takion_recv_batch(ChiakiTakion *takion, bool *crypt_available);
+#endif
 static ChiakiErrorCode takion_recv_message_init_ack(ChiakiTakion *takion, TakionMessagePayloadInitAck *payload);
 static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion);
 static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
 static ChiakiErrorCode takion_read_extra_sock_messages(ChiakiTakion *takion);
+static uint64_t takion_data_ack_poll(ChiakiTakion *takion);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, ChiakiTakionConnectInfo *info, chiaki_socket_t *sock)
 {
@@ -224,6 +247,20 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 	takion->postponed_packets_size = 0;
 	takion->postponed_packets_count = 0;
 	takion->enable_dualsense = info->enable_dualsense;
+	takion->recv_batch_size = info->recv_batch_size;
+	takion->event_loop = info->event_loop;
+	takion->recv_batch = NULL;
+	memset(&takion->recv_stats, 0, sizeof(takion->recv_stats));
+
+	size_t data_window = info->data_window ? info->data_window : CHIAKI_TAKION_DATA_WINDOW_DEFAULT;
+	takion->data_queue_size_exp = 0;
+	while(((size_t)1 << takion->data_queue_size_exp) < data_window && takion->data_queue_size_exp < CHIAKI_REORDER_QUEUE_SIZE_EXP_MAX)
+		takion->data_queue_size_exp++;
+	takion->data_ack_delay_ms = info->data_ack_delay_ms;
+	takion->data_ack_pending = false;
+	takion->data_ack_seq_num = 0;
+	takion->data_ack_pending_count = 0;
+	takion->data_ack_deadline_ms = 0;
 
 	CHIAKI_LOGI(takion->log, "Takion connecting (version %u)", (unsigned int)info->protocol_version);
 	bool mac_dontfrag = true;
@@ -567,6 +604,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send(ChiakiTakion *takion, uint8_t *
 	return chiaki_takion_send_raw(takion, buf, buf_size);
 }
 
+/**
+ * Acks are handled on the takion thread, so it must never wait for room in the send buffer.
+ */
+static uint64_t takion_send_buffer_reserve_timeout(ChiakiTakion *takion)
+{
+	return chiaki_thread_is_current(&takion->thread) ? 0 : TAKION_SEND_BUFFER_RESERVE_TIMEOUT_MS;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *takion, uint8_t chunk_flags, uint16_t channel, uint8_t *buf, size_t buf_size, ChiakiSeqNum32 *seq_num)
 {
 	// TODO: can we make this more memory-efficient?
@@ -599,15 +644,27 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *taki
 	*(msg_payload + 8) = 0;
 	memcpy(msg_payload + 9, buf, buf_size);
 
+	// wait for room before sending, so the packet never goes out without being tracked for re-sending
+	err = chiaki_takion_send_buffer_reserve(&takion->send_buffer, seq_num_val, takion_send_buffer_reserve_timeout(takion));
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(takion->log, "Takion failed to reserve data packet in send buffer: %s", chiaki_error_string(err));
+		free(packet_buf);
+		return err;
+	}
+
 	err = chiaki_takion_send(takion, packet_buf, packet_size, key_pos); // will alter packet_buf with gmac
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to send data packet: %s", chiaki_error_string(err));
+		chiaki_takion_send_buffer_cancel(&takion->send_buffer, seq_num_val);
 		free(packet_buf);
 		return err;
 	}
 
-	chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
+	err = chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size, 0);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
 
 	if(seq_num)
 		*seq_num = seq_num_val;
@@ -646,15 +703,27 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data_cont(ChiakiTakion
 	*((chiaki_unaligned_uint16_t *)(msg_payload + 6)) = 0;
 	memcpy(msg_payload + 8, buf, buf_size);
 
+	// wait for room before sending, so the packet never goes out without being tracked for re-sending
+	err = chiaki_takion_send_buffer_reserve(&takion->send_buffer, seq_num_val, takion_send_buffer_reserve_timeout(takion));
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(takion->log, "Takion failed to reserve data packet in send buffer: %s", chiaki_error_string(err));
+		free(packet_buf);
+		return err;
+	}
+
 	err = chiaki_takion_send(takion, packet_buf, packet_size, key_pos); // will alter packet_buf with gmac
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to send data packet: %s", chiaki_error_string(err));
+		chiaki_takion_send_buffer_cancel(&takion->send_buffer, seq_num_val);
 		free(packet_buf);
 		return err;
 	}
 
-	chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
+	err = chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size, 0);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
 
 	if(seq_num)
 		*seq_num = seq_num_val;
@@ -907,9 +976,71 @@ static void takion_data_drop(uint64_t seq_num, void *elem_user, void *cb_user)
 {
 	ChiakiTakion *takion = cb_user;
 	CHIAKI_LOGE(takion->log, "Takion dropping data with seq num %#llx", (unsigned long long)seq_num);
-	TakionDataPacketEntry *entry = elem_user;
-	free(entry->packet_buf);
-	free(entry);
+	ChiakiPacketBuf *packet = elem_user;
+	chiaki_packet_buf_unref(packet);
+}
+
+/**
+ * Get the data payload of a control packet that has already been validated by takion_parse_message().
+ */
+static inline void takion_data_packet_payload(ChiakiPacketBuf *packet, uint8_t **payload, size_t *payload_size)
+{
+	*payload = packet->data + 1 + TAKION_MESSAGE_HEADER_SIZE;
+	*payload_size = packet->size - 1 - TAKION_MESSAGE_HEADER_SIZE;
+}
+
+static void takion_postponed_packets_clear(ChiakiTakion *takion)
+{
+	if(!takion->postponed_packets)
+		return;
+	for(size_t i=0; i<takion->postponed_packets_count; i++)
+		chiaki_packet_buf_unref(takion->postponed_packets[i].packet);
+	free(takion->postponed_packets);
+	takion->postponed_packets = NULL;
+	takion->postponed_packets_size = 0;
+	takion->postponed_packets_count = 0;
+}
+
+/**
+ * Re-check queued data and flush postponed packets once gkcrypt_remote has been set from the callback.
+ */
+static void takion_check_crypt_available(ChiakiTakion *takion, bool *crypt_available)
+{
+	if(takion->enable_crypt && !*crypt_available && takion->gkcrypt_remote)
+	{
+		*crypt_available = true;
+		CHIAKI_LOGI(takion->log, "Crypt has become available. Re-checking MACs of %llu packets", (unsigned long long)chiaki_reorder_queue_count(&takion->data_queue));
+		for(uint64_t i=0; i<chiaki_reorder_queue_count(&takion->data_queue); i++)
+		{
+			uint64_t seq_num;
+			ChiakiPacketBuf *packet;
+			bool peeked = chiaki_reorder_queue_peek(&takion->data_queue, i, &seq_num, (void **)&packet);
+			if(!peeked)
+				continue;
+			if(packet->size == 0)
+				continue;
+			uint8_t base_type = (uint8_t)(packet->data[0] & TAKION_PACKET_BASE_TYPE_MASK);
+			if(takion_handle_packet_mac(takion, base_type, packet->data, packet->size) != CHIAKI_ERR_SUCCESS)
+			{
+				CHIAKI_LOGW(takion->log, "Found an invalid MAC");
+				chiaki_reorder_queue_drop(&takion->data_queue, i);
+			}
+		}
+
+	}
+
+	if(takion->postponed_packets && takion->gkcrypt_remote)
+	{
+		// there are some postponed packets that were waiting until crypt is initialized and it is now :-)
+
+		CHIAKI_LOGI(takion->log, "Takion flushing %llu postpone packet(s)", (unsigned long long)takion->postponed_packets_count);
+
+		// ownership of all postponed packets is passed on to takion_handle_packet()
+		for(size_t i=0; i<takion->postponed_packets_count; i++)
+			takion_handle_packet(takion, takion->postponed_packets[i].packet);
+		takion->postponed_packets_count = 0;
+		takion_postponed_packets_clear(takion);
+	}
 }
 
 static void *takion_thread_func(void *user)
@@ -920,15 +1051,32 @@ static void *takion_thread_func(void *user)
 	if(takion_handshake(takion, &seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
 		goto beach;
 
-	if(chiaki_reorder_queue_init_32(&takion->data_queue, TAKION_REORDER_QUEUE_SIZE_EXP, seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
+	size_t recv_batch_size = 0;
+#ifdef TAKION_RECV_BATCH_SUPPORTED
+	if(takion->recv_batch_size > 1)
+		recv_batch_size = takion->recv_batch_size;
+#endif
+
+	size_t data_queue_size = (size_t)1 << takion->data_queue_size_exp;
+	if(chiaki_packet_pool_init(&takion->packet_pool,
+				TAKION_POSTPONE_PACKETS_SIZE + data_queue_size + TAKION_PACKET_POOL_HEADROOM + recv_batch_size) != CHIAKI_ERR_SUCCESS)
 		goto beach;
 
+	if(chiaki_reorder_queue_init_32(&takion->data_queue, takion->data_queue_size_exp, seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
+		goto error_packet_pool;
+	CHIAKI_LOGI(takion->log, "Takion data window is %zu packets, acks delayed by up to %llu ms",
+			data_queue_size, (unsigned long long)takion->data_ack_delay_ms);
+
 	chiaki_reorder_queue_set_drop_cb(&takion->data_queue, takion_data_drop, takion);
 
 	// The send buffer size MUST be consistent with the acked seqnums array size in takion_handle_packet_message_data_ack()
-	if(chiaki_takion_send_buffer_init(&takion->send_buffer, takion, TAKION_SEND_BUFFER_SIZE) != CHIAKI_ERR_SUCCESS)
+	if(chiaki_takion_send_buffer_init(&takion->send_buffer, takion, TAKION_SEND_BUFFER_SIZE, takion->event_loop) != CHIAKI_ERR_SUCCESS)
 		goto error_reoder_queue;
 
+#ifdef TAKION_RECV_BATCH_SUPPORTED
+	if(recv_batch_size && takion_recv_batch_init(takion) != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGW(takion->log, "Takion failed to initialize batched receive, falling back to single receive");
+#endif
 
 	if(takion->cb)
 	{
@@ -941,68 +1089,30 @@ static void *takion_thread_func(void *user)
 
 	while(true)
 	{
-		if(takion->enable_crypt && !crypt_available && takion->gkcrypt_remote)
-		{
-			crypt_available = true;
-			CHIAKI_LOGI(takion->log, "Crypt has become available. Re-checking MACs of %llu packets", (unsigned long long)chiaki_reorder_queue_count(&takion->data_queue));
-			for(uint64_t i=0; i<chiaki_reorder_queue_count(&takion->data_queue); i++)
-			{
-				TakionDataPacketEntry *packet;
-				bool peeked = chiaki_reorder_queue_peek(&takion->data_queue, i, NULL, (void **)&packet);
-				if(!peeked)
-					continue;
-				if(packet->packet_size == 0)
-					continue;
-				uint8_t base_type = (uint8_t)(packet->packet_buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
-				if(takion_handle_packet_mac(takion, base_type, packet->packet_buf, packet->packet_size) != CHIAKI_ERR_SUCCESS)
-				{
-					CHIAKI_LOGW(takion->log, "Found an invalid MAC");
-					chiaki_reorder_queue_drop(&takion->data_queue, i);
-				}
-			}
-
-		}
-
-		if(takion->postponed_packets && takion->gkcrypt_remote)
-		{
-			// there are some postponed packets that were waiting until crypt is initialized and it is now :-)
-
-			CHIAKI_LOGI(takion->log, "Takion flushing %llu postpone packet(s)", (unsigned long long)takion->postponed_packets_count);
-
-			for(size_t i=0; i<takion->postponed_packets_count; i++)
-			{
-				ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[i];
-				takion_handle_packet(takion, packet->buf, packet->buf_size);
-			}
-			free(takion->postponed_packets);
-			takion->postponed_packets = NULL;
-			takion->postponed_packets_size = 0;
-			takion->postponed_packets_count = 0;
-		}
-
-		size_t received_size = 1500;
-		uint8_t *buf = malloc(received_size); // TODO: no malloc?
-		if(!buf)
-			break;
-		ChiakiErrorCode err = takion_recv(takion, buf, &received_size, UINT64_MAX);
+		ChiakiErrorCode err;
+#ifdef TAKION_RECV_BATCH_SUPPORTED
+		if(takion->recv_batch)
+			err = takion_recv_batch(takion, &crypt_available);
+		else
+#endif
+			err = takion_recv_single(takion, &crypt_available);
 		if(err != CHIAKI_ERR_SUCCESS)
-		{
-			free(buf);
 			break;
-		}
-		uint8_t *resized_buf = realloc(buf, received_size);
-		if(!resized_buf)
-		{
-			free(buf);
-			continue;
-		}
-		takion_handle_packet(takion, resized_buf, received_size);
 	}
 
+#ifdef TAKION_RECV_BATCH_SUPPORTED
+	takion_recv_batch_fini(takion);
+#endif
 	chiaki_takion_send_buffer_fini(&takion->send_buffer);
 
 error_reoder_queue:
 	chiaki_reorder_queue_fini(&takion->data_queue);
+	takion_postponed_packets_clear(takion);
+	CHIAKI_LOGI(takion->log, "Takion received %llu packets with %llu heap allocations",
+			(unsigned long long)takion->packet_pool.acquired, (unsigned long long)takion->packet_pool.heap_allocs);
+
+error_packet_pool:
+	chiaki_packet_pool_fini(&takion->packet_pool);
 
 beach:
 	if(takion->cb)
@@ -1025,6 +1135,7 @@ beach:
 static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms)
 {
 	ChiakiErrorCode err = chiaki_stop_pipe_select_single(&takion->stop_pipe, takion->sock, false, timeout_ms);
+	takion->recv_stats.wait_calls++;
 	if(err == CHIAKI_ERR_TIMEOUT || err == CHIAKI_ERR_CANCELED)
 		return err;
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -1034,6 +1145,7 @@ static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *b
 	}
 
 	CHIAKI_SSIZET_TYPE received_sz = recv(takion->sock, buf, *buf_size, 0);
+	takion->recv_stats.recv_calls++;
 	if(received_sz <= 0)
 	{
 		if(received_sz < 0)
@@ -1043,9 +1155,154 @@ static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *b
 		return CHIAKI_ERR_NETWORK;
 	}
 	*buf_size = (size_t)received_sz;
+	takion->recv_stats.packets++;
+	takion->recv_stats.bytes += *buf_size;
 	return CHIAKI_ERR_SUCCESS;
 }
 
+/**
+ * Receive a single datagram into the packet pool and handle it.
+ */
+static ChiakiErrorCode takion_recv_single(ChiakiTakion *takion, bool *crypt_available)
+{
+	takion_check_crypt_available(takion, crypt_available);
+
+	uint64_t timeout_ms = takion_data_ack_poll(takion);
+
+	ChiakiPacketBuf *packet = chiaki_packet_pool_acquire(&takion->packet_pool);
+	if(!packet)
+		return CHIAKI_ERR_MEMORY;
+	size_t received_size = packet->capacity;
+	ChiakiErrorCode err = takion_recv(takion, packet->data, &received_size, timeout_ms);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_packet_buf_unref(packet);
+		return err == CHIAKI_ERR_TIMEOUT ? CHIAKI_ERR_SUCCESS : err; // pending data ack is due
+	}
+	packet->size = received_size;
+	takion_handle_packet(takion, packet);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+#ifdef TAKION_RECV_BATCH_SUPPORTED
+static ChiakiErrorCode takion_recv_batch_init(ChiakiTakion *takion)
+{
+	ChiakiTakionRecvBatch *batch = calloc(1, sizeof(ChiakiTakionRecvBatch));
+	if(!batch)
+		return CHIAKI_ERR_MEMORY;
+	batch->size = takion->recv_batch_size;
+	batch->msgs = calloc(batch->size, sizeof(struct mmsghdr));
+	batch->iovs = calloc(batch->size, sizeof(struct iovec));
+	batch->packets = calloc(batch->size, sizeof(ChiakiPacketBuf *));
+	if(!batch->msgs || !batch->iovs || !batch->packets)
+	{
+		free(batch->msgs);
+		free(batch->iovs);
+		free(batch->packets);
+		free(batch);
+		return CHIAKI_ERR_MEMORY;
+	}
+	for(size_t i=0; i<batch->size; i++)
+	{
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	takion->recv_batch = batch;
+	CHIAKI_LOGI(takion->log, "Takion using batched receive of up to %zu datagrams", batch->size);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void takion_recv_batch_fini(ChiakiTakion *takion)
+{
+	ChiakiTakionRecvBatch *batch = takion->recv_batch;
+	if(!batch)
+		return;
+	for(size_t i=0; i<batch->size; i++)
+	{
+		if(batch->packets[i])
+			chiaki_packet_buf_unref(batch->packets[i]);
+	}
+	free(batch->msgs);
+	free(batch->iovs);
+	free(batch->packets);
+	free(batch);
+	takion->recv_batch = NULL;
+}
+
+/**
+ * Wait once for the socket to become readable, then receive up to recv_batch_size datagrams
+ * with a single recvmmsg() and handle them in order.
+ */
+static ChiakiErrorCode takion_recv_batch(ChiakiTakion *takion, bool *crypt_available)
+{
+	ChiakiTakionRecvBatch *batch = takion->recv_batch;
+
+	takion_check_crypt_available(takion, crypt_available);
+
+	// everything of the previous batch is handled, so a pending data ack covers all of it now
+	uint64_t timeout_ms = takion_data_ack_poll(takion);
+
+	ChiakiErrorCode err = chiaki_stop_pipe_select_single(&takion->stop_pipe, takion->sock, false, timeout_ms);
+	takion->recv_stats.wait_calls++;
+	if(err == CHIAKI_ERR_TIMEOUT)
+		return CHIAKI_ERR_SUCCESS;
+	if(err == CHIAKI_ERR_CANCELED)
+		return err;
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(takion->log, "Takion select failed: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		return err;
+	}
+
+	// buffers that were not filled by the previous call are kept for the next one
+	for(size_t i=0; i<batch->size; i++)
+	{
+		if(!batch->packets[i])
+		{
+			ChiakiPacketBuf *packet = chiaki_packet_pool_acquire(&takion->packet_pool);
+			if(!packet)
+				return CHIAKI_ERR_MEMORY;
+			batch->packets[i] = packet;
+			batch->iovs[i].iov_base = packet->data;
+			batch->iovs[i].iov_len = packet->capacity;
+		}
+		batch->msgs[i].msg_len = 0;
+		batch->msgs[i].msg_hdr.msg_flags = 0;
+	}
+
+	int r = recvmmsg(takion->sock, batch->msgs, (unsigned int)batch->size, MSG_DONTWAIT, NULL);
+	takion->recv_stats.recv_calls++;
+	if(r < 0)
+	{
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return CHIAKI_ERR_SUCCESS;
+		CHIAKI_LOGE(takion->log, "Takion recvmmsg failed: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		return CHIAKI_ERR_NETWORK;
+	}
+
+	for(int i=0; i<r; i++)
+	{
+		ChiakiPacketBuf *packet = batch->packets[i];
+		batch->packets[i] = NULL;
+		packet->size = batch->msgs[i].msg_len;
+		if(!packet->size)
+		{
+			chiaki_packet_buf_unref(packet);
+			continue;
+		}
+		takion->recv_stats.packets++;
+		takion->recv_stats.bytes += packet->size;
+
+		// a packet of this batch may have made crypt available from the callback
+		if(i > 0)
+			takion_check_crypt_available(takion, crypt_available);
+		takion_handle_packet(takion, packet);
+	}
+
+	return CHIAKI_ERR_SUCCESS;
+}
+#endif
+
 static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size)
 {
 	if(!takion->gkcrypt_remote)
@@ -1083,13 +1340,19 @@ static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t ba
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+/**
+ * @param packet ownership of this reference is taken.
+ */
+static void takion_postpone_packet(ChiakiTakion *takion, ChiakiPacketBuf *packet)
 {
 	if(!takion->postponed_packets)
 	{
 		takion->postponed_packets = calloc(TAKION_POSTPONE_PACKETS_SIZE, sizeof(ChiakiTakionPostponedPacket));
 		if(!takion->postponed_packets)
+		{
+			chiaki_packet_buf_unref(packet);
 			return;
+		}
 		takion->postponed_packets_size = TAKION_POSTPONE_PACKETS_SIZE;
 		takion->postponed_packets_count = 0;
 	}
@@ -1097,60 +1360,64 @@ static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t bu
 	if(takion->postponed_packets_count >= takion->postponed_packets_size)
 	{
 		CHIAKI_LOGE(takion->log, "Should postpone a packet, but there is no space left");
+		chiaki_packet_buf_unref(packet);
 		return;
 	}
 
-	CHIAKI_LOGI(takion->log, "Postpone packet of size %#llx", (unsigned long long)buf_size);
-	ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[takion->postponed_packets_count++];
-	packet->buf = buf;
-	packet->buf_size = buf_size;
+	CHIAKI_LOGI(takion->log, "Postpone packet of size %#llx", (unsigned long long)packet->size);
+	takion->postponed_packets[takion->postponed_packets_count++].packet = packet;
 }
 
 /**
- * @param buf ownership of this buf is taken.
+ * @param packet ownership of this reference is taken.
  */
-static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+static void takion_handle_packet(ChiakiTakion *takion, ChiakiPacketBuf *packet)
 {
+	uint8_t *buf = packet->data;
+	size_t buf_size = packet->size;
 	assert(buf_size > 0);
 	uint8_t base_type = (uint8_t)(buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
 
 	if(takion_handle_packet_mac(takion, base_type, buf, buf_size) != CHIAKI_ERR_SUCCESS)
 	{
-		free(buf);
+		chiaki_packet_buf_unref(packet);
 		return;
 	}
 
 	switch(base_type)
 	{
 		case TAKION_PACKET_TYPE_CONTROL:
-			takion_handle_packet_message(takion, buf, buf_size);
+			takion_handle_packet_message(takion, packet);
 			break;
 		case TAKION_PACKET_TYPE_VIDEO:
 		case TAKION_PACKET_TYPE_AUDIO:
 			if(takion->enable_crypt && !takion->gkcrypt_remote)
-				takion_postpone_packet(takion, buf, buf_size);
+				takion_postpone_packet(takion, packet);
 			else
 			{
 				takion_handle_packet_av(takion, base_type, buf, buf_size);
-				free(buf);
+				chiaki_packet_buf_unref(packet);
 			}
 			break;
 		default:
 			CHIAKI_LOGW(takion->log, "Takion packet with unknown type %#x received", base_type);
 			chiaki_log_hexdump(takion->log, CHIAKI_LOG_WARNING, buf, buf_size);
-			free(buf);
+			chiaki_packet_buf_unref(packet);
 			break;
 	}
 }
 
 
-static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+/**
+ * @param packet ownership of this reference is taken.
+ */
+static void takion_handle_packet_message(ChiakiTakion *takion, ChiakiPacketBuf *packet)
 {
 	TakionMessage msg;
-	ChiakiErrorCode err = takion_parse_message(takion, buf+1, buf_size-1, &msg);
+	ChiakiErrorCode err = takion_parse_message(takion, packet->data+1, packet->size-1, &msg);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		free(buf);
+		chiaki_packet_buf_unref(packet);
 		return;
 	}
 
@@ -1160,40 +1427,87 @@ static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, siz
 	switch(msg.chunk_type)
 	{
 		case TAKION_CHUNK_TYPE_DATA:
-			takion_handle_packet_message_data(takion, buf, buf_size, msg.chunk_flags, msg.payload, msg.payload_size);
+			takion_handle_packet_message_data(takion, packet, msg.chunk_flags, msg.payload, msg.payload_size);
 			break;
 		case TAKION_CHUNK_TYPE_DATA_ACK:
 			takion_handle_packet_message_data_ack(takion, msg.chunk_flags, msg.payload, msg.payload_size);
-			free(buf);
+			chiaki_packet_buf_unref(packet);
 			break;
 		default:
 			CHIAKI_LOGW(takion->log, "Takion received message with unknown chunk type = %#x", msg.chunk_type);
-			free(buf);
+			chiaki_packet_buf_unref(packet);
 			break;
 	}
 }
 
+static void takion_data_ack_send(ChiakiTakion *takion)
+{
+	if(!takion->data_ack_pending)
+		return;
+	takion->data_ack_pending = false;
+	takion->data_ack_pending_count = 0;
+	takion->recv_stats.data_acks++;
+	chiaki_takion_send_message_data_ack(takion, takion->data_ack_seq_num);
+}
+
+/**
+ * Hold back the ack for data delivered up to seq_num, so it can be coalesced with the next ones.
+ */
+static void takion_data_ack_schedule(ChiakiTakion *takion, ChiakiSeqNum32 seq_num, size_t delivered)
+{
+	if(!takion->data_ack_pending)
+	{
+		takion->data_ack_pending = true;
+		takion->data_ack_deadline_ms = chiaki_time_now_monotonic_ms() + takion->data_ack_delay_ms;
+	}
+	takion->data_ack_seq_num = seq_num;
+	takion->data_ack_pending_count += delivered;
+	if(takion->data_ack_pending_count >= TAKION_DATA_ACK_PENDING_MAX)
+		takion_data_ack_send(takion);
+}
+
+/**
+ * Send the pending data ack if it is due. Called before waiting for the next datagrams.
+ *
+ * @return how long to wait at most until the pending data ack becomes due, UINT64_MAX if there is none
+ */
+static uint64_t takion_data_ack_poll(ChiakiTakion *takion)
+{
+	if(!takion->data_ack_pending)
+		return UINT64_MAX;
+	if(takion->data_ack_delay_ms)
+	{
+		uint64_t now_ms = chiaki_time_now_monotonic_ms();
+		if(now_ms < takion->data_ack_deadline_ms)
+			return takion->data_ack_deadline_ms - now_ms;
+	}
+	takion_data_ack_send(takion);
+	return UINT64_MAX;
+}
+
 static void takion_flush_data_queue(ChiakiTakion *takion)
 {
 	uint64_t seq_num = 0;
-	bool ack = false;
+	size_t delivered = 0;
 	while(true)
 	{
-		TakionDataPacketEntry *entry;
-		bool pulled = chiaki_reorder_queue_pull(&takion->data_queue, &seq_num, (void **)&entry);
+		ChiakiPacketBuf *packet;
+		bool pulled = chiaki_reorder_queue_pull(&takion->data_queue, &seq_num, (void **)&packet);
 		if(!pulled)
 			break;
-		ack = true;
+		delivered++;
 
-		if(entry->payload_size < 9)
+		uint8_t *payload;
+		size_t payload_size;
+		takion_data_packet_payload(packet, &payload, &payload_size);
+		if(payload_size < 9)
 		{
-			free(entry->packet_buf);
-			free(entry);
+			chiaki_packet_buf_unref(packet);
 			continue;
 		}
 
-		uint16_t zero_a = *((chiaki_unaligned_uint16_t *)(entry->payload + 6));
-		uint8_t data_type = entry->payload[8]; // & 0xf
+		uint16_t zero_a = *((chiaki_unaligned_uint16_t *)(payload + 6));
+		uint8_t data_type = payload[8]; // & 0xf
 
 		if(zero_a != 0)
 			CHIAKI_LOGW(takion->log, "Takion received data with unexpected nonzero %#x at buf+6", zero_a);
@@ -1204,27 +1518,32 @@ static void takion_flush_data_queue(ChiakiTakion *takion)
 				&& data_type != CHIAKI_TAKION_MESSAGE_DATA_TYPE_PAD_INFO)
 		{
 			CHIAKI_LOGW(takion->log, "Takion received data with unexpected data type %#x", data_type);
-			chiaki_log_hexdump(takion->log, CHIAKI_LOG_WARNING, entry->packet_buf, entry->packet_size);
+			chiaki_log_hexdump(takion->log, CHIAKI_LOG_WARNING, packet->data, packet->size);
 		}
 		else if(takion->cb)
 		{
 			ChiakiTakionEvent event = { 0 };
 			event.type = CHIAKI_TAKION_EVENT_TYPE_DATA;
 			event.data.data_type = (ChiakiTakionMessageDataType)data_type;
-			event.data.buf = entry->payload + 9;
-			event.data.buf_size = (size_t)(entry->payload_size - 9);
+			event.data.buf = payload + 9;
+			event.data.buf_size = (size_t)(payload_size - 9);
 			takion->cb(&event, takion->cb_user);
 		}
 
-		free(entry->packet_buf);
-		free(entry);
+		chiaki_packet_buf_unref(packet);
 	}
 
-	if(ack)
-		chiaki_takion_send_message_data_ack(takion, (uint32_t)seq_num);
+	if(delivered)
+	{
+		takion->recv_stats.data_packets += delivered;
+		takion_data_ack_schedule(takion, (ChiakiSeqNum32)seq_num, delivered);
+	}
 }
 
-static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size)
+/**
+ * @param packet ownership of this reference is taken and passed on to the data queue.
+ */
+static void takion_handle_packet_message_data(ChiakiTakion *takion, ChiakiPacketBuf *packet, uint8_t type_b, uint8_t *payload, size_t payload_size)
 {
 	if(type_b != 1)
 		CHIAKI_LOGW(takion->log, "Takion received data with type_b = %#x (was expecting %#x)", type_b, 1);
@@ -1232,22 +1551,22 @@ static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *pac
 	if(payload_size < 9)
 	{
 		CHIAKI_LOGE(takion->log, "Takion received data with a size less than the header size");
+		chiaki_packet_buf_unref(packet);
 		return;
 	}
 
-	TakionDataPacketEntry *entry = malloc(sizeof(TakionDataPacketEntry));
-	if(!entry)
-		return;
-
-	entry->type_b = type_b;
-	entry->packet_buf = packet_buf;
-	entry->packet_size = packet_buf_size;
-	entry->payload = payload;
-	entry->payload_size = payload_size;
-	entry->channel = ntohs(*((chiaki_unaligned_uint16_t *)(payload + 4)));
 	ChiakiSeqNum32 seq_num = ntohl(*((chiaki_unaligned_uint32_t *)(payload + 0)));
 
-	chiaki_reorder_queue_push(&takion->data_queue, seq_num, entry);
+	ChiakiSeqNum32 seq_num_next = (ChiakiSeqNum32)takion->data_queue.begin;
+	if(chiaki_seq_num_32_lt(seq_num, seq_num_next))
+	{
+		// re-sent data that was already delivered, so the ack for it was probably lost
+		takion->data_ack_pending = true;
+		takion->data_ack_seq_num = seq_num_next - 1;
+		takion_data_ack_send(takion);
+	}
+
+	chiaki_reorder_queue_push(&takion->data_queue, seq_num, packet);
 	takion_flush_data_queue(takion);
 }
 
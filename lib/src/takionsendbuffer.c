@@ -2,6 +2,8 @@
 
 #ifndef CHIAKI_UNIT_TEST
 
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_TAKION
+
 #include <chiaki/takionsendbuffer.h>
 #include <chiaki/takion.h>
 #include <chiaki/time.h>
@@ -9,38 +11,61 @@
 #include <string.h>
 #include <assert.h>
 
-#define TAKION_DATA_RESEND_TIMEOUT_MS 200
-#define TAKION_DATA_RESEND_WAKEUP_TIMEOUT_MS (TAKION_DATA_RESEND_TIMEOUT_MS/2)
+#define TAKION_DATA_RESEND_TIMEOUT_MS 200 // initial, until there are rtt samples
+#define TAKION_DATA_RESEND_TIMEOUT_MIN_MS 40
+#define TAKION_DATA_RESEND_TIMEOUT_MAX_MS 1000
 #define TAKION_DATA_RESEND_TRIES_MAX 25
-#define TAKION_SEND_BUFFER_SIZE 16
 
 #endif
 
+#define TAKION_SEND_BUFFER_INDEX_NONE UINT32_MAX
+
 struct chiaki_takion_send_buffer_packet_t
 {
 	ChiakiSeqNum32 seq_num;
 	uint64_t tries;
-	uint64_t last_send_ms; // chiaki_time_now_monotonic_ms()
-	uint8_t *buf;
+	uint64_t first_send_us; // chiaki_time_now_monotonic_us()
+	uint64_t deadline_ms; // chiaki_time_now_monotonic_ms() of the next re-send
+	uint32_t wheel_slot;
+	uint32_t wheel_prev;
+	uint32_t wheel_next;
+	uint8_t *buf; // NULL if the slot is free or only reserved
 	size_t buf_size;
+	bool reserved; // seq_num has been reserved and is being sent, buf is pushed afterwards
+	bool acked; // acked while it was still reserved
 }; // ChiakiTakionSendBufferPacket
 
 #ifndef CHIAKI_UNIT_TEST
 
 static void *takion_send_buffer_thread_func(void *user);
+static void takion_send_buffer_timer_cb(void *user);
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size, ChiakiEventLoop *event_loop)
 {
 	send_buffer->takion = takion;
 	send_buffer->log = takion ? takion->log : NULL;
 
-	send_buffer->packets = calloc(size, sizeof(ChiakiTakionSendBufferPacket));
+	size_t size_pot = 1;
+	while(size_pot < size)
+		size_pot <<= 1;
+	send_buffer->packets = calloc(size_pot, sizeof(ChiakiTakionSendBufferPacket));
 	if(!send_buffer->packets)
 		return CHIAKI_ERR_MEMORY;
-	send_buffer->packets_size = size;
+	send_buffer->packets_size = size_pot;
 	send_buffer->packets_count = 0;
+	send_buffer->packets_reserved = 0;
+	send_buffer->seq_num_first = 0;
+	send_buffer->seq_num_last = 0;
+
+	for(size_t i=0; i<CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS; i++)
+		send_buffer->wheel[i] = TAKION_SEND_BUFFER_INDEX_NONE;
+	send_buffer->wheel_tick = chiaki_time_now_monotonic_ms() / CHIAKI_TAKION_SEND_BUFFER_WHEEL_TICK_MS;
+
+	chiaki_rtt_estimator_init(&send_buffer->rtt, TAKION_DATA_RESEND_TIMEOUT_MS, TAKION_DATA_RESEND_TIMEOUT_MIN_MS, TAKION_DATA_RESEND_TIMEOUT_MAX_MS);
+	memset(&send_buffer->stats, 0, sizeof(send_buffer->stats));
 
 	send_buffer->should_stop = false;
+	send_buffer->event_loop = NULL;
 
 	ChiakiErrorCode err = chiaki_mutex_init(&send_buffer->mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -50,13 +75,31 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuf
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_mutex;
 
-	err = chiaki_thread_create(&send_buffer->thread, takion_send_buffer_thread_func, send_buffer);
+	err = chiaki_cond_init(&send_buffer->space_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_cond;
 
+	if(event_loop)
+	{
+		// added disarmed, armed by the first packet pushed
+		err = chiaki_event_loop_add_timer(event_loop, &send_buffer->resend_timer, 0, takion_send_buffer_timer_cb, send_buffer);
+		if(err == CHIAKI_ERR_SUCCESS)
+		{
+			send_buffer->event_loop = event_loop;
+			return CHIAKI_ERR_SUCCESS;
+		}
+		CHIAKI_LOGW(send_buffer->log, "Takion Send Buffer failed to add timer to Event Loop, falling back to a thread");
+	}
+
+	err = chiaki_thread_create(&send_buffer->thread, takion_send_buffer_thread_func, send_buffer);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_space_cond;
+
 	chiaki_thread_set_name(&send_buffer->thread, "Chiaki Takion Send Buffer");
 
 	return CHIAKI_ERR_SUCCESS;
+error_space_cond:
+	chiaki_cond_fini(&send_buffer->space_cond);
 error_cond:
 	chiaki_cond_fini(&send_buffer->cond);
 error_mutex:
@@ -68,56 +111,217 @@ error_packets:
 
 CHIAKI_EXPORT void chiaki_takion_send_buffer_fini(ChiakiTakionSendBuffer *send_buffer)
 {
+	chiaki_mutex_lock(&send_buffer->mutex);
 	send_buffer->should_stop = true;
-	ChiakiErrorCode err = chiaki_cond_signal(&send_buffer->cond);
-	assert(err == CHIAKI_ERR_SUCCESS);
-	err = chiaki_thread_join(&send_buffer->thread, NULL);
-	assert(err == CHIAKI_ERR_SUCCESS);
+	chiaki_mutex_unlock(&send_buffer->mutex);
+	chiaki_cond_broadcast(&send_buffer->space_cond);
+
+	if(send_buffer->event_loop)
+		chiaki_event_loop_remove(send_buffer->event_loop, &send_buffer->resend_timer);
+	else
+	{
+		ChiakiErrorCode err = chiaki_cond_signal(&send_buffer->cond);
+		assert(err == CHIAKI_ERR_SUCCESS);
+		err = chiaki_thread_join(&send_buffer->thread, NULL);
+		assert(err == CHIAKI_ERR_SUCCESS);
+	}
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
+	for(size_t i=0; i<send_buffer->packets_size; i++)
 		free(send_buffer->packets[i].buf);
 
+	chiaki_cond_fini(&send_buffer->space_cond);
 	chiaki_cond_fini(&send_buffer->cond);
 	chiaki_mutex_fini(&send_buffer->mutex);
 	free(send_buffer->packets);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size)
+static uint32_t takion_send_buffer_index(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num)
+{
+	return seq_num & (uint32_t)(send_buffer->packets_size - 1);
+}
+
+static void takion_send_buffer_wheel_insert(ChiakiTakionSendBuffer *send_buffer, uint32_t index)
+{
+	ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[index];
+	uint64_t tick = packet->deadline_ms / CHIAKI_TAKION_SEND_BUFFER_WHEEL_TICK_MS;
+	if(tick <= send_buffer->wheel_tick)
+		tick = send_buffer->wheel_tick + 1;
+	// deadlines beyond the wheel's range wrap around and are skipped until they are due
+	packet->wheel_slot = (uint32_t)(tick % CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS);
+	uint32_t *head = &send_buffer->wheel[packet->wheel_slot];
+	packet->wheel_prev = TAKION_SEND_BUFFER_INDEX_NONE;
+	packet->wheel_next = *head;
+	if(*head != TAKION_SEND_BUFFER_INDEX_NONE)
+		send_buffer->packets[*head].wheel_prev = index;
+	*head = index;
+}
+
+static void takion_send_buffer_wheel_unlink(ChiakiTakionSendBuffer *send_buffer, uint32_t index)
+{
+	ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[index];
+	if(packet->wheel_prev != TAKION_SEND_BUFFER_INDEX_NONE)
+		send_buffer->packets[packet->wheel_prev].wheel_next = packet->wheel_next;
+	else if(send_buffer->wheel[packet->wheel_slot] == index)
+		send_buffer->wheel[packet->wheel_slot] = packet->wheel_next;
+	if(packet->wheel_next != TAKION_SEND_BUFFER_INDEX_NONE)
+		send_buffer->packets[packet->wheel_next].wheel_prev = packet->wheel_prev;
+}
+
+static bool takion_send_buffer_used(ChiakiTakionSendBufferPacket *packet)
+{
+	return packet->buf || packet->reserved;
+}
+
+/**
+ * Free the packet or reservation at index and move seq_num_first forward if it was the first one.
+ */
+static void takion_send_buffer_remove(ChiakiTakionSendBuffer *send_buffer, uint32_t index)
+{
+	ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[index];
+	if(packet->buf) // reservations are not in the wheel
+		takion_send_buffer_wheel_unlink(send_buffer, index);
+	if(packet->reserved)
+		send_buffer->packets_reserved--;
+	free(packet->buf);
+	packet->buf = NULL;
+	packet->reserved = false;
+	packet->acked = false;
+	send_buffer->packets_count--;
+
+	if(!send_buffer->packets_count || packet->seq_num != send_buffer->seq_num_first)
+		return;
+	ChiakiSeqNum32 seq_num = send_buffer->seq_num_first + 1;
+	while(!takion_send_buffer_used(&send_buffer->packets[takion_send_buffer_index(send_buffer, seq_num)]))
+		seq_num++;
+	send_buffer->seq_num_first = seq_num;
+}
+
+static bool takion_send_buffer_fits(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num)
+{
+	if(!send_buffer->packets_count)
+		return true;
+	ChiakiSeqNum32 first = chiaki_seq_num_32_lt(seq_num, send_buffer->seq_num_first) ? seq_num : send_buffer->seq_num_first;
+	ChiakiSeqNum32 last = chiaki_seq_num_32_gt(seq_num, send_buffer->seq_num_last) ? seq_num : send_buffer->seq_num_last;
+	return (uint32_t)(last - first) < send_buffer->packets_size;
+}
+
+/**
+ * Wait for seq_num to fit into the window and take its slot. Must be called with mutex held.
+ */
+static ChiakiErrorCode takion_send_buffer_reserve_locked(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint64_t timeout_ms)
+{
+	if(!takion_send_buffer_fits(send_buffer, seq_num))
+	{
+		if(timeout_ms)
+		{
+			send_buffer->stats.backpressure_waits++;
+			uint64_t start_ms = chiaki_time_now_monotonic_ms();
+			while(!send_buffer->should_stop && !takion_send_buffer_fits(send_buffer, seq_num))
+			{
+				uint64_t elapsed_ms = chiaki_time_now_monotonic_ms() - start_ms;
+				if(elapsed_ms >= timeout_ms)
+					break;
+				chiaki_cond_timedwait(&send_buffer->space_cond, &send_buffer->mutex, timeout_ms - elapsed_ms);
+			}
+		}
+		if(!takion_send_buffer_fits(send_buffer, seq_num))
+		{
+			CHIAKI_LOGE(send_buffer->log, "Takion Send Buffer overflow");
+			send_buffer->stats.overflows++;
+			return CHIAKI_ERR_OVERFLOW;
+		}
+	}
+
+	ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[takion_send_buffer_index(send_buffer, seq_num)];
+	if(takion_send_buffer_used(packet))
+	{
+		CHIAKI_LOGE(send_buffer->log, "Tried to push duplicate seqnum into Takion Send Buffer");
+		return CHIAKI_ERR_INVALID_DATA;
+	}
+
+	if(!send_buffer->packets_count)
+		send_buffer->seq_num_first = send_buffer->seq_num_last = seq_num;
+	else if(chiaki_seq_num_32_lt(seq_num, send_buffer->seq_num_first))
+		send_buffer->seq_num_first = seq_num;
+	else if(chiaki_seq_num_32_gt(seq_num, send_buffer->seq_num_last))
+		send_buffer->seq_num_last = seq_num;
+	send_buffer->packets_count++;
+
+	packet->seq_num = seq_num;
+	packet->reserved = true;
+	packet->acked = false;
+	send_buffer->packets_reserved++;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_reserve(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint64_t timeout_ms)
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
+	err = takion_send_buffer_reserve_locked(send_buffer, seq_num, timeout_ms);
+	chiaki_mutex_unlock(&send_buffer->mutex);
+	return err;
+}
 
-	if(send_buffer->packets_count >= send_buffer->packets_size)
+CHIAKI_EXPORT void chiaki_takion_send_buffer_cancel(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num)
+{
+	if(chiaki_mutex_lock(&send_buffer->mutex) != CHIAKI_ERR_SUCCESS)
+		return;
+	uint32_t index = takion_send_buffer_index(send_buffer, seq_num);
+	ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[index];
+	if(packet->reserved && packet->seq_num == seq_num)
 	{
-		CHIAKI_LOGE(send_buffer->log, "Takion Send Buffer overflow");
-		err = CHIAKI_ERR_OVERFLOW;
-		goto beach;
+		takion_send_buffer_remove(send_buffer, index);
+		chiaki_cond_broadcast(&send_buffer->space_cond);
 	}
+	chiaki_mutex_unlock(&send_buffer->mutex);
+}
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size, uint64_t timeout_ms)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		if(send_buffer->packets[i].seq_num == seq_num)
-		{
-			CHIAKI_LOGE(send_buffer->log, "Tried to push duplicate seqnum into Takion Send Buffer");
-			err = CHIAKI_ERR_INVALID_DATA;
+		free(buf);
+		return err;
+	}
+
+	uint32_t index = takion_send_buffer_index(send_buffer, seq_num);
+	ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[index];
+	if(!packet->reserved || packet->seq_num != seq_num)
+	{
+		err = takion_send_buffer_reserve_locked(send_buffer, seq_num, timeout_ms);
+		if(err != CHIAKI_ERR_SUCCESS)
 			goto beach;
-		}
 	}
 
-	ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[send_buffer->packets_count++];
-	packet->seq_num = seq_num;
-	packet->tries = 0;
-	packet->last_send_ms = chiaki_time_now_monotonic_ms();
 	packet->buf = buf;
 	packet->buf_size = buf_size;
+	packet->reserved = false;
+	send_buffer->packets_reserved--;
+	if(packet->acked)
+	{
+		// the ack overtook us, nothing to re-send
+		takion_send_buffer_remove(send_buffer, index);
+		chiaki_cond_broadcast(&send_buffer->space_cond);
+		goto beach;
+	}
+
+	packet->tries = 0;
+	packet->first_send_us = chiaki_time_now_monotonic_us();
+	packet->deadline_ms = packet->first_send_us / 1000 + chiaki_rtt_estimator_rto_ms(&send_buffer->rtt);
+	takion_send_buffer_wheel_insert(send_buffer, index);
 
 	CHIAKI_LOGV(send_buffer->log, "Pushed seq num %#llx into Takion Send Buffer", (unsigned long long)seq_num);
 
-	if(send_buffer->packets_count == 1)
+	if(send_buffer->packets_count - send_buffer->packets_reserved == 1)
 	{
 		// buffer was empty before, so it will sleep without timeout => WAKE UP!!
-		chiaki_cond_signal(&send_buffer->cond);
+		if(send_buffer->event_loop)
+			chiaki_event_loop_timer_set_oneshot(&send_buffer->resend_timer, chiaki_rtt_estimator_rto_ms(&send_buffer->rtt));
+		else
+			chiaki_cond_signal(&send_buffer->cond);
 	}
 
 beach:
@@ -136,61 +340,63 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuff
 	if(acked_seq_nums_count)
 		*acked_seq_nums_count = 0;
 
-	size_t i;
-	size_t shift = 0; // amount to shift back
-	size_t shift_start = SIZE_MAX;
-	for(i=0; i<send_buffer->packets_count; i++)
-	{
-		if(send_buffer->packets[i].seq_num == seq_num || chiaki_seq_num_32_lt(send_buffer->packets[i].seq_num, seq_num))
-		{
-			if(acked_seq_nums && acked_seq_nums_count)
-				acked_seq_nums[(*acked_seq_nums_count)++] = send_buffer->packets[i].seq_num;
-
-			free(send_buffer->packets[i].buf);
-			if(shift_start == SIZE_MAX)
-			{
-				// first shift
-				shift_start = i;
-				shift = 1;
-			}
-			else if(shift_start + shift == i)
-			{
-				// still in the same gap
-				shift++;
-			}
-			else
-			{
-				// new gap, do shift
-				memmove(send_buffer->packets + shift_start,
-						send_buffer->packets + shift_start + shift,
-						(i - (shift_start + shift)) * sizeof(ChiakiTakionSendBufferPacket));
-				// start new shift
-				shift_start = i - shift;
-				shift++;
-			}
-		}
-	}
+	if(!send_buffer->packets_count || chiaki_seq_num_32_lt(seq_num, send_buffer->seq_num_first))
+		goto beach;
 
-	if(shift_start != SIZE_MAX)
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	uint64_t rtt_us = 0;
+	ChiakiSeqNum32 end = (chiaki_seq_num_32_lt(seq_num, send_buffer->seq_num_last) ? seq_num : send_buffer->seq_num_last) + 1;
+	for(ChiakiSeqNum32 cur = send_buffer->seq_num_first; cur != end && send_buffer->packets_count; cur++)
 	{
-		// do final shift
-		if(shift_start + shift < send_buffer->packets_count)
+		uint32_t index = takion_send_buffer_index(send_buffer, cur);
+		ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[index];
+		if(packet->reserved && packet->seq_num == cur)
 		{
-			memmove(send_buffer->packets + shift_start,
-					send_buffer->packets + shift_start + shift,
-					(send_buffer->packets_count - (shift_start + shift)) * sizeof(ChiakiTakionSendBufferPacket));
+			// sent, but not pushed yet, so it is removed by the push
+			packet->acked = true;
+			continue;
 		}
-		send_buffer->packets_count -= shift;
+		if(!packet->buf || packet->seq_num != cur)
+			continue;
+		if(acked_seq_nums && acked_seq_nums_count)
+			acked_seq_nums[(*acked_seq_nums_count)++] = cur;
+		if(!packet->tries)
+			rtt_us = now_us - packet->first_send_us;
+		takion_send_buffer_remove(send_buffer, index);
 	}
 
+	if(rtt_us)
+		chiaki_rtt_estimator_sample(&send_buffer->rtt, rtt_us);
+
+	chiaki_cond_broadcast(&send_buffer->space_cond);
+
 	CHIAKI_LOGV(send_buffer->log, "Acked seq num %#llx from Takion Send Buffer", (unsigned long long)seq_num);
 
+beach:
 	chiaki_mutex_unlock(&send_buffer->mutex);
 	return err;
 }
 
 static void takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer);
 
+/**
+ * @return ms until the next tick that has packets in the wheel, UINT64_MAX if there are none
+ */
+static uint64_t takion_send_buffer_next_timeout_ms(ChiakiTakionSendBuffer *send_buffer)
+{
+	if(send_buffer->packets_count == send_buffer->packets_reserved)
+		return UINT64_MAX;
+	uint64_t now_ms = chiaki_time_now_monotonic_ms();
+	for(uint64_t tick = send_buffer->wheel_tick + 1; tick <= send_buffer->wheel_tick + CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS; tick++)
+	{
+		if(send_buffer->wheel[tick % CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS] == TAKION_SEND_BUFFER_INDEX_NONE)
+			continue;
+		uint64_t tick_ms = tick * CHIAKI_TAKION_SEND_BUFFER_WHEEL_TICK_MS;
+		return tick_ms > now_ms ? tick_ms - now_ms : 1;
+	}
+	return CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS * CHIAKI_TAKION_SEND_BUFFER_WHEEL_TICK_MS;
+}
+
 static bool takion_send_buffer_check_pred_packets(void *user)
 {
 	ChiakiTakionSendBuffer *send_buffer = user;
@@ -200,7 +406,7 @@ static bool takion_send_buffer_check_pred_packets(void *user)
 static bool takion_send_buffer_check_pred_no_packets(void *user)
 {
 	ChiakiTakionSendBuffer *send_buffer = user;
-	return send_buffer->should_stop || send_buffer->packets_count;
+	return send_buffer->should_stop || send_buffer->packets_count > send_buffer->packets_reserved;
 }
 
 static void *takion_send_buffer_thread_func(void *user)
@@ -213,8 +419,9 @@ static void *takion_send_buffer_thread_func(void *user)
 
 	while(true)
 	{
-		if(send_buffer->packets_count) // if there are packets, wait with timeout
-			err = chiaki_cond_timedwait_pred(&send_buffer->cond, &send_buffer->mutex, TAKION_DATA_RESEND_WAKEUP_TIMEOUT_MS, takion_send_buffer_check_pred_packets, send_buffer);
+		uint64_t timeout_ms = takion_send_buffer_next_timeout_ms(send_buffer);
+		if(timeout_ms != UINT64_MAX) // if there are packets, wait until the next one is due
+			err = chiaki_cond_timedwait_pred(&send_buffer->cond, &send_buffer->mutex, timeout_ms, takion_send_buffer_check_pred_packets, send_buffer);
 		else // if not, wait without timeout, but also wakeup if packets become available
 			err = chiaki_cond_wait_pred(&send_buffer->cond, &send_buffer->mutex, takion_send_buffer_check_pred_no_packets, send_buffer);
 
@@ -231,36 +438,79 @@ static void *takion_send_buffer_thread_func(void *user)
 	return NULL;
 }
 
-static void takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer)
+static void takion_send_buffer_timer_cb(void *user)
 {
-	if(!send_buffer->takion)
+	ChiakiTakionSendBuffer *send_buffer = user;
+
+	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
 		return;
 
+	takion_send_buffer_resend(send_buffer);
+
+	// nothing left to re-send, so do not wake up again until the next push
+	uint64_t timeout_ms = takion_send_buffer_next_timeout_ms(send_buffer);
+	chiaki_event_loop_timer_set_oneshot(&send_buffer->resend_timer, timeout_ms == UINT64_MAX ? 0 : timeout_ms);
+
+	chiaki_mutex_unlock(&send_buffer->mutex);
+}
+
+static void takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer)
+{
 	uint64_t now = chiaki_time_now_monotonic_ms();
+	uint64_t now_tick = now / CHIAKI_TAKION_SEND_BUFFER_WHEEL_TICK_MS;
+	if(now_tick <= send_buffer->wheel_tick)
+		return;
+
+	// visit each slot at most once, even if we slept for longer than a whole wheel turn
+	uint64_t tick = send_buffer->wheel_tick + 1;
+	if(now_tick - send_buffer->wheel_tick > CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS)
+		tick = now_tick - CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS + 1;
+	send_buffer->wheel_tick = now_tick;
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
+	bool removed = false;
+	bool resent = false;
+	uint64_t rto_ms = chiaki_rtt_estimator_rto_ms(&send_buffer->rtt);
+	for(; tick <= now_tick; tick++)
 	{
-		ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[i];
-		if(now - packet->last_send_ms > TAKION_DATA_RESEND_TIMEOUT_MS)
+		uint32_t *head = &send_buffer->wheel[tick % CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS];
+		// detach the slot's list, packets that are not due yet are put back
+		uint32_t index = *head;
+		*head = TAKION_SEND_BUFFER_INDEX_NONE;
+		while(index != TAKION_SEND_BUFFER_INDEX_NONE)
 		{
-			if(packet->tries >= TAKION_DATA_RESEND_TRIES_MAX)
+			ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[index];
+			uint32_t next = packet->wheel_next;
+			packet->wheel_prev = packet->wheel_next = TAKION_SEND_BUFFER_INDEX_NONE;
+
+			if(packet->deadline_ms > now)
+				takion_send_buffer_wheel_insert(send_buffer, index);
+			else if(packet->tries >= TAKION_DATA_RESEND_TRIES_MAX)
 			{
 				CHIAKI_LOGI(send_buffer->log, "Hit max retries of %d tries... giving up on packet with seqnum %#llx", TAKION_DATA_RESEND_TRIES_MAX, (unsigned long long)packet->seq_num);
-				ChiakiSeqNum32 ack_seq_nums[TAKION_SEND_BUFFER_SIZE];
-				size_t ack_seq_nums_count;
-				chiaki_mutex_unlock(&send_buffer->mutex);
-				chiaki_takion_send_buffer_ack(send_buffer, packet->seq_num, ack_seq_nums, &ack_seq_nums_count);
-				chiaki_mutex_lock(&send_buffer->mutex);
-				if(i > 0)
-					i-= 1;
-				continue;
+				send_buffer->stats.give_ups++;
+				takion_send_buffer_remove(send_buffer, index);
+				removed = true;
 			}
-			CHIAKI_LOGI(send_buffer->log, "Takion Send Buffer re-sending packet with seqnum %#llx, tries: %llu", (unsigned long long)packet->seq_num, (unsigned long long)packet->tries);
-			packet->last_send_ms = now;
-			chiaki_takion_send_raw(send_buffer->takion, packet->buf, packet->buf_size);
-			packet->tries++;
+			else
+			{
+				CHIAKI_LOGI(send_buffer->log, "Takion Send Buffer re-sending packet with seqnum %#llx, tries: %llu", (unsigned long long)packet->seq_num, (unsigned long long)packet->tries);
+				if(send_buffer->takion)
+					chiaki_takion_send_raw(send_buffer->takion, packet->buf, packet->buf_size);
+				send_buffer->stats.resends++;
+				packet->tries++;
+				packet->deadline_ms = now + rto_ms;
+				resent = true;
+				takion_send_buffer_wheel_insert(send_buffer, index);
+			}
+			index = next;
 		}
 	}
+
+	if(resent)
+		chiaki_rtt_estimator_backoff(&send_buffer->rtt);
+	if(removed)
+		chiaki_cond_broadcast(&send_buffer->space_cond);
 }
 
 #endif
@@ -9,6 +9,10 @@
 #include <stdlib.h>
 #include <errno.h>
 
+#ifndef _WIN32
+#include <sched.h>
+#endif
+
 #ifdef __SWITCH__
 #include <switch.h>
 #endif
@@ -72,6 +76,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_join(ChiakiThread *thread, void **re
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT bool chiaki_thread_is_current(ChiakiThread *thread)
+{
+#if _WIN32
+	return GetThreadId(thread->thread) == GetCurrentThreadId();
+#else
+	return pthread_equal(thread->thread, pthread_self()) != 0;
+#endif
+}
+
 //#define CHIAKI_WINDOWS_THREAD_NAME
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_set_name(ChiakiThread *thread, const char *name)
@@ -97,6 +110,17 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_set_name(ChiakiThread *thread, const
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT void chiaki_thread_yield()
+{
+#if _WIN32
+	SwitchToThread();
+#elif defined(__SWITCH__)
+	svcSleepThread(0);
+#else
+	sched_yield();
+#endif
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_init(ChiakiMutex *mutex, bool rec)
 {
 #if _WIN32
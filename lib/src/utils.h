@@ -21,6 +21,15 @@
 #endif
 
 #include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CHIAKI_XOR_BYTES_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CHIAKI_XOR_BYTES_NEON
+#endif
 
 static inline ChiakiErrorCode set_port(struct sockaddr *sa, uint16_t port)
 {
@@ -93,8 +102,30 @@ static inline int sendto_broadcast(ChiakiLog *log, chiaki_socket_t s, const void
 	return sendto(s, (CHIAKI_SOCKET_BUF_TYPE) msg, len, flags, to, tolen);
 }
 
-static inline void xor_bytes(uint8_t *dst, uint8_t *src, size_t sz)
+/**
+ * dst ^= src, 16 bytes at a time with unaligned vector loads where available.
+ */
+static inline void xor_bytes(uint8_t *dst, const uint8_t *src, size_t sz)
 {
+#if defined(CHIAKI_XOR_BYTES_SSE2)
+	for(; sz >= 16; dst += 16, src += 16, sz -= 16)
+	{
+		__m128i d = _mm_loadu_si128((const __m128i *)dst);
+		__m128i s = _mm_loadu_si128((const __m128i *)src);
+		_mm_storeu_si128((__m128i *)dst, _mm_xor_si128(d, s));
+	}
+#elif defined(CHIAKI_XOR_BYTES_NEON)
+	for(; sz >= 16; dst += 16, src += 16, sz -= 16)
+		vst1q_u8(dst, veorq_u8(vld1q_u8(dst), vld1q_u8(src)));
+#endif
+	for(; sz >= sizeof(uint64_t); dst += sizeof(uint64_t), src += sizeof(uint64_t), sz -= sizeof(uint64_t))
+	{
+		uint64_t d, s;
+		memcpy(&d, dst, sizeof(d));
+		memcpy(&s, src, sizeof(s));
+		d ^= s;
+		memcpy(dst, &d, sizeof(d));
+	}
 	while(sz > 0)
 	{
 		*dst ^= *src;
@@ -1,36 +1,69 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#define CHIAKI_LOG_SUBSYSTEM CHIAKI_LOG_SUBSYSTEM_VIDEO
+
 #include <chiaki/videoreceiver.h>
 #include <chiaki/session.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 
-static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver);
+static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver, ChiakiFrameProcessor *frame_processor, bool allow_async);
+static void chiaki_video_receiver_emit_frame(ChiakiFrameProcessorFlushResult flush_result, ChiakiSeqNum16 frame_index,
+		uint8_t *frame, size_t frame_size, ChiakiFrameProcessorTimes *times, ChiakiFrameProcessorNal *nal, void *user);
+
+void chiaki_session_send_event(ChiakiSession *session, ChiakiEvent *event);
+
+CHIAKI_EXPORT void chiaki_video_reference_window_reset(ChiakiVideoReferenceWindow *window)
+{
+	window->newest = 0;
+	window->bits = 0;
+}
 
-static void add_ref_frame(ChiakiVideoReceiver *video_receiver, int32_t frame)
+CHIAKI_EXPORT void chiaki_video_reference_window_add(ChiakiVideoReferenceWindow *window, ChiakiSeqNum16 frame_index)
 {
-	if(video_receiver->reference_frames[0] != -1)
+	if(!window->bits || chiaki_seq_num_16_gt(frame_index, window->newest))
 	{
-		memmove(&video_receiver->reference_frames[1], &video_receiver->reference_frames[0], sizeof(int32_t) * 15);
-		video_receiver->reference_frames[0] = frame;
+		ChiakiSeqNum16 shift = window->bits ? (ChiakiSeqNum16)(frame_index - window->newest) : CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE;
+		window->bits = shift < CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE ? (uint16_t)(window->bits << shift) : 0;
+		window->bits |= 1;
+		window->newest = frame_index;
 		return;
 	}
-	for(int i=15; i>=0; i--)
-	{
-		if(video_receiver->reference_frames[i] == -1)
-		{
-			video_receiver->reference_frames[i] = frame;
-			return;
-		}
-	}
+	ChiakiSeqNum16 age = window->newest - frame_index;
+	if(age < CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE)
+		window->bits |= (uint16_t)(1 << age);
 }
 
-static bool have_ref_frame(ChiakiVideoReceiver *video_receiver, int32_t frame)
+CHIAKI_EXPORT bool chiaki_video_reference_window_contains(ChiakiVideoReferenceWindow *window, ChiakiSeqNum16 frame_index)
 {
-	for(int i=0; i<16; i++)
-		if(video_receiver->reference_frames[i] == frame)
-			return true;
-	return false;
+	if(!window->bits || chiaki_seq_num_16_gt(frame_index, window->newest))
+		return false;
+	ChiakiSeqNum16 age = window->newest - frame_index;
+	return age < CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE && (window->bits & (1 << age));
+}
+
+CHIAKI_EXPORT unsigned int chiaki_video_reference_window_nearest(ChiakiVideoReferenceWindow *window, ChiakiSeqNum16 frame_index, unsigned int distance_min)
+{
+	if(!window->bits || distance_min > CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE)
+		return 0;
+
+	// realign the window so that bit i is frame_index - i
+	uint32_t refs;
+	if(chiaki_seq_num_16_lt(window->newest, frame_index))
+	{
+		ChiakiSeqNum16 shift = frame_index - window->newest;
+		refs = shift <= CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE ? (uint32_t)window->bits << shift : 0;
+	}
+	else
+	{
+		ChiakiSeqNum16 shift = window->newest - frame_index;
+		refs = shift < CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE ? (uint32_t)window->bits >> shift : 0;
+	}
+
+	refs &= ((uint32_t)1 << (CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE + 1)) - 1;
+	refs &= ~(((uint32_t)1 << distance_min) - 1);
+	return refs ? (unsigned int)__builtin_ctz(refs) : 0;
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
@@ -42,22 +75,66 @@ CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receive
 	video_receiver->profile_cur = -1;
 
 	video_receiver->frame_index_cur = -1;
+	video_receiver->frame_index_flush = -1;
 	video_receiver->frame_index_prev = -1;
 	video_receiver->frame_index_prev_complete = 0;
 
-	chiaki_frame_processor_init(&video_receiver->frame_processor, video_receiver->log);
+	video_receiver->frame_slots_count = session->connect_info.video_reorder_frames;
+	if(video_receiver->frame_slots_count < 1)
+		video_receiver->frame_slots_count = 1;
+	else if(video_receiver->frame_slots_count > CHIAKI_VIDEO_RECEIVER_FRAME_SLOTS_MAX)
+		video_receiver->frame_slots_count = CHIAKI_VIDEO_RECEIVER_FRAME_SLOTS_MAX;
+	video_receiver->reorder_deadline_us = session->connect_info.video_reorder_deadline_us;
+	if(!video_receiver->reorder_deadline_us)
+		video_receiver->reorder_deadline_us = CHIAKI_VIDEO_RECEIVER_REORDER_DEADLINE_US_DEFAULT;
+	memset(&video_receiver->reorder_stats, 0, sizeof(video_receiver->reorder_stats));
+	chiaki_stream_stats_reset(&video_receiver->stream_stats);
+
 	video_receiver->packet_stats = packet_stats;
+	unsigned int fps = session->connect_info.video_profile.max_fps ? session->connect_info.video_profile.max_fps : 60;
+	video_receiver->frame_interval_us = 1000000 / fps;
+	video_receiver->frame_cur_first_unit_us = 0;
+	video_receiver->congestion_control = NULL;
+	memset(&video_receiver->frame_times, 0, sizeof(video_receiver->frame_times));
+	for(size_t i=0; i<video_receiver->frame_slots_count; i++)
+	{
+		ChiakiVideoReceiverFrameSlot *slot = &video_receiver->frame_slots[i];
+		slot->frame_index = -1;
+		slot->flushed = true;
+		slot->overtaken_us = 0;
+		chiaki_frame_processor_init(&slot->frame_processor, video_receiver->log);
+		if(session->video_sample_alloc_cb)
+			chiaki_frame_processor_set_alloc_cb(&slot->frame_processor, session->video_sample_alloc_cb, session->video_sample_cb_user);
+		if(!session->connect_info.video_fec_async)
+			continue;
+		// all slots share one worker, so their frames are emitted in the order they were flushed
+		if(i == 0)
+		{
+			ChiakiErrorCode err = chiaki_frame_processor_fec_worker_start(&slot->frame_processor, chiaki_video_receiver_emit_frame, video_receiver);
+			if(err != CHIAKI_ERR_SUCCESS)
+				CHIAKI_LOGE(video_receiver->log, "Failed to start FEC worker, recovering frames synchronously");
+		}
+		else
+			chiaki_frame_processor_fec_worker_share(&slot->frame_processor, &video_receiver->frame_slots[0].frame_processor);
+	}
 
 	video_receiver->frames_lost = 0;
-	memset(video_receiver->reference_frames, -1, sizeof(video_receiver->reference_frames));
+	chiaki_video_reference_window_reset(&video_receiver->reference_frames);
 	chiaki_bitstream_init(&video_receiver->bitstream, video_receiver->log, video_receiver->session->connect_info.video_profile.codec);
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receiver)
 {
+	if(video_receiver->frame_slots_count > 1)
+		CHIAKI_LOGI(video_receiver->log, "Video Receiver reordering rescued %llu frames, %llu frames hit the deadline, %llu frames were evicted",
+				(unsigned long long)video_receiver->reorder_stats.frames_rescued,
+				(unsigned long long)video_receiver->reorder_stats.frames_deadline,
+				(unsigned long long)video_receiver->reorder_stats.frames_evicted);
+	// the last one stops the fec worker, which may still emit frames
+	for(size_t i=0; i<video_receiver->frame_slots_count; i++)
+		chiaki_frame_processor_fini(&video_receiver->frame_slots[i].frame_processor);
 	for(size_t i=0; i<video_receiver->profiles_count; i++)
 		free(video_receiver->profiles[i].header);
-	chiaki_frame_processor_fini(&video_receiver->frame_processor);
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_receiver, ChiakiVideoProfile *profiles, size_t profiles_count)
@@ -80,12 +157,197 @@ CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_
 	}
 }
 
+CHIAKI_EXPORT void chiaki_video_receiver_get_reorder_stats(ChiakiVideoReceiver *video_receiver, ChiakiVideoReceiverReorderStats *stats)
+{
+	*stats = video_receiver->reorder_stats;
+}
+
+/**
+ * Collect the stream stats of all slots, frames still on the fec worker are counted once they have been emitted.
+ */
+static void video_receiver_collect_stream_stats(ChiakiVideoReceiver *video_receiver)
+{
+	for(size_t i=0; i<video_receiver->frame_slots_count; i++)
+	{
+		ChiakiFrameProcessor *frame_processor = &video_receiver->frame_slots[i].frame_processor;
+		video_receiver->stream_stats.frames += frame_processor->stream_stats.frames;
+		video_receiver->stream_stats.bytes += frame_processor->stream_stats.bytes;
+		chiaki_stream_stats_reset(&frame_processor->stream_stats);
+	}
+}
+
+/**
+ * Wait until the fec worker has emitted all frames and collect the stream stats.
+ */
+static void video_receiver_fec_wait(ChiakiVideoReceiver *video_receiver)
+{
+	chiaki_frame_processor_fec_wait(&video_receiver->frame_slots[0].frame_processor);
+	video_receiver_collect_stream_stats(video_receiver);
+}
+
+static ChiakiVideoReceiverFrameSlot *video_receiver_slot_find(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 frame_index)
+{
+	for(size_t i=0; i<video_receiver->frame_slots_count; i++)
+	{
+		ChiakiVideoReceiverFrameSlot *slot = &video_receiver->frame_slots[i];
+		if(slot->frame_index >= 0 && (ChiakiSeqNum16)slot->frame_index == frame_index)
+			return slot;
+	}
+	return NULL;
+}
+
+/**
+ * @return the slot with the oldest frame that has not been flushed yet, NULL if there is none
+ */
+static ChiakiVideoReceiverFrameSlot *video_receiver_slot_oldest(ChiakiVideoReceiver *video_receiver)
+{
+	ChiakiVideoReceiverFrameSlot *oldest = NULL;
+	for(size_t i=0; i<video_receiver->frame_slots_count; i++)
+	{
+		ChiakiVideoReceiverFrameSlot *slot = &video_receiver->frame_slots[i];
+		if(slot->frame_index < 0 || slot->flushed)
+			continue;
+		if(!oldest || chiaki_seq_num_16_lt((ChiakiSeqNum16)slot->frame_index, (ChiakiSeqNum16)oldest->frame_index))
+			oldest = slot;
+	}
+	return oldest;
+}
+
+static void video_receiver_flush_slot(ChiakiVideoReceiver *video_receiver, ChiakiVideoReceiverFrameSlot *slot)
+{
+	video_receiver->frame_index_flush = slot->frame_index;
+	slot->flushed = true;
+	chiaki_video_receiver_flush_frame(video_receiver, &slot->frame_processor, true);
+	video_receiver_collect_stream_stats(video_receiver);
+}
+
+/**
+ * Flush frames in order, as long as the oldest pending one is decodable or has been given up on.
+ *
+ * @param last_unit_slot slot that has just received the last unit of its frame, if any
+ */
+static void video_receiver_flush_ready(ChiakiVideoReceiver *video_receiver, ChiakiVideoReceiverFrameSlot *last_unit_slot)
+{
+	uint64_t now_us = 0;
+	ChiakiVideoReceiverFrameSlot *slot;
+	while((slot = video_receiver_slot_oldest(video_receiver)))
+	{
+		if(chiaki_frame_processor_flush_possible(&slot->frame_processor))
+		{
+			if(slot->overtaken_us)
+				video_receiver->reorder_stats.frames_rescued++;
+		}
+		else if(video_receiver->frame_slots_count == 1)
+		{
+			// without reordering, the rest of the frame is lost once its last unit arrived
+			if(slot != last_unit_slot)
+				break;
+		}
+		else
+		{
+			// the deadline is only checked when packets arrive, which they do continuously while streaming
+			if(!slot->overtaken_us)
+				break;
+			if(!now_us)
+				now_us = chiaki_time_now_monotonic_us();
+			if(now_us - slot->overtaken_us < video_receiver->reorder_deadline_us)
+				break;
+			video_receiver->reorder_stats.frames_deadline++;
+		}
+		video_receiver_flush_slot(video_receiver, slot);
+	}
+}
+
+/**
+ * Count how much the time since the previous frame started deviates from the frame interval
+ */
+static void video_receiver_push_jitter(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 frame_index, uint64_t now_us)
+{
+	if(video_receiver->packet_stats && video_receiver->frame_index_cur >= 0 && video_receiver->frame_cur_first_unit_us)
+	{
+		uint64_t frames = (ChiakiSeqNum16)(frame_index - (ChiakiSeqNum16)video_receiver->frame_index_cur);
+		uint64_t expected_us = frames * video_receiver->frame_interval_us;
+		uint64_t delta_us = now_us - video_receiver->frame_cur_first_unit_us;
+		chiaki_packet_stats_push_hist(video_receiver->packet_stats, CHIAKI_PACKET_STATS_HIST_JITTER,
+				delta_us > expected_us ? delta_us - expected_us : expected_us - delta_us);
+	}
+	video_receiver->frame_cur_first_unit_us = now_us;
+}
+
+/**
+ * @return slot that has been allocated for the frame of packet, NULL if the frame is too old
+ */
+static ChiakiVideoReceiverFrameSlot *video_receiver_slot_alloc(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet)
+{
+	ChiakiSeqNum16 frame_index = packet->frame_index;
+
+	// prefer an unused slot, then the one with the oldest flushed frame
+	ChiakiVideoReceiverFrameSlot *slot = NULL;
+	for(size_t i=0; i<video_receiver->frame_slots_count; i++)
+	{
+		ChiakiVideoReceiverFrameSlot *s = &video_receiver->frame_slots[i];
+		if(s->frame_index < 0)
+		{
+			slot = s;
+			break;
+		}
+		if(s->flushed && (!slot || chiaki_seq_num_16_lt((ChiakiSeqNum16)s->frame_index, (ChiakiSeqNum16)slot->frame_index)))
+			slot = s;
+	}
+
+	if(!slot)
+	{
+		// all slots are being filled, so give up on the oldest frame
+		slot = video_receiver_slot_oldest(video_receiver);
+		if(chiaki_seq_num_16_lt(frame_index, (ChiakiSeqNum16)slot->frame_index))
+		{
+			// flushing would emit frames out of order
+			CHIAKI_LOGW(video_receiver->log, "Video Receiver received old frame packet");
+			return NULL;
+		}
+		if(video_receiver->frame_slots_count > 1)
+			video_receiver->reorder_stats.frames_evicted++;
+		video_receiver_flush_slot(video_receiver, slot);
+	}
+
+	// late units of the previous frame are counted here even if the fec worker is still busy with its own copy of it
+	if(slot->frame_index >= 0 && video_receiver->packet_stats)
+		chiaki_frame_processor_report_packet_stats(&slot->frame_processor, video_receiver->packet_stats);
+
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	for(size_t i=0; i<video_receiver->frame_slots_count; i++)
+	{
+		ChiakiVideoReceiverFrameSlot *s = &video_receiver->frame_slots[i];
+		if(s->frame_index < 0 || s->flushed || s->overtaken_us
+			|| !chiaki_seq_num_16_lt((ChiakiSeqNum16)s->frame_index, frame_index)
+			|| chiaki_frame_processor_flush_possible(&s->frame_processor))
+			continue;
+		s->overtaken_us = now_us;
+	}
+
+	slot->frame_index = frame_index;
+	slot->flushed = false;
+	slot->overtaken_us = 0;
+	if(video_receiver->frame_index_cur < 0
+		|| chiaki_seq_num_16_gt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_cur))
+	{
+		video_receiver_push_jitter(video_receiver, frame_index, now_us);
+		video_receiver->frame_index_cur = frame_index;
+	}
+	else // a whole frame arrived late
+		slot->overtaken_us = now_us;
+
+	chiaki_frame_processor_alloc_frame(&slot->frame_processor, packet);
+	return slot;
+}
+
 CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet)
 {
 	// old frame?
 	ChiakiSeqNum16 frame_index = packet->frame_index;
-	if(video_receiver->frame_index_cur >= 0
-		&& chiaki_seq_num_16_lt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_cur))
+	ChiakiVideoReceiverFrameSlot *slot = video_receiver_slot_find(video_receiver, frame_index);
+	if(!slot && video_receiver->frame_index_flush >= 0
+		&& !chiaki_seq_num_16_gt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_flush))
 	{
 		CHIAKI_LOGW(video_receiver->log, "Video Receiver received old frame packet");
 		return;
@@ -94,6 +356,8 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 	// check adaptive stream index
 	if(video_receiver->profile_cur < 0 || video_receiver->profile_cur != packet->adaptive_stream_index)
 	{
+		// frames emitted by the fec worker use the bitstream
+		video_receiver_fec_wait(video_receiver);
 		if(packet->adaptive_stream_index >= video_receiver->profiles_count)
 		{
 			CHIAKI_LOGE(video_receiver->log, "Packet has invalid adaptive stream index %lu >= %lu",
@@ -112,88 +376,156 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 	}
 
 	// next frame?
-	if(video_receiver->frame_index_cur < 0 ||
-		chiaki_seq_num_16_gt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_cur))
+	if(!slot)
 	{
-		if(video_receiver->packet_stats)
-			chiaki_frame_processor_report_packet_stats(&video_receiver->frame_processor, video_receiver->packet_stats);
+		slot = video_receiver_slot_alloc(video_receiver, packet);
+		if(!slot)
+			return;
+	}
 
-		// last frame not flushed yet?
-		if(video_receiver->frame_index_cur >= 0 && video_receiver->frame_index_prev != video_receiver->frame_index_cur)
-			chiaki_video_receiver_flush_frame(video_receiver);
+	ChiakiErrorCode err = chiaki_frame_processor_put_unit(&slot->frame_processor, packet);
+	if(err == CHIAKI_ERR_SUCCESS && video_receiver->congestion_control
+		&& chiaki_congestion_control_wants_units(video_receiver->congestion_control))
+	{
+		ChiakiCongestionUnitSample sample = {
+			.arrival_us = chiaki_time_now_monotonic_us(),
+			.frame_index = frame_index,
+			.unit_index = packet->unit_index,
+			.units_in_frame_total = packet->units_in_frame_total,
+			.size = packet->data_size
+		};
+		chiaki_congestion_control_unit(video_receiver->congestion_control, &sample);
+	}
 
-		ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
-		if(chiaki_seq_num_16_gt(frame_index, next_frame_expected)
-			&& !(frame_index == 1 && video_receiver->frame_index_cur < 0)) // ok for frame 1
-		{
-			CHIAKI_LOGW(video_receiver->log, "Detected missing or corrupt frame(s) from %d to %d", next_frame_expected, (int)frame_index);
-			stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, next_frame_expected, frame_index - 1);
-		}
+	// if we are currently building up this frame, flush it and any following ones as soon as possible
+	if(!slot->flushed)
+		video_receiver_flush_ready(video_receiver, packet->unit_index == packet->units_in_frame_total - 1 ? slot : NULL);
+}
 
-		video_receiver->frame_index_cur = frame_index;
-		chiaki_frame_processor_alloc_frame(&video_receiver->frame_processor, packet);
+static void video_receiver_frame_result(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 frame_index, ChiakiFrameProcessorFlushResult flush_result)
+{
+	if(video_receiver->packet_stats)
+	{
+		ChiakiPacketStatsFrameResult result = CHIAKI_PACKET_STATS_FRAME_FAILED;
+		if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS)
+			result = CHIAKI_PACKET_STATS_FRAME_COMPLETE;
+		else if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS)
+			result = CHIAKI_PACKET_STATS_FRAME_FEC_RECOVERED;
+		chiaki_packet_stats_push_frame(video_receiver->packet_stats, result);
 	}
+	if(video_receiver->congestion_control)
+	{
+		ChiakiCongestionFrameSample sample = {
+			.frame_index = frame_index,
+			.result = flush_result
+		};
+		chiaki_congestion_control_frame(video_receiver->congestion_control, &sample);
+	}
+}
 
-	chiaki_frame_processor_put_unit(&video_receiver->frame_processor, packet);
-
-	// if we are currently building up a frame
-	if(video_receiver->frame_index_cur != video_receiver->frame_index_prev)
+/**
+ * Flush frame_index_flush from frame_processor.
+ *
+ * @param allow_async whether the frame may be handed over to the fec worker
+ */
+static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver, ChiakiFrameProcessor *frame_processor, bool allow_async)
+{
+	// frames are emitted in order, so once one went to the fec worker, the following ones have to go there too
+	if(allow_async && frame_processor->fec_worker && !frame_processor->flushed
+		&& (frame_processor->units_source_received < frame_processor->units_source_expected
+			|| chiaki_frame_processor_fec_pending(frame_processor)))
 	{
-		// if we already have enough for the whole frame, flush it already
-		if(chiaki_frame_processor_flush_possible(&video_receiver->frame_processor) || packet->unit_index == packet->units_in_frame_total - 1)
-			chiaki_video_receiver_flush_frame(video_receiver);
+		ChiakiErrorCode err = chiaki_frame_processor_flush_async(frame_processor);
+		if(err == CHIAKI_ERR_SUCCESS)
+			return CHIAKI_ERR_SUCCESS;
 	}
+
+	// emitting here, so frames still on the worker go first, which only happens if handing over failed
+	chiaki_frame_processor_fec_wait(frame_processor);
+	uint8_t *frame = NULL;
+	size_t frame_size = 0;
+	ChiakiFrameProcessorFlushResult flush_result = frame_processor->alloc_cb
+		? chiaki_frame_processor_flush_alloc(frame_processor, frame_processor->alloc_cb, frame_processor->alloc_cb_user, &frame, &frame_size)
+		: chiaki_frame_processor_flush(frame_processor, &frame, &frame_size);
+	chiaki_video_receiver_emit_frame(flush_result, (ChiakiSeqNum16)video_receiver->frame_index_flush, frame, frame_size,
+			&frame_processor->times, &frame_processor->nal, video_receiver);
+	return flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS || flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS
+		? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_UNKNOWN;
 }
 
-static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver)
+/**
+ * Hand a flushed frame to the decoder and account for the frames before it, either from
+ * chiaki_video_receiver_flush_frame() or on the fec worker, always in frame order.
+ * Only touches state that the takion thread leaves alone while frames are on the fec worker.
+ */
+static void chiaki_video_receiver_emit_frame(ChiakiFrameProcessorFlushResult flush_result, ChiakiSeqNum16 frame_index,
+		uint8_t *frame, size_t frame_size, ChiakiFrameProcessorTimes *times, ChiakiFrameProcessorNal *nal, void *user)
 {
-	uint8_t *frame;
-	size_t frame_size;
-	ChiakiFrameProcessorFlushResult flush_result = chiaki_frame_processor_flush(&video_receiver->frame_processor, &frame, &frame_size);
+	ChiakiVideoReceiver *video_receiver = user;
+	video_receiver->frame_times = *times;
+	video_receiver_frame_result(video_receiver, frame_index, flush_result);
+	CHIAKI_LOGV(video_receiver->log, "Frame %d emitted %llu us after its first unit, %llu us after it was decodable",
+			(int)frame_index,
+			(unsigned long long)(times->emitted_us - times->first_unit_us),
+			(unsigned long long)(times->decodable_us ? times->emitted_us - times->decodable_us : 0));
 
-	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED
-		|| flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
+	ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
+	if(chiaki_seq_num_16_gt(frame_index, next_frame_expected)
+		&& !(frame_index == 1 && video_receiver->frame_index_prev < 0)) // ok for frame 1
 	{
-		if (flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
-		{
-			ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
-			stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, next_frame_expected, video_receiver->frame_index_cur);
-			video_receiver->frames_lost += video_receiver->frame_index_cur - next_frame_expected + 1;
-			video_receiver->frame_index_prev = video_receiver->frame_index_cur;
-		}
-		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)video_receiver->frame_index_cur);
-		return CHIAKI_ERR_UNKNOWN;
+		CHIAKI_LOGW(video_receiver->log, "Detected missing or corrupt frame(s) from %d to %d", next_frame_expected, (int)frame_index);
+		stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, next_frame_expected, frame_index - 1);
+	}
+
+	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED)
+	{
+		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)frame_index);
+		return;
+	}
+	video_receiver->frame_index_prev = frame_index;
+
+	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
+	{
+		stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, next_frame_expected, frame_index);
+		video_receiver->frames_lost += frame_index - next_frame_expected + 1;
+		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)frame_index);
+		return;
 	}
 
 	bool succ = flush_result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
 	bool recovered = false;
+	ChiakiEvent recovered_event = { 0 };
 
+	// the frame processor already knows where the slice starts, only fall back to searching if it does not
 	ChiakiBitstreamSlice slice;
-	if(chiaki_bitstream_slice(&video_receiver->bitstream, frame, frame_size, &slice))
+	bool slice_parsed = nal->size
+		? chiaki_bitstream_slice_nal(&video_receiver->bitstream, frame + nal->offset, nal->size, &slice)
+		: chiaki_bitstream_slice(&video_receiver->bitstream, frame, frame_size, &slice);
+	if(slice_parsed)
 	{
 		if(slice.slice_type == CHIAKI_BITSTREAM_SLICE_P)
 		{
-			ChiakiSeqNum16 ref_frame_index = video_receiver->frame_index_cur - slice.reference_frame - 1;
-			if(slice.reference_frame != 0xff && !have_ref_frame(video_receiver, ref_frame_index))
+			ChiakiSeqNum16 ref_frame_index = frame_index - slice.reference_frame - 1;
+			if(slice.reference_frame != 0xff && !chiaki_video_reference_window_contains(&video_receiver->reference_frames, ref_frame_index))
 			{
-				for(unsigned i=slice.reference_frame+1; i<16; i++)
+				// reference_frame i is at distance i + 1, so only look at older frames than the missing one
+				unsigned int distance = chiaki_video_reference_window_nearest(&video_receiver->reference_frames,
+						frame_index, slice.reference_frame + 2);
+				if(distance && chiaki_bitstream_slice_rewrite_reference_frame(&video_receiver->bitstream, &slice, distance - 1))
 				{
-					ChiakiSeqNum16 ref_frame_index_new = video_receiver->frame_index_cur - i - 1;
-					if(have_ref_frame(video_receiver, ref_frame_index_new))
-					{
-						if(chiaki_bitstream_slice_set_reference_frame(&video_receiver->bitstream, frame, frame_size, i))
-						{
-							recovered = true;
-							CHIAKI_LOGW(video_receiver->log, "Missing reference frame %d for decoding frame %d -> changed to %d", (int)ref_frame_index, (int)video_receiver->frame_index_cur, (int)ref_frame_index_new);
-						}
-						break;
-					}
+					recovered = true;
+					recovered_event.type = CHIAKI_EVENT_VIDEO_RECOVERED;
+					recovered_event.video_recovered.frame_index = frame_index;
+					recovered_event.video_recovered.reference_frame_index_missing = ref_frame_index;
+					recovered_event.video_recovered.reference_frame_index = frame_index - distance;
+					CHIAKI_LOGW(video_receiver->log, "Missing reference frame %d for decoding frame %d -> changed to %d",
+							(int)ref_frame_index, (int)frame_index, (int)recovered_event.video_recovered.reference_frame_index);
 				}
-				if(!recovered)
+				else
 				{
 					succ = false;
 					video_receiver->frames_lost++;
-					CHIAKI_LOGW(video_receiver->log, "Missing reference frame %d for decoding frame %d", (int)ref_frame_index, (int)video_receiver->frame_index_cur);
+					CHIAKI_LOGW(video_receiver->log, "Missing reference frame %d for decoding frame %d", (int)ref_frame_index, (int)frame_index);
 				}
 			}
 		}
@@ -201,6 +533,14 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 
 	if(succ && video_receiver->session->video_sample_cb)
 	{
+		if(video_receiver->session->video_sample_info_cb)
+		{
+			ChiakiVideoSampleInfo info = {
+				.frame_index = frame_index,
+				.receive_us = times->first_unit_us
+			};
+			video_receiver->session->video_sample_info_cb(&info, video_receiver->session->video_sample_cb_user);
+		}
 		// --- MODIFICAÇÃO: BYPASS DE VÍDEO ---
 		// Comentamos a chamada real que processaria o vídeo (pesado)
 		// bool cb_succ = video_receiver->session->video_sample_cb(frame, frame_size, video_receiver->frames_lost, recovered, video_receiver->session->video_sample_cb_user);
@@ -216,15 +556,15 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 		}
 		else
 		{
-			add_ref_frame(video_receiver, video_receiver->frame_index_cur);
-			CHIAKI_LOGV(video_receiver->log, "Added reference %c frame %d", slice.slice_type == CHIAKI_BITSTREAM_SLICE_I ? 'I' : 'P', (int)video_receiver->frame_index_cur);
+			chiaki_video_reference_window_add(&video_receiver->reference_frames, frame_index);
+			CHIAKI_LOGV(video_receiver->log, "Added reference %c frame %d", slice.slice_type == CHIAKI_BITSTREAM_SLICE_I ? 'I' : 'P', (int)frame_index);
 		}
 	}
 
-	video_receiver->frame_index_prev = video_receiver->frame_index_cur;
-
 	if(succ)
-		video_receiver->frame_index_prev_complete = video_receiver->frame_index_cur;
-
-	return CHIAKI_ERR_SUCCESS;
+	{
+		video_receiver->frame_index_prev_complete = frame_index;
+		if(recovered)
+			chiaki_session_send_event(video_receiver->session, &recovered_event);
+	}
 }
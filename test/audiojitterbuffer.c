@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/audiojitterbuffer.h>
+
+#define FRAME_US 10000
+
+static void put(ChiakiAudioJitterBuffer *jitter_buffer, ChiakiSeqNum16 frame_index, uint64_t arrival_us)
+{
+	uint8_t buf[2] = { frame_index & 0xff, frame_index >> 8 };
+	munit_assert_true(chiaki_audio_jitter_buffer_put(jitter_buffer, frame_index, buf, sizeof(buf), arrival_us));
+}
+
+static void assert_pull(ChiakiAudioJitterBuffer *jitter_buffer, ChiakiAudioJitterBufferAction action_expected, int frame_index_expected)
+{
+	const uint8_t *buf;
+	size_t buf_size;
+	ChiakiAudioJitterBufferAction action = chiaki_audio_jitter_buffer_pull(jitter_buffer, &buf, &buf_size);
+	munit_assert_int(action, ==, action_expected);
+	if(frame_index_expected < 0)
+	{
+		munit_assert_null(buf);
+		return;
+	}
+	munit_assert_not_null(buf);
+	munit_assert_size(buf_size, ==, 2);
+	munit_assert_uint16(buf[0] | (buf[1] << 8), ==, (ChiakiSeqNum16)frame_index_expected);
+}
+
+static MunitResult test_steady(const MunitParameter params[], void *user)
+{
+	ChiakiAudioJitterBuffer jitter_buffer;
+	chiaki_audio_jitter_buffer_init(&jitter_buffer, FRAME_US, 0, 0);
+
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_WAIT, -1);
+	put(&jitter_buffer, 0, 100000);
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_WAIT, -1);
+	for(int i=1; i<100; i++)
+	{
+		put(&jitter_buffer, i, 100000 + i * FRAME_US);
+		assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_DECODE, i - 1);
+	}
+
+	// duplicates and frames that have been played out already are ignored
+	munit_assert_false(chiaki_audio_jitter_buffer_put(&jitter_buffer, 99, (const uint8_t *)"xx", 2, 0));
+	munit_assert_false(chiaki_audio_jitter_buffer_put(&jitter_buffer, 42, (const uint8_t *)"xx", 2, 0));
+
+	ChiakiAudioJitterBufferStats stats;
+	chiaki_audio_jitter_buffer_get_stats(&jitter_buffer, &stats);
+	munit_assert_uint64(stats.decoded, ==, 99);
+	munit_assert_uint64(stats.fec_recovered, ==, 0);
+	munit_assert_uint64(stats.concealed, ==, 0);
+	munit_assert_uint64(stats.underruns, ==, 0);
+	munit_assert_uint64(stats.overruns, ==, 0);
+	munit_assert_uint64(stats.late, ==, 1);
+	munit_assert_uint64(stats.target_delay_frames, ==, CHIAKI_AUDIO_JITTER_BUFFER_DELAY_MIN_DEFAULT);
+	return MUNIT_OK;
+}
+
+static MunitResult test_loss(const MunitParameter params[], void *user)
+{
+	ChiakiAudioJitterBuffer jitter_buffer;
+	chiaki_audio_jitter_buffer_init(&jitter_buffer, FRAME_US, 0, 0);
+
+	// start right before the wraparound
+	ChiakiSeqNum16 base = 0xfffa;
+	put(&jitter_buffer, base, 0);
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_WAIT, -1);
+	for(int i=1; i<5; i++)
+	{
+		put(&jitter_buffer, base + i, i * FRAME_US);
+		assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_DECODE, (ChiakiSeqNum16)(base + i - 1));
+	}
+
+	// 5 is lost, so it is recovered from the fec data in 6
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_DECODE, (ChiakiSeqNum16)(base + 4));
+	put(&jitter_buffer, base + 6, 6 * FRAME_US);
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_DECODE_FEC, (ChiakiSeqNum16)(base + 6));
+	for(int i=7; i<10; i++)
+	{
+		put(&jitter_buffer, base + i, i * FRAME_US);
+		assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_DECODE, (ChiakiSeqNum16)(base + i - 1));
+	}
+
+	// 10 and 11 are lost, the playout runs dry before that is clear
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_DECODE, (ChiakiSeqNum16)(base + 9));
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_CONCEAL, -1);
+	put(&jitter_buffer, base + 12, 12 * FRAME_US);
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_CONCEAL, -1);
+	put(&jitter_buffer, base + 13, 13 * FRAME_US);
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_DECODE_FEC, (ChiakiSeqNum16)(base + 12));
+	put(&jitter_buffer, base + 14, 14 * FRAME_US);
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_DECODE, (ChiakiSeqNum16)(base + 12));
+
+	ChiakiAudioJitterBufferStats stats;
+	chiaki_audio_jitter_buffer_get_stats(&jitter_buffer, &stats);
+	munit_assert_uint64(stats.decoded, ==, 10);
+	munit_assert_uint64(stats.fec_recovered, ==, 2);
+	munit_assert_uint64(stats.concealed, ==, 2);
+	munit_assert_uint64(stats.underruns, ==, 1);
+	munit_assert_uint64(stats.overruns, ==, 0);
+	return MUNIT_OK;
+}
+
+static MunitResult test_underrun_overrun(const MunitParameter params[], void *user)
+{
+	ChiakiAudioJitterBuffer jitter_buffer;
+	chiaki_audio_jitter_buffer_init(&jitter_buffer, FRAME_US, 2, 4);
+
+	put(&jitter_buffer, 0, FRAME_US);
+	put(&jitter_buffer, 1, 2 * FRAME_US);
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_DECODE, 0);
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_DECODE, 1);
+
+	// the stream stops, so after concealing for the maximum delay, buffer up again
+	for(int i=0; i<4; i++)
+		assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_CONCEAL, -1);
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_WAIT, -1);
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_WAIT, -1);
+	put(&jitter_buffer, 2, 10 * FRAME_US);
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_WAIT, -1);
+	put(&jitter_buffer, 3, 11 * FRAME_US);
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_DECODE, 2);
+
+	// a burst beyond the target delay is cut down to it
+	for(int i=4; i<12; i++)
+		put(&jitter_buffer, i, 12 * FRAME_US);
+	size_t target = chiaki_audio_jitter_buffer_target_delay(&jitter_buffer);
+	munit_assert_size(target, <=, 4);
+	int first = 12 - (int)target - 2;
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_DECODE, first);
+	munit_assert_false(chiaki_audio_jitter_buffer_put(&jitter_buffer, 4, (const uint8_t *)"xx", 2, 12 * FRAME_US));
+
+	// far ahead, e.g. after an interruption, starts over
+	put(&jitter_buffer, 1000, 100 * FRAME_US);
+	put(&jitter_buffer, 1001, 101 * FRAME_US);
+	assert_pull(&jitter_buffer, CHIAKI_AUDIO_JITTER_BUFFER_DECODE, 1000);
+
+	ChiakiAudioJitterBufferStats stats;
+	chiaki_audio_jitter_buffer_get_stats(&jitter_buffer, &stats);
+	munit_assert_uint64(stats.underruns, ==, 5);
+	munit_assert_uint64(stats.concealed, ==, 4);
+	munit_assert_uint64(stats.overruns, ==, (uint64_t)(first - 3) + (11 - first));
+	munit_assert_uint64(stats.late, ==, 1);
+	return MUNIT_OK;
+}
+
+static MunitResult test_adaptive(const MunitParameter params[], void *user)
+{
+	ChiakiAudioJitterBuffer jitter_buffer;
+	chiaki_audio_jitter_buffer_init(&jitter_buffer, FRAME_US, 0, 0);
+
+	// frames arrive in bursts of 4, the playout pulls one per frame duration
+	ChiakiSeqNum16 frame_index = 0;
+	uint64_t underruns_warm = 0;
+	ChiakiAudioJitterBufferStats stats;
+	for(int tick=0; tick<1000; tick++)
+	{
+		uint64_t now_us = 100000 + tick * FRAME_US;
+		if(tick % 4 == 0)
+		{
+			for(int i=0; i<4; i++)
+				put(&jitter_buffer, frame_index++, now_us);
+		}
+		const uint8_t *buf;
+		size_t buf_size;
+		chiaki_audio_jitter_buffer_pull(&jitter_buffer, &buf, &buf_size);
+		if(tick == 499)
+		{
+			chiaki_audio_jitter_buffer_get_stats(&jitter_buffer, &stats);
+			underruns_warm = stats.underruns;
+		}
+	}
+
+	chiaki_audio_jitter_buffer_get_stats(&jitter_buffer, &stats);
+	munit_assert_uint64(stats.target_delay_frames, >, CHIAKI_AUDIO_JITTER_BUFFER_DELAY_MIN_DEFAULT);
+	munit_assert_uint64(stats.target_delay_frames, <=, CHIAKI_AUDIO_JITTER_BUFFER_DELAY_MAX_DEFAULT);
+	munit_assert_uint64(stats.underruns, ==, underruns_warm);
+	munit_assert_uint64(stats.decoded, >=, 990);
+	return MUNIT_OK;
+}
+
+MunitTest tests_audio_jitter_buffer[] = {
+	{
+		"/steady",
+		test_steady,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/loss",
+		test_loss,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/underrun_overrun",
+		test_underrun_overrun,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/adaptive",
+		test_adaptive,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_BENCH_H
+#define CHIAKI_BENCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * CPU time consumed by the calling thread in microseconds.
+ */
+uint64_t bench_thread_cpu_us();
+
+/**
+ * Print a single result line in a common format, e.g. "takion_recv/batch32: syscalls/packet 0.06"
+ */
+void bench_report(const char *bench, const char *variant, const char *metric, double value);
+
+#endif // CHIAKI_BENCH_H
@@ -0,0 +1,117 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/bitstream.h>
+
+#include "bench.h"
+#include "../test_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUNDS_COUNT 200000
+
+// the vectors of test/bitstream.c
+static const uint8_t header_h264[] = {
+	0x00, 0x00, 0x00, 0x01, 0x67, 0x4d, 0x40, 0x32, 0x91, 0x8a, 0x01, 0xe0, 0x08, 0x9f, 0x97, 0x01,
+	0x6a, 0x02, 0x02, 0x02, 0x80, 0x00, 0x03, 0xe9, 0x00, 0x01, 0xd4, 0xc0, 0x44, 0xd0, 0xf1, 0xf1,
+	0x50, 0x00, 0x00, 0x00, 0x01, 0x68, 0xee, 0x3c, 0x80,
+};
+
+static const uint8_t slice_h264[] = {
+	0x00, 0x00, 0x00, 0x01, 0x41, 0x9b, 0xfd, 0x98, 0x89, 0xdf, 0x00, 0x03, 0x24, 0x60, 0x47, 0x1a,
+	0x90, 0x10, 0xb3, 0x2c, 0x4e, 0x45, 0xfc, 0xff, 0x45, 0x24, 0x8c, 0x79, 0xec, 0x12, 0xe5, 0x9b,
+};
+
+static const uint8_t header_h265[] = {
+	0x00, 0x00, 0x00, 0x01, 0x40, 0x01, 0x0c, 0x01, 0xff, 0xff, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00,
+	0xb0, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x96, 0x0a, 0xc0, 0x90, 0x00, 0x00, 0x00, 0x01,
+	0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0xb0, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03,
+	0x00, 0x96, 0xa0, 0x03, 0xc0, 0x80, 0x11, 0x07, 0xcb, 0xc2, 0xb9, 0x24, 0x29, 0x52, 0x70, 0x16,
+	0xa0, 0x20, 0x20, 0x20, 0x80, 0x00, 0x07, 0xd2, 0x00, 0x01, 0xd4, 0xc0, 0x20, 0xe5, 0xa1, 0xe3,
+	0xd0, 0x00, 0x00, 0x00, 0x01, 0x44, 0x01, 0xc0, 0xf3, 0xc0, 0x4c, 0x90,
+};
+
+static const uint8_t slice_h265[] = {
+	0x00, 0x00, 0x00, 0x01, 0x02, 0x01, 0xd2, 0x85, 0x7a, 0xaa, 0xa6, 0x08, 0x60, 0x13, 0x55, 0x17,
+	0x6b, 0x71, 0x72, 0xf9, 0x6e, 0xd4, 0xf2, 0x66, 0x78, 0x0c, 0x12, 0xe7, 0x79, 0xf0, 0xbc, 0xc9,
+};
+
+#define SLICE_NAL_OFFSET 4
+
+static MunitParameterEnum slice_params[] = {
+	{ "codec", (char *[]){ "h264", "h265", NULL } },
+	{ "frame_kb", (char *[]){ "0", "64", "512", NULL } },
+	{ NULL, NULL }
+};
+
+/**
+ * Parse the slice header of a frame of the given size made from a test vector, once by searching for its start code
+ * and once from the NAL unit offset the frame processor recorded. For H.265, also rewrite its reference frame in place.
+ * Neither should depend on the size of the frame.
+ */
+static MunitResult bench_slice(const MunitParameter params[], void *user)
+{
+	bool h265 = !strcmp(munit_parameters_get(params, "codec"), "h265");
+	size_t frame_kb = (size_t)atoi(munit_parameters_get(params, "frame_kb"));
+	const uint8_t *header = h265 ? header_h265 : header_h264;
+	size_t header_size = h265 ? sizeof(header_h265) : sizeof(header_h264);
+	const uint8_t *slice_vector = h265 ? slice_h265 : slice_h264;
+	size_t slice_vector_size = h265 ? sizeof(slice_h265) : sizeof(slice_h264);
+
+	ChiakiBitstream bitstream;
+	chiaki_bitstream_init(&bitstream, get_test_log(), h265 ? CHIAKI_CODEC_H265 : CHIAKI_CODEC_H264);
+	munit_assert(chiaki_bitstream_header(&bitstream, (uint8_t *)header, header_size));
+
+	size_t frame_size = slice_vector_size + frame_kb * 1024;
+	uint8_t *frame = malloc(frame_size);
+	munit_assert_not_null(frame);
+	memcpy(frame, slice_vector, slice_vector_size);
+	munit_rand_memory(frame_size - slice_vector_size, frame + slice_vector_size);
+
+	ChiakiBitstreamSlice slice;
+	uint64_t start_us = bench_thread_cpu_us();
+	for(size_t i=0; i<ROUNDS_COUNT; i++)
+		munit_assert(chiaki_bitstream_slice(&bitstream, frame, frame_size, &slice));
+	uint64_t search_us = bench_thread_cpu_us() - start_us;
+	munit_assert_int(slice.slice_type, ==, CHIAKI_BITSTREAM_SLICE_P);
+
+	start_us = bench_thread_cpu_us();
+	for(size_t i=0; i<ROUNDS_COUNT; i++)
+		munit_assert(chiaki_bitstream_slice_nal(&bitstream, frame + SLICE_NAL_OFFSET, frame_size - SLICE_NAL_OFFSET, &slice));
+	uint64_t nal_us = bench_thread_cpu_us() - start_us;
+
+	char variant[0x20];
+	snprintf(variant, sizeof(variant), "%s_%zukb", h265 ? "h265" : "h264", frame_kb);
+	bench_report("bitstream_slice", variant, "ns/parse from start code", (double)search_us * 1000.0 / ROUNDS_COUNT);
+	bench_report("bitstream_slice", variant, "ns/parse from nal", (double)nal_us * 1000.0 / ROUNDS_COUNT);
+
+	if(h265)
+	{
+		start_us = bench_thread_cpu_us();
+		for(size_t i=0; i<ROUNDS_COUNT; i++)
+			munit_assert(chiaki_bitstream_slice_rewrite_reference_frame(&bitstream, &slice, 3 + (i & 1)));
+		uint64_t rewrite_us = bench_thread_cpu_us() - start_us;
+		bench_report("bitstream_slice", variant, "ns/rewrite reference", (double)rewrite_us * 1000.0 / ROUNDS_COUNT);
+
+		munit_assert(chiaki_bitstream_slice_nal(&bitstream, frame + SLICE_NAL_OFFSET, frame_size - SLICE_NAL_OFFSET, &slice));
+		munit_assert_uint(slice.reference_frame, ==, 3 + ((ROUNDS_COUNT - 1) & 1));
+	}
+
+	free(frame);
+	return MUNIT_OK;
+}
+
+MunitTest bench_bitstream[] = {
+	{
+		"/slice",
+		bench_slice,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		slice_params
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/congestionsim.h>
+
+#include "bench.h"
+#include "../test_log.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define PACKET_LOSS_MAX 0.1
+
+typedef struct bench_trace_t
+{
+	const char *name;
+	const ChiakiCongestionSimStep *steps;
+	size_t steps_count;
+	uint64_t congestion_start_ms; // when the controller should start reporting loss
+} BenchTrace;
+
+// a queue builds up on a link without packet loss
+static const ChiakiCongestionSimStep trace_queue[] = {
+	{ 5000, 15000, 15000, 0.0, 0 },
+	{ 3000, 15000, 315000, 0.0, 0 },
+	{ 5000, 15000, 15000, 0.0, 0 }
+};
+
+// wifi-like short bursts that fec recovers
+static const ChiakiCongestionSimStep trace_bursts[] = {
+	{ 15000, 15000, 15000, 0.003, 3 }
+};
+
+// a queue builds up until the link starts dropping
+static const ChiakiCongestionSimStep trace_overflow[] = {
+	{ 5000, 15000, 15000, 0.0, 0 },
+	{ 3000, 15000, 215000, 0.0, 0 },
+	{ 3000, 215000, 215000, 0.08, 6 },
+	{ 4000, 15000, 15000, 0.0, 0 }
+};
+
+static const BenchTrace traces[] = {
+	{ "queue", trace_queue, sizeof(trace_queue) / sizeof(trace_queue[0]), 5000 },
+	{ "bursts", trace_bursts, sizeof(trace_bursts) / sizeof(trace_bursts[0]), 0 },
+	{ "overflow", trace_overflow, sizeof(trace_overflow) / sizeof(trace_overflow[0]), 5000 }
+};
+
+typedef struct bench_reports_t
+{
+	uint64_t congestion_start_ms;
+	uint64_t reaction_ms; // first report with loss after congestion_start_ms
+	uint64_t reports_with_loss;
+} BenchReports;
+
+static void bench_report_cb(uint64_t time_ms, uint64_t received, uint64_t lost, const ChiakiTakionCongestionPacket *packet, void *user)
+{
+	BenchReports *reports = user;
+	if(!packet->lost)
+		return;
+	reports->reports_with_loss++;
+	if(reports->congestion_start_ms && !reports->reaction_ms && time_ms > reports->congestion_start_ms)
+		reports->reaction_ms = time_ms - reports->congestion_start_ms;
+}
+
+static MunitParameterEnum controller_params[] = {
+	{ "controller", (char *[]){ "loss", "delay-loss", NULL } },
+	{ "trace", (char *[]){ "queue", "bursts", "overflow", NULL } },
+	{ NULL, NULL }
+};
+
+/**
+ * Replay traces through the built-in controllers and compare what they report to the console.
+ * A queue should be reported early, bursts fec recovered should not cost much bitrate.
+ */
+static MunitResult bench_controller(const MunitParameter params[], void *user)
+{
+	const char *controller_name = munit_parameters_get(params, "controller");
+	ChiakiCongestionControllerType type = !strcmp(controller_name, "loss")
+		? CHIAKI_CONGESTION_CONTROLLER_LOSS
+		: CHIAKI_CONGESTION_CONTROLLER_DELAY_LOSS;
+	const char *trace_name = munit_parameters_get(params, "trace");
+	const BenchTrace *trace = NULL;
+	for(size_t i=0; i<sizeof(traces) / sizeof(traces[0]); i++)
+		if(!strcmp(traces[i].name, trace_name))
+			trace = &traces[i];
+	munit_assert_not_null(trace);
+
+	ChiakiCongestionSimConfig config;
+	chiaki_congestion_sim_config_default(&config);
+	ChiakiCongestionController controller;
+	ChiakiErrorCode err = chiaki_congestion_controller_init(&controller, type, get_test_log(), PACKET_LOSS_MAX, 1000000 / config.fps);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	BenchReports reports = { 0 };
+	reports.congestion_start_ms = trace->congestion_start_ms;
+	ChiakiCongestionSimResult result;
+	uint64_t cpu_start_us = bench_thread_cpu_us();
+	chiaki_congestion_sim_run(&config, trace->steps, trace->steps_count, &controller, bench_report_cb, &reports, &result);
+	uint64_t cpu_us = bench_thread_cpu_us() - cpu_start_us;
+	chiaki_congestion_controller_fini(&controller);
+
+	char variant[64];
+	snprintf(variant, sizeof(variant), "%s/%s", controller_name, trace_name);
+	bench_report("congestion_control", variant, "measured loss mean", result.loss_measured_mean);
+	bench_report("congestion_control", variant, "reported loss mean", result.loss_reported_mean);
+	bench_report("congestion_control", variant, "reported loss max", result.loss_reported_max);
+	bench_report("congestion_control", variant, "reports with loss %", 100.0 * reports.reports_with_loss / result.reports);
+	if(trace->congestion_start_ms)
+		bench_report("congestion_control", variant, "reaction ms", reports.reaction_ms ? (double)reports.reaction_ms : -1.0);
+	bench_report("congestion_control", variant, "frames failed", (double)result.frames_failed);
+	bench_report("congestion_control", variant, "cpu ns/frame", 1000.0 * cpu_us / result.frames);
+
+	return MUNIT_OK;
+}
+
+MunitTest bench_congestion_control[] = {
+	{
+		"/controller",
+		bench_controller,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		controller_params
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
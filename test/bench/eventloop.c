@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/eventloop.h>
+#include <chiaki/thread.h>
+#include <chiaki/time.h>
+
+#include "bench.h"
+#include "../test_log.h"
+
+#include <string.h>
+
+#if CHIAKI_EVENT_LOOP_SUPPORTED
+
+#include <time.h>
+#include <unistd.h>
+
+#define SESSIONS_COUNT 8
+#define SESSION_DURATION_MS 3000
+
+/**
+ * Periodic work of a session that can run on the event loop.
+ * The takion re-send timer is only armed while there are unacked packets, which is the case while streaming.
+ */
+typedef struct bench_task_def_t
+{
+	const char *name;
+	uint64_t interval_ms;
+	bool streaming_only;
+} BenchTaskDef;
+
+static const BenchTaskDef task_defs[] = {
+	{ "congestion control", 200, false },
+	{ "takion re-send", 100, true }
+};
+
+#define TASKS_COUNT (sizeof(task_defs) / sizeof(task_defs[0]))
+
+typedef struct bench_task_t
+{
+	const BenchTaskDef *def;
+	uint64_t last_us;
+	uint64_t calls;
+	uint64_t wakeups;
+	uint64_t error_us_sum; // deviation of the time between two calls from the interval
+	uint64_t error_us_max;
+
+	// thread variant
+	ChiakiThread thread;
+	ChiakiBoolPredCond stop_cond;
+
+	// event loop variant
+	ChiakiEventLoopSource source;
+} BenchTask;
+
+static void bench_task_tick(BenchTask *task)
+{
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	if(task->last_us)
+	{
+		uint64_t delta_us = now_us - task->last_us;
+		uint64_t interval_us = task->def->interval_ms * 1000;
+		uint64_t error_us = delta_us > interval_us ? delta_us - interval_us : interval_us - delta_us;
+		task->error_us_sum += error_us;
+		if(error_us > task->error_us_max)
+			task->error_us_max = error_us;
+		task->calls++;
+	}
+	task->last_us = now_us;
+}
+
+/**
+ * Same structure as e.g. the congestion control thread
+ */
+static void *bench_task_thread_func(void *user)
+{
+	BenchTask *task = user;
+	ChiakiErrorCode err = chiaki_bool_pred_cond_lock(&task->stop_cond);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	while(true)
+	{
+		err = chiaki_bool_pred_cond_timedwait(&task->stop_cond, task->def->interval_ms);
+		task->wakeups++;
+		if(err != CHIAKI_ERR_TIMEOUT)
+			break;
+		bench_task_tick(task);
+	}
+	chiaki_bool_pred_cond_unlock(&task->stop_cond);
+	return NULL;
+}
+
+static void bench_task_timer_cb(void *user)
+{
+	bench_task_tick(user);
+}
+
+static uint64_t bench_process_cpu_us()
+{
+	struct timespec ts;
+	if(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static MunitParameterEnum session_params[] = {
+	{ "mode", (char *[]){ "threads", "event_loop", NULL } },
+	{ "load", (char *[]){ "idle", "streaming", NULL } },
+	{ NULL, NULL }
+};
+
+/**
+ * Run the periodic tasks of SESSIONS_COUNT sessions, either with one thread per task or one event loop per session,
+ * and count how often the process has to wake up for them.
+ */
+static MunitResult bench_session(const MunitParameter params[], void *user)
+{
+	bool event_loop = !strcmp(munit_parameters_get(params, "mode"), "event_loop");
+	bool streaming = !strcmp(munit_parameters_get(params, "load"), "streaming");
+
+	static ChiakiEventLoop loops[SESSIONS_COUNT];
+	static BenchTask tasks[SESSIONS_COUNT][TASKS_COUNT];
+	memset(tasks, 0, sizeof(tasks));
+
+	uint64_t cpu_start_us = bench_process_cpu_us();
+	for(size_t s=0; s<SESSIONS_COUNT; s++)
+	{
+		if(event_loop)
+		{
+			ChiakiErrorCode err = chiaki_event_loop_init(&loops[s], get_test_log());
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			err = chiaki_event_loop_start(&loops[s]);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		}
+		for(size_t t=0; t<TASKS_COUNT; t++)
+		{
+			BenchTask *task = &tasks[s][t];
+			task->def = &task_defs[t];
+			if(task->def->streaming_only && !streaming)
+				continue; // an idle re-send thread sleeps without timeout and a disarmed timer never fires
+			ChiakiErrorCode err;
+			if(event_loop)
+				err = chiaki_event_loop_add_timer(&loops[s], &task->source, task->def->interval_ms, bench_task_timer_cb, task);
+			else
+			{
+				err = chiaki_bool_pred_cond_init(&task->stop_cond);
+				munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+				err = chiaki_thread_create(&task->thread, bench_task_thread_func, task);
+			}
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		}
+	}
+
+	usleep(SESSION_DURATION_MS * 1000);
+
+	uint64_t wakeups = 0;
+	uint64_t calls = 0;
+	uint64_t error_us_sum = 0;
+	uint64_t error_us_max = 0;
+	for(size_t s=0; s<SESSIONS_COUNT; s++)
+	{
+		for(size_t t=0; t<TASKS_COUNT; t++)
+		{
+			BenchTask *task = &tasks[s][t];
+			if(task->def->streaming_only && !streaming)
+				continue;
+			if(event_loop)
+				chiaki_event_loop_remove(&loops[s], &task->source);
+			else
+			{
+				chiaki_bool_pred_cond_signal(&task->stop_cond);
+				chiaki_thread_join(&task->thread, NULL);
+				chiaki_bool_pred_cond_fini(&task->stop_cond);
+				wakeups += task->wakeups;
+			}
+			calls += task->calls;
+			error_us_sum += task->error_us_sum;
+			if(task->error_us_max > error_us_max)
+				error_us_max = task->error_us_max;
+		}
+		if(event_loop)
+		{
+			ChiakiEventLoopStats stats;
+			chiaki_event_loop_get_stats(&loops[s], &stats);
+			wakeups += stats.wakeups;
+			chiaki_event_loop_fini(&loops[s]);
+		}
+	}
+	uint64_t cpu_us = bench_process_cpu_us() - cpu_start_us;
+
+	const char *variant = event_loop
+		? (streaming ? "event_loop/streaming" : "event_loop/idle")
+		: (streaming ? "threads/streaming" : "threads/idle");
+	double seconds = SESSION_DURATION_MS / 1000.0;
+	bench_report("session", variant, "wakeups/s per session", (double)wakeups / seconds / SESSIONS_COUNT);
+	bench_report("session", variant, "cpu us/s per session", (double)cpu_us / seconds / SESSIONS_COUNT);
+	bench_report("session", variant, "timer error us mean", calls ? (double)error_us_sum / calls : 0.0);
+	bench_report("session", variant, "timer error us max", (double)error_us_max);
+
+	return MUNIT_OK;
+}
+
+#else
+
+static MunitResult bench_session(const MunitParameter params[], void *user)
+{
+	return MUNIT_SKIP;
+}
+
+#define session_params NULL
+
+#endif
+
+MunitTest bench_event_loop[] = {
+	{
+		"/session",
+		bench_session,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		session_params
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/fec.h>
+#include <chiaki/base64.h>
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define ROUNDS_COUNT 2000
+
+// roughly a 4K frame at 120 fps and 150 Mbit/s, with 25% fec units
+#define ENGINE_K 112
+#define ENGINE_M 28
+#define ENGINE_UNIT_SIZE 1408
+#define ENGINE_PATTERNS_COUNT 8
+#define ENGINE_FRAMES_COUNT 2000
+
+typedef struct fec_test_case_t
+{
+	unsigned int k;
+	unsigned int m;
+	const int erasures[0x10];
+	const char *frame_buffer_b64;
+	const size_t unit_size;
+} FECTestCase;
+
+#include "../fec_test_cases.inl"
+
+#define FEC_TEST_CASES_COUNT (sizeof(fec_test_cases) / sizeof(fec_test_cases[0]))
+
+typedef struct bench_fec_frame_t
+{
+	uint8_t *frame_buffer;
+	size_t stride;
+	unsigned int erasures[0x10];
+	size_t erasures_count;
+} BenchFecFrame;
+
+static void bench_fec_frame_load(BenchFecFrame *frame, FECTestCase *test_case)
+{
+	size_t b64len = strlen(test_case->frame_buffer_b64);
+	uint8_t *frame_buffer_ref = malloc(b64len);
+	munit_assert_not_null(frame_buffer_ref);
+	ChiakiErrorCode err = chiaki_base64_decode(test_case->frame_buffer_b64, b64len, frame_buffer_ref, &b64len);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	frame->stride = ((test_case->unit_size + 0xf) / 0x10) * 0x10;
+	frame->frame_buffer = calloc(test_case->k + test_case->m, frame->stride);
+	munit_assert_not_null(frame->frame_buffer);
+	for(size_t i=0; i<test_case->k + test_case->m; i++)
+		memcpy(frame->frame_buffer + i * frame->stride, frame_buffer_ref + i * test_case->unit_size, test_case->unit_size);
+	free(frame_buffer_ref);
+
+	frame->erasures_count = 0;
+	for(const int *e = test_case->erasures; *e >= 0; e++)
+	{
+		frame->erasures[frame->erasures_count++] = (unsigned int)*e;
+		memset(frame->frame_buffer + frame->stride * *e, 0x42, test_case->unit_size);
+	}
+}
+
+static MunitParameterEnum fec_decode_params[] = {
+	{ "cache", (char *[]){ "on", "off", NULL } },
+	{ NULL, NULL }
+};
+
+/**
+ * Recover all frames from fec_test_cases.inl repeatedly, in their original order.
+ * Decoding is idempotent, so the same buffers can be decoded again without restoring the erasures.
+ */
+static MunitResult bench_fec_decode(const MunitParameter params[], void *user)
+{
+	(void)fec_test_case_ids; // only used for the parameters of the unit test
+	bool cache_on = !strcmp(munit_parameters_get(params, "cache"), "on");
+
+	BenchFecFrame frames[FEC_TEST_CASES_COUNT];
+	for(size_t i=0; i<FEC_TEST_CASES_COUNT; i++)
+		bench_fec_frame_load(&frames[i], &fec_test_cases[i]);
+
+	ChiakiFecCache cache;
+	chiaki_fec_cache_init(&cache);
+
+	uint64_t start_us = bench_thread_cpu_us();
+	for(size_t round=0; round<ROUNDS_COUNT; round++)
+	{
+		for(size_t i=0; i<FEC_TEST_CASES_COUNT; i++)
+		{
+			FECTestCase *test_case = &fec_test_cases[i];
+			BenchFecFrame *frame = &frames[i];
+			ChiakiErrorCode err = cache_on
+				? chiaki_fec_cache_decode(&cache, frame->frame_buffer, test_case->unit_size, frame->stride,
+						test_case->k, test_case->m, frame->erasures, frame->erasures_count)
+				: chiaki_fec_decode(frame->frame_buffer, test_case->unit_size, frame->stride,
+						test_case->k, test_case->m, frame->erasures, frame->erasures_count);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		}
+	}
+	uint64_t cpu_us = bench_thread_cpu_us() - start_us;
+
+	const char *variant = cache_on ? "cache" : "nocache";
+	bench_report("fec_decode", variant, "recovered frames/s", (double)(ROUNDS_COUNT * FEC_TEST_CASES_COUNT) * 1e6 / (double)cpu_us);
+	if(cache_on)
+		bench_report("fec_decode", variant, "schedule hit rate", (double)cache.stats.schedule_hits / (double)(cache.stats.schedule_hits + cache.stats.schedule_misses));
+
+	chiaki_fec_cache_fini(&cache);
+	for(size_t i=0; i<FEC_TEST_CASES_COUNT; i++)
+		free(frames[i].frame_buffer);
+	return MUNIT_OK;
+}
+
+static MunitParameterEnum fec_engine_params[] = {
+	{ "engine", (char *[]){ "reference", "scalar", "ssse3", "avx2", "neon", NULL } },
+	{ "erasures", (char *[]){ "10", "20", NULL } },
+	{ NULL, NULL }
+};
+
+/**
+ * Recover 4K/120 fps sized frames with the given percentage of units erased.
+ * Erasures are drawn from a few fixed patterns, so this measures the engine rather than building schedules.
+ */
+static MunitResult bench_fec_engine(const MunitParameter params[], void *user)
+{
+	const char *engine_name = munit_parameters_get(params, "engine");
+	ChiakiFecEngine engine = CHIAKI_FEC_ENGINE_REFERENCE;
+	while(strcmp(chiaki_fec_engine_name(engine), engine_name))
+		engine++;
+	if(!chiaki_fec_engine_supported(engine))
+		return MUNIT_SKIP;
+	size_t erasures_percent = (size_t)atoi(munit_parameters_get(params, "erasures"));
+	size_t erasures_count = (ENGINE_K + ENGINE_M) * erasures_percent / 100;
+	munit_assert_size(erasures_count, <=, ENGINE_M);
+
+	uint8_t *encoded = malloc((ENGINE_K + ENGINE_M) * ENGINE_UNIT_SIZE);
+	uint8_t *frame_buffer = malloc((ENGINE_K + ENGINE_M) * ENGINE_UNIT_SIZE);
+	munit_assert_not_null(encoded);
+	munit_assert_not_null(frame_buffer);
+	munit_rand_memory(ENGINE_K * ENGINE_UNIT_SIZE, encoded);
+	ChiakiErrorCode err = chiaki_fec_encode(encoded, ENGINE_UNIT_SIZE, ENGINE_UNIT_SIZE, ENGINE_K, ENGINE_M);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	memcpy(frame_buffer, encoded, (ENGINE_K + ENGINE_M) * ENGINE_UNIT_SIZE);
+
+	unsigned int patterns[ENGINE_PATTERNS_COUNT][ENGINE_M];
+	for(size_t p=0; p<ENGINE_PATTERNS_COUNT; p++)
+	{
+		for(size_t i=0; i<erasures_count; i++)
+		{
+			unsigned int e;
+			bool dup;
+			do
+			{
+				e = (unsigned int)munit_rand_int_range(0, ENGINE_K + ENGINE_M - 1);
+				dup = false;
+				for(size_t j=0; j<i; j++)
+					dup = dup || patterns[p][j] == e;
+			} while(dup);
+			patterns[p][i] = e;
+		}
+	}
+
+	ChiakiFecCache cache;
+	chiaki_fec_cache_init(&cache);
+	cache.engine = engine;
+
+	uint64_t start_us = bench_thread_cpu_us();
+	for(size_t frame=0; frame<ENGINE_FRAMES_COUNT; frame++)
+	{
+		const unsigned int *pattern = patterns[frame % ENGINE_PATTERNS_COUNT];
+		// erased fec units are neither read nor restored, so only source units need to be damaged
+		for(size_t i=0; i<erasures_count; i++)
+		{
+			if(pattern[i] < ENGINE_K)
+				frame_buffer[pattern[i] * ENGINE_UNIT_SIZE] ^= 0x42;
+		}
+		err = chiaki_fec_cache_decode(&cache, frame_buffer, ENGINE_UNIT_SIZE, ENGINE_UNIT_SIZE,
+				ENGINE_K, ENGINE_M, pattern, erasures_count);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+	uint64_t cpu_us = bench_thread_cpu_us() - start_us;
+	munit_assert_memory_equal(ENGINE_K * ENGINE_UNIT_SIZE, frame_buffer, encoded);
+
+	char variant[32];
+	snprintf(variant, sizeof(variant), "%s_%zupct", engine_name, erasures_percent);
+	double frames_per_s = (double)ENGINE_FRAMES_COUNT * 1e6 / (double)cpu_us;
+	bench_report("fec_engine", variant, "recovered frames/s", frames_per_s);
+	bench_report("fec_engine", variant, "recovered MB/s", frames_per_s * ENGINE_K * ENGINE_UNIT_SIZE / 1e6);
+	bench_report("fec_engine", variant, "cpu % at 120 fps", 120.0 * 100.0 / frames_per_s);
+
+	chiaki_fec_cache_fini(&cache);
+	free(encoded);
+	free(frame_buffer);
+	return MUNIT_OK;
+}
+
+MunitTest bench_fec[] = {
+	{
+		"/decode",
+		bench_fec_decode,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		fec_decode_params
+	},
+	{
+		"/engine",
+		bench_fec_engine,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		fec_engine_params
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/ffmpegdecoder.h>
+#include <chiaki/video.h>
+#include <chiaki/time.h>
+
+#include "bench.h"
+#include "../test_log.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define ROUNDS_COUNT 3
+
+/**
+ * Annex B elementary stream, split into access units.
+ */
+typedef struct bench_stream_t
+{
+	uint8_t *data;
+	size_t size;
+	size_t *au_offsets; // au_count + 1 entries, the last one is size
+	size_t au_count;
+	size_t au_size_max;
+} BenchStream;
+
+static size_t next_start_code(const uint8_t *data, size_t size, size_t pos)
+{
+	for(; pos + 3 <= size; pos++)
+		if(data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 1)
+			return pos;
+	return size;
+}
+
+/**
+ * @param vcl set if nal is a slice
+ * @return whether nal starts a new access unit, given that the current one already has a slice
+ */
+static bool nal_starts_au(ChiakiCodec codec, const uint8_t *nal, size_t nal_size, bool *vcl)
+{
+	if(chiaki_codec_is_h265(codec))
+	{
+		if(nal_size < 3)
+			return false;
+		unsigned int type = (nal[0] >> 1) & 0x3f;
+		*vcl = type < 32;
+		if(*vcl)
+			return nal[2] & 0x80; // first_slice_segment_in_pic_flag
+		return (type >= 32 && type <= 35) || type == 39; // VPS, SPS, PPS, AUD, prefix SEI
+	}
+	if(nal_size < 2)
+		return false;
+	unsigned int type = nal[0] & 0x1f;
+	*vcl = type >= 1 && type <= 5;
+	if(*vcl)
+		return nal[1] & 0x80; // first_mb_in_slice == 0
+	return type >= 6 && type <= 9; // SEI, SPS, PPS, AUD
+}
+
+static bool bench_stream_load(BenchStream *stream, const char *filename, ChiakiCodec codec)
+{
+	memset(stream, 0, sizeof(*stream));
+	FILE *f = fopen(filename, "rb");
+	if(!f)
+		return false;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	stream->data = malloc(size > 0 ? size : 1);
+	munit_assert_not_null(stream->data);
+	stream->size = fread(stream->data, 1, size, f);
+	fclose(f);
+
+	// at most one access unit per start code
+	size_t au_offsets_size = 1;
+	for(size_t pos = next_start_code(stream->data, stream->size, 0); pos < stream->size; pos = next_start_code(stream->data, stream->size, pos + 3))
+		au_offsets_size++;
+	stream->au_offsets = malloc(au_offsets_size * sizeof(size_t));
+	munit_assert_not_null(stream->au_offsets);
+
+	bool au_has_vcl = false;
+	size_t pos = next_start_code(stream->data, stream->size, 0);
+	while(pos < stream->size)
+	{
+		size_t nal = pos + 3;
+		size_t next = next_start_code(stream->data, stream->size, nal);
+		size_t start = pos > 0 && stream->data[pos - 1] == 0 ? pos - 1 : pos; // 4 byte start code
+		bool vcl = false;
+		bool starts_au = nal_starts_au(codec, stream->data + nal, next - nal, &vcl);
+		if(!stream->au_count || (starts_au && au_has_vcl))
+		{
+			stream->au_offsets[stream->au_count++] = start;
+			au_has_vcl = false;
+		}
+		au_has_vcl |= vcl;
+		pos = next;
+	}
+	stream->au_offsets[stream->au_count] = stream->size;
+	for(size_t i=0; i<stream->au_count; i++)
+	{
+		size_t au_size = stream->au_offsets[i + 1] - stream->au_offsets[i];
+		if(au_size > stream->au_size_max)
+			stream->au_size_max = au_size;
+	}
+	return stream->au_count > 0;
+}
+
+static void bench_stream_fini(BenchStream *stream)
+{
+	free(stream->au_offsets);
+	free(stream->data);
+}
+
+static void frame_available_cb(ChiakiFfmpegDecoder *decoder, void *user)
+{
+	(void)decoder;
+	(void)user;
+}
+
+static int cmp_uint64(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *)a;
+	uint64_t vb = *(const uint64_t *)b;
+	return va < vb ? -1 : (va > vb ? 1 : 0);
+}
+
+static MunitParameterEnum submit_params[] = {
+	{ "file", NULL }, // elementary stream to decode, e.g. --param file stream.h265 --param codec h265
+	{ "codec", (char *[]){ "h264", "h265", NULL } },
+	{ "submit", (char *[]){ "copy", "pool", NULL } },
+	{ NULL, NULL }
+};
+
+/**
+ * Decode a file with the software decoder, assembling each access unit either into a plain buffer
+ * that the codec has to copy, like the frame processor's own buffer, or into one from the decoder's packet pool.
+ */
+static MunitResult bench_submit(const MunitParameter params[], void *user)
+{
+	const char *filename = munit_parameters_get(params, "file");
+	if(!filename)
+		return MUNIT_SKIP;
+	ChiakiCodec codec = !strcmp(munit_parameters_get(params, "codec"), "h265") ? CHIAKI_CODEC_H265 : CHIAKI_CODEC_H264;
+	const char *submit = munit_parameters_get(params, "submit");
+	bool pool = !strcmp(submit, "pool");
+
+	BenchStream stream;
+	if(!bench_stream_load(&stream, filename, codec))
+	{
+		fprintf(stderr, "Failed to load access units from %s\n", filename);
+		return MUNIT_SKIP;
+	}
+
+	ChiakiFfmpegDecoder decoder;
+	ChiakiErrorCode err = chiaki_ffmpeg_decoder_init(&decoder, get_test_log(), codec, NULL, NULL, NULL, frame_available_cb, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint8_t *scratch = malloc(stream.au_size_max + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	munit_assert_not_null(scratch);
+	size_t samples_count = stream.au_count * ROUNDS_COUNT;
+	uint64_t *submit_us = malloc(samples_count * sizeof(uint64_t));
+	munit_assert_not_null(submit_us);
+
+	size_t frames = 0;
+	for(size_t i=0; i<samples_count; i++)
+	{
+		size_t au = i % stream.au_count;
+		size_t au_size = stream.au_offsets[au + 1] - stream.au_offsets[au];
+		uint8_t *buf = pool ? chiaki_ffmpeg_decoder_video_sample_alloc_cb(au_size, &decoder) : scratch;
+		munit_assert_not_null(buf);
+		memcpy(buf, stream.data + stream.au_offsets[au], au_size);
+		memset(buf + au_size, 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+
+		uint64_t start_us = chiaki_time_now_monotonic_us();
+		chiaki_ffmpeg_decoder_video_sample_cb(buf, au_size, 0, false, &decoder);
+		submit_us[i] = chiaki_time_now_monotonic_us() - start_us;
+
+		int32_t frames_lost;
+		AVFrame *frame = chiaki_ffmpeg_decoder_pull_frame(&decoder, &frames_lost);
+		if(frame)
+		{
+			frames++;
+			av_frame_free(&frame);
+		}
+	}
+
+	ChiakiFfmpegDecoderStats stats;
+	chiaki_ffmpeg_decoder_get_stats(&decoder, &stats);
+	chiaki_ffmpeg_decoder_fini(&decoder);
+
+	uint64_t submit_us_sum = 0;
+	for(size_t i=0; i<samples_count; i++)
+		submit_us_sum += submit_us[i];
+	qsort(submit_us, samples_count, sizeof(uint64_t), cmp_uint64);
+
+	const char *variant = chiaki_codec_is_h265(codec) ? (pool ? "h265_pool" : "h265_copy") : (pool ? "h264_pool" : "h264_copy");
+	bench_report("ffmpeg_submit", variant, "submit_us/frame", (double)submit_us_sum / samples_count);
+	bench_report("ffmpeg_submit", variant, "submit_us_p99", (double)submit_us[samples_count * 99 / 100]);
+	bench_report("ffmpeg_submit", variant, "copies/frame", (double)stats.samples_copied / stats.samples);
+	bench_report("ffmpeg_submit", variant, "pool_allocs/frame", (double)stats.packet_bufs_allocated / stats.samples);
+	bench_report("ffmpeg_submit", variant, "decoded/submitted", (double)frames / samples_count);
+
+	free(submit_us);
+	free(scratch);
+	bench_stream_fini(&stream);
+	return MUNIT_OK;
+}
+
+static MunitParameterEnum profile_params[] = {
+	{ "file", NULL },
+	{ "codec", (char *[]){ "h264", "h265", NULL } },
+	{ "profile", (char *[]){ "default", "latency", "throughput", NULL } },
+	{ NULL, NULL }
+};
+
+/**
+ * Decode a file with each decoder profile and measure the time from submitting a sample until its frame is pulled.
+ * Samples are submitted back to back and everything available is pulled after each one,
+ * so frame threads show up as frames of delay at the decoding speed.
+ */
+static MunitResult bench_profile(const MunitParameter params[], void *user)
+{
+	const char *filename = munit_parameters_get(params, "file");
+	if(!filename)
+		return MUNIT_SKIP;
+	ChiakiCodec codec = !strcmp(munit_parameters_get(params, "codec"), "h265") ? CHIAKI_CODEC_H265 : CHIAKI_CODEC_H264;
+	const char *profile_name = munit_parameters_get(params, "profile");
+	ChiakiFfmpegDecoderProfile profile_id = CHIAKI_FFMPEG_DECODER_PROFILE_DEFAULT;
+	if(!strcmp(profile_name, "latency"))
+		profile_id = CHIAKI_FFMPEG_DECODER_PROFILE_LATENCY;
+	else if(!strcmp(profile_name, "throughput"))
+		profile_id = CHIAKI_FFMPEG_DECODER_PROFILE_THROUGHPUT;
+
+	BenchStream stream;
+	if(!bench_stream_load(&stream, filename, codec))
+	{
+		fprintf(stderr, "Failed to load access units from %s\n", filename);
+		return MUNIT_SKIP;
+	}
+
+	ChiakiFfmpegDecoderProfileSettings profile;
+	chiaki_ffmpeg_decoder_profile_settings_init(&profile, profile_id);
+	ChiakiFfmpegDecoder decoder;
+	ChiakiErrorCode err = chiaki_ffmpeg_decoder_init(&decoder, get_test_log(), codec, NULL, NULL, &profile, frame_available_cb, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	size_t samples_count = stream.au_count * ROUNDS_COUNT;
+	uint64_t *submit_us = malloc(samples_count * sizeof(uint64_t));
+	munit_assert_not_null(submit_us);
+	uint64_t *latency_us = malloc(samples_count * sizeof(uint64_t));
+	munit_assert_not_null(latency_us);
+
+	size_t frames = 0;
+	for(size_t i=0; i<samples_count; i++)
+	{
+		size_t au = i % stream.au_count;
+		size_t au_size = stream.au_offsets[au + 1] - stream.au_offsets[au];
+		uint8_t *buf = chiaki_ffmpeg_decoder_video_sample_alloc_cb(au_size, &decoder);
+		munit_assert_not_null(buf);
+		memcpy(buf, stream.data + stream.au_offsets[au], au_size);
+		memset(buf + au_size, 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+
+		submit_us[i] = chiaki_time_now_monotonic_us();
+		chiaki_ffmpeg_decoder_video_sample_cb(buf, au_size, 0, false, &decoder);
+
+		while(true)
+		{
+			int32_t frames_lost;
+			AVFrame *frame = chiaki_ffmpeg_decoder_pull_frame(&decoder, &frames_lost);
+			if(!frame)
+				break;
+			uint64_t now_us = chiaki_time_now_monotonic_us();
+			ChiakiFfmpegDecoderStats stats;
+			chiaki_ffmpeg_decoder_get_stats(&decoder, &stats);
+			// frames come out in submission order, so all dropped ones were older than this
+			size_t sample = frames + stats.frames_dropped;
+			if(sample < samples_count)
+				latency_us[frames++] = now_us - submit_us[sample];
+			av_frame_free(&frame);
+		}
+	}
+
+	ChiakiFfmpegDecoderStats stats;
+	chiaki_ffmpeg_decoder_get_stats(&decoder, &stats);
+	chiaki_ffmpeg_decoder_fini(&decoder);
+
+	char variant[0x20];
+	snprintf(variant, sizeof(variant), "%s_%s", chiaki_codec_is_h265(codec) ? "h265" : "h264", profile_name);
+	if(frames)
+	{
+		qsort(latency_us, frames, sizeof(uint64_t), cmp_uint64);
+		bench_report("ffmpeg_profile", variant, "latency_us_p50", (double)latency_us[frames * 50 / 100]);
+		bench_report("ffmpeg_profile", variant, "latency_us_p90", (double)latency_us[frames * 90 / 100]);
+		bench_report("ffmpeg_profile", variant, "latency_us_p99", (double)latency_us[frames * 99 / 100]);
+	}
+	bench_report("ffmpeg_profile", variant, "pulled/submitted", (double)frames / samples_count);
+	bench_report("ffmpeg_profile", variant, "dropped/submitted", (double)stats.frames_dropped / samples_count);
+
+	free(latency_us);
+	free(submit_us);
+	bench_stream_fini(&stream);
+	return MUNIT_OK;
+}
+
+MunitTest bench_ffmpeg_decoder[] = {
+	{
+		"/submit",
+		bench_submit,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		submit_params
+	},
+	{
+		"/profile",
+		bench_profile,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		profile_params
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
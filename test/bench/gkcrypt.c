@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/gkcrypt.h>
+#include <chiaki/session.h>
+#include <chiaki/takion.h>
+#include <chiaki/time.h>
+
+#include "bench.h"
+#include "../test_log.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define PACKETS_COUNT 200000
+
+#define DECRYPT_BURSTS_COUNT 4000
+#define DECRYPT_BURST_PACKETS 16
+#define DECRYPT_PACKET_SIZE 1400
+
+static const uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE] = { 0x70, 0x58, 0x37, 0x50, 0x91, 0xea, 0xd1, 0x37, 0x71, 0x58, 0xec, 0xb3, 0xb, 0xea, 0x23, 0x87 };
+static const uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE] = { 0x3c, 0x3a, 0xf0, 0xec, 0xd6, 0x33, 0x1b, 0xb1, 0x6d, 0x24, 0x4f, 0x48, 0x19, 0xde, 0x6, 0x3d,
+									0xc7, 0xe, 0xac, 0x95, 0x70, 0xac, 0x24, 0x92, 0x86, 0xa7, 0x24, 0xd0, 0x7a, 0x37, 0x55, 0x52 };
+
+static MunitParameterEnum packet_mac_params[] = {
+	{ "packet_size", (char *[]){ "64", "1400", NULL } },
+	{ "key_pos", (char *[]){ "current", "previous", NULL } },
+	{ NULL, NULL }
+};
+
+/**
+ * MAC of video packets as done for every received packet.
+ * "previous" alternates between the current gmac key and the one before, like reordered packets around a key refresh.
+ */
+static MunitResult bench_packet_mac(const MunitParameter params[], void *user)
+{
+	size_t packet_size = (size_t)atoi(munit_parameters_get(params, "packet_size"));
+	bool previous = !strcmp(munit_parameters_get(params, "key_pos"), "previous");
+
+	ChiakiGKCrypt gkcrypt;
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, NULL, 0, 3, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint8_t buf[1500];
+	munit_rand_memory(sizeof(buf), buf);
+	buf[0] = 2; // video
+
+	uint64_t key_pos = 4 * CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x10;
+	uint8_t mac[CHIAKI_GKCRYPT_GMAC_SIZE];
+
+	uint64_t start_us = bench_thread_cpu_us();
+	for(size_t i=0; i<PACKETS_COUNT; i++)
+	{
+		uint64_t pos = key_pos;
+		if(previous && (i & 1))
+			pos -= CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+		err = chiaki_takion_packet_mac(&gkcrypt, buf, packet_size, pos, mac, NULL);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		key_pos += packet_size;
+	}
+	uint64_t duration_us = bench_thread_cpu_us() - start_us;
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+
+	char variant[32];
+	snprintf(variant, sizeof(variant), "%zu_%s", packet_size, previous ? "previous" : "current");
+	bench_report("packet_mac", variant, "packets/s", (double)PACKETS_COUNT * 1e6 / (double)(duration_us ? duration_us : 1));
+
+	return MUNIT_OK;
+}
+
+static bool key_buf_wait_contains(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, size_t size)
+{
+	uint64_t deadline = chiaki_time_now_monotonic_ms() + 1000;
+	while(chiaki_time_now_monotonic_ms() < deadline)
+	{
+		if(chiaki_gkcrypt_key_buf_contains(gkcrypt, key_pos, size))
+			return true;
+		chiaki_thread_yield();
+	}
+	return false;
+}
+
+static MunitParameterEnum decrypt_params[] = {
+	{ "key_buf", (char *[]){ "on", "off", NULL } },
+	{ NULL, NULL }
+};
+
+/**
+ * Decryption of AV packet payloads in bursts.
+ * With key_buf, each burst starts once the generator thread has the whole burst in the ring,
+ * so only the cost on the receiving thread is measured.
+ */
+static MunitResult bench_decrypt(const MunitParameter params[], void *user)
+{
+	bool key_buf = !strcmp(munit_parameters_get(params, "key_buf"), "on");
+
+	ChiakiGKCrypt gkcrypt;
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, get_test_log(), key_buf ? CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT : 0, 3, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint8_t buf[DECRYPT_PACKET_SIZE];
+	munit_rand_memory(sizeof(buf), buf);
+
+	uint64_t key_pos = 0x11;
+	uint64_t duration_us = 0;
+	size_t misses = 0;
+	for(size_t burst=0; burst<DECRYPT_BURSTS_COUNT; burst++)
+	{
+		if(key_buf && !key_buf_wait_contains(&gkcrypt, key_pos, DECRYPT_BURST_PACKETS * DECRYPT_PACKET_SIZE))
+			misses++;
+		uint64_t start_us = bench_thread_cpu_us();
+		for(size_t i=0; i<DECRYPT_BURST_PACKETS; i++)
+		{
+			err = chiaki_gkcrypt_decrypt(&gkcrypt, key_pos, buf, sizeof(buf));
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			key_pos += sizeof(buf);
+		}
+		duration_us += bench_thread_cpu_us() - start_us;
+	}
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+
+	double mbit = (double)DECRYPT_BURSTS_COUNT * DECRYPT_BURST_PACKETS * DECRYPT_PACKET_SIZE * 8.0 / 1e6;
+	bench_report("decrypt", key_buf ? "key_buf" : "generate", "cpu us/Mbit", (double)duration_us / mbit);
+	if(key_buf)
+		bench_report("decrypt", "key_buf", "bursts not in key buf", (double)misses);
+
+	return MUNIT_OK;
+}
+
+MunitTest bench_gkcrypt[] = {
+	{
+		"/packet_mac",
+		bench_packet_mac,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		packet_mac_params
+	},
+	{
+		"/decrypt",
+		bench_decrypt,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		decrypt_params
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
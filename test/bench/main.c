@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/common.h>
+
+extern MunitTest bench_takion[];
+extern MunitTest bench_gkcrypt[];
+extern MunitTest bench_fec[];
+extern MunitTest bench_event_loop[];
+extern MunitTest bench_congestion_control[];
+extern MunitTest bench_bitstream[];
+#ifdef CHIAKI_BENCH_ENABLE_FFMPEG_DECODER
+extern MunitTest bench_ffmpeg_decoder[];
+#endif
+
+static MunitSuite suites[] = {
+	{
+		"/takion",
+		bench_takion,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/gkcrypt",
+		bench_gkcrypt,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/fec",
+		bench_fec,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/event_loop",
+		bench_event_loop,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/congestion_control",
+		bench_congestion_control,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/bitstream",
+		bench_bitstream,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+#ifdef CHIAKI_BENCH_ENABLE_FFMPEG_DECODER
+	{
+		"/ffmpeg_decoder",
+		bench_ffmpeg_decoder,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+#endif
+	{ NULL, NULL, NULL, 0, MUNIT_SUITE_OPTION_NONE }
+};
+
+static const MunitSuite suite_main = {
+	"/chiaki-bench",
+	NULL,
+	suites,
+	1,
+	MUNIT_SUITE_OPTION_NONE
+};
+
+int main(int argc, char *argv[])
+{
+	if(chiaki_lib_init() != CHIAKI_ERR_SUCCESS)
+		return 1;
+	return munit_suite_main(&suite_main, NULL, argc, argv);
+}
@@ -0,0 +1,379 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/takion.h>
+#include <chiaki/time.h>
+
+#include "bench.h"
+#include "../test_log.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#endif
+
+#define FRAMES_COUNT 240
+#define PACKETS_PER_FRAME 80
+#define FRAME_INTERVAL_US 4166 // 240 fps
+#define PACKET_PAYLOAD_SIZE 1400
+#define REMOTE_TAG 0x4823
+
+typedef struct bench_takion_t
+{
+	ChiakiTakion takion;
+	ChiakiBoolPredCond connected_cond;
+	uint64_t av_packets;
+	uint64_t cpu_first_us;
+	uint64_t cpu_last_us;
+} BenchTakion;
+
+static void bench_sleep_us(uint64_t us)
+{
+#ifdef _WIN32
+	Sleep((DWORD)(us / 1000));
+#else
+	usleep((useconds_t)us);
+#endif
+}
+
+static void takion_cb(ChiakiTakionEvent *event, void *user)
+{
+	BenchTakion *bench = user;
+	switch(event->type)
+	{
+		case CHIAKI_TAKION_EVENT_TYPE_CONNECTED:
+			chiaki_bool_pred_cond_lock(&bench->connected_cond);
+			bench->connected_cond.pred = true;
+			chiaki_bool_pred_cond_unlock(&bench->connected_cond);
+			chiaki_bool_pred_cond_signal(&bench->connected_cond);
+			break;
+		case CHIAKI_TAKION_EVENT_TYPE_AV:
+			if(!bench->av_packets)
+				bench->cpu_first_us = bench_thread_cpu_us();
+			bench->av_packets++;
+			bench->cpu_last_us = bench_thread_cpu_us();
+			break;
+		default:
+			break;
+	}
+}
+
+static void write_message_header(uint8_t *buf, uint32_t tag, uint8_t chunk_type, size_t payload_data_size)
+{
+	buf[0] = 0; // control
+	*((chiaki_unaligned_uint32_t *)(buf + 1)) = htonl(tag);
+	memset(buf + 5, 0, 8); // gmac, key pos
+	buf[0xd] = chunk_type;
+	buf[0xe] = 0;
+	*((chiaki_unaligned_uint16_t *)(buf + 0xf)) = htons((uint16_t)(payload_data_size + 4));
+}
+
+/**
+ * Play the console side of the Takion handshake on console_sock.
+ */
+static bool fake_console_handshake(chiaki_socket_t console_sock, struct sockaddr_storage *client_addr, socklen_t *client_addr_len)
+{
+	uint8_t buf[1500];
+	*client_addr_len = sizeof(*client_addr);
+	CHIAKI_SSIZET_TYPE r = recvfrom(console_sock, (CHIAKI_SOCKET_BUF_TYPE)buf, sizeof(buf), 0, (struct sockaddr *)client_addr, client_addr_len);
+	if(r < 1 + 0x10 + 0x10 || buf[0xd] != 1) // init
+		return false;
+	uint32_t tag_local = ntohl(*((chiaki_unaligned_uint32_t *)(buf + 0x11)));
+
+	uint8_t init_ack[1 + 0x10 + 0x10 + 0x20] = { 0 };
+	write_message_header(init_ack, tag_local, 2, 0x30);
+	uint8_t *pl = init_ack + 0x11;
+	*((chiaki_unaligned_uint32_t *)(pl + 0)) = htonl(REMOTE_TAG);
+	*((chiaki_unaligned_uint32_t *)(pl + 4)) = htonl(0x19000);
+	*((chiaki_unaligned_uint16_t *)(pl + 8)) = htons(0x64);
+	*((chiaki_unaligned_uint16_t *)(pl + 0xa)) = htons(0x64);
+	*((chiaki_unaligned_uint32_t *)(pl + 0xc)) = htonl(REMOTE_TAG);
+	sendto(console_sock, (CHIAKI_SOCKET_BUF_TYPE)init_ack, sizeof(init_ack), 0, (struct sockaddr *)client_addr, *client_addr_len);
+
+	r = recvfrom(console_sock, (CHIAKI_SOCKET_BUF_TYPE)buf, sizeof(buf), 0, NULL, NULL);
+	if(r < 1 + 0x10 || buf[0xd] != 0xa) // cookie
+		return false;
+
+	uint8_t cookie_ack[1 + 0x10];
+	write_message_header(cookie_ack, tag_local, 0xb, 0);
+	sendto(console_sock, (CHIAKI_SOCKET_BUF_TYPE)cookie_ack, sizeof(cookie_ack), 0, (struct sockaddr *)client_addr, *client_addr_len);
+	return true;
+}
+
+typedef struct bench_console_t
+{
+	chiaki_socket_t sock;
+	struct sockaddr_storage client_addr;
+	socklen_t client_addr_len;
+} BenchConsole;
+
+/**
+ * Connect bench->takion to a fake console on loopback. Fills in the address and callback of info.
+ */
+static void bench_console_connect(BenchConsole *console, BenchTakion *bench, ChiakiTakionConnectInfo *info)
+{
+	console->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert(!CHIAKI_SOCKET_IS_INVALID(console->sock));
+	struct sockaddr_in console_addr = { 0 };
+	console_addr.sin_family = AF_INET;
+	console_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	console_addr.sin_port = 0;
+	munit_assert_int(bind(console->sock, (struct sockaddr *)&console_addr, sizeof(console_addr)), ==, 0);
+	socklen_t console_addr_len = sizeof(console_addr);
+	munit_assert_int(getsockname(console->sock, (struct sockaddr *)&console_addr, &console_addr_len), ==, 0);
+#ifdef _WIN32
+	DWORD timeout = 5000;
+#else
+	struct timeval timeout = { 5, 0 };
+#endif
+	setsockopt(console->sock, SOL_SOCKET, SO_RCVTIMEO, (const CHIAKI_SOCKET_BUF_TYPE)&timeout, sizeof(timeout));
+
+	chiaki_bool_pred_cond_init(&bench->connected_cond);
+
+	info->log = get_test_log();
+	info->sa = (struct sockaddr *)&console_addr;
+	info->sa_len = console_addr_len;
+	info->ip_dontfrag = false;
+	info->cb = takion_cb;
+	info->cb_user = bench;
+	info->disable_audio_video = CHIAKI_NONE_DISABLED;
+	info->enable_crypt = false;
+	info->protocol_version = 7;
+	info->close_socket = true;
+	ChiakiErrorCode err = chiaki_takion_connect(&bench->takion, info, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	munit_assert(fake_console_handshake(console->sock, &console->client_addr, &console->client_addr_len));
+
+	chiaki_bool_pred_cond_lock(&bench->connected_cond);
+	err = chiaki_bool_pred_cond_timedwait(&bench->connected_cond, 5000);
+	chiaki_bool_pred_cond_unlock(&bench->connected_cond);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+}
+
+static void bench_console_close(BenchConsole *console, BenchTakion *bench)
+{
+	chiaki_takion_close(&bench->takion);
+	CHIAKI_SOCKET_CLOSE(console->sock);
+	chiaki_bool_pred_cond_fini(&bench->connected_cond);
+}
+
+static MunitParameterEnum recv_params[] = {
+	{ "recv_batch_size", (char *[]){ "0", "8", "32", NULL } },
+	{ NULL, NULL }
+};
+
+/**
+ * Loopback stream of video packets in bursts of PACKETS_PER_FRAME, received by a real ChiakiTakion.
+ * Reports syscalls per packet and CPU time of the Takion thread per Mbit.
+ */
+static MunitResult bench_takion_recv(const MunitParameter params[], void *user)
+{
+	const char *batch_str = munit_parameters_get(params, "recv_batch_size");
+	size_t recv_batch_size = (size_t)atoi(batch_str);
+
+	BenchTakion bench = { 0 };
+	BenchConsole console;
+	ChiakiTakionConnectInfo info = { 0 };
+	info.recv_batch_size = recv_batch_size;
+	bench_console_connect(&console, &bench, &info);
+
+	uint8_t packet_buf[0x20 + PACKET_PAYLOAD_SIZE];
+	memset(packet_buf, 0x42, sizeof(packet_buf));
+	ChiakiTakionAVPacket av = { 0 };
+	av.is_video = true;
+	av.units_in_frame_total = PACKETS_PER_FRAME;
+
+	uint64_t packets_sent = 0;
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	for(size_t frame=0; frame<FRAMES_COUNT; frame++)
+	{
+		av.frame_index = (ChiakiSeqNum16)frame;
+		for(size_t unit=0; unit<PACKETS_PER_FRAME; unit++)
+		{
+			av.unit_index = (ChiakiSeqNum16)unit;
+			size_t header_size;
+			chiaki_takion_v7_av_packet_format_header(packet_buf, sizeof(packet_buf), &header_size, &av);
+			sendto(console.sock, (CHIAKI_SOCKET_BUF_TYPE)packet_buf, header_size + PACKET_PAYLOAD_SIZE, 0, (struct sockaddr *)&console.client_addr, console.client_addr_len);
+			av.packet_index++;
+			packets_sent++;
+		}
+		uint64_t next_us = start_us + (frame + 1) * FRAME_INTERVAL_US;
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		if(next_us > now_us)
+			bench_sleep_us(next_us - now_us);
+	}
+
+	// give the receiver some time to drain the socket
+	for(size_t i=0; i<100 && bench.av_packets < packets_sent; i++)
+		bench_sleep_us(5000);
+
+	bench_console_close(&console, &bench);
+
+	ChiakiTakionRecvStats *stats = &bench.takion.recv_stats;
+	munit_assert_uint64(bench.av_packets, >, 0);
+
+	char variant[32];
+	snprintf(variant, sizeof(variant), "batch%zu", recv_batch_size);
+	double mbit = (double)stats->bytes * 8.0 / 1e6;
+	bench_report("takion_recv", variant, "packets received/sent", (double)bench.av_packets / (double)packets_sent);
+	bench_report("takion_recv", variant, "syscalls/packet", (double)(stats->wait_calls + stats->recv_calls) / (double)stats->packets);
+	bench_report("takion_recv", variant, "cpu us/Mbit", (double)(bench.cpu_last_us - bench.cpu_first_us) / mbit);
+
+	return MUNIT_OK;
+}
+
+static MunitParameterEnum data_ack_params[] = {
+	{ "data_window", (char *[]){ "16", "128", NULL } },
+	{ "data_ack_delay_ms", (char *[]){ "0", "5", NULL } },
+	{ "order", (char *[]){ "in_order", "first_last", NULL } },
+	{ NULL, NULL }
+};
+
+#define DATA_BURSTS 100
+#define DATA_BURST_SIZE 40 // pad info, trigger effects and rumble coming in at once
+#define DATA_BURST_INTERVAL_US 16666
+#define DATA_PAYLOAD_SIZE 64
+
+/**
+ * Bursts of reliable data, either paced in order or with the first packet of each burst arriving last.
+ * Reports how much of it could be delivered without re-sending and how many acks were needed.
+ */
+static MunitResult bench_takion_data_ack(const MunitParameter params[], void *user)
+{
+	size_t data_window = (size_t)atoi(munit_parameters_get(params, "data_window"));
+	uint64_t data_ack_delay_ms = (uint64_t)atoi(munit_parameters_get(params, "data_ack_delay_ms"));
+	const char *order = munit_parameters_get(params, "order");
+	bool first_last = !strcmp(order, "first_last");
+
+	BenchTakion bench = { 0 };
+	BenchConsole console;
+	ChiakiTakionConnectInfo info = { 0 };
+	info.recv_batch_size = CHIAKI_TAKION_RECV_BATCH_SIZE_DEFAULT;
+	info.data_window = data_window;
+	info.data_ack_delay_ms = data_ack_delay_ms;
+	bench_console_connect(&console, &bench, &info);
+
+	uint8_t packet_buf[1 + 0x10 + 9 + DATA_PAYLOAD_SIZE];
+	memset(packet_buf, 0, sizeof(packet_buf));
+	ChiakiSeqNum32 seq_num = REMOTE_TAG; // initial seq num is the tag
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	for(size_t burst=0; burst<DATA_BURSTS; burst++)
+	{
+		for(size_t i=0; i<DATA_BURST_SIZE; i++)
+		{
+			ChiakiSeqNum32 packet_seq_num = seq_num + (ChiakiSeqNum32)(first_last ? (i + 1) % DATA_BURST_SIZE : i);
+			write_message_header(packet_buf, bench.takion.tag_local, 0 /* data */, 9 + DATA_PAYLOAD_SIZE);
+			packet_buf[0xe] = 1; // type_b
+			uint8_t *pl = packet_buf + 0x11;
+			*((chiaki_unaligned_uint32_t *)(pl + 0)) = htonl(packet_seq_num);
+			*((chiaki_unaligned_uint16_t *)(pl + 4)) = htons(2); // channel
+			pl[8] = CHIAKI_TAKION_MESSAGE_DATA_TYPE_PAD_INFO;
+			sendto(console.sock, (CHIAKI_SOCKET_BUF_TYPE)packet_buf, sizeof(packet_buf), 0, (struct sockaddr *)&console.client_addr, console.client_addr_len);
+			if(!first_last)
+				bench_sleep_us(100);
+		}
+		seq_num += DATA_BURST_SIZE;
+		uint64_t next_us = start_us + (burst + 1) * DATA_BURST_INTERVAL_US;
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		if(next_us > now_us)
+			bench_sleep_us(next_us - now_us);
+	}
+	bench_sleep_us(50000);
+
+	bench_console_close(&console, &bench);
+
+	ChiakiTakionRecvStats *stats = &bench.takion.recv_stats;
+	uint64_t sent = DATA_BURSTS * DATA_BURST_SIZE;
+
+	char variant[64];
+	snprintf(variant, sizeof(variant), "window%zu/delay%llums/%s", data_window, (unsigned long long)data_ack_delay_ms, order);
+	bench_report("takion_data_ack", variant, "delivered/sent", (double)stats->data_packets / (double)sent);
+	bench_report("takion_data_ack", variant, "acks/delivered", stats->data_packets ? (double)stats->data_acks / (double)stats->data_packets : 0.0);
+
+	return MUNIT_OK;
+}
+
+static MunitParameterEnum send_buffer_params[] = {
+	{ "in_flight", (char *[]){ "16", "256", NULL } },
+	{ "ack_every", (char *[]){ "1", "8", NULL } },
+	{ NULL, NULL }
+};
+
+#define SEND_BUFFER_PACKETS 2000000
+
+/**
+ * Keep in_flight packets unacked and push one packet after another while acking cumulatively
+ * every ack_every packets, like a steady stream of control/feedback data.
+ */
+static MunitResult bench_takion_send_buffer(const MunitParameter params[], void *user)
+{
+	size_t in_flight = (size_t)atoi(munit_parameters_get(params, "in_flight"));
+	size_t ack_every = (size_t)atoi(munit_parameters_get(params, "ack_every"));
+
+	ChiakiTakionSendBuffer send_buffer;
+	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, in_flight + ack_every, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	send_buffer.log = get_test_log();
+
+	ChiakiSeqNum32 seq_num = munit_rand_uint32();
+	ChiakiSeqNum32 seq_num_acked = seq_num - 1;
+	uint64_t cpu_start_us = bench_thread_cpu_us();
+	for(size_t i=0; i<SEND_BUFFER_PACKETS; i++)
+	{
+		err = chiaki_takion_send_buffer_push(&send_buffer, seq_num++, malloc(64), 64, 0);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		if(i >= in_flight && (i % ack_every) == 0)
+		{
+			seq_num_acked = seq_num - 1 - (ChiakiSeqNum32)in_flight;
+			chiaki_takion_send_buffer_ack(&send_buffer, seq_num_acked, NULL, NULL);
+		}
+	}
+	uint64_t cpu_us = bench_thread_cpu_us() - cpu_start_us;
+
+	chiaki_takion_send_buffer_fini(&send_buffer);
+
+	char variant[48];
+	snprintf(variant, sizeof(variant), "in_flight%zu/ack_every%zu", in_flight, ack_every);
+	bench_report("takion_send_buffer", variant, "cpu ns/packet", (double)cpu_us * 1000.0 / SEND_BUFFER_PACKETS);
+
+	return MUNIT_OK;
+}
+
+MunitTest bench_takion[] = {
+	{
+		"/recv",
+		bench_takion_recv,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		recv_params
+	},
+	{
+		"/data_ack",
+		bench_takion_data_ack,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		data_ack_params
+	},
+	{
+		"/send_buffer",
+		bench_takion_send_buffer,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		send_buffer_params
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
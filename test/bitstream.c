@@ -167,6 +167,38 @@ static MunitResult test_bitstream_set_ref_h265(const MunitParameter params[], vo
 	// Slice have 9 reference frames
 	munit_assert(!chiaki_bitstream_slice_set_reference_frame(&bs, slice_p, ARRAY_SIZE(slice_p), 10));
 
+	// emulation prevention byte right before used_by_curr_pic_s0_flag[1], at the end of the loaded bits
+	uint8_t slice_p_epb[] = {
+		0x00, 0x00, 0x00, 0x01, 0x02, 0x01, 0x52, 0x53, 0x80, 0x00, 0x40, 0x00, 0x60, 0x00, 0x00, 0x40,
+		0x00, 0x00, 0x03, 0x02, 0x92, 0xd2, 0xd2, 0xd2, 0xd2, 0xd2, 0xd2, 0xd2,
+	};
+	memset(&slice, -1, sizeof(slice));
+	munit_assert(chiaki_bitstream_slice(&bs, slice_p_epb, ARRAY_SIZE(slice_p_epb), &slice));
+	munit_assert(slice.reference_frame == 0);
+	munit_assert_uint(slice.ref_flags_count, ==, 2);
+	munit_assert_uint32(slice.ref_flag_bits[1], ==, 15 * 8);
+	munit_assert(chiaki_bitstream_slice_set_reference_frame(&bs, slice_p_epb, ARRAY_SIZE(slice_p_epb), 1));
+	munit_assert_uint8(slice_p_epb[18], ==, 0x03);
+	munit_assert_uint8(slice_p_epb[19], ==, 0x82);
+	memset(&slice, -1, sizeof(slice));
+	munit_assert(chiaki_bitstream_slice(&bs, slice_p_epb, ARRAY_SIZE(slice_p_epb), &slice));
+	munit_assert(slice.reference_frame == 1);
+
+	// used_by_curr_pic_s0_flag[1] is in the zeros escaped by the following 0x03
+	uint8_t slice_p_epb_flag[] = {
+		0x00, 0x00, 0x00, 0x01, 0x02, 0x01, 0x52, 0x51, 0x39, 0x00, 0x00, 0x03, 0x00, 0x80, 0x00, 0x00,
+		0x05, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x28,
+	};
+	uint8_t slice_p_epb_flag_orig[ARRAY_SIZE(slice_p_epb_flag)];
+	memcpy(slice_p_epb_flag_orig, slice_p_epb_flag, sizeof(slice_p_epb_flag));
+	memset(&slice, -1, sizeof(slice));
+	munit_assert(chiaki_bitstream_slice(&bs, slice_p_epb_flag, ARRAY_SIZE(slice_p_epb_flag), &slice));
+	munit_assert(slice.reference_frame == 0);
+	munit_assert_uint(slice.ref_flags_count, ==, 3);
+	munit_assert_uint32(slice.ref_flag_bits[1], ==, 5 * 8 + 2);
+	munit_assert(!chiaki_bitstream_slice_set_reference_frame(&bs, slice_p_epb_flag, ARRAY_SIZE(slice_p_epb_flag), 1));
+	munit_assert_memory_equal(sizeof(slice_p_epb_flag), slice_p_epb_flag, slice_p_epb_flag_orig);
+
 	return MUNIT_OK;
 }
 
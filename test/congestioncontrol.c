@@ -0,0 +1,251 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/congestioncontrol.h>
+#include <chiaki/congestionsim.h>
+
+#include "test_log.h"
+
+#include <string.h>
+
+#define REPORTS_MAX 256
+
+typedef struct report_log_t
+{
+	ChiakiCongestionController *controller;
+	size_t count;
+	uint64_t time_ms[REPORTS_MAX];
+	uint64_t received[REPORTS_MAX];
+	uint64_t lost[REPORTS_MAX];
+	ChiakiTakionCongestionPacket packets[REPORTS_MAX];
+	bool overuse[REPORTS_MAX];
+	bool frames_failed[REPORTS_MAX]; // since the previous report
+	uint64_t frames_failed_prev;
+} ReportLog;
+
+static void report_log_cb(uint64_t time_ms, uint64_t received, uint64_t lost, const ChiakiTakionCongestionPacket *packet, void *user)
+{
+	ReportLog *log = user;
+	munit_assert_size(log->count, <, REPORTS_MAX);
+	size_t i = log->count++;
+	log->time_ms[i] = time_ms;
+	log->received[i] = received;
+	log->lost[i] = lost;
+	log->packets[i] = *packet;
+	munit_assert_uint64((uint64_t)packet->received + packet->lost, ==, received + lost);
+
+	ChiakiCongestionControllerStats stats;
+	log->controller->stats_cb(&stats, log->controller->user);
+	log->overuse[i] = stats.usage == CHIAKI_CONGESTION_USAGE_OVERUSE;
+	log->frames_failed[i] = stats.frames_failed != log->frames_failed_prev;
+	log->frames_failed_prev = stats.frames_failed;
+}
+
+static double packet_loss(const ChiakiTakionCongestionPacket *packet)
+{
+	unsigned int total = packet->received + packet->lost;
+	return total ? (double)packet->lost / total : 0.0;
+}
+
+static void run_trace(ReportLog *log, ChiakiCongestionControllerType type, double packet_loss_max, uint32_t seed,
+		const ChiakiCongestionSimStep *steps, size_t steps_count, ChiakiCongestionSimResult *result)
+{
+	ChiakiCongestionSimConfig config;
+	chiaki_congestion_sim_config_default(&config);
+	config.seed = seed;
+	ChiakiCongestionController controller;
+	ChiakiErrorCode err = chiaki_congestion_controller_init(&controller, type, get_test_log(), packet_loss_max, 1000000 / config.fps);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	memset(log, 0, sizeof(*log));
+	log->controller = &controller;
+	chiaki_congestion_sim_run(&config, steps, steps_count, &controller, report_log_cb, log, result);
+	munit_assert_uint64(result->reports, ==, log->count);
+	chiaki_congestion_controller_fini(&controller);
+}
+
+static MunitResult test_loss_clamp(const MunitParameter params[], void *user)
+{
+	static const ChiakiCongestionSimStep steps[] = {
+		{ 2000, 20000, 20000, 0.01, 0 },
+		{ 2000, 20000, 20000, 0.2, 0 }
+	};
+	static ReportLog log;
+	ChiakiCongestionSimResult result;
+	run_trace(&log, CHIAKI_CONGESTION_CONTROLLER_LOSS, 0.05, 1, steps, 2, &result);
+	munit_assert_uint64(result.reports, ==, 20);
+
+	for(size_t i=0; i<log.count; i++)
+	{
+		uint64_t total = log.received[i] + log.lost[i];
+		if((double)log.lost[i] / total <= 0.05)
+			munit_assert_uint16(log.packets[i].lost, ==, log.lost[i]);
+		else
+			munit_assert_uint16(log.packets[i].lost, ==, (uint64_t)(total * 0.05));
+		munit_assert_false(log.overuse[i]);
+	}
+	munit_assert_double(result.loss_measured_mean, >, 0.1);
+	munit_assert_double(result.loss_reported_max, <=, 0.05);
+	return MUNIT_OK;
+}
+
+static MunitResult test_delay_overuse(const MunitParameter params[], void *user)
+{
+	// a queue builds up by 100 ms per second without any loss, then stays
+	static const ChiakiCongestionSimStep steps[] = {
+		{ 3000, 20000, 20000, 0.0, 0 },
+		{ 2000, 20000, 220000, 0.0, 0 },
+		{ 3000, 220000, 220000, 0.0, 0 }
+	};
+	static ReportLog log;
+	ChiakiCongestionSimResult result;
+
+	run_trace(&log, CHIAKI_CONGESTION_CONTROLLER_LOSS, 0.3, 1, steps, 3, &result);
+	munit_assert_double(result.loss_reported_max, ==, 0.0);
+
+	run_trace(&log, CHIAKI_CONGESTION_CONTROLLER_DELAY_LOSS, 0.3, 1, steps, 3, &result);
+	uint64_t first_loss_ms = 0;
+	double loss_prev = 0.0;
+	for(size_t i=0; i<log.count; i++)
+	{
+		double loss = packet_loss(&log.packets[i]);
+		uint64_t t = log.time_ms[i];
+		munit_assert(log.overuse[i] == (loss > 0.0) || t > 5000);
+		if(t <= 3000 || t > 6000)
+			munit_assert_double(loss, ==, 0.0);
+		if(loss > 0.0 && !first_loss_ms)
+			first_loss_ms = t;
+		// keeps increasing while the queue does, until packet_loss_max is reached
+		if(first_loss_ms && t > first_loss_ms + 200 && t <= 4600)
+			munit_assert_double(loss, >, loss_prev);
+		loss_prev = loss;
+	}
+	munit_assert_uint64(first_loss_ms, >, 3000);
+	munit_assert_uint64(first_loss_ms, <=, 3600);
+	munit_assert_double(result.loss_reported_max, <=, 0.3);
+	return MUNIT_OK;
+}
+
+static MunitResult test_fec_burst(const MunitParameter params[], void *user)
+{
+	// short bursts are recovered by the 4 fec units of a frame
+	static const ChiakiCongestionSimStep steps_recovered[] = {
+		{ 10000, 20000, 20000, 0.002, 2 }
+	};
+	static ReportLog log;
+	ChiakiCongestionSimResult result;
+	run_trace(&log, CHIAKI_CONGESTION_CONTROLLER_DELAY_LOSS, 1.0, 1, steps_recovered, 1, &result);
+	munit_assert_uint64(result.frames_failed, ==, 0);
+	munit_assert_uint64(result.frames_fec_recovered, >, 0);
+	double measured_max = 0.0;
+	for(size_t i=0; i<log.count; i++)
+	{
+		double measured = (double)log.lost[i] / (log.received[i] + log.lost[i]);
+		if(measured > measured_max)
+			measured_max = measured;
+	}
+	munit_assert_double(result.loss_reported_max, <, measured_max * 0.5);
+	munit_assert_double(result.loss_reported_mean, <=, result.loss_measured_mean * 1.5);
+
+	// bursts of 8 units are not, so that loss is reported in full right away
+	static const ChiakiCongestionSimStep steps_failed[] = {
+		{ 10000, 20000, 20000, 0.002, 8 }
+	};
+	run_trace(&log, CHIAKI_CONGESTION_CONTROLLER_DELAY_LOSS, 1.0, 1, steps_failed, 1, &result);
+	munit_assert_uint64(result.frames_failed, >, 0);
+	size_t failed_reports = 0;
+	for(size_t i=0; i<log.count; i++)
+	{
+		if(!log.frames_failed[i])
+			continue;
+		failed_reports++;
+		munit_assert_uint16(log.packets[i].lost, >=, log.lost[i]);
+	}
+	munit_assert_size(failed_reports, >, 0);
+	return MUNIT_OK;
+}
+
+static MunitResult test_deterministic(const MunitParameter params[], void *user)
+{
+	static const ChiakiCongestionSimStep steps[] = {
+		{ 2000, 10000, 10000, 0.01, 2 },
+		{ 1000, 10000, 150000, 0.01, 2 },
+		{ 2000, 150000, 30000, 0.05, 4 }
+	};
+	static ReportLog a, b, c;
+	ChiakiCongestionSimResult result_a, result_b, result_c;
+	run_trace(&a, CHIAKI_CONGESTION_CONTROLLER_DELAY_LOSS, 0.1, 42, steps, 3, &result_a);
+	run_trace(&b, CHIAKI_CONGESTION_CONTROLLER_DELAY_LOSS, 0.1, 42, steps, 3, &result_b);
+	run_trace(&c, CHIAKI_CONGESTION_CONTROLLER_DELAY_LOSS, 0.1, 43, steps, 3, &result_c);
+
+	munit_assert_size(a.count, ==, b.count);
+	munit_assert_memory_equal(a.count * sizeof(a.packets[0]), a.packets, b.packets);
+	munit_assert_memory_equal(a.count * sizeof(a.lost[0]), a.lost, b.lost);
+	munit_assert_memory_equal(sizeof(result_a), &result_a, &result_b);
+	munit_assert(memcmp(a.lost, c.lost, a.count * sizeof(a.lost[0])) != 0);
+	return MUNIT_OK;
+}
+
+static MunitResult test_control_not_started(const MunitParameter params[], void *user)
+{
+	ChiakiCongestionControl control;
+	ChiakiErrorCode err = chiaki_congestion_control_init(&control);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// video units may arrive before congestion control is started
+	munit_assert_false(chiaki_congestion_control_wants_units(&control));
+	ChiakiCongestionUnitSample unit = { 0 };
+	chiaki_congestion_control_unit(&control, &unit);
+	ChiakiCongestionFrameSample frame = { 0 };
+	chiaki_congestion_control_frame(&control, &frame);
+	ChiakiCongestionControllerStats stats;
+	err = chiaki_congestion_control_get_stats(&control, &stats);
+	munit_assert_int(err, ==, CHIAKI_ERR_UNINITIALIZED);
+
+	chiaki_congestion_control_fini(&control);
+	return MUNIT_OK;
+}
+
+MunitTest tests_congestion_control[] = {
+	{
+		"/loss_clamp",
+		test_loss_clamp,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/delay_overuse",
+		test_delay_overuse,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/fec_burst",
+		test_fec_burst,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/deterministic",
+		test_deterministic,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/control_not_started",
+		test_control_not_started,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
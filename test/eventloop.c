@@ -0,0 +1,250 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/eventloop.h>
+#include <chiaki/time.h>
+
+#include "test_log.h"
+
+#if CHIAKI_EVENT_LOOP_SUPPORTED
+
+#include <unistd.h>
+
+#define WAIT_TIMEOUT_MS 2000
+
+typedef struct event_loop_test_t
+{
+	ChiakiEventLoop *loop;
+	ChiakiEventLoopSource source;
+	int fd;
+	uint64_t calls;
+	uint64_t called_us; // time of the last call
+	bool remove_in_cb;
+} EventLoopTest;
+
+static uint64_t test_calls(EventLoopTest *test)
+{
+	return __atomic_load_n(&test->calls, __ATOMIC_ACQUIRE);
+}
+
+static bool wait_calls(EventLoopTest *test, uint64_t calls)
+{
+	uint64_t start = chiaki_time_now_monotonic_ms();
+	while(test_calls(test) < calls)
+	{
+		if(chiaki_time_now_monotonic_ms() - start > WAIT_TIMEOUT_MS)
+			return false;
+		usleep(1000);
+	}
+	return true;
+}
+
+static void test_cb(void *user)
+{
+	EventLoopTest *test = user;
+	if(!test->source.timer)
+	{
+		uint8_t b;
+		munit_assert_int(read(test->fd, &b, 1), ==, 1);
+	}
+	if(test->remove_in_cb)
+		chiaki_event_loop_remove(test->loop, &test->source);
+	__atomic_store_n(&test->called_us, chiaki_time_now_monotonic_us(), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&test->calls, 1, __ATOMIC_RELEASE);
+}
+
+static MunitResult test_timer(const MunitParameter params[], void *user)
+{
+	ChiakiEventLoop loop;
+	ChiakiErrorCode err = chiaki_event_loop_init(&loop, get_test_log());
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_event_loop_start(&loop);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	EventLoopTest test = { 0 };
+	test.loop = &loop;
+	err = chiaki_event_loop_add_timer(&loop, &test.source, 5, test_cb, &test);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert(wait_calls(&test, 3));
+
+	// disarmed timers do not wake up the loop
+	err = chiaki_event_loop_timer_set(&test.source, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	uint64_t calls = test_calls(&test);
+	ChiakiEventLoopStats stats_before;
+	chiaki_event_loop_get_stats(&loop, &stats_before);
+	usleep(30000);
+	munit_assert_uint64(test_calls(&test), <=, calls + 1); // one expiration may have been pending
+	ChiakiEventLoopStats stats;
+	chiaki_event_loop_get_stats(&loop, &stats);
+	munit_assert_uint64(stats.wakeups, <=, stats_before.wakeups + 1);
+
+	err = chiaki_event_loop_timer_set(&test.source, 5);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert(wait_calls(&test, test_calls(&test) + 2));
+
+	chiaki_event_loop_remove(&loop, &test.source);
+	chiaki_event_loop_get_stats(&loop, &stats);
+	munit_assert_uint64(stats.timer_expirations, >=, 5);
+	munit_assert_uint64(stats.fd_events, ==, 0);
+
+	chiaki_event_loop_fini(&loop);
+	return MUNIT_OK;
+}
+
+static MunitResult test_timer_oneshot(const MunitParameter params[], void *user)
+{
+	ChiakiEventLoop loop;
+	ChiakiErrorCode err = chiaki_event_loop_init(&loop, get_test_log());
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_event_loop_start(&loop);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	EventLoopTest test = { 0 };
+	test.loop = &loop;
+	err = chiaki_event_loop_add_timer(&loop, &test.source, 0, test_cb, &test);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	for(uint64_t i=1; i<=4; i++)
+	{
+		uint64_t armed_us = chiaki_time_now_monotonic_us();
+		err = chiaki_event_loop_timer_set_oneshot(&test.source, 15);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert(wait_calls(&test, i));
+		// never before the deadline, no matter how it lines up with multiples of the timeout
+		munit_assert_uint64(__atomic_load_n(&test.called_us, __ATOMIC_RELAXED) - armed_us, >=, 15000);
+	}
+
+	// and only once
+	usleep(50000);
+	munit_assert_uint64(test_calls(&test), ==, 4);
+
+	// disarmed before the deadline
+	err = chiaki_event_loop_timer_set_oneshot(&test.source, 15);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_event_loop_timer_set_oneshot(&test.source, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	usleep(50000);
+	munit_assert_uint64(test_calls(&test), ==, 4);
+
+	chiaki_event_loop_remove(&loop, &test.source);
+	chiaki_event_loop_fini(&loop);
+	return MUNIT_OK;
+}
+
+static MunitResult test_fd(const MunitParameter params[], void *user)
+{
+	ChiakiEventLoop loop;
+	ChiakiErrorCode err = chiaki_event_loop_init(&loop, get_test_log());
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_event_loop_start(&loop);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	int fds[2];
+	munit_assert_int(pipe(fds), ==, 0);
+
+	EventLoopTest test = { 0 };
+	test.loop = &loop;
+	test.fd = fds[0];
+	err = chiaki_event_loop_add_fd(&loop, &test.source, fds[0], test_cb, &test);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	for(uint64_t i=1; i<=8; i++)
+	{
+		munit_assert_int(write(fds[1], "x", 1), ==, 1);
+		munit_assert(wait_calls(&test, i));
+	}
+
+	chiaki_event_loop_remove(&loop, &test.source);
+	munit_assert_int(write(fds[1], "x", 1), ==, 1);
+	usleep(20000);
+	munit_assert_uint64(test_calls(&test), ==, 8);
+
+	ChiakiEventLoopStats stats;
+	chiaki_event_loop_get_stats(&loop, &stats);
+	munit_assert_uint64(stats.fd_events, ==, 8);
+
+	chiaki_event_loop_fini(&loop);
+	close(fds[0]);
+	close(fds[1]);
+	return MUNIT_OK;
+}
+
+static MunitResult test_remove_in_cb(const MunitParameter params[], void *user)
+{
+	ChiakiEventLoop loop;
+	ChiakiErrorCode err = chiaki_event_loop_init(&loop, get_test_log());
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_event_loop_start(&loop);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	EventLoopTest test = { 0 };
+	test.loop = &loop;
+	test.remove_in_cb = true;
+	err = chiaki_event_loop_add_timer(&loop, &test.source, 2, test_cb, &test);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert(wait_calls(&test, 1));
+	usleep(20000);
+	munit_assert_uint64(test_calls(&test), ==, 1);
+
+	// the freed slot can be used again
+	test.remove_in_cb = false;
+	err = chiaki_event_loop_add_timer(&loop, &test.source, 2, test_cb, &test);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert(wait_calls(&test, 2));
+	chiaki_event_loop_remove(&loop, &test.source);
+
+	chiaki_event_loop_fini(&loop);
+	return MUNIT_OK;
+}
+
+#else
+
+static MunitResult test_unsupported(const MunitParameter params[], void *user)
+{
+	return MUNIT_SKIP;
+}
+
+#define test_timer test_unsupported
+#define test_timer_oneshot test_unsupported
+#define test_fd test_unsupported
+#define test_remove_in_cb test_unsupported
+
+#endif
+
+MunitTest tests_event_loop[] = {
+	{
+		"/timer",
+		test_timer,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/timer_oneshot",
+		test_timer_oneshot,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/fd",
+		test_fd,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/remove_in_cb",
+		test_remove_in_cb,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
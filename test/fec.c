@@ -16,43 +16,70 @@ typedef struct fec_test_case_t
 
 #include "fec_test_cases.inl"
 
-static MunitResult test_fec_case(FECTestCase *test_case)
+typedef struct fec_test_frame_t
+{
+	uint8_t *frame_buffer_ref;
+	uint8_t *frame_buffer;
+	size_t stride;
+	size_t erasures_count;
+} FECTestFrame;
+
+static void fec_test_frame_load(FECTestFrame *frame, FECTestCase *test_case)
 {
 	size_t b64len = strlen(test_case->frame_buffer_b64);
-	uint8_t *frame_buffer_ref = malloc(b64len);
-	munit_assert_not_null(frame_buffer_ref);
+	frame->frame_buffer_ref = malloc(b64len);
+	munit_assert_not_null(frame->frame_buffer_ref);
 
-	size_t stride = ((test_case->unit_size + 0xf) / 0x10) * 0x10;
-	size_t frame_buffer_size = stride * (test_case->k + test_case->m);
-	uint8_t *frame_buffer = malloc(frame_buffer_size);
-	munit_assert_not_null(frame_buffer);
+	frame->stride = ((test_case->unit_size + 0xf) / 0x10) * 0x10;
+	size_t frame_buffer_size = frame->stride * (test_case->k + test_case->m);
+	frame->frame_buffer = malloc(frame_buffer_size);
+	munit_assert_not_null(frame->frame_buffer);
 
-	ChiakiErrorCode err = chiaki_base64_decode(test_case->frame_buffer_b64, b64len, frame_buffer_ref, &b64len);
+	ChiakiErrorCode err = chiaki_base64_decode(test_case->frame_buffer_b64, b64len, frame->frame_buffer_ref, &b64len);
 	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
 	munit_assert_size(b64len, ==, test_case->unit_size * (test_case->k + test_case->m));
 
-	for(size_t i=0; i<test_case->k + test_case->m; i++)
-		memcpy(frame_buffer + i * stride, frame_buffer_ref + i * test_case->unit_size, test_case->unit_size);
+	frame->erasures_count = 0;
+	for(const int *e = test_case->erasures; *e >= 0; e++, frame->erasures_count++);
+}
 
-	size_t erasures_count = 0;
-	for(const int *e = test_case->erasures; *e >= 0; e++, erasures_count++);
+static void fec_test_frame_reset(FECTestFrame *frame, FECTestCase *test_case)
+{
+	for(size_t i=0; i<test_case->k + test_case->m; i++)
+		memcpy(frame->frame_buffer + i * frame->stride, frame->frame_buffer_ref + i * test_case->unit_size, test_case->unit_size);
 
 	// write garbage over erasures
-	for(size_t i=0; i<erasures_count; i++)
+	for(size_t i=0; i<frame->erasures_count; i++)
 	{
 		unsigned int e = test_case->erasures[i];
 		munit_assert_uint(e, <, test_case->k + test_case->m);
-		memset(frame_buffer + stride * e, 0x42, test_case->unit_size);
+		memset(frame->frame_buffer + frame->stride * e, 0x42, test_case->unit_size);
 	}
+}
 
-	err = chiaki_fec_decode(frame_buffer, test_case->unit_size, stride, test_case->k, test_case->m, (const unsigned int *)test_case->erasures, erasures_count);
-	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
-
+static void fec_test_frame_check(FECTestFrame *frame, FECTestCase *test_case)
+{
 	for(size_t i=0; i<test_case->k; i++)
-		munit_assert_memory_equal(test_case->unit_size, frame_buffer + i * stride, frame_buffer_ref + i * test_case->unit_size);
+		munit_assert_memory_equal(test_case->unit_size, frame->frame_buffer + i * frame->stride, frame->frame_buffer_ref + i * test_case->unit_size);
+}
 
-	free(frame_buffer);
-	free(frame_buffer_ref);
+static void fec_test_frame_fini(FECTestFrame *frame)
+{
+	free(frame->frame_buffer);
+	free(frame->frame_buffer_ref);
+}
+
+static MunitResult test_fec_case(FECTestCase *test_case)
+{
+	FECTestFrame frame;
+	fec_test_frame_load(&frame, test_case);
+	fec_test_frame_reset(&frame, test_case);
+
+	ChiakiErrorCode err = chiaki_fec_decode(frame.frame_buffer, test_case->unit_size, frame.stride, test_case->k, test_case->m, (const unsigned int *)test_case->erasures, frame.erasures_count);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	fec_test_frame_check(&frame, test_case);
+
+	fec_test_frame_fini(&frame);
 	return MUNIT_OK;
 }
 
@@ -67,6 +94,195 @@ static MunitResult test_fec(const MunitParameter params[], void *test_user)
 	return test_fec_case(&fec_test_cases[test_case_id]);
 }
 
+static MunitResult test_fec_cache(const MunitParameter params[], void *test_user)
+{
+	ChiakiFecCache cache;
+	chiaki_fec_cache_init(&cache);
+
+	size_t cases_count = sizeof(fec_test_cases) / sizeof(fec_test_cases[0]);
+	for(size_t pass=0; pass<2; pass++)
+	{
+		uint64_t misses_before = cache.stats.schedule_misses;
+		for(size_t i=0; i<cases_count; i++)
+		{
+			FECTestCase *test_case = &fec_test_cases[i];
+			FECTestFrame frame;
+			fec_test_frame_load(&frame, test_case);
+			fec_test_frame_reset(&frame, test_case);
+			ChiakiErrorCode err = chiaki_fec_cache_decode(&cache, frame.frame_buffer, test_case->unit_size, frame.stride,
+					test_case->k, test_case->m, (const unsigned int *)test_case->erasures, frame.erasures_count);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			fec_test_frame_check(&frame, test_case);
+
+			// the same erasures again must be a hit
+			uint64_t misses = cache.stats.schedule_misses;
+			fec_test_frame_reset(&frame, test_case);
+			err = chiaki_fec_cache_decode(&cache, frame.frame_buffer, test_case->unit_size, frame.stride,
+					test_case->k, test_case->m, (const unsigned int *)test_case->erasures, frame.erasures_count);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			fec_test_frame_check(&frame, test_case);
+			munit_assert_uint64(cache.stats.schedule_misses, ==, misses);
+			fec_test_frame_fini(&frame);
+		}
+		// the test cases contain fewer distinct erasure patterns than the cache holds
+		if(pass == 1)
+			munit_assert_uint64(cache.stats.schedule_misses, ==, misses_before);
+	}
+
+	// more patterns than the cache holds, so entries get evicted
+	const unsigned int k = CHIAKI_FEC_CACHE_SCHEDULES + 8;
+	const unsigned int m = 2;
+	const size_t unit_size = 0x40;
+	uint8_t *ref = malloc((k + m) * unit_size);
+	uint8_t *buf = malloc((k + m) * unit_size);
+	munit_assert_not_null(ref);
+	munit_assert_not_null(buf);
+	munit_rand_memory(k * unit_size, ref);
+	ChiakiErrorCode err = chiaki_fec_encode(ref, unit_size, unit_size, k, m);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	for(size_t pass=0; pass<2; pass++)
+	{
+		for(unsigned int i=0; i<k; i++)
+		{
+			memcpy(buf, ref, (k + m) * unit_size);
+			unsigned int erasures[] = { k, i };
+			memset(buf + i * unit_size, 0x42, unit_size);
+			memset(buf + k * unit_size, 0x42, unit_size);
+			err = chiaki_fec_cache_decode(&cache, buf, unit_size, unit_size, k, m, erasures, 2);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			munit_assert_memory_equal(k * unit_size, buf, ref);
+		}
+	}
+	free(buf);
+	free(ref);
+
+	chiaki_fec_cache_fini(&cache);
+	return MUNIT_OK;
+}
+
+static MunitResult test_fec_too_many_erasures(const MunitParameter params[], void *test_user)
+{
+	FECTestCase *test_case = &fec_test_cases[0];
+	FECTestFrame frame;
+	fec_test_frame_load(&frame, test_case);
+	fec_test_frame_reset(&frame, test_case);
+
+	unsigned int erasures[0x10];
+	for(unsigned int i=0; i<=test_case->m; i++)
+		erasures[i] = i;
+	ChiakiErrorCode err = chiaki_fec_decode(frame.frame_buffer, test_case->unit_size, frame.stride, test_case->k, test_case->m, erasures, test_case->m + 1);
+	munit_assert_int(err, ==, CHIAKI_ERR_FEC_FAILED);
+
+	// duplicates don't count
+	for(unsigned int i=0; i<=test_case->m; i++)
+		erasures[i] = test_case->erasures[0];
+	fec_test_frame_reset(&frame, test_case);
+	err = chiaki_fec_decode(frame.frame_buffer, test_case->unit_size, frame.stride, test_case->k, test_case->m, erasures, test_case->m + 1);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	fec_test_frame_check(&frame, test_case);
+
+	erasures[0] = test_case->k + test_case->m;
+	err = chiaki_fec_decode(frame.frame_buffer, test_case->unit_size, frame.stride, test_case->k, test_case->m, erasures, 1);
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+
+	fec_test_frame_fini(&frame);
+	return MUNIT_OK;
+}
+
+static MunitParameterEnum fec_engine_params[] = {
+	{ "engine", (char *[]){ "scalar", "ssse3", "avx2", "neon", NULL } },
+	{ NULL, NULL },
+};
+
+static ChiakiFecEngine fec_engine_param(const MunitParameter params[])
+{
+	const char *name = munit_parameters_get(params, "engine");
+	for(ChiakiFecEngine engine=CHIAKI_FEC_ENGINE_REFERENCE; engine<=CHIAKI_FEC_ENGINE_NEON; engine++)
+	{
+		if(!strcmp(chiaki_fec_engine_name(engine), name))
+			return engine;
+	}
+	munit_error("unknown engine");
+	return CHIAKI_FEC_ENGINE_REFERENCE;
+}
+
+static void fec_engine_decode_compare(ChiakiFecCache *cache, ChiakiFecCache *cache_ref, uint8_t *frame_buffer, uint8_t *frame_buffer_ref,
+		size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count)
+{
+	ChiakiErrorCode err = chiaki_fec_cache_decode(cache_ref, frame_buffer_ref, unit_size, stride, k, m, erasures, erasures_count);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_fec_cache_decode(cache, frame_buffer, unit_size, stride, k, m, erasures, erasures_count);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	for(size_t i=0; i<k; i++)
+		munit_assert_memory_equal(unit_size, frame_buffer + i * stride, frame_buffer_ref + i * stride);
+}
+
+static MunitResult test_fec_engine(const MunitParameter params[], void *test_user)
+{
+	ChiakiFecEngine engine = fec_engine_param(params);
+	if(!chiaki_fec_engine_supported(engine))
+		return MUNIT_SKIP;
+
+	ChiakiFecCache cache, cache_ref;
+	chiaki_fec_cache_init(&cache);
+	chiaki_fec_cache_init(&cache_ref);
+	cache.engine = engine;
+	cache_ref.engine = CHIAKI_FEC_ENGINE_REFERENCE;
+
+	// all test vectors, byte-identical to the reference
+	for(size_t i=0; i<sizeof(fec_test_cases) / sizeof(fec_test_cases[0]); i++)
+	{
+		FECTestCase *test_case = &fec_test_cases[i];
+		FECTestFrame frame, frame_ref;
+		fec_test_frame_load(&frame, test_case);
+		fec_test_frame_load(&frame_ref, test_case);
+		fec_test_frame_reset(&frame, test_case);
+		fec_test_frame_reset(&frame_ref, test_case);
+		fec_engine_decode_compare(&cache, &cache_ref, frame.frame_buffer, frame_ref.frame_buffer, test_case->unit_size, frame.stride,
+				test_case->k, test_case->m, (const unsigned int *)test_case->erasures, frame.erasures_count);
+		fec_test_frame_check(&frame, test_case);
+		fec_test_frame_fini(&frame);
+		fec_test_frame_fini(&frame_ref);
+	}
+
+	// bigger frames with random erasures and a unit size that is not a multiple of any vector size
+	const unsigned int k = 64;
+	const unsigned int m = 16;
+	const size_t unit_size = 1397;
+	const size_t stride = 1408;
+	uint8_t *encoded = malloc((k + m) * unit_size);
+	uint8_t *frame_buffer = malloc((k + m) * stride);
+	uint8_t *frame_buffer_ref = malloc((k + m) * stride);
+	munit_assert_not_null(encoded);
+	munit_assert_not_null(frame_buffer);
+	munit_assert_not_null(frame_buffer_ref);
+	munit_rand_memory(k * unit_size, encoded);
+	ChiakiErrorCode err = chiaki_fec_encode(encoded, unit_size, unit_size, k, m);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	for(size_t round=0; round<16; round++)
+	{
+		unsigned int erasures[16];
+		size_t erasures_count = munit_rand_int_range(1, m);
+		for(size_t i=0; i<erasures_count; i++)
+			erasures[i] = (unsigned int)munit_rand_int_range(0, k + m - 1);
+		for(size_t i=0; i<k + m; i++)
+			memcpy(frame_buffer + i * stride, encoded + i * unit_size, unit_size);
+		for(size_t i=0; i<erasures_count; i++)
+			memset(frame_buffer + erasures[i] * stride, 0x42, unit_size);
+		memcpy(frame_buffer_ref, frame_buffer, (k + m) * stride);
+		fec_engine_decode_compare(&cache, &cache_ref, frame_buffer, frame_buffer_ref, unit_size, stride, k, m, erasures, erasures_count);
+		for(size_t i=0; i<k; i++)
+			munit_assert_memory_equal(unit_size, frame_buffer + i * stride, encoded + i * unit_size);
+	}
+	free(encoded);
+	free(frame_buffer);
+	free(frame_buffer_ref);
+
+	chiaki_fec_cache_fini(&cache);
+	chiaki_fec_cache_fini(&cache_ref);
+	return MUNIT_OK;
+}
+
 MunitTest tests_fec[] = {
 	{
 		"/fec",
@@ -76,5 +292,29 @@ MunitTest tests_fec[] = {
 		MUNIT_TEST_OPTION_NONE,
 		fec_params
 	},
+	{
+		"/cache",
+		test_fec_cache,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/engine",
+		test_fec_engine,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		fec_engine_params
+	},
+	{
+		"/too_many_erasures",
+		test_fec_too_many_erasures,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/ffmpegdecoder.h>
+#include <chiaki/video.h>
+
+#include <libavutil/cpu.h>
+
+#include "test_log.h"
+
+#include <string.h>
+
+// 32x32 baseline H.264, SPS and PPS as sent in the profile header
+static const uint8_t header[] = {
+	0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0xc0, 0x1e, 0xda, 0x25, 0x90,
+	0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x3c, 0x80
+};
+
+// IDR slice headers of two slices with 2 I_PCM macroblocks each, up to the pcm samples of the first one
+static const uint8_t idr_slice_prefixes[2][9] = {
+	{ 0x00, 0x00, 0x00, 0x01, 0x65, 0x88, 0x84, 0xa0, 0xd0 }, // first_mb_in_slice = 0
+	{ 0x00, 0x00, 0x00, 0x01, 0x65, 0x62, 0x21, 0x28, 0x34 } // first_mb_in_slice = 2
+};
+
+#define PCM_SAMPLES_SIZE 384 // 16x16 luma and 2x 8x8 chroma
+
+static size_t idr_build(uint8_t *buf)
+{
+	size_t size = 0;
+	for(size_t i=0; i<2; i++)
+	{
+		memcpy(buf + size, idr_slice_prefixes[i], sizeof(idr_slice_prefixes[i]));
+		size += sizeof(idr_slice_prefixes[i]);
+		memset(buf + size, 0x80, PCM_SAMPLES_SIZE);
+		size += PCM_SAMPLES_SIZE;
+		buf[size++] = 0x0d; // mb_type = I_PCM
+		buf[size++] = 0x00; // pcm_alignment_zero_bits
+		memset(buf + size, 0x80, PCM_SAMPLES_SIZE);
+		size += PCM_SAMPLES_SIZE;
+		buf[size++] = 0x80; // rbsp_trailing_bits
+	}
+	return size;
+}
+
+static void frame_available_cb(ChiakiFfmpegDecoder *decoder, void *user)
+{
+	(void)decoder;
+	(*(int *)user)++;
+}
+
+static MunitResult test_header_first(const MunitParameter params[], void *user)
+{
+	ChiakiFfmpegDecoderProfileSettings profile;
+	chiaki_ffmpeg_decoder_profile_settings_init(&profile, CHIAKI_FFMPEG_DECODER_PROFILE_LATENCY);
+	int frames_available = 0;
+	ChiakiFfmpegDecoder decoder;
+	ChiakiErrorCode err = chiaki_ffmpeg_decoder_init(&decoder, get_test_log(), CHIAKI_CODEC_H264, NULL, NULL, &profile, frame_available_cb, &frames_available);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_false(decoder.codec_opened);
+
+	// the header comes first and has no slices, so it must not decide the thread count
+	uint8_t *buf = chiaki_ffmpeg_decoder_video_sample_alloc_cb(sizeof(header), &decoder);
+	munit_assert_not_null(buf);
+	memcpy(buf, header, sizeof(header));
+	memset(buf + sizeof(header), 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	munit_assert_true(chiaki_ffmpeg_decoder_video_sample_cb(buf, sizeof(header), 0, false, &decoder));
+	munit_assert_false(decoder.codec_opened);
+	ChiakiFfmpegDecoderStats stats;
+	chiaki_ffmpeg_decoder_get_stats(&decoder, &stats);
+	munit_assert_uint64(stats.samples, ==, 0);
+
+	// the first picture opens the codec with as many slice threads as it has slices, then the header goes in before it
+	static uint8_t idr[2 * (sizeof(idr_slice_prefixes[0]) + 2 * PCM_SAMPLES_SIZE + 3) + CHIAKI_VIDEO_BUFFER_PADDING_SIZE];
+	size_t idr_size = idr_build(idr);
+	memset(idr + idr_size, 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	munit_assert_true(chiaki_ffmpeg_decoder_video_sample_cb(idr, idr_size, 0, false, &decoder));
+	munit_assert_true(decoder.codec_opened);
+	int cpus = av_cpu_count();
+	munit_assert_int(decoder.codec_context->thread_count, ==, cpus < 2 ? cpus : 2);
+	chiaki_ffmpeg_decoder_get_stats(&decoder, &stats);
+	munit_assert_uint64(stats.samples, ==, 2);
+	munit_assert_int(frames_available, ==, 1);
+
+	int32_t frames_lost;
+	AVFrame *frame = chiaki_ffmpeg_decoder_pull_frame(&decoder, &frames_lost);
+	munit_assert_not_null(frame);
+	munit_assert_int(frame->width, ==, 32);
+	munit_assert_int(frame->height, ==, 32);
+	av_frame_free(&frame);
+
+	chiaki_ffmpeg_decoder_fini(&decoder);
+	return MUNIT_OK;
+}
+
+MunitTest tests_ffmpeg_decoder[] = {
+	{
+		"/header_first",
+		test_header_first,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
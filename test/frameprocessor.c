@@ -0,0 +1,425 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/frameprocessor.h>
+#include <chiaki/fec.h>
+#include <chiaki/thread.h>
+#include <chiaki/video.h>
+
+#include "test_log.h"
+
+#include <string.h>
+
+#define UNITS_SOURCE 8
+#define UNITS_FEC 3
+#define UNIT_SIZE 0x60
+#define FRAMES_MAX 4
+
+/**
+ * A frame of UNITS_SOURCE + UNITS_FEC units with zero padding, as sent by the console.
+ */
+typedef struct test_frame_t
+{
+	uint8_t units[UNITS_SOURCE + UNITS_FEC][UNIT_SIZE];
+	size_t unit_sizes[UNITS_SOURCE + UNITS_FEC];
+	uint8_t payload[UNITS_SOURCE * (UNIT_SIZE - 2)];
+	size_t payload_size;
+} TestFrame;
+
+/**
+ * @param short_units whether odd source units should be shorter than the others, which fec sees zero-padded
+ */
+static void test_frame_init_units(TestFrame *frame, bool short_units)
+{
+	munit_rand_memory(sizeof(frame->units), (uint8_t *)frame->units);
+	static const uint8_t start_code[] = { 0x00, 0x00, 0x00, 0x01 };
+	memcpy(frame->units[0] + 2, start_code, sizeof(start_code));
+	frame->payload_size = 0;
+	for(size_t i=0; i<UNITS_SOURCE + UNITS_FEC; i++)
+	{
+		size_t size = UNIT_SIZE;
+		if(short_units && i < UNITS_SOURCE && (i & 1))
+			size -= 7 * i;
+		frame->unit_sizes[i] = size;
+		if(i >= UNITS_SOURCE)
+			continue;
+		uint16_t padding = (uint16_t)(UNIT_SIZE - size);
+		frame->units[i][0] = (uint8_t)(padding >> 8);
+		frame->units[i][1] = (uint8_t)padding;
+		memset(frame->units[i] + size, 0, UNIT_SIZE - size);
+		memcpy(frame->payload + frame->payload_size, frame->units[i] + 2, size - 2);
+		frame->payload_size += size - 2;
+	}
+	ChiakiErrorCode err = chiaki_fec_encode((uint8_t *)frame->units, UNIT_SIZE, UNIT_SIZE, UNITS_SOURCE, UNITS_FEC);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+}
+
+static void test_frame_init(TestFrame *frame)
+{
+	test_frame_init_units(frame, false);
+}
+
+/**
+ * Put all units of frame except the ones in lost, stopping as soon as the frame is decodable.
+ */
+static void test_frame_put(ChiakiFrameProcessor *frame_processor, TestFrame *frame, ChiakiSeqNum16 frame_index, const unsigned int *lost, size_t lost_count)
+{
+	ChiakiTakionAVPacket packet = { 0 };
+	packet.frame_index = frame_index;
+	packet.units_in_frame_total = UNITS_SOURCE + UNITS_FEC;
+	packet.units_in_frame_fec = UNITS_FEC;
+	bool allocated = false;
+	for(unsigned int i=0; i<UNITS_SOURCE + UNITS_FEC; i++)
+	{
+		bool is_lost = false;
+		for(size_t j=0; j<lost_count; j++)
+			is_lost = is_lost || lost[j] == i;
+		if(is_lost)
+			continue;
+		packet.unit_index = i;
+		packet.data = frame->units[i];
+		packet.data_size = frame->unit_sizes[i];
+		if(!allocated)
+		{
+			munit_assert_int(chiaki_frame_processor_alloc_frame(frame_processor, &packet), ==, CHIAKI_ERR_SUCCESS);
+			allocated = true;
+		}
+		munit_assert_int(chiaki_frame_processor_put_unit(frame_processor, &packet), ==, CHIAKI_ERR_SUCCESS);
+		if(chiaki_frame_processor_flush_possible(frame_processor))
+			break;
+	}
+}
+
+static MunitResult test_fec_sync(const MunitParameter params[], void *user)
+{
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, get_test_log());
+
+	TestFrame frame;
+	test_frame_init(&frame);
+	const unsigned int lost[] = { 0, 5, UNITS_SOURCE + 1 };
+	test_frame_put(&frame_processor, &frame, 1, lost, 3);
+	munit_assert(chiaki_frame_processor_flush_possible(&frame_processor));
+
+	uint8_t *buf;
+	size_t buf_size;
+	ChiakiFrameProcessorFlushResult result = chiaki_frame_processor_flush(&frame_processor, &buf, &buf_size);
+	munit_assert_int(result, ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS);
+	munit_assert_size(buf_size, ==, frame.payload_size);
+	munit_assert_memory_equal(frame.payload_size, buf, frame.payload);
+
+	ChiakiFrameProcessorTimes *times = &frame_processor.times;
+	munit_assert_uint64(times->first_unit_us, >, 0);
+	munit_assert_uint64(times->decodable_us, >=, times->first_unit_us);
+	munit_assert_uint64(times->emitted_us, >=, times->decodable_us);
+
+	// unit 0 was recovered, but the NAL unit in it is still found
+	munit_assert_size(frame_processor.nal.offset, ==, 4);
+	munit_assert_size(frame_processor.nal.size, ==, UNIT_SIZE - 2 - 4);
+
+	chiaki_frame_processor_fini(&frame_processor);
+	return MUNIT_OK;
+}
+
+static MunitResult test_packet_stats(const MunitParameter params[], void *user)
+{
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, get_test_log());
+	ChiakiPacketStats packet_stats;
+	chiaki_packet_stats_init(&packet_stats);
+
+	TestFrame frame;
+	test_frame_init(&frame);
+	const unsigned int lost[] = { 1, 2, 5 };
+	test_frame_put(&frame_processor, &frame, 1, lost, 3);
+	uint8_t *buf;
+	size_t buf_size;
+	ChiakiFrameProcessorFlushResult result = chiaki_frame_processor_flush(&frame_processor, &buf, &buf_size);
+	munit_assert_int(result, ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS);
+
+	// units recovered by fec still count as lost
+	chiaki_frame_processor_report_packet_stats(&frame_processor, &packet_stats);
+	uint64_t received, lost_count;
+	chiaki_packet_stats_get(&packet_stats, false, &received, &lost_count);
+	munit_assert_uint64(received, ==, UNITS_SOURCE + UNITS_FEC - 3);
+	munit_assert_uint64(lost_count, ==, 3);
+
+	ChiakiPacketStatsHistograms hists;
+	chiaki_packet_stats_get_histograms(&packet_stats, &hists);
+	ChiakiPacketStatsHistogram *bursts = &hists.hist[CHIAKI_PACKET_STATS_HIST_LOSS_BURST];
+	munit_assert_uint64(bursts->buckets[1], ==, 1); // 5
+	munit_assert_uint64(bursts->buckets[2], ==, 1); // 1, 2
+	munit_assert_uint64(hists.hist[CHIAKI_PACKET_STATS_HIST_FRAME_LOSS].buckets[2], ==, 1);
+
+	chiaki_packet_stats_fini(&packet_stats);
+	chiaki_frame_processor_fini(&frame_processor);
+	return MUNIT_OK;
+}
+
+typedef struct async_frames_t
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool hold; // the callback waits while this is set
+	size_t count;
+	ChiakiFrameProcessorFlushResult results[FRAMES_MAX];
+	ChiakiSeqNum16 frame_indexes[FRAMES_MAX];
+	uint8_t payloads[FRAMES_MAX][UNITS_SOURCE * (UNIT_SIZE - 2)];
+	size_t sizes[FRAMES_MAX];
+	ChiakiFrameProcessorTimes times[FRAMES_MAX];
+	uint8_t *allocated; // by async_alloc_cb() for the frame being emitted
+	size_t allocated_count;
+} AsyncFrames;
+
+static uint8_t *async_alloc_cb(size_t size, void *user)
+{
+	AsyncFrames *frames = user;
+	munit_assert_null(frames->allocated);
+	frames->allocated = malloc(size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	munit_assert_not_null(frames->allocated);
+	frames->allocated_count++;
+	return frames->allocated;
+}
+
+static void async_frame_cb(ChiakiFrameProcessorFlushResult result, ChiakiSeqNum16 frame_index,
+		uint8_t *frame, size_t frame_size, ChiakiFrameProcessorTimes *times, ChiakiFrameProcessorNal *nal, void *user)
+{
+	AsyncFrames *frames = user;
+	chiaki_mutex_lock(&frames->mutex);
+	while(frames->hold)
+		chiaki_cond_wait(&frames->cond, &frames->mutex);
+	munit_assert_size(frames->count, <, FRAMES_MAX);
+	munit_assert_size(frame_size, <=, sizeof(frames->payloads[0]));
+	frames->results[frames->count] = result;
+	frames->frame_indexes[frames->count] = frame_index;
+	memcpy(frames->payloads[frames->count], frame, frame_size);
+	frames->sizes[frames->count] = frame_size;
+	frames->times[frames->count] = *times;
+	if(result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
+		munit_assert_size(nal->offset, ==, 4);
+	frames->count++;
+	if(frames->allocated)
+	{
+		munit_assert_ptr_equal(frame, frames->allocated);
+		free(frames->allocated);
+		frames->allocated = NULL;
+	}
+	chiaki_mutex_unlock(&frames->mutex);
+}
+
+static MunitResult test_fec_async(const MunitParameter params[], void *user)
+{
+	bool alloc = !strcmp(munit_parameters_get(params, "alloc"), "on");
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, get_test_log());
+	AsyncFrames frames = { 0 };
+	chiaki_mutex_init(&frames.mutex, false);
+	ChiakiErrorCode err = chiaki_frame_processor_fec_worker_start(&frame_processor, async_frame_cb, &frames);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	if(alloc)
+		chiaki_frame_processor_set_alloc_cb(&frame_processor, async_alloc_cb, &frames);
+
+	TestFrame test_frames[3];
+	const unsigned int lost[][2] = {
+		{ 2, 3 },
+		{ 7, UNITS_SOURCE },
+		{ 0, 1 }
+	};
+	for(size_t i=0; i<3; i++)
+	{
+		test_frame_init(&test_frames[i]);
+		test_frame_put(&frame_processor, &test_frames[i], (ChiakiSeqNum16)i, lost[i], 2);
+		munit_assert(chiaki_frame_processor_flush_possible(&frame_processor));
+		err = chiaki_frame_processor_flush_async(&frame_processor);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert(frame_processor.flushed);
+
+		// late units are still counted, but not stored
+		ChiakiTakionAVPacket late = { 0 };
+		late.unit_index = lost[i][1];
+		late.data = test_frames[i].units[late.unit_index];
+		late.data_size = UNIT_SIZE;
+		err = chiaki_frame_processor_put_unit(&frame_processor, &late);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+	chiaki_frame_processor_fec_wait(&frame_processor);
+
+	munit_assert_size(frames.count, ==, 3);
+	for(size_t i=0; i<3; i++)
+	{
+		munit_assert_int(frames.results[i], ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS);
+		munit_assert_uint16(frames.frame_indexes[i], ==, i);
+		munit_assert_size(frames.sizes[i], ==, test_frames[i].payload_size);
+		munit_assert_memory_equal(test_frames[i].payload_size, frames.payloads[i], test_frames[i].payload);
+		munit_assert_uint64(frames.times[i].decodable_us, >=, frames.times[i].first_unit_us);
+		munit_assert_uint64(frames.times[i].emitted_us, >=, frames.times[i].decodable_us);
+	}
+	munit_assert_uint64(frame_processor.stream_stats.frames, ==, 3);
+	munit_assert_size(frames.allocated_count, ==, alloc ? 3 : 0);
+
+	// nothing to hand over anymore
+	err = chiaki_frame_processor_flush_async(&frame_processor);
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+
+	chiaki_frame_processor_fini(&frame_processor);
+	chiaki_mutex_fini(&frames.mutex);
+	return MUNIT_OK;
+}
+
+/**
+ * Two frame processors sharing a worker hand over frames without waiting for the ones before,
+ * which are still emitted in order.
+ */
+static MunitResult test_fec_async_shared(const MunitParameter params[], void *user)
+{
+	ChiakiFrameProcessor frame_processors[2];
+	for(size_t i=0; i<2; i++)
+		chiaki_frame_processor_init(&frame_processors[i], get_test_log());
+	AsyncFrames frames = { 0 };
+	chiaki_mutex_init(&frames.mutex, false);
+	chiaki_cond_init(&frames.cond);
+	ChiakiErrorCode err = chiaki_frame_processor_fec_worker_start(&frame_processors[0], async_frame_cb, &frames);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_frame_processor_fec_worker_share(&frame_processors[1], &frame_processors[0]);
+	munit_assert_ptr_equal(frame_processors[1].fec_worker, frame_processors[0].fec_worker);
+
+	// the callback is stuck at the first frame, but both can still be handed over and the next one assembled
+	frames.hold = true;
+	TestFrame test_frames[3];
+	const unsigned int lost[] = { 1, 4 };
+	for(size_t i=0; i<3; i++)
+	{
+		test_frame_init(&test_frames[i]);
+		ChiakiFrameProcessor *frame_processor = &frame_processors[i % 2];
+		test_frame_put(frame_processor, &test_frames[i], (ChiakiSeqNum16)(i + 10), lost, 2);
+		if(i == 2)
+			break;
+		err = chiaki_frame_processor_flush_async(frame_processor);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+	munit_assert(chiaki_frame_processor_fec_pending(&frame_processors[1]));
+	chiaki_mutex_lock(&frames.mutex);
+	munit_assert_size(frames.count, ==, 0);
+	frames.hold = false;
+	chiaki_cond_signal(&frames.cond);
+	chiaki_mutex_unlock(&frames.mutex);
+
+	err = chiaki_frame_processor_flush_async(&frame_processors[0]);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_frame_processor_fec_wait(&frame_processors[1]);
+	munit_assert(!chiaki_frame_processor_fec_pending(&frame_processors[0]));
+
+	munit_assert_size(frames.count, ==, 3);
+	for(size_t i=0; i<3; i++)
+	{
+		munit_assert_int(frames.results[i], ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS);
+		munit_assert_uint16(frames.frame_indexes[i], ==, i + 10);
+		munit_assert_size(frames.sizes[i], ==, test_frames[i].payload_size);
+		munit_assert_memory_equal(test_frames[i].payload_size, frames.payloads[i], test_frames[i].payload);
+	}
+	munit_assert_uint64(frame_processors[0].stream_stats.frames + frame_processors[1].stream_stats.frames, ==, 3);
+
+	// the worker is stopped by the last frame processor using it
+	chiaki_frame_processor_fini(&frame_processors[0]);
+	munit_assert_not_null(frame_processors[1].fec_worker);
+	chiaki_frame_processor_fini(&frame_processors[1]);
+	chiaki_cond_fini(&frames.cond);
+	chiaki_mutex_fini(&frames.mutex);
+	return MUNIT_OK;
+}
+
+static uint8_t *alloc_cb(size_t size, void *user)
+{
+	uint8_t *buf = malloc(size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	munit_assert_not_null(buf);
+	memset(buf, 0xff, size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	*((uint8_t **)user) = buf;
+	return buf;
+}
+
+/**
+ * frame_buf is reused without clearing it, so short units must still be seen zero-padded by fec.
+ */
+static MunitResult test_dirty_buffer(const MunitParameter params[], void *user)
+{
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, get_test_log());
+
+	static const uint8_t zero[CHIAKI_VIDEO_BUFFER_PADDING_SIZE] = { 0 };
+	for(size_t i=0; i<4; i++)
+	{
+		bool short_units = i & 1;
+		bool alloc = i >= 2;
+		TestFrame frame;
+		test_frame_init_units(&frame, short_units);
+		const unsigned int lost[] = { 3, 5, 6 };
+		test_frame_put(&frame_processor, &frame, (ChiakiSeqNum16)i, lost, short_units ? 3 : 0);
+
+		uint8_t *buf;
+		size_t buf_size;
+		uint8_t *allocated = NULL;
+		ChiakiFrameProcessorFlushResult result = alloc
+			? chiaki_frame_processor_flush_alloc(&frame_processor, alloc_cb, &allocated, &buf, &buf_size)
+			: chiaki_frame_processor_flush(&frame_processor, &buf, &buf_size);
+		munit_assert_int(result, ==, short_units ? CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS : CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS);
+		if(alloc)
+			munit_assert_ptr_equal(buf, allocated);
+		munit_assert_size(buf_size, ==, frame.payload_size);
+		munit_assert_memory_equal(frame.payload_size, buf, frame.payload);
+		munit_assert_memory_equal(sizeof(zero), buf + buf_size, zero);
+		free(allocated);
+	}
+
+	chiaki_frame_processor_fini(&frame_processor);
+	return MUNIT_OK;
+}
+
+static MunitParameterEnum fec_async_params[] = {
+	{ "alloc", (char *[]){ "off", "on", NULL } },
+	{ NULL, NULL }
+};
+
+MunitTest tests_frame_processor[] = {
+	{
+		"/fec_sync",
+		test_fec_sync,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/packet_stats",
+		test_packet_stats,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/fec_async",
+		test_fec_async,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		fec_async_params
+	},
+	{
+		"/fec_async_shared",
+		test_fec_async_shared,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/dirty_buffer",
+		test_dirty_buffer,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -4,6 +4,12 @@
 
 #include <chiaki/ecdh.h>
 #include <chiaki/gkcrypt.h>
+#include <chiaki/session.h>
+#include <chiaki/time.h>
+
+#include "test_log.h"
+
+#include <string.h>
 
 static MunitResult test_ecdh(const MunitParameter params[], void *user)
 {
@@ -169,6 +175,145 @@ static MunitResult test_endecrypt(const MunitParameter params[], void *user)
 	return MUNIT_OK;
 }
 
+static bool gkcrypt_key_buf_wait_contains(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, size_t size)
+{
+	uint64_t deadline = chiaki_time_now_monotonic_ms() + 1000;
+	while(chiaki_time_now_monotonic_ms() < deadline)
+	{
+		if(chiaki_gkcrypt_key_buf_contains(gkcrypt, key_pos, size))
+			return true;
+		chiaki_thread_yield();
+	}
+	return false;
+}
+
+static MunitResult test_decrypt_key_buf(const MunitParameter params[], void *user)
+{
+	static const uint8_t handshake_key[] = { 0x14, 0xf1, 0xe6, 0x94, 0x6c, 0x5d, 0xce, 0xa8, 0xb7, 0xaa, 0x48, 0x50, 0xf6, 0x4d, 0x21, 0xac };
+	static const uint8_t ecdh_secret[] = { 0xc, 0xeb, 0x77, 0x9, 0x83, 0x4d, 0x7a, 0xfc, 0x50, 0xb8, 0x46, 0x8c, 0xc6, 0x3c, 0x1e, 0x7c, 0x4e, 0x4a, 0x88, 0x93, 0x42, 0x80, 0xc1, 0x28, 0xe6, 0x1e, 0xe9, 0xd4, 0x1b, 0x8c, 0x69, 0x36 };
+
+	// key stream from the ring buffer must be xored exactly like freshly generated key stream,
+	// including unaligned key positions, wrap around in the ring and sizes beyond the temporary generation buffer
+	ChiakiGKCrypt gkcrypt_buf;
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt_buf, get_test_log(), 4, 42, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiGKCrypt gkcrypt_gen;
+	err = chiaki_gkcrypt_init(&gkcrypt_gen, get_test_log(), 0, 42, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint8_t clear[0x700];
+	for(size_t i=0; i<sizeof(clear); i++)
+		clear[i] = (uint8_t)(i * 13 + 5);
+	uint8_t buf_a[sizeof(clear)];
+	uint8_t buf_b[sizeof(clear)];
+
+	uint64_t key_pos = 3;
+	size_t ring_hits = 0;
+	for(size_t i=0; i<60; i++)
+	{
+		size_t size = 0x100 + (i * 0x97) % (sizeof(clear) - 0x100);
+		if(gkcrypt_key_buf_wait_contains(&gkcrypt_buf, key_pos, size))
+			ring_hits++;
+
+		memcpy(buf_a, clear, size);
+		err = chiaki_gkcrypt_decrypt(&gkcrypt_buf, key_pos, buf_a, size);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		memcpy(buf_b, clear, size);
+		err = chiaki_gkcrypt_decrypt(&gkcrypt_gen, key_pos, buf_b, size);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(size, buf_a, buf_b);
+
+		key_pos += size;
+	}
+	munit_assert_size(ring_hits, >, 0);
+
+	chiaki_gkcrypt_fini(&gkcrypt_buf);
+	chiaki_gkcrypt_fini(&gkcrypt_gen);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_key_buf_ring(const MunitParameter params[], void *user)
+{
+	static const uint8_t handshake_key[] = { 0x14, 0xf1, 0xe6, 0x94, 0x6c, 0x5d, 0xce, 0xa8, 0xb7, 0xaa, 0x48, 0x50, 0xf6, 0x4d, 0x21, 0xac };
+	static const uint8_t ecdh_secret[] = { 0xc, 0xeb, 0x77, 0x9, 0x83, 0x4d, 0x7a, 0xfc, 0x50, 0xb8, 0x46, 0x8c, 0xc6, 0x3c, 0x1e, 0x7c, 0x4e, 0x4a, 0x88, 0x93, 0x42, 0x80, 0xc1, 0x28, 0xe6, 0x1e, 0xe9, 0xd4, 0x1b, 0x8c, 0x69, 0x36 };
+
+	ChiakiGKCrypt gkcrypt_buf;
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt_buf, get_test_log(), 8, 42, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiGKCrypt gkcrypt_gen;
+	err = chiaki_gkcrypt_init(&gkcrypt_gen, get_test_log(), 0, 42, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint8_t buf_a[1400];
+	uint8_t buf_b[1400];
+	ChiakiGKCryptKeyBufStats stats;
+
+	// paced streaming is always served from the ring
+	uint64_t key_pos = 0x11;
+	for(size_t i=0; i<500; i++)
+	{
+		munit_assert(gkcrypt_key_buf_wait_contains(&gkcrypt_buf, key_pos, sizeof(buf_a)));
+		memset(buf_a, 0, sizeof(buf_a));
+		err = chiaki_gkcrypt_get_key_stream(&gkcrypt_buf, key_pos, buf_a, sizeof(buf_a));
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		memset(buf_b, 0, sizeof(buf_b));
+		err = chiaki_gkcrypt_decrypt(&gkcrypt_gen, key_pos, buf_b, sizeof(buf_b));
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(sizeof(buf_a), buf_a, buf_b);
+		key_pos += sizeof(buf_a);
+	}
+	chiaki_gkcrypt_get_key_buf_stats(&gkcrypt_buf, &stats);
+	munit_assert_uint64(stats.hits, ==, 500);
+	munit_assert_uint64(stats.misses, ==, 0);
+	munit_assert_uint64(stats.skips, ==, 0);
+
+	// jumping far ahead misses once, then the thread skips ahead
+	key_pos += 0x100000;
+	err = chiaki_gkcrypt_decrypt(&gkcrypt_buf, key_pos, buf_a, sizeof(buf_a));
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	key_pos += sizeof(buf_a);
+	munit_assert(gkcrypt_key_buf_wait_contains(&gkcrypt_buf, key_pos, sizeof(buf_a)));
+	chiaki_gkcrypt_get_key_buf_stats(&gkcrypt_buf, &stats);
+	munit_assert_uint64(stats.misses, ==, 1);
+	munit_assert_uint64(stats.skips, ==, 1);
+
+	// unpaced, racing with the generator thread, the result must always be correct
+	for(size_t i=0; i<5000; i++)
+	{
+		memset(buf_a, 0, sizeof(buf_a));
+		err = chiaki_gkcrypt_decrypt(&gkcrypt_buf, key_pos, buf_a, sizeof(buf_a));
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		memset(buf_b, 0, sizeof(buf_b));
+		err = chiaki_gkcrypt_decrypt(&gkcrypt_gen, key_pos, buf_b, sizeof(buf_b));
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(sizeof(buf_a), buf_a, buf_b);
+		// occasionally go back a bit like reordered packets
+		key_pos = (i % 7 == 6) ? key_pos - sizeof(buf_a) : key_pos + sizeof(buf_a);
+	}
+
+	chiaki_gkcrypt_fini(&gkcrypt_buf);
+	chiaki_gkcrypt_fini(&gkcrypt_gen);
+
+	return MUNIT_OK;
+}
+
+/**
+ * Init gkcrypt with its AES contexts, but override iv and the gmac keys to only test the gmac.
+ */
+static void gkcrypt_init_gmac(ChiakiGKCrypt *gkcrypt, const uint8_t *key_gmac, const uint8_t *iv)
+{
+	static const uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE] = { 0 };
+	static const uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE] = { 0 };
+	ChiakiErrorCode err = chiaki_gkcrypt_init(gkcrypt, NULL, 0, 0, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	memset(gkcrypt->key_gmac_base, 0, sizeof(gkcrypt->key_gmac_base));
+	memcpy(gkcrypt->key_gmac_current, key_gmac, sizeof(gkcrypt->key_gmac_current));
+	memcpy(gkcrypt->iv, iv, sizeof(gkcrypt->iv));
+	gkcrypt->key_gmac_index_current = 0;
+}
+
 static MunitResult test_gmac(const MunitParameter params[], void *user)
 {
 	static const uint8_t gkcrypt_key[] = {	0xb6, 0x4b, 0x1e, 0x65, 0x3f, 0xbb, 0xa7, 0xab, 0x80, 0xb3, 0x1e, 0x5a, 0x32, 0x4d, 0xec, 0xc0 };
@@ -201,31 +346,21 @@ static MunitResult test_gmac(const MunitParameter params[], void *user)
 	ChiakiGKCrypt gkcrypt;
 
 	// Low
-	memset(&gkcrypt, 0, sizeof(gkcrypt));
-	memcpy(gkcrypt.key_gmac_current, gkcrypt_key, sizeof(gkcrypt.key_gmac_current));
-	memcpy(gkcrypt.iv, gkcrypt_iv, sizeof(gkcrypt.iv));
-
-	gkcrypt.key_buf = NULL;
-	gkcrypt.key_buf_size = 0;
-	gkcrypt.key_gmac_index_current = 0;
+	gkcrypt_init_gmac(&gkcrypt, gkcrypt_key, gkcrypt_iv);
 
 	uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
 	ChiakiErrorCode err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos, buf, sizeof(buf), gmac);
+	chiaki_gkcrypt_fini(&gkcrypt);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return MUNIT_ERROR;
 
 	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected);
 
 	// High
-	memset(&gkcrypt, 0, sizeof(gkcrypt));
-	memcpy(gkcrypt.key_gmac_current, gkcrypt_key, sizeof(gkcrypt.key_gmac_current));
-	memcpy(gkcrypt.iv, gkcrypt_iv, sizeof(gkcrypt.iv));
-
-	gkcrypt.key_buf = NULL;
-	gkcrypt.key_buf_size = 0;
-	gkcrypt.key_gmac_index_current = 0;
+	gkcrypt_init_gmac(&gkcrypt, gkcrypt_key, gkcrypt_iv);
 
 	err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos_high, buf, sizeof(buf), gmac);
+	chiaki_gkcrypt_fini(&gkcrypt);
 	if (err != CHIAKI_ERR_SUCCESS)
 		return MUNIT_ERROR;
 
@@ -302,31 +437,21 @@ static MunitResult test_gmac_split(const MunitParameter params[], void *user)
 	static const uint8_t gmac_expected_high[] = { 0xf0, 0x17, 0x95, 0x3c };
 
 	ChiakiGKCrypt gkcrypt;
-	memset(&gkcrypt, 0, sizeof(gkcrypt));
-
-	memcpy(gkcrypt.key_gmac_current, gkcrypt_key, sizeof(gkcrypt.key_gmac_current));
-	memcpy(gkcrypt.iv, gkcrypt_iv, sizeof(gkcrypt.iv));
-	gkcrypt.key_buf = NULL;
-	gkcrypt.key_buf_size = 0;
-	gkcrypt.key_gmac_index_current = 0;
+	gkcrypt_init_gmac(&gkcrypt, gkcrypt_key, gkcrypt_iv);
 
 	uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
 	ChiakiErrorCode err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos, buf, sizeof(buf), gmac);
+	chiaki_gkcrypt_fini(&gkcrypt);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return MUNIT_ERROR;
 
 	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected);
 
 	// High
-	memset(&gkcrypt, 0, sizeof(gkcrypt));
-
-	memcpy(gkcrypt.key_gmac_current, gkcrypt_key, sizeof(gkcrypt.key_gmac_current));
-	memcpy(gkcrypt.iv, gkcrypt_iv, sizeof(gkcrypt.iv));
-	gkcrypt.key_buf = NULL;
-	gkcrypt.key_buf_size = 0;
-	gkcrypt.key_gmac_index_current = 0;
+	gkcrypt_init_gmac(&gkcrypt, gkcrypt_key, gkcrypt_iv);
 
 	err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos_high, buf, sizeof(buf), gmac);
+	chiaki_gkcrypt_fini(&gkcrypt);
 	if (err != CHIAKI_ERR_SUCCESS)
 		return MUNIT_ERROR;
 
@@ -380,6 +505,56 @@ static MunitResult test_gmac_multiple_of_key_refresh(const MunitParameter params
 }
 
 
+static MunitResult test_gmac_context_reuse(const MunitParameter params[], void *user)
+{
+	static const uint8_t handshake_key[] = { 0x70, 0x58, 0x37, 0x50, 0x91, 0xea, 0xd1, 0x37, 0x71, 0x58, 0xec, 0xb3, 0xb, 0xea, 0x23, 0x87 };
+	static const uint8_t ecdh_secret[] = { 0x3c, 0x3a, 0xf0, 0xec, 0xd6, 0x33, 0x1b, 0xb1, 0x6d, 0x24, 0x4f, 0x48, 0x19, 0xde, 0x6, 0x3d,
+										0xc7, 0xe, 0xac, 0x95, 0x70, 0xac, 0x24, 0x92, 0x86, 0xa7, 0x24, 0xd0, 0x7a, 0x37, 0x55, 0x52 };
+
+	// moves forward over key refreshes, back to older keys and forward again
+	static const uint64_t key_positions[] = {
+		0x10, 0x420,
+		CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x10,
+		0x430,
+		3 * CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x10,
+		CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x20,
+		CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x30,
+		0x440,
+		3 * CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x20,
+		5 * CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS
+	};
+
+	uint8_t buf[0x100];
+	for(size_t i=0; i<sizeof(buf); i++)
+		buf[i] = (uint8_t)(i * 7);
+
+	ChiakiGKCrypt gkcrypt;
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, NULL, 0, 3, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	for(size_t i=0; i<sizeof(key_positions) / sizeof(key_positions[0]); i++)
+	{
+		uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
+		err = chiaki_gkcrypt_gmac(&gkcrypt, key_positions[i], buf, sizeof(buf), gmac);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		// a fresh instance can only use contexts keyed for this position
+		ChiakiGKCrypt gkcrypt_fresh;
+		err = chiaki_gkcrypt_init(&gkcrypt_fresh, NULL, 0, 3, handshake_key, ecdh_secret);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		uint8_t gmac_expected[CHIAKI_GKCRYPT_GMAC_SIZE];
+		err = chiaki_gkcrypt_gmac(&gkcrypt_fresh, key_positions[i], buf, sizeof(buf), gmac_expected);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		chiaki_gkcrypt_fini(&gkcrypt_fresh);
+
+		munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected);
+	}
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+
+	return MUNIT_OK;
+}
+
 MunitTest tests_gkcrypt[] = {
 	{
 		"/ecdh",
@@ -405,6 +580,22 @@ MunitTest tests_gkcrypt[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/decrypt_key_buf",
+		test_decrypt_key_buf,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/key_buf_ring",
+		test_key_buf_ring,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{
 		"/gmac",
 		test_gmac,
@@ -437,5 +628,13 @@ MunitTest tests_gkcrypt[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/gmac_context_reuse",
+		test_gmac_context_reuse,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
\ No newline at end of file
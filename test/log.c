@@ -0,0 +1,117 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/log.h>
+
+#include <string.h>
+
+typedef struct sink_t
+{
+	unsigned int count;
+	ChiakiLogLevel last_level;
+	char last_msg[0x100];
+} Sink;
+
+static void sink_cb(ChiakiLogLevel level, const char *msg, void *user)
+{
+	Sink *sink = user;
+	sink->count++;
+	sink->last_level = level;
+	strncpy(sink->last_msg, msg, sizeof(sink->last_msg) - 1);
+	sink->last_msg[sizeof(sink->last_msg) - 1] = '\0';
+}
+
+static int evaluated(int *count)
+{
+	(*count)++;
+	return *count;
+}
+
+static MunitResult test_lazy_args(const MunitParameter params[], void *user)
+{
+	Sink sink = { 0 };
+	ChiakiLog log;
+	chiaki_log_init(&log, CHIAKI_LOG_ALL & ~(CHIAKI_LOG_VERBOSE | CHIAKI_LOG_DEBUG), sink_cb, &sink);
+
+	int count = 0;
+	CHIAKI_LOGV(&log, "%d", evaluated(&count));
+	CHIAKI_LOGD(&log, "%d", evaluated(&count));
+	munit_assert_int(count, ==, 0);
+	munit_assert_uint(sink.count, ==, 0);
+
+	CHIAKI_LOGI(&log, "%d", evaluated(&count));
+	munit_assert_int(count, ==, 1);
+	munit_assert_uint(sink.count, ==, 1);
+	munit_assert_string_equal(sink.last_msg, "1");
+
+	// the log argument itself is only evaluated once
+	ChiakiLog *logs[] = { &log, NULL };
+	ChiakiLog **cur = logs;
+	CHIAKI_LOGW(*cur++, "warning");
+	munit_assert_ptr_equal(cur, logs + 1);
+	munit_assert_uint(sink.count, ==, 2);
+	munit_assert_int(sink.last_level, ==, CHIAKI_LOG_WARNING);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_subsystem(const MunitParameter params[], void *user)
+{
+	if(!(CHIAKI_LOG_COMPILED_MASK & CHIAKI_LOG_VERBOSE))
+		return MUNIT_SKIP;
+
+	Sink sink = { 0 };
+	ChiakiLog log;
+	chiaki_log_init(&log, CHIAKI_LOG_ALL & ~(CHIAKI_LOG_VERBOSE | CHIAKI_LOG_DEBUG), sink_cb, &sink);
+
+	chiaki_log_set_subsystem_level(&log, CHIAKI_LOG_SUBSYSTEM_TAKION, CHIAKI_LOG_VERBOSE);
+	CHIAKI_LOG_SUBSYSTEM_LEVEL(&log, CHIAKI_LOG_SUBSYSTEM_VIDEO, CHIAKI_LOG_VERBOSE, "video");
+	CHIAKI_LOG_SUBSYSTEM_LEVEL(&log, CHIAKI_LOG_SUBSYSTEM_TAKION, CHIAKI_LOG_DEBUG, "takion debug");
+	munit_assert_uint(sink.count, ==, 0);
+	CHIAKI_LOG_SUBSYSTEM_LEVEL(&log, CHIAKI_LOG_SUBSYSTEM_TAKION, CHIAKI_LOG_VERBOSE, "takion verbose");
+	munit_assert_uint(sink.count, ==, 1);
+	munit_assert_string_equal(sink.last_msg, "takion verbose");
+
+	// the global mask still applies to all subsystems
+	CHIAKI_LOG_SUBSYSTEM_LEVEL(&log, CHIAKI_LOG_SUBSYSTEM_AUDIO, CHIAKI_LOG_INFO, "audio");
+	munit_assert_uint(sink.count, ==, 2);
+
+	// plain chiaki_log() does not know the subsystem
+	chiaki_log(&log, CHIAKI_LOG_VERBOSE, "general");
+	munit_assert_uint(sink.count, ==, 2);
+
+	ChiakiErrorCode err = chiaki_log_set_subsystems_verbose(&log, "video,,holepunch");
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint32(log.subsystem_level_mask[CHIAKI_LOG_SUBSYSTEM_VIDEO], ==, CHIAKI_LOG_VERBOSE | CHIAKI_LOG_DEBUG);
+	munit_assert_uint32(log.subsystem_level_mask[CHIAKI_LOG_SUBSYSTEM_HOLEPUNCH], ==, CHIAKI_LOG_VERBOSE | CHIAKI_LOG_DEBUG);
+	munit_assert_uint32(log.subsystem_level_mask[CHIAKI_LOG_SUBSYSTEM_CRYPT], ==, 0);
+
+	err = chiaki_log_set_subsystems_verbose(&log, "crypt,vid");
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+	munit_assert_uint32(log.subsystem_level_mask[CHIAKI_LOG_SUBSYSTEM_CRYPT], ==, CHIAKI_LOG_VERBOSE | CHIAKI_LOG_DEBUG);
+
+	munit_assert_string_equal(chiaki_log_subsystem_name(CHIAKI_LOG_SUBSYSTEM_TAKION), "takion");
+
+	return MUNIT_OK;
+}
+
+MunitTest tests_log[] = {
+	{
+		"/lazy_args",
+		test_lazy_args,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/subsystem",
+		test_subsystem,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/logasync.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#define SINK_MSGS_MAX 64
+
+typedef struct sink_t
+{
+	ChiakiMutex mutex;
+	uint64_t count;
+	uint64_t warnings;
+	char msgs[SINK_MSGS_MAX][CHIAKI_LOG_ASYNC_MSG_SIZE + 1];
+	size_t lens[SINK_MSGS_MAX];
+
+	// the writer blocks in the callback on a message "block" until released
+	ChiakiBoolPredCond blocked;
+	ChiakiBoolPredCond released;
+} Sink;
+
+static void sink_cb(ChiakiLogLevel level, const char *msg, void *user)
+{
+	Sink *sink = user;
+	if(!strcmp(msg, "block"))
+	{
+		chiaki_bool_pred_cond_lock(&sink->blocked);
+		sink->blocked.pred = true;
+		chiaki_bool_pred_cond_unlock(&sink->blocked);
+		chiaki_bool_pred_cond_signal(&sink->blocked);
+
+		chiaki_bool_pred_cond_lock(&sink->released);
+		chiaki_bool_pred_cond_wait(&sink->released);
+		chiaki_bool_pred_cond_unlock(&sink->released);
+		return;
+	}
+
+	chiaki_mutex_lock(&sink->mutex);
+	if(sink->count < SINK_MSGS_MAX)
+	{
+		strncpy(sink->msgs[sink->count], msg, CHIAKI_LOG_ASYNC_MSG_SIZE);
+		sink->msgs[sink->count][CHIAKI_LOG_ASYNC_MSG_SIZE] = '\0';
+		sink->lens[sink->count] = strlen(msg);
+	}
+	sink->count++;
+	if(level == CHIAKI_LOG_WARNING)
+		sink->warnings++;
+	chiaki_mutex_unlock(&sink->mutex);
+}
+
+static void sink_init(Sink *sink, ChiakiLog *log)
+{
+	memset(sink, 0, sizeof(*sink));
+	chiaki_mutex_init(&sink->mutex, false);
+	chiaki_bool_pred_cond_init(&sink->blocked);
+	chiaki_bool_pred_cond_init(&sink->released);
+	chiaki_log_init(log, CHIAKI_LOG_ALL & ~CHIAKI_LOG_VERBOSE, sink_cb, sink);
+}
+
+static void sink_fini(Sink *sink)
+{
+	chiaki_bool_pred_cond_fini(&sink->released);
+	chiaki_bool_pred_cond_fini(&sink->blocked);
+	chiaki_mutex_fini(&sink->mutex);
+}
+
+static MunitResult test_order(const MunitParameter params[], void *user)
+{
+	static Sink sink;
+	ChiakiLog forward_log;
+	sink_init(&sink, &forward_log);
+
+	ChiakiLogAsync log_async;
+	ChiakiErrorCode err = chiaki_log_async_init(&log_async, SINK_MSGS_MAX, 0, &forward_log);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiLog *log = chiaki_log_async_get_log(&log_async);
+
+	// forward_log's mask applies
+	CHIAKI_LOGV(log, "not forwarded");
+
+	char long_msg[0x200];
+	memset(long_msg, 'x', sizeof(long_msg) - 1);
+	long_msg[sizeof(long_msg) - 1] = '\0';
+	CHIAKI_LOGI(log, "%s", long_msg);
+
+	for(int i=0; i<SINK_MSGS_MAX - 1; i++)
+		CHIAKI_LOGI(log, "msg %d", i);
+
+	munit_assert_uint64(chiaki_log_async_dropped(&log_async), ==, 0);
+	chiaki_log_async_fini(&log_async);
+	munit_assert_uint64(sink.count, ==, SINK_MSGS_MAX);
+	// long messages are forwarded in full
+	munit_assert_size(sink.lens[0], ==, sizeof(long_msg) - 1);
+	munit_assert_uint64(chiaki_log_async_truncated(&log_async), ==, 0);
+	for(int i=0; i<SINK_MSGS_MAX - 1; i++)
+	{
+		char expected[0x20];
+		snprintf(expected, sizeof(expected), "msg %d", i);
+		munit_assert_string_equal(sink.msgs[i + 1], expected);
+	}
+
+	sink_fini(&sink);
+	return MUNIT_OK;
+}
+
+static MunitResult test_drop(const MunitParameter params[], void *user)
+{
+	static Sink sink;
+	ChiakiLog forward_log;
+	sink_init(&sink, &forward_log);
+
+	ChiakiLogAsync log_async;
+	ChiakiErrorCode err = chiaki_log_async_init(&log_async, 4, CHIAKI_LOG_ERROR, &forward_log);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiLog *log = chiaki_log_async_get_log(&log_async);
+
+	// keep the writer busy
+	CHIAKI_LOGI(log, "block");
+	chiaki_bool_pred_cond_lock(&sink.blocked);
+	err = chiaki_bool_pred_cond_timedwait(&sink.blocked, 5000);
+	chiaki_bool_pred_cond_unlock(&sink.blocked);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	for(int i=0; i<4; i++)
+		CHIAKI_LOGI(log, "queued %d", i);
+	munit_assert_uint64(chiaki_log_async_dropped(&log_async), ==, 0);
+
+	CHIAKI_LOGI(log, "dropped");
+	CHIAKI_LOGD(log, "dropped");
+	munit_assert_uint64(chiaki_log_async_dropped(&log_async), ==, 2);
+
+	// errors are never dropped, but forwarded right away
+	CHIAKI_LOGE(log, "error");
+	munit_assert_uint64(chiaki_log_async_dropped(&log_async), ==, 2);
+	munit_assert_uint64(sink.count, ==, 1);
+	munit_assert_string_equal(sink.msgs[0], "error");
+
+	chiaki_bool_pred_cond_lock(&sink.released);
+	sink.released.pred = true;
+	chiaki_bool_pred_cond_unlock(&sink.released);
+	chiaki_bool_pred_cond_signal(&sink.released);
+
+	chiaki_log_async_fini(&log_async);
+	munit_assert_uint64(sink.count, ==, 6);
+	for(int i=0; i<4; i++)
+	{
+		char expected[0x20];
+		snprintf(expected, sizeof(expected), "queued %d", i);
+		munit_assert_string_equal(sink.msgs[i + 1], expected);
+	}
+	munit_assert_uint64(sink.warnings, ==, 1); // about the dropped ones
+	munit_assert_not_null(strstr(sink.msgs[5], "dropped 2"));
+
+	sink_fini(&sink);
+	return MUNIT_OK;
+}
+
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_MSGS 20000
+
+static void *concurrent_thread(void *user)
+{
+	ChiakiLog *log = user;
+	for(int i=0; i<CONCURRENT_MSGS; i++)
+		CHIAKI_LOGI(log, "msg %d", i);
+	return NULL;
+}
+
+static MunitResult test_concurrent(const MunitParameter params[], void *user)
+{
+	static Sink sink;
+	ChiakiLog forward_log;
+	sink_init(&sink, &forward_log);
+
+	ChiakiLogAsync log_async;
+	ChiakiErrorCode err = chiaki_log_async_init(&log_async, 64, 0, &forward_log);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiThread threads[CONCURRENT_THREADS];
+	for(size_t i=0; i<CONCURRENT_THREADS; i++)
+		munit_assert_int(chiaki_thread_create(&threads[i], concurrent_thread, chiaki_log_async_get_log(&log_async)), ==, CHIAKI_ERR_SUCCESS);
+	for(size_t i=0; i<CONCURRENT_THREADS; i++)
+		chiaki_thread_join(&threads[i], NULL);
+	uint64_t dropped = chiaki_log_async_dropped(&log_async);
+	chiaki_log_async_fini(&log_async);
+
+	// everything was either forwarded or counted as dropped, plus the warnings about it
+	munit_assert_uint64(sink.count - sink.warnings + dropped, ==, CONCURRENT_THREADS * CONCURRENT_MSGS);
+	munit_assert(dropped == 0 || sink.warnings > 0);
+
+	sink_fini(&sink);
+	return MUNIT_OK;
+}
+
+MunitTest tests_log_async[] = {
+	{
+		"/order",
+		test_order,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/drop",
+		test_drop,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/concurrent",
+		test_concurrent,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -10,6 +10,20 @@ extern MunitTest tests_rpcrypt[];
 extern MunitTest tests_gkcrypt[];
 extern MunitTest tests_takion[];
 extern MunitTest tests_fec[];
+extern MunitTest tests_frame_processor[];
+extern MunitTest tests_video_receiver[];
+extern MunitTest tests_packet_stats[];
+extern MunitTest tests_present_queue[];
+extern MunitTest tests_audio_jitter_buffer[];
+#ifdef CHIAKI_TEST_ENABLE_FFMPEG_DECODER
+extern MunitTest tests_ffmpeg_decoder[];
+#endif
+extern MunitTest tests_log[];
+extern MunitTest tests_log_async[];
+extern MunitTest tests_event_loop[];
+extern MunitTest tests_stop_pipe[];
+extern MunitTest tests_rtt_estimator[];
+extern MunitTest tests_congestion_control[];
 extern MunitTest tests_regist[];
 extern MunitTest tests_bitstream[];
 
@@ -70,6 +84,92 @@ static MunitSuite suites[] = {
 		1,
 		MUNIT_SUITE_OPTION_NONE
 	},
+	{
+		"/frame_processor",
+		tests_frame_processor,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/video_receiver",
+		tests_video_receiver,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/packet_stats",
+		tests_packet_stats,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/present_queue",
+		tests_present_queue,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/audio_jitter_buffer",
+		tests_audio_jitter_buffer,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+#ifdef CHIAKI_TEST_ENABLE_FFMPEG_DECODER
+	{
+		"/ffmpeg_decoder",
+		tests_ffmpeg_decoder,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+#endif
+	{
+		"/log",
+		tests_log,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/log_async",
+		tests_log_async,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/event_loop",
+		tests_event_loop,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/stop_pipe",
+		tests_stop_pipe,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/rtt_estimator",
+		tests_rtt_estimator,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/congestion_control",
+		tests_congestion_control,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
 	{
 		"/regist",
 		tests_regist,
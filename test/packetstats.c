@@ -0,0 +1,205 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/packetstats.h>
+#include <chiaki/thread.h>
+
+#define CONCURRENT_PUSHES 200000
+#define CONCURRENT_SEQ_PUSHES 30000 // less than half the sequence number space, so the final max stays comparable
+
+static MunitResult test_seq(const MunitParameter params[], void *user)
+{
+	ChiakiPacketStats stats;
+	chiaki_packet_stats_init(&stats);
+
+	uint64_t received, lost;
+	chiaki_packet_stats_get(&stats, true, &received, &lost);
+	munit_assert_uint64(received, ==, 0);
+	munit_assert_uint64(lost, ==, 0);
+
+	// the first interval only establishes where the sequence starts
+	chiaki_packet_stats_push_seq(&stats, 1000);
+	chiaki_packet_stats_push_seq(&stats, 1001);
+	chiaki_packet_stats_get(&stats, true, &received, &lost);
+	munit_assert_uint64(received, ==, 2);
+	munit_assert_uint64(lost, ==, 0);
+
+	// 1002 and 1005-1007 lost, 1004 duplicated
+	chiaki_packet_stats_push_seq(&stats, 1003);
+	chiaki_packet_stats_push_seq(&stats, 1004);
+	chiaki_packet_stats_push_seq(&stats, 1004);
+	chiaki_packet_stats_push_seq(&stats, 1008);
+	chiaki_packet_stats_get(&stats, false, &received, &lost);
+	munit_assert_uint64(received, ==, 4);
+	munit_assert_uint64(lost, ==, 3);
+	chiaki_packet_stats_get(&stats, true, &received, &lost);
+	munit_assert_uint64(received, ==, 4);
+	munit_assert_uint64(lost, ==, 3);
+
+	// across the wraparound, one reordered
+	chiaki_packet_stats_push_seq(&stats, 1009);
+	chiaki_packet_stats_push_seq(&stats, 1011);
+	chiaki_packet_stats_push_seq(&stats, 1010);
+	for(uint32_t seq=1012; seq<=65535 + 3; seq++)
+		chiaki_packet_stats_push_seq(&stats, (ChiakiSeqNum16)seq);
+	chiaki_packet_stats_get(&stats, true, &received, &lost);
+	munit_assert_uint64(received, ==, 65535 + 3 - 1008);
+	munit_assert_uint64(lost, ==, 0);
+
+	ChiakiPacketStatsHistograms hists;
+	chiaki_packet_stats_get_histograms(&stats, &hists);
+	ChiakiPacketStatsHistogram *bursts = &hists.hist[CHIAKI_PACKET_STATS_HIST_LOSS_BURST];
+	munit_assert_uint64(bursts->buckets[1], ==, 2); // 1002, 1010
+	munit_assert_uint64(bursts->buckets[2], ==, 1); // 1005-1007
+	for(size_t b=3; b<CHIAKI_PACKET_STATS_HIST_BUCKETS; b++)
+		munit_assert_uint64(bursts->buckets[b], ==, 0);
+
+	chiaki_packet_stats_fini(&stats);
+	return MUNIT_OK;
+}
+
+static MunitResult test_histograms(const MunitParameter params[], void *user)
+{
+	ChiakiPacketStats stats;
+	chiaki_packet_stats_init(&stats);
+
+	chiaki_packet_stats_push_generation(&stats, 10, 0);
+	chiaki_packet_stats_push_generation(&stats, 7, 3);
+	chiaki_packet_stats_push_hist(&stats, CHIAKI_PACKET_STATS_HIST_JITTER, 1500);
+	chiaki_packet_stats_push_hist(&stats, CHIAKI_PACKET_STATS_HIST_JITTER, UINT64_MAX);
+	chiaki_packet_stats_push_frame(&stats, CHIAKI_PACKET_STATS_FRAME_COMPLETE);
+	chiaki_packet_stats_push_frame(&stats, CHIAKI_PACKET_STATS_FRAME_FEC_RECOVERED);
+
+	uint64_t received, lost;
+	chiaki_packet_stats_get(&stats, true, &received, &lost);
+	munit_assert_uint64(received, ==, 17);
+	munit_assert_uint64(lost, ==, 3);
+
+	ChiakiPacketStatsHistograms hists;
+	chiaki_packet_stats_get_histograms(&stats, &hists);
+	ChiakiPacketStatsHistogram *frame_loss = &hists.hist[CHIAKI_PACKET_STATS_HIST_FRAME_LOSS];
+	munit_assert_uint64(frame_loss->buckets[0], ==, 1);
+	munit_assert_uint64(frame_loss->buckets[2], ==, 1);
+	ChiakiPacketStatsHistogram *jitter = &hists.hist[CHIAKI_PACKET_STATS_HIST_JITTER];
+	munit_assert_uint64(jitter->buckets[11], ==, 1);
+	munit_assert_uint64(chiaki_packet_stats_hist_bucket_min(11), ==, 1024);
+	munit_assert_uint64(jitter->buckets[CHIAKI_PACKET_STATS_HIST_BUCKETS - 1], ==, 1);
+	munit_assert_uint64(hists.frames[CHIAKI_PACKET_STATS_FRAME_COMPLETE], ==, 1);
+	munit_assert_uint64(hists.frames[CHIAKI_PACKET_STATS_FRAME_FEC_RECOVERED], ==, 1);
+	munit_assert_uint64(hists.frames[CHIAKI_PACKET_STATS_FRAME_FAILED], ==, 0);
+
+	// one failed frame per interval, the histograms only keep the last ones
+	for(size_t i=0; i<CHIAKI_PACKET_STATS_HIST_INTERVALS * 2; i++)
+	{
+		chiaki_packet_stats_push_frame(&stats, CHIAKI_PACKET_STATS_FRAME_FAILED);
+		chiaki_packet_stats_get_histograms(&stats, &hists);
+		uint64_t expected = i + 1 < CHIAKI_PACKET_STATS_HIST_INTERVALS ? i + 1 : CHIAKI_PACKET_STATS_HIST_INTERVALS;
+		munit_assert_uint64(hists.frames[CHIAKI_PACKET_STATS_FRAME_FAILED], ==, expected);
+		munit_assert_uint64(hists.frames[CHIAKI_PACKET_STATS_FRAME_COMPLETE], ==, i + 1 < CHIAKI_PACKET_STATS_HIST_INTERVALS ? 1 : 0);
+		chiaki_packet_stats_reset(&stats);
+	}
+
+	chiaki_packet_stats_fini(&stats);
+	return MUNIT_OK;
+}
+
+typedef struct concurrent_t
+{
+	ChiakiPacketStats stats;
+} Concurrent;
+
+static void *concurrent_gen_thread(void *user)
+{
+	Concurrent *c = user;
+	for(size_t i=0; i<CONCURRENT_PUSHES; i++)
+	{
+		chiaki_packet_stats_push_generation(&c->stats, 3, 1);
+		chiaki_packet_stats_push_frame(&c->stats, CHIAKI_PACKET_STATS_FRAME_COMPLETE);
+	}
+	return NULL;
+}
+
+static void *concurrent_seq_thread(void *user)
+{
+	Concurrent *c = user;
+	// every fourth packet lost
+	for(size_t i=0; i<CONCURRENT_SEQ_PUSHES; i++)
+		if(i % 4 != 3)
+			chiaki_packet_stats_push_seq(&c->stats, (ChiakiSeqNum16)i);
+	return NULL;
+}
+
+/**
+ * Producers never block, and nothing pushed is lost or counted twice while the consumer resets concurrently.
+ */
+static MunitResult test_concurrent(const MunitParameter params[], void *user)
+{
+	static Concurrent c;
+	chiaki_packet_stats_init(&c.stats);
+
+	// establish the start of the sequence
+	chiaki_packet_stats_push_seq(&c.stats, (ChiakiSeqNum16)-1);
+	uint64_t received_sum, lost_sum;
+	chiaki_packet_stats_get(&c.stats, true, &received_sum, &lost_sum);
+
+	ChiakiThread gen_threads[2];
+	ChiakiThread seq_thread;
+	for(size_t i=0; i<2; i++)
+		munit_assert_int(chiaki_thread_create(&gen_threads[i], concurrent_gen_thread, &c), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_thread_create(&seq_thread, concurrent_seq_thread, &c), ==, CHIAKI_ERR_SUCCESS);
+
+	received_sum = 0;
+	lost_sum = 0;
+	for(size_t i=0; i<2000; i++)
+	{
+		uint64_t received, lost;
+		chiaki_packet_stats_get(&c.stats, true, &received, &lost);
+		received_sum += received;
+		lost_sum += lost;
+	}
+
+	for(size_t i=0; i<2; i++)
+		chiaki_thread_join(&gen_threads[i], NULL);
+	chiaki_thread_join(&seq_thread, NULL);
+	uint64_t received, lost;
+	chiaki_packet_stats_get(&c.stats, true, &received, &lost);
+	received_sum += received;
+	lost_sum += lost;
+
+	uint64_t seq_received = CONCURRENT_SEQ_PUSHES - CONCURRENT_SEQ_PUSHES / 4;
+	munit_assert_uint64(received_sum, ==, 2 * 3 * CONCURRENT_PUSHES + seq_received);
+	// the last packet of the sequence is lost, but nothing after it shows that
+	munit_assert_uint64(lost_sum, ==, 2 * CONCURRENT_PUSHES + CONCURRENT_SEQ_PUSHES / 4 - 1);
+
+	chiaki_packet_stats_fini(&c.stats);
+	return MUNIT_OK;
+}
+
+MunitTest tests_packet_stats[] = {
+	{
+		"/seq",
+		test_seq,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/histograms",
+		test_histograms,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/concurrent",
+		test_concurrent,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/presentqueue.h>
+
+#define REFRESH_US 16667
+
+typedef struct frame_t
+{
+	int index;
+	bool freed;
+} Frame;
+
+static void frame_free_cb(void *frame, void *user)
+{
+	((Frame *)frame)->freed = true;
+	(*(unsigned int *)user)++;
+}
+
+static void push(ChiakiPresentQueue *queue, Frame *frame, uint64_t decoded_us)
+{
+	ChiakiPresentFrameInfo info = {
+		.frame_index = (ChiakiSeqNum16)frame->index,
+		.receive_us = decoded_us > 5000 ? decoded_us - 5000 : 0,
+		.decoded_us = decoded_us
+	};
+	chiaki_present_queue_push(queue, frame, &info);
+}
+
+static MunitResult test_latest(const MunitParameter params[], void *user)
+{
+	unsigned int freed = 0;
+	ChiakiPresentQueue queue;
+	ChiakiErrorCode err = chiaki_present_queue_init(&queue, CHIAKI_PRESENT_POLICY_LATEST, REFRESH_US, 4, frame_free_cb, &freed);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// nothing presented yet, so nothing is repeated
+	munit_assert_null(chiaki_present_queue_present(&queue, 1000, NULL));
+
+	Frame frames[6] = { { 0 }, { 1 }, { 2 }, { 3 }, { 4 }, { 5 } };
+	for(int i=0; i<3; i++)
+		push(&queue, &frames[i], 10000 + i * 1000);
+
+	ChiakiPresentFrameInfo info;
+	Frame *frame = chiaki_present_queue_present(&queue, 13000, &info);
+	munit_assert_ptr_equal(frame, &frames[2]);
+	munit_assert_uint16(info.frame_index, ==, 2);
+	munit_assert_uint64(info.receive_us, ==, 12000 - 5000);
+	munit_assert_uint64(info.decoded_us, ==, 12000);
+	munit_assert_uint64(info.handoff_us, ==, 13000);
+	munit_assert_uint(freed, ==, 2);
+	munit_assert_true(frames[0].freed && frames[1].freed);
+
+	munit_assert_null(chiaki_present_queue_present(&queue, 14000, NULL));
+
+	// the queue itself only holds 4 frames
+	for(int i=0; i<6; i++)
+		push(&queue, &frames[i], 20000 + i * 1000);
+	munit_assert_uint(freed, ==, 4);
+	frame = chiaki_present_queue_present(&queue, 20000 + 5000 + REFRESH_US + 1, NULL);
+	munit_assert_ptr_equal(frame, &frames[5]);
+
+	ChiakiPresentQueueStats stats;
+	chiaki_present_queue_get_stats(&queue, &stats);
+	munit_assert_uint64(stats.pushed, ==, 9);
+	munit_assert_uint64(stats.presented, ==, 2);
+	munit_assert_uint64(stats.dropped, ==, 7);
+	munit_assert_uint64(stats.repeated, ==, 1);
+	munit_assert_uint64(stats.late, ==, 1);
+	munit_assert_uint64(stats.receive_to_decoded_us, ==, 2 * 5000);
+	munit_assert_uint64(stats.decoded_to_handoff_us, ==, 1000 + REFRESH_US + 1);
+	munit_assert_uint64(stats.target_delay_us, ==, 0);
+
+	chiaki_present_queue_fini(&queue);
+	munit_assert_uint(freed, ==, 7);
+	return MUNIT_OK;
+}
+
+static MunitResult test_paced_steady(const MunitParameter params[], void *user)
+{
+	unsigned int freed = 0;
+	ChiakiPresentQueue queue;
+	ChiakiErrorCode err = chiaki_present_queue_init(&queue, CHIAKI_PRESENT_POLICY_PACED, REFRESH_US, 0, frame_free_cb, &freed);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// decoded right between two refreshes, every frame is shown on the next one
+	static Frame frames[200];
+	for(int i=0; i<200; i++)
+	{
+		frames[i].index = i;
+		push(&queue, &frames[i], 100000 + i * REFRESH_US + REFRESH_US / 2);
+		Frame *frame = chiaki_present_queue_present(&queue, 100000 + (i + 1) * REFRESH_US, NULL);
+		munit_assert_ptr_equal(frame, &frames[i]);
+	}
+
+	ChiakiPresentQueueStats stats;
+	chiaki_present_queue_get_stats(&queue, &stats);
+	munit_assert_uint64(stats.presented, ==, 200);
+	munit_assert_uint64(stats.dropped, ==, 0);
+	munit_assert_uint64(stats.late, ==, 0);
+	munit_assert_uint64(stats.repeated, ==, 0);
+	munit_assert_uint64(stats.target_delay_us, ==, 0);
+
+	chiaki_present_queue_fini(&queue);
+	munit_assert_uint(freed, ==, 0);
+	return MUNIT_OK;
+}
+
+static MunitResult test_paced_jitter(const MunitParameter params[], void *user)
+{
+	unsigned int freed = 0;
+	ChiakiPresentQueue queue;
+	ChiakiErrorCode err = chiaki_present_queue_init(&queue, CHIAKI_PRESENT_POLICY_PACED, REFRESH_US, 0, frame_free_cb, &freed);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// frames arrive in pairs every other refresh
+	static Frame frames[400];
+	int pushed = 0;
+	unsigned int presented = 0;
+	uint64_t repeated_prev = 0;
+	ChiakiPresentQueueStats stats;
+	for(int tick=0; tick<400; tick++)
+	{
+		uint64_t now_us = 100000 + tick * REFRESH_US;
+		if(tick % 2 == 0)
+		{
+			for(int i=0; i<2; i++)
+			{
+				frames[pushed].index = pushed;
+				push(&queue, &frames[pushed], now_us - REFRESH_US / 2 + i * 100);
+				pushed++;
+			}
+		}
+		Frame *frame = chiaki_present_queue_present(&queue, now_us, NULL);
+		if(frame)
+		{
+			// always in order
+			munit_assert_int(frame->index, >=, (int)presented);
+			presented = frame->index + 1;
+		}
+		if(tick == 199)
+		{
+			chiaki_present_queue_get_stats(&queue, &stats);
+			repeated_prev = stats.repeated;
+		}
+	}
+
+	// once the jitter is known, the pairs are spread over both refreshes
+	chiaki_present_queue_get_stats(&queue, &stats);
+	munit_assert_uint64(stats.target_delay_us, >, REFRESH_US / 2);
+	munit_assert_uint64(stats.target_delay_us, <=, 7 * REFRESH_US);
+	munit_assert_uint64(stats.repeated, ==, repeated_prev);
+	munit_assert_uint64(stats.pushed, ==, stats.presented + stats.dropped + queue.count);
+	munit_assert_uint64(stats.dropped, ==, freed);
+
+	chiaki_present_queue_fini(&queue);
+	return MUNIT_OK;
+}
+
+static MunitResult test_paced_backlog(const MunitParameter params[], void *user)
+{
+	unsigned int freed = 0;
+	ChiakiPresentQueue queue;
+	ChiakiErrorCode err = chiaki_present_queue_init(&queue, CHIAKI_PRESENT_POLICY_PACED, REFRESH_US, 0, frame_free_cb, &freed);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// without any jitter, frames that piled up beyond the current one only add latency
+	Frame frames[3] = { { 0 }, { 1 }, { 2 } };
+	for(int i=0; i<3; i++)
+		push(&queue, &frames[i], 100000);
+	munit_assert_uint64(queue.jitter_us, ==, 0);
+	Frame *frame = chiaki_present_queue_present(&queue, 100000 + 3 * REFRESH_US, NULL);
+	munit_assert_ptr_equal(frame, &frames[2]);
+	munit_assert_uint(freed, ==, 2);
+
+	ChiakiPresentQueueStats stats;
+	chiaki_present_queue_get_stats(&queue, &stats);
+	munit_assert_uint64(stats.dropped, ==, 2);
+	munit_assert_uint64(stats.late, ==, 1);
+
+	chiaki_present_queue_fini(&queue);
+	return MUNIT_OK;
+}
+
+MunitTest tests_present_queue[] = {
+	{
+		"/latest",
+		test_latest,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/paced_steady",
+		test_paced_steady,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/paced_jitter",
+		test_paced_jitter,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/paced_backlog",
+		test_paced_backlog,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
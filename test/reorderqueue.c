@@ -4,6 +4,8 @@
 
 #include <chiaki/reorderqueue.h>
 
+#include <stdlib.h>
+
 #define DROP_RECORD_MAX 16
 
 typedef struct drop_record_t
@@ -171,6 +173,89 @@ static MunitResult test_reorder_queue_16(const MunitParameter params[], void *te
 	return MUNIT_OK;
 }
 
+static void drop_count(uint64_t seq_num, void *elem_user, void *cb_user)
+{
+	uint64_t *count = cb_user;
+	(*count)++;
+}
+
+static MunitParameterEnum wraparound_params[] = {
+	{ "size_exp", (char *[]){ "4", "10", "15", NULL } },
+	{ NULL, NULL }
+};
+
+static MunitResult test_reorder_queue_32_wraparound(const MunitParameter params[], void *test_user)
+{
+	size_t size_exp = (size_t)atoi(munit_parameters_get(params, "size_exp"));
+	uint64_t size = (uint64_t)1 << size_exp;
+	ChiakiSeqNum32 start = (ChiakiSeqNum32)(0 - size / 2); // the window covers 2^32 right in the middle
+
+	ChiakiReorderQueue queue;
+	ChiakiErrorCode err = chiaki_reorder_queue_init_32(&queue, size_exp, start);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(chiaki_reorder_queue_size(&queue), ==, size);
+	uint64_t dropped = 0;
+	chiaki_reorder_queue_set_drop_cb(&queue, drop_count, &dropped);
+
+	// fill everything but the first one in reverse, nothing can be pulled until the first arrives
+	for(uint64_t i=size-1; i>0; i--)
+		chiaki_reorder_queue_push(&queue, (ChiakiSeqNum32)(start + i), (void *)(size_t)i);
+	munit_assert_uint64(chiaki_reorder_queue_count(&queue), ==, size);
+	munit_assert(!chiaki_reorder_queue_is_set(&queue, 0));
+	for(uint64_t i=1; i<size; i++)
+		munit_assert(chiaki_reorder_queue_is_set(&queue, i));
+	munit_assert(!chiaki_reorder_queue_pull(&queue, NULL, NULL));
+
+	// beyond the window, duplicate
+	chiaki_reorder_queue_push(&queue, (ChiakiSeqNum32)(start + size), NULL);
+	chiaki_reorder_queue_push(&queue, (ChiakiSeqNum32)(start + 1), NULL);
+	munit_assert_uint64(dropped, ==, 2);
+
+	chiaki_reorder_queue_push(&queue, start, (void *)0);
+	for(uint64_t i=0; i<size; i++)
+	{
+		uint64_t seq_num;
+		void *user;
+		munit_assert(chiaki_reorder_queue_pull(&queue, &seq_num, &user));
+		munit_assert_uint64(seq_num, ==, (ChiakiSeqNum32)(start + i));
+		munit_assert_uint64((uint64_t)(size_t)user, ==, i);
+	}
+	munit_assert_uint64(chiaki_reorder_queue_count(&queue), ==, 0);
+	munit_assert_uint64(queue.begin, ==, (ChiakiSeqNum32)(start + size));
+
+	// old ones are dropped after the wraparound
+	chiaki_reorder_queue_push(&queue, (ChiakiSeqNum32)(start + size - 1), NULL);
+	munit_assert_uint64(dropped, ==, 3);
+
+	// a jump of several windows with CHIAKI_REORDER_QUEUE_DROP_STRATEGY_BEGIN drops only what is set and keeps the bitmap clean
+	chiaki_reorder_queue_set_drop_strategy(&queue, CHIAKI_REORDER_QUEUE_DROP_STRATEGY_BEGIN);
+	ChiakiSeqNum32 begin = (ChiakiSeqNum32)queue.begin;
+	chiaki_reorder_queue_push(&queue, begin + 1, NULL);
+	chiaki_reorder_queue_push(&queue, begin + 3, NULL);
+	ChiakiSeqNum32 far = begin + 3 * (ChiakiSeqNum32)size;
+	chiaki_reorder_queue_push(&queue, far, NULL);
+	munit_assert_uint64(dropped, ==, 5);
+	munit_assert_uint64(chiaki_reorder_queue_count(&queue), ==, 1);
+	munit_assert_uint64(queue.begin, ==, far);
+	chiaki_reorder_queue_push(&queue, far + (ChiakiSeqNum32)size - 1, NULL);
+	munit_assert_uint64(chiaki_reorder_queue_count(&queue), ==, size);
+	for(uint64_t i=1; i<size-1; i++)
+		munit_assert(!chiaki_reorder_queue_is_set(&queue, i));
+	munit_assert(chiaki_reorder_queue_is_set(&queue, size - 1));
+
+	chiaki_reorder_queue_fini(&queue);
+	munit_assert_uint64(dropped, ==, 7);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_reorder_queue_size_max(const MunitParameter params[], void *test_user)
+{
+	ChiakiReorderQueue queue;
+	ChiakiErrorCode err = chiaki_reorder_queue_init_32(&queue, CHIAKI_REORDER_QUEUE_SIZE_EXP_MAX + 1, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+	return MUNIT_OK;
+}
 
 MunitTest tests_reorder_queue[] = {
 	{
@@ -181,5 +266,21 @@ MunitTest tests_reorder_queue[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/reorder_queue_32_wraparound",
+		test_reorder_queue_32_wraparound,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		wraparound_params
+	},
+	{
+		"/reorder_queue_size_max",
+		test_reorder_queue_size_max,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
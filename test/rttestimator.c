@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/rttestimator.h>
+
+static MunitResult test_converge(const MunitParameter params[], void *user)
+{
+	ChiakiRttEstimator estimator;
+	chiaki_rtt_estimator_init(&estimator, 1000, 50, 4000);
+
+	ChiakiRttStats stats;
+	chiaki_rtt_estimator_get_stats(&estimator, &stats);
+	munit_assert_uint64(stats.samples, ==, 0);
+	munit_assert_uint64(stats.srtt_us, ==, 0);
+	munit_assert_uint64(stats.rto_ms, ==, 1000);
+
+	// first sample: srtt = r, rttvar = r/2, rto = srtt + 4 * rttvar
+	chiaki_rtt_estimator_sample(&estimator, 100000);
+	chiaki_rtt_estimator_get_stats(&estimator, &stats);
+	munit_assert_uint64(stats.samples, ==, 1);
+	munit_assert_uint64(stats.srtt_us, ==, 100000);
+	munit_assert_uint64(stats.rttvar_us, ==, 50000);
+	munit_assert_uint64(stats.rto_ms, ==, 300);
+
+	// a remote connection with a stable rtt of 120ms
+	for(int i=0; i<100; i++)
+		chiaki_rtt_estimator_sample(&estimator, 120000 + (i % 2) * 2000);
+	chiaki_rtt_estimator_get_stats(&estimator, &stats);
+	munit_assert_uint64(stats.srtt_us, >=, 119000);
+	munit_assert_uint64(stats.srtt_us, <=, 123000);
+	munit_assert_uint64(stats.rto_ms, >, 120);
+	munit_assert_uint64(stats.rto_ms, <, 130);
+	munit_assert_uint64(chiaki_rtt_estimator_rto_ms(&estimator), ==, stats.rto_ms);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_clamp_backoff(const MunitParameter params[], void *user)
+{
+	ChiakiRttEstimator estimator;
+	chiaki_rtt_estimator_init(&estimator, 200, 40, 1000);
+
+	for(int i=0; i<20; i++)
+		chiaki_rtt_estimator_sample(&estimator, 500);
+	munit_assert_uint64(chiaki_rtt_estimator_rto_ms(&estimator), ==, 40);
+
+	chiaki_rtt_estimator_backoff(&estimator);
+	munit_assert_uint64(chiaki_rtt_estimator_rto_ms(&estimator), ==, 80);
+	for(int i=0; i<10; i++)
+		chiaki_rtt_estimator_backoff(&estimator);
+	munit_assert_uint64(chiaki_rtt_estimator_rto_ms(&estimator), ==, 1000);
+
+	// the next sample recovers from the backoff
+	chiaki_rtt_estimator_sample(&estimator, 500);
+	munit_assert_uint64(chiaki_rtt_estimator_rto_ms(&estimator), ==, 40);
+
+	chiaki_rtt_estimator_sample(&estimator, 5000000);
+	munit_assert_uint64(chiaki_rtt_estimator_rto_ms(&estimator), ==, 1000);
+
+	return MUNIT_OK;
+}
+
+MunitTest tests_rtt_estimator[] = {
+	{
+		"/converge",
+		test_converge,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/clamp_backoff",
+		test_clamp_backoff,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
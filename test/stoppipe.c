@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/stoppipe.h>
+
+#ifndef _WIN32
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+
+#define MANY_FDS_PAIRS 1600
+
+static void socket_pair(int fds[2])
+{
+	munit_assert_int(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+}
+
+static void drain(int fd)
+{
+	uint8_t buf[16];
+	munit_assert_int(read(fd, buf, sizeof(buf)), >, 0);
+}
+
+static MunitResult test_single(const MunitParameter params[], void *user)
+{
+	ChiakiStopPipe stop_pipe;
+	ChiakiErrorCode err = chiaki_stop_pipe_init(&stop_pipe);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	int fds[2];
+	socket_pair(fds);
+
+	err = chiaki_stop_pipe_select_single(&stop_pipe, fds[0], false, 10);
+	munit_assert_int(err, ==, CHIAKI_ERR_TIMEOUT);
+
+	err = chiaki_stop_pipe_select_single(&stop_pipe, fds[0], true, 10);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	munit_assert_int(write(fds[1], "x", 1), ==, 1);
+	err = chiaki_stop_pipe_select_single(&stop_pipe, fds[0], false, 10);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	drain(fds[0]);
+
+	// stopping wins over ready fds and is sticky until reset
+	munit_assert_int(write(fds[1], "x", 1), ==, 1);
+	chiaki_stop_pipe_stop(&stop_pipe);
+	chiaki_stop_pipe_stop(&stop_pipe);
+	for(int i=0; i<2; i++)
+	{
+		err = chiaki_stop_pipe_select_single(&stop_pipe, fds[0], false, UINT64_MAX);
+		munit_assert_int(err, ==, CHIAKI_ERR_CANCELED);
+	}
+	err = chiaki_stop_pipe_select_single(&stop_pipe, CHIAKI_INVALID_SOCKET, false, 10);
+	munit_assert_int(err, ==, CHIAKI_ERR_CANCELED);
+
+	err = chiaki_stop_pipe_reset(&stop_pipe);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_stop_pipe_select_single(&stop_pipe, fds[0], false, 10);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	drain(fds[0]);
+	err = chiaki_stop_pipe_select_single(&stop_pipe, CHIAKI_INVALID_SOCKET, false, 10);
+	munit_assert_int(err, ==, CHIAKI_ERR_TIMEOUT);
+
+	close(fds[0]);
+	close(fds[1]);
+	chiaki_stop_pipe_fini(&stop_pipe);
+	return MUNIT_OK;
+}
+
+static MunitResult test_multi(const MunitParameter params[], void *user)
+{
+	ChiakiStopPipe stop_pipe;
+	ChiakiErrorCode err = chiaki_stop_pipe_init(&stop_pipe);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	int pairs[4][2];
+	ChiakiStopPipeWaitFd wait_fds[4];
+	for(size_t i=0; i<4; i++)
+	{
+		socket_pair(pairs[i]);
+		wait_fds[i].fd = pairs[i][0];
+		wait_fds[i].write = false;
+	}
+
+	err = chiaki_stop_pipe_select_multi(&stop_pipe, wait_fds, 4, 10);
+	munit_assert_int(err, ==, CHIAKI_ERR_TIMEOUT);
+
+	munit_assert_int(write(pairs[1][1], "x", 1), ==, 1);
+	munit_assert_int(write(pairs[3][1], "x", 1), ==, 1);
+	err = chiaki_stop_pipe_select_multi(&stop_pipe, wait_fds, 4, UINT64_MAX);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert(!wait_fds[0].ready);
+	munit_assert(wait_fds[1].ready);
+	munit_assert(!wait_fds[2].ready);
+	munit_assert(wait_fds[3].ready);
+	drain(pairs[1][0]);
+	drain(pairs[3][0]);
+
+	// mixed directions
+	wait_fds[2].write = true;
+	err = chiaki_stop_pipe_select_multi(&stop_pipe, wait_fds, 4, 10);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert(!wait_fds[0].ready);
+	munit_assert(!wait_fds[1].ready);
+	munit_assert(wait_fds[2].ready);
+	munit_assert(!wait_fds[3].ready);
+
+	chiaki_stop_pipe_stop(&stop_pipe);
+	err = chiaki_stop_pipe_select_multi(&stop_pipe, wait_fds, 4, UINT64_MAX);
+	munit_assert_int(err, ==, CHIAKI_ERR_CANCELED);
+
+	for(size_t i=0; i<4; i++)
+	{
+		close(pairs[i][0]);
+		close(pairs[i][1]);
+	}
+	chiaki_stop_pipe_fini(&stop_pipe);
+	return MUNIT_OK;
+}
+
+/**
+ * Open thousands of fds so the stop pipe and the sockets it waits on get numbers beyond FD_SETSIZE,
+ * which select() can not handle.
+ */
+static MunitResult test_many_fds(const MunitParameter params[], void *user)
+{
+	struct rlimit lim;
+	munit_assert_int(getrlimit(RLIMIT_NOFILE, &lim), ==, 0);
+	rlim_t needed = MANY_FDS_PAIRS * 2 + 64;
+	struct rlimit lim_orig = lim;
+	if(lim.rlim_cur < needed)
+	{
+		if(lim.rlim_max != RLIM_INFINITY && lim.rlim_max < needed)
+			return MUNIT_SKIP;
+		lim.rlim_cur = needed;
+		if(setrlimit(RLIMIT_NOFILE, &lim) != 0)
+			return MUNIT_SKIP;
+	}
+
+	int (*pairs)[2] = calloc(MANY_FDS_PAIRS, sizeof(*pairs));
+	ChiakiStopPipeWaitFd *wait_fds = calloc(MANY_FDS_PAIRS, sizeof(*wait_fds));
+	munit_assert_not_null(pairs);
+	munit_assert_not_null(wait_fds);
+	for(size_t i=0; i<MANY_FDS_PAIRS; i++)
+	{
+		socket_pair(pairs[i]);
+		wait_fds[i].fd = pairs[i][0];
+		wait_fds[i].write = false;
+	}
+	munit_assert_int(pairs[MANY_FDS_PAIRS - 1][0], >=, FD_SETSIZE);
+
+	ChiakiStopPipe stop_pipe;
+	ChiakiErrorCode err = chiaki_stop_pipe_init(&stop_pipe);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	int high_fd = pairs[MANY_FDS_PAIRS - 1][0];
+	err = chiaki_stop_pipe_select_single(&stop_pipe, high_fd, false, 10);
+	munit_assert_int(err, ==, CHIAKI_ERR_TIMEOUT);
+	munit_assert_int(write(pairs[MANY_FDS_PAIRS - 1][1], "x", 1), ==, 1);
+	err = chiaki_stop_pipe_select_single(&stop_pipe, high_fd, false, UINT64_MAX);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	err = chiaki_stop_pipe_select_multi(&stop_pipe, wait_fds, MANY_FDS_PAIRS, UINT64_MAX);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	for(size_t i=0; i<MANY_FDS_PAIRS; i++)
+		munit_assert(wait_fds[i].ready == (i == MANY_FDS_PAIRS - 1));
+	drain(high_fd);
+
+	size_t some = MANY_FDS_PAIRS / 3;
+	munit_assert_int(write(pairs[some][1], "x", 1), ==, 1);
+	err = chiaki_stop_pipe_select_multi(&stop_pipe, wait_fds, MANY_FDS_PAIRS, UINT64_MAX);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert(wait_fds[some].ready);
+	drain(pairs[some][0]);
+
+	err = chiaki_stop_pipe_select_multi(&stop_pipe, wait_fds, MANY_FDS_PAIRS, 10);
+	munit_assert_int(err, ==, CHIAKI_ERR_TIMEOUT);
+
+	chiaki_stop_pipe_stop(&stop_pipe);
+	err = chiaki_stop_pipe_select_multi(&stop_pipe, wait_fds, MANY_FDS_PAIRS, UINT64_MAX);
+	munit_assert_int(err, ==, CHIAKI_ERR_CANCELED);
+	err = chiaki_stop_pipe_select_single(&stop_pipe, high_fd, false, UINT64_MAX);
+	munit_assert_int(err, ==, CHIAKI_ERR_CANCELED);
+
+	chiaki_stop_pipe_fini(&stop_pipe);
+	for(size_t i=0; i<MANY_FDS_PAIRS; i++)
+	{
+		close(pairs[i][0]);
+		close(pairs[i][1]);
+	}
+	free(pairs);
+	free(wait_fds);
+	setrlimit(RLIMIT_NOFILE, &lim_orig);
+	return MUNIT_OK;
+}
+
+#else
+
+static MunitResult test_unsupported(const MunitParameter params[], void *user)
+{
+	return MUNIT_SKIP;
+}
+
+#define test_single test_unsupported
+#define test_multi test_unsupported
+#define test_many_fds test_unsupported
+
+#endif
+
+MunitTest tests_stop_pipe[] = {
+	{
+		"/single",
+		test_single,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/multi",
+		test_multi,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/many_fds",
+		test_many_fds,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
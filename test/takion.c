@@ -5,6 +5,7 @@
 #include <chiaki/takion.h>
 #include <chiaki/seqnum.h>
 #include <chiaki/base64.h>
+#include <chiaki/time.h>
 
 #define CHIAKI_UNIT_TEST
 #include "../lib/src/takionsendbuffer.c"
@@ -61,22 +62,6 @@ static MunitResult test_av_packet_parse_real_video(const MunitParameter params[]
 	return MUNIT_OK;
 }
 
-static void random_seqnums(ChiakiSeqNum32 *nums, size_t count)
-{
-	for(size_t i=0; i<count; i++)
-	{
-		ChiakiSeqNum32 seqnum;
-		retry:
-		seqnum = munit_rand_uint32();
-		for(size_t j=0; j<i; j++)
-		{
-			if(nums[j] == seqnum)
-				goto retry;
-		}
-		nums[i] = seqnum;
-	}
-}
-
 static bool check_send_buffer_contents(ChiakiTakionSendBuffer *send_buffer, const ChiakiSeqNum32 *nums_expected, size_t nums_expected_count)
 {
 	// nums_expected must be unique
@@ -89,19 +74,14 @@ static bool check_send_buffer_contents(ChiakiTakionSendBuffer *send_buffer, cons
 
 	for(size_t i=0; i<nums_expected_count; i++)
 	{
-		bool found = false;
-		for(size_t j=0; j<send_buffer->packets_count; j++)
-		{
-			if(send_buffer->packets[j].seq_num == nums_expected[i])
-			{
-				found = true;
-				break;
-			}
-		}
-		if(!found)
+		ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[nums_expected[i] & (send_buffer->packets_size - 1)];
+		if(!packet->buf || packet->seq_num != nums_expected[i])
 			goto fail;
 	}
 
+	if(nums_expected_count && send_buffer->seq_num_first != nums_expected[0])
+		goto fail;
+
 	chiaki_mutex_unlock(&send_buffer->mutex);
 	return true;
 fail:
@@ -124,33 +104,62 @@ static void seqnums_ack(ChiakiSeqNum32 *nums, size_t *nums_count, ChiakiSeqNum32
 	}
 }
 
-static MunitResult test_takion_send_buffer(const MunitParameter params[], void *user)
+static void sleep_ms(uint64_t ms)
 {
-#define nums_count 0x30
+	uint64_t start = chiaki_time_now_monotonic_ms();
+	while(chiaki_time_now_monotonic_ms() - start < ms)
+		chiaki_thread_yield();
+}
+
+static void send_buffer_stats(ChiakiTakionSendBuffer *send_buffer, ChiakiTakionSendBufferStats *stats)
+{
+	chiaki_mutex_lock(&send_buffer->mutex);
+	*stats = send_buffer->stats;
+	chiaki_mutex_unlock(&send_buffer->mutex);
+}
+
+static MunitResult send_buffer_fill_ack(ChiakiSeqNum32 seq_num_start)
+{
+#define nums_count 0x40
 	ChiakiTakionSendBuffer send_buffer;
-	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, nums_count);
+	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, nums_count, NULL);
 	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
 	send_buffer.log = get_test_log();
 
-	ChiakiSeqNum32 nums_expected[nums_count + 1];
-	random_seqnums(nums_expected, nums_count + 1);
+	ChiakiSeqNum32 nums_expected[nums_count];
+	for(size_t i=0; i<nums_count; i++)
+		nums_expected[i] = seq_num_start + (ChiakiSeqNum32)i;
 
+	// push out of order, the window only depends on the lowest and highest seq num
 	for(size_t i=0; i<nums_count; i++)
 	{
-		err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[i], malloc(8), 8);
+		size_t j = i ^ 1;
+		err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[j], malloc(8), 8, 0);
 		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
 	}
 
-	err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[nums_count], malloc(8), 8);
+	err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[3], malloc(8), 8, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+
+	err = chiaki_takion_send_buffer_push(&send_buffer, seq_num_start + nums_count, malloc(8), 8, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_OVERFLOW);
+	err = chiaki_takion_send_buffer_push(&send_buffer, seq_num_start - 1, malloc(8), 8, 0);
 	munit_assert_int(err, ==, CHIAKI_ERR_OVERFLOW);
 
 	size_t nums_count_cur = nums_count;
 	while(nums_count_cur > 0)
 	{
-		ChiakiSeqNum32 ack_num = nums_expected[nums_count_cur - 1]
-				+ munit_rand_int_range(-1, 1) * munit_rand_int_range(1, 32);
-		chiaki_takion_send_buffer_ack(&send_buffer, ack_num, NULL, NULL); // TODO: test acked seqnums params
+		ChiakiSeqNum32 ack_num = nums_expected[0]
+				+ munit_rand_int_range(-1, 16);
+		ChiakiSeqNum32 acked_seq_nums[nums_count];
+		size_t acked_seq_nums_count;
+		chiaki_takion_send_buffer_ack(&send_buffer, ack_num, acked_seq_nums, &acked_seq_nums_count);
+		size_t nums_count_prev = nums_count_cur;
+		ChiakiSeqNum32 first_prev = nums_expected[0];
 		seqnums_ack(nums_expected, &nums_count_cur, ack_num);
+		munit_assert_size(acked_seq_nums_count, ==, nums_count_prev - nums_count_cur);
+		for(size_t i=0; i<acked_seq_nums_count; i++)
+			munit_assert_uint32(acked_seq_nums[i], ==, first_prev + (ChiakiSeqNum32)i);
 		bool correct = check_send_buffer_contents(&send_buffer, nums_expected, nums_count_cur);
 		munit_assert(correct);
 	}
@@ -160,6 +169,184 @@ static MunitResult test_takion_send_buffer(const MunitParameter params[], void *
 #undef nums_count
 }
 
+static MunitResult test_takion_send_buffer(const MunitParameter params[], void *user)
+{
+	return send_buffer_fill_ack(munit_rand_uint32());
+}
+
+static MunitResult test_takion_send_buffer_wraparound(const MunitParameter params[], void *user)
+{
+	return send_buffer_fill_ack(0xfffffff0);
+}
+
+typedef struct send_buffer_push_thread_t
+{
+	ChiakiTakionSendBuffer *send_buffer;
+	ChiakiSeqNum32 seq_num;
+	ChiakiErrorCode err;
+} SendBufferPushThread;
+
+static void *send_buffer_push_thread_func(void *user)
+{
+	SendBufferPushThread *push = user;
+	push->err = chiaki_takion_send_buffer_push(push->send_buffer, push->seq_num, malloc(8), 8, 5000);
+	return NULL;
+}
+
+static MunitResult test_takion_send_buffer_backpressure(const MunitParameter params[], void *user)
+{
+	ChiakiTakionSendBuffer send_buffer;
+	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, 4, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	send_buffer.log = get_test_log();
+
+	for(ChiakiSeqNum32 i=0; i<4; i++)
+	{
+		err = chiaki_takion_send_buffer_push(&send_buffer, 100 + i, malloc(8), 8, 0);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+
+	// the window is full, so a push with timeout blocks until acks make room instead of dropping
+	SendBufferPushThread push = { &send_buffer, 105, CHIAKI_ERR_UNKNOWN };
+	ChiakiThread thread;
+	err = chiaki_thread_create(&thread, send_buffer_push_thread_func, &push);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiTakionSendBufferStats stats;
+	uint64_t start = chiaki_time_now_monotonic_ms();
+	do
+	{
+		munit_assert_uint64(chiaki_time_now_monotonic_ms() - start, <, 2000);
+		sleep_ms(1);
+		send_buffer_stats(&send_buffer, &stats);
+	} while(!stats.backpressure_waits);
+
+	// 105 still does not fit with 101 in the buffer
+	chiaki_takion_send_buffer_ack(&send_buffer, 100, NULL, NULL);
+	sleep_ms(10);
+	chiaki_mutex_lock(&send_buffer.mutex);
+	munit_assert_size(send_buffer.packets_count, ==, 3);
+	chiaki_mutex_unlock(&send_buffer.mutex);
+
+	chiaki_takion_send_buffer_ack(&send_buffer, 101, NULL, NULL);
+	err = chiaki_thread_join(&thread, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(push.err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint32_t nums[] = { 102, 103, 105 };
+	munit_assert(check_send_buffer_contents(&send_buffer, nums, 3));
+	send_buffer_stats(&send_buffer, &stats);
+	munit_assert_uint64(stats.overflows, ==, 0);
+
+	// with a timeout, pushes eventually fail if nothing is acked
+	err = chiaki_takion_send_buffer_push(&send_buffer, 106, malloc(8), 8, 20);
+	munit_assert_int(err, ==, CHIAKI_ERR_OVERFLOW);
+
+	chiaki_takion_send_buffer_fini(&send_buffer);
+	return MUNIT_OK;
+}
+
+static MunitResult test_takion_send_buffer_reserve(const MunitParameter params[], void *user)
+{
+	ChiakiTakionSendBuffer send_buffer;
+	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, 4, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	send_buffer.log = get_test_log();
+
+	// reserved slots count for the window before anything is pushed
+	for(ChiakiSeqNum32 i=0; i<4; i++)
+	{
+		err = chiaki_takion_send_buffer_reserve(&send_buffer, 200 + i, 0);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+	err = chiaki_takion_send_buffer_reserve(&send_buffer, 204, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_OVERFLOW);
+	err = chiaki_takion_send_buffer_reserve(&send_buffer, 201, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+
+	// pushing into a reserved slot never waits or fails
+	err = chiaki_takion_send_buffer_push(&send_buffer, 200, malloc(8), 8, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_takion_send_buffer_push(&send_buffer, 202, malloc(8), 8, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// a packet that failed to send gives its slot back
+	chiaki_takion_send_buffer_cancel(&send_buffer, 203);
+	chiaki_mutex_lock(&send_buffer.mutex);
+	munit_assert_size(send_buffer.packets_count, ==, 3);
+	munit_assert_size(send_buffer.packets_reserved, ==, 1);
+	chiaki_mutex_unlock(&send_buffer.mutex);
+
+	// an ack that overtakes the push of a sent packet removes it on push
+	chiaki_takion_send_buffer_ack(&send_buffer, 202, NULL, NULL);
+	chiaki_mutex_lock(&send_buffer.mutex);
+	munit_assert_size(send_buffer.packets_count, ==, 1);
+	chiaki_mutex_unlock(&send_buffer.mutex);
+	err = chiaki_takion_send_buffer_push(&send_buffer, 201, malloc(8), 8, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert(check_send_buffer_contents(&send_buffer, NULL, 0));
+	munit_assert_size(send_buffer.packets_reserved, ==, 0);
+
+	err = chiaki_takion_send_buffer_reserve(&send_buffer, 205, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_takion_send_buffer_cancel(&send_buffer, 205);
+	munit_assert(check_send_buffer_contents(&send_buffer, NULL, 0));
+
+	chiaki_takion_send_buffer_fini(&send_buffer);
+	return MUNIT_OK;
+}
+
+static MunitResult test_takion_send_buffer_rto(const MunitParameter params[], void *user)
+{
+	ChiakiTakionSendBuffer send_buffer;
+	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, 16, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	send_buffer.log = get_test_log();
+
+	uint64_t rto_initial_ms = send_buffer.rtt.rto_ms;
+	ChiakiSeqNum32 seq_num = 0;
+	for(; seq_num<8; seq_num++)
+	{
+		err = chiaki_takion_send_buffer_push(&send_buffer, seq_num, malloc(8), 8, 0);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		sleep_ms(5);
+		chiaki_takion_send_buffer_ack(&send_buffer, seq_num, NULL, NULL);
+	}
+
+	chiaki_mutex_lock(&send_buffer.mutex);
+	munit_assert_uint64(send_buffer.rtt.srtt_us, >=, 4000);
+	munit_assert_uint64(send_buffer.rtt.srtt_us, <, 100000);
+	uint64_t rto_ms = send_buffer.rtt.rto_ms;
+	chiaki_mutex_unlock(&send_buffer.mutex);
+	munit_assert_uint64(rto_ms, <, rto_initial_ms);
+
+	// an unacked packet is re-sent after the adapted timeout
+	uint64_t pushed_ms = chiaki_time_now_monotonic_ms();
+	err = chiaki_takion_send_buffer_push(&send_buffer, seq_num, malloc(8), 8, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiTakionSendBufferStats stats;
+	do
+	{
+		munit_assert_uint64(chiaki_time_now_monotonic_ms() - pushed_ms, <, 2000);
+		sleep_ms(1);
+		send_buffer_stats(&send_buffer, &stats);
+	} while(!stats.resends);
+	munit_assert_uint64(chiaki_time_now_monotonic_ms() - pushed_ms, >=, rto_ms);
+	munit_assert_uint64(chiaki_rtt_estimator_rto_ms(&send_buffer.rtt), >, rto_ms); // backed off
+
+	// acks of re-sent packets do not give rtt samples
+	chiaki_mutex_lock(&send_buffer.mutex);
+	uint64_t srtt_us = send_buffer.rtt.srtt_us;
+	chiaki_mutex_unlock(&send_buffer.mutex);
+	sleep_ms(20);
+	chiaki_takion_send_buffer_ack(&send_buffer, seq_num, NULL, NULL);
+	munit_assert_uint64(send_buffer.rtt.srtt_us, ==, srtt_us);
+	munit_assert_size(send_buffer.packets_count, ==, 0);
+
+	chiaki_takion_send_buffer_fini(&send_buffer);
+	return MUNIT_OK;
+}
+
 static MunitResult test_takion_format_congestion(const MunitParameter params[], void *user)
 {
 	static const uint8_t handshake_key[] = { 0x54, 0x65, 0x4c, 0x34, 0x5c, 0xac, 0x56, 0xb8, 0xea, 0xe6, 0x15, 0x2a, 0xde, 0x1c, 0xe2, 0xe8 };
@@ -195,6 +382,69 @@ static MunitResult test_takion_format_congestion(const MunitParameter params[],
 	return MUNIT_OK;
 }
 
+static MunitResult test_takion_packet_pool(const MunitParameter params[], void *user)
+{
+#define pool_size 8
+	ChiakiPacketPool pool;
+	ChiakiErrorCode err = chiaki_packet_pool_init(&pool, pool_size);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(chiaki_packet_pool_free_count(&pool), ==, pool_size);
+
+	ChiakiPacketBuf *bufs[pool_size + 1];
+	for(size_t i=0; i<pool_size; i++)
+	{
+		bufs[i] = chiaki_packet_pool_acquire(&pool);
+		munit_assert_not_null(bufs[i]);
+		munit_assert_uint32(bufs[i]->refs, ==, 1);
+		munit_assert_size(bufs[i]->capacity, >=, 1500);
+		munit_assert_size((size_t)bufs[i]->data % CHIAKI_PACKET_POOL_ALIGNMENT, ==, 0);
+		memset(bufs[i]->data, (int)i, bufs[i]->capacity);
+	}
+	munit_assert_size(chiaki_packet_pool_free_count(&pool), ==, 0);
+	munit_assert_uint64(pool.heap_allocs, ==, 0);
+
+	// exhausted, must fall back to the heap
+	bufs[pool_size] = chiaki_packet_pool_acquire(&pool);
+	munit_assert_not_null(bufs[pool_size]);
+	munit_assert_size((size_t)bufs[pool_size]->data % CHIAKI_PACKET_POOL_ALIGNMENT, ==, 0);
+	munit_assert_uint64(pool.heap_allocs, ==, 1);
+	chiaki_packet_buf_unref(bufs[pool_size]);
+	munit_assert_size(chiaki_packet_pool_free_count(&pool), ==, 0);
+
+	// buffers must not overlap
+	for(size_t i=0; i<pool_size; i++)
+	{
+		for(size_t j=0; j<bufs[i]->capacity; j++)
+			munit_assert_uint8(bufs[i]->data[j], ==, (uint8_t)i);
+	}
+
+	// additional references keep the buffer alive
+	chiaki_packet_buf_ref(bufs[0]);
+	chiaki_packet_buf_unref(bufs[0]);
+	munit_assert_size(chiaki_packet_pool_free_count(&pool), ==, 0);
+	chiaki_packet_buf_unref(bufs[0]);
+	munit_assert_size(chiaki_packet_pool_free_count(&pool), ==, 1);
+
+	for(size_t i=1; i<pool_size; i++)
+		chiaki_packet_buf_unref(bufs[i]);
+	munit_assert_size(chiaki_packet_pool_free_count(&pool), ==, pool_size);
+
+	// steady state with some packets held back, like in the reorder queue
+	for(size_t i=0; i<1000; i++)
+	{
+		ChiakiPacketBuf *a = chiaki_packet_pool_acquire(&pool);
+		ChiakiPacketBuf *b = chiaki_packet_pool_acquire(&pool);
+		chiaki_packet_buf_unref(a);
+		chiaki_packet_buf_unref(b);
+	}
+	munit_assert_uint64(pool.heap_allocs, ==, 1);
+	munit_assert_size(chiaki_packet_pool_free_count(&pool), ==, pool_size);
+
+	chiaki_packet_pool_fini(&pool);
+	return MUNIT_OK;
+#undef pool_size
+}
+
 MunitTest tests_takion[] = {
 	{
 		"/av_packet_parse",
@@ -220,6 +470,46 @@ MunitTest tests_takion[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/send_buffer_wraparound",
+		test_takion_send_buffer_wraparound,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/send_buffer_backpressure",
+		test_takion_send_buffer_backpressure,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/send_buffer_reserve",
+		test_takion_send_buffer_reserve,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/send_buffer_rto",
+		test_takion_send_buffer_rto,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/packet_pool",
+		test_takion_packet_pool,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{
 		"/format_congestion",
 		test_takion_format_congestion,
@@ -10,6 +10,9 @@ static ChiakiLog log_quiet;
 ChiakiLog *get_test_log()
 {
 	if(!initialized)
+	{
 		chiaki_log_init(&log_quiet, 0, NULL, NULL);
+		initialized = true;
+	}
 	return &log_quiet;
 }
\ No newline at end of file
@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/videoreceiver.h>
+
+static MunitResult test_reference_window(const MunitParameter params[], void *user)
+{
+	ChiakiVideoReferenceWindow window;
+	chiaki_video_reference_window_reset(&window);
+	munit_assert_false(chiaki_video_reference_window_contains(&window, 0));
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 1, 1), ==, 0);
+
+	// 10, 11, 13 and 14 are references, 12 got lost
+	chiaki_video_reference_window_add(&window, 10);
+	chiaki_video_reference_window_add(&window, 11);
+	chiaki_video_reference_window_add(&window, 13);
+	chiaki_video_reference_window_add(&window, 14);
+	munit_assert_true(chiaki_video_reference_window_contains(&window, 10));
+	munit_assert_true(chiaki_video_reference_window_contains(&window, 11));
+	munit_assert_false(chiaki_video_reference_window_contains(&window, 12));
+	munit_assert_true(chiaki_video_reference_window_contains(&window, 14));
+	munit_assert_false(chiaki_video_reference_window_contains(&window, 15));
+	munit_assert_false(chiaki_video_reference_window_contains(&window, 9));
+
+	// frame 15 referencing 12 falls back to 11
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 15, 1), ==, 1);
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 15, 3), ==, 4);
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 15, 6), ==, 0);
+	// with frames in between lost
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 20, 1), ==, 6);
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 10 + CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE, 13), ==, 13);
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 10 + CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE, 14), ==, 15);
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 10 + CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE, 16), ==, 16);
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 14 + CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE, 1), ==, CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE);
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 15 + CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE, 1), ==, 0);
+
+	// late frames can still be added as long as they are in the window
+	chiaki_video_reference_window_add(&window, 12);
+	munit_assert_true(chiaki_video_reference_window_contains(&window, 12));
+	chiaki_video_reference_window_add(&window, 14 - CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE);
+	munit_assert_false(chiaki_video_reference_window_contains(&window, 14 - CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE));
+
+	// sliding drops everything that falls out
+	chiaki_video_reference_window_add(&window, 10 + CHIAKI_VIDEO_REFERENCE_WINDOW_SIZE);
+	munit_assert_false(chiaki_video_reference_window_contains(&window, 10));
+	munit_assert_true(chiaki_video_reference_window_contains(&window, 11));
+	chiaki_video_reference_window_add(&window, 100);
+	munit_assert_false(chiaki_video_reference_window_contains(&window, 14));
+	munit_assert_true(chiaki_video_reference_window_contains(&window, 100));
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 101, 1), ==, 1);
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 101, 2), ==, 0);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_reference_window_wrap(const MunitParameter params[], void *user)
+{
+	ChiakiVideoReferenceWindow window;
+	chiaki_video_reference_window_reset(&window);
+
+	for(ChiakiSeqNum16 frame_index = 0xfff8; frame_index != 4; frame_index++)
+	{
+		if(frame_index != 0xffff && frame_index != 1)
+			chiaki_video_reference_window_add(&window, frame_index);
+	}
+	munit_assert_uint16(window.newest, ==, 3);
+	munit_assert_true(chiaki_video_reference_window_contains(&window, 0xfffe));
+	munit_assert_false(chiaki_video_reference_window_contains(&window, 0xffff));
+	munit_assert_true(chiaki_video_reference_window_contains(&window, 0));
+	munit_assert_false(chiaki_video_reference_window_contains(&window, 1));
+	munit_assert_false(chiaki_video_reference_window_contains(&window, 4));
+
+	// frame 1 referencing 0xffff falls back to 0xfffe
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 1, 1), ==, 1);
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 1, 2), ==, 3);
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 4, 1), ==, 1);
+	munit_assert_uint(chiaki_video_reference_window_nearest(&window, 4, 3), ==, 4);
+
+	return MUNIT_OK;
+}
+
+MunitTest tests_video_receiver[] = {
+	{
+		"/reference_window",
+		test_reference_window,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/reference_window_wrap",
+		test_reference_window_wrap,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};